@@ -65,25 +65,216 @@
  *
  * ==> rm	Remove one or more files from the floppy disk.
  *
+ * ==> cp	Copy a file within the floppy disk.  The copy has the
+ *		same type and encoding as the original, unless they
+ *		are given as qualifiers (as for copyin) on its name.
+ *
  * ==> format	Create a new floppy image.
  *
+ * ==> scrub	Fill free granules with 0xff and the unused tail of the
+ *		last granule of each file with 0x00 (or the specified
+ *		value, or "keep" to leave file slack alone), so that
+ *		the image compresses better.  Only sectors that change
+ *		are written back.
+ *
+ * ==> sortdir	Reorder the directory entries and pack the free entries
+ *		at the end of the directory.  Disk BASIC searches the
+ *		directory sequentially, so files that sort first are
+ *		found with fewer sector reads.  The entries may be
+ *		sorted by name ("name"), by a usage manifest listing
+ *		one file per line, optionally preceded by a use count
+ *		("manifest <file>"), or by the order in which they
+ *		are loaded ("order file1 [file2 [...]]").  With no
+ *		arguments, the free entries are simply packed.
+ *
+ * ==> crunch	Crunch one or more tokenized BASIC programs in place:
+ *		remove REMarks and unneeded spaces, and merge lines
+ *		that are not the target of a GOTO, GOSUB, THEN, ELSE,
+ *		or RUN.
+ *
+ * ==> pack-bin Compress one or more machine code (LOADM) programs in
+ *		place.  The packed program is itself a LOADM file that
+ *		contains a small 6809 decompressor, which unpacks the
+ *		original segments and then jumps to the original exec
+ *		address.
+ *
+ * ==> age	Age the file system: replay a long randomized (or
+ *		recorded) sequence of copyin / rm / append operations
+ *		against an in-memory copy of the image using each of
+ *		the granule allocation policies, and report how
+ *		fragmentation, estimated load time, and allocator cost
+ *		evolve.  The image itself is not modified.
+ *
+ * ==> identify	Look up every file on the floppy disk in a database of
+ *		known software built by mkiddb, and show the title and
+ *		version of each one that matches (or the content hash
+ *		of each one that doesn't).
+ *
  * ==> dump	Dump information about the floppy disk.  This is
  *		essentially an enhanced version of the "ls" command
  *		that also shows information about the layout of the
  *		files on disk and shows additional information when
  *		disk format errors are encountered.
+ *
+ * The following global options may be given before the image name:
+ *
+ * ==> --shrink	When saving the image, leave off any trailing tracks
+ *		that hold neither the directory nor allocated granules.
+ *		cocofs (and most emulators) treat the missing tracks as
+ *		unformatted free space when the image is loaded.
+ *
+ * ==> --crunch	Crunch tokenized BASIC programs (as with the "crunch"
+ *		command) as they are copied in.
+ *
+ * ==> --alloc=NAME
+ *		Select the granule allocation policy: nextfit (the
+ *		default), firstfit, nearest, or bestfit.
+ *
+ * ==> --record=FILE
+ *		Append a compact binary trace of the command, its
+ *		arguments, and every read and write it issues (with
+ *		offsets, sizes, and timings) to FILE.
+ *
+ * ==> --trace=FILE
+ *		Write a timeline of each image's open, load, command,
+ *		save, and close phases to FILE in the Chrome trace-event
+ *		JSON format (viewable in chrome://tracing or Perfetto).
+ *
+ * ==> --jobs=N	Number of worker threads used by scan (default 1), of
+ *		threads reading host files ahead for copyin, and of
+ *		threads writing host files for copyout.
+ *
+ * ==> --metrics=FILE
+ *		Maintain counters (images, bytes read and written,
+ *		lookups, allocations, errors) and per-command latency
+ *		histograms, and write them to FILE in the Prometheus
+ *		text format every --metrics-interval=SECS seconds
+ *		(default 10) and on exit.
+ *
+ * ==> --journal=FILE
+ *		Record scan progress in FILE, so that an interrupted
+ *		scan can be picked up again with --resume.  Requires
+ *		the scan output to go to a file (-o).
+ *
+ * ==> --resume	Continue a journaled scan, skipping the images it
+ *		has already finished.
+ *
+ * ==> --cache-size=BYTES
+ *		Memory budget (with an optional K, M, or G suffix) for
+ *		the loaded images kept by long-running modes such as
+ *		watch (default 64M).
+ *
+ * ==> --direct	Have scan read images with O_DIRECT, where the file
+ *		system allows it, so they bypass the page cache.
+ *		(Scans always ask the kernel to drop images from the
+ *		cache once they are done.)
+ *
+ * ==> --rate-bytes=BYTES, --rate-ops=N
+ *		Limit image I/O to BYTES (with an optional K, M, or G
+ *		suffix) and/or N operations per second, across all
+ *		threads.  The limits are lowered while the p99 read
+ *		latency is above --rate-latency=MS (default 50), and
+ *		the throughput achieved is reported at the end.
+ *
+ * ==> --hdb-drive=N
+ *		Operate on RS-DOS disk N of the HDB-DOS region of a
+ *		hard disk image, rather than on a floppy image.
+ *
+ * ==> --hdb-offset=BYTES|auto
+ *		Where the HDB-DOS region starts in the hard disk image.
+ *		By default (auto), it's found as for hdbscan.
+ *
+ * The following commands are given in place of the image name:
+ *
+ * ==> replay	Re-issue the image I/O recorded in a trace against
+ *		scratch copies of the images, and report the latency
+ *		distribution of the recorded and replayed operations.
+ *
+ * ==> scan	Run a command over every image (*.dsk) found under a
+ *		directory, or listed one per line in a file.  Each
+ *		image's output is preceded by its name, and goes to
+ *		stdout or, with -o, to the named file.  A command that
+ *		modifies images (copyin, rm, cp, ...) changes an image
+ *		only if it succeeds on it; the images are synced all
+ *		together at the end, and -m writes the outcome for each
+ *		one to a manifest.  Error messages go to stderr as they
+ *		happen, apart from the output; with --jobs, use -m to
+ *		tell which images failed.
+ *
+ * ==> watch	Build a catalog of every file in every image under a
+ *		directory tree, then keep it up to date as images are
+ *		added, changed, or removed (Linux only).
+ *
+ * ==> catalog	Look files up by name in a catalog built by watch.
+ *
+ * ==> hdbscan	Find the HDB-DOS region of a hard disk image (from the
+ *		OS-9 partition's size in LSN0, and the RS-DOS
+ *		directories found in the image) and list the drives in
+ *		it that are formatted.
+ *
+ * ==> dwserve	Serve disk images, and host directories presented as
+ *		disk images, to emulators as DriveWire drives over TCP
+ *		(a "Becker port").
+ *
+ * ==> http	Serve the images under a directory over HTTP (read-only):
+ *		directory listings as JSON, and whole images or single
+ *		files, with ETags and Range requests.
+ *
+ * ==> export-arrow
+ *		Write a row for each file in each image found under a
+ *		directory (or listed in a file) -- its image, name,
+ *		type, encoding, size, granule chain and content hash --
+ *		to an Apache Arrow IPC (Feather) file.
+ *
+ * ==> mkiddb	Build the database used by identify from a list of
+ *		titles, versions, and the disk images or files that
+ *		they consist of.
+ *
+ * ==> coderefs	Find the machine-language programs, in the images found
+ *		under a directory (or listed in a file), that share code
+ *		with each other: patched versions, and common routines
+ *		linked into different programs.
  */
 
+#ifdef __linux__
+#define	_GNU_SOURCE		/* O_DIRECT */
+#include <sys/inotify.h>
+#include <sys/sendfile.h>
+#endif
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
 #include <sys/stat.h>
+#ifndef _WIN32
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
 #include <assert.h>
+#include <ctype.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <math.h>
+#ifndef _WIN32
+#include <netdb.h>
+#endif
+#ifndef _WIN32
+#include <poll.h>
+#endif
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 /* We need to use O_BINARY on platforms that have it (Windows). */
@@ -124,8 +315,8 @@
 #define	COCOFS_BYTES_PER_GRANULE \
 	(COCOFS_SEC_PER_GRANULE * COCOFS_BYTES_PER_SEC)
 
-#define	COCOFS_TOTALSIZE	\
-	(COCOFS_TRACKS * COCOFS_SEC_PER_TRACK * COCOFS_BYTES_PER_SEC)
+#define	COCOFS_NSECTORS		(COCOFS_TRACKS * COCOFS_SEC_PER_TRACK)
+#define	COCOFS_TOTALSIZE	(COCOFS_NSECTORS * COCOFS_BYTES_PER_SEC)
 
 #define	COCOFS_DIR_TRACK	17
 #define	COCOFS_GRANULES_PER_TRACK \
@@ -175,6 +366,26 @@ cocofs_granule_to_offset(unsigned int granule)
 	return offset;
 }
 
+/*
+ * Returns the granule holding the given image offset, or
+ * COCOFS_NGRANULES if it's on the directory track.
+ */
+static unsigned int
+cocofs_offset_to_granule(unsigned int offset)
+{
+	unsigned int track = offset / COCOFS_BYTES_PER_TRACK;
+	unsigned int half = (offset % COCOFS_BYTES_PER_TRACK) /
+	    COCOFS_BYTES_PER_GRANULE;
+
+	if (track == COCOFS_DIR_TRACK) {
+		return COCOFS_NGRANULES;
+	}
+	if (track > COCOFS_DIR_TRACK) {
+		track--;
+	}
+	return track * COCOFS_GRANULES_PER_TRACK + half;
+}
+
 /*
  * CoCo DOS directory track:
  *
@@ -252,15 +463,60 @@ struct cocofs_dirent {
 	((COCOFS_DIR_TRACK_NSEC * COCOFS_BYTES_PER_SEC) / 		\
 	 sizeof(struct cocofs_dirent))
 
+/*
+ * USDT (statically-defined tracing) probes for bpftrace, perf, and
+ * SystemTap.  These are compiled in when building with -DCOCOFS_USDT
+ * (which requires <sys/sdt.h>); each one is then a single nop until a
+ * tracer attaches to it.  Otherwise they compile away entirely.
+ *
+ *	load__start(path)
+ *	load__done(path, bytes read, free granules)
+ *	save__start(path)
+ *	save__done(path, bytes written or -1)
+ *	galloc(path, hint, granule, free granules)
+ *	lookup(path, name[8], ext[3], dirent index or -1)
+ *	copyin__start(path, source)
+ *	copyin__done(path, source, bytes or -1, granules)
+ *	copyout__start(path, name[8], destination)
+ *	copyout__done(path, name[8], destination, bytes or -1, granules)
+ *	chain__error(path, name[8], granule index, granule, map entry)
+ *
+ * The name and ext arguments are not NUL-terminated.
+ */
+#ifdef COCOFS_USDT
+#include <sys/sdt.h>
+#define	COCOFS_PROBE1(n, a)		DTRACE_PROBE1(cocofs, n, a)
+#define	COCOFS_PROBE2(n, a, b)		DTRACE_PROBE2(cocofs, n, a, b)
+#define	COCOFS_PROBE3(n, a, b, c)	DTRACE_PROBE3(cocofs, n, a, b, c)
+#define	COCOFS_PROBE4(n, a, b, c, d)	DTRACE_PROBE4(cocofs, n, a, b, c, d)
+#define	COCOFS_PROBE5(n, a, b, c, d, e)					\
+	DTRACE_PROBE5(cocofs, n, a, b, c, d, e)
+#else
+#define	COCOFS_PROBE1(n, a)		do { } while (0)
+#define	COCOFS_PROBE2(n, a, b)		do { } while (0)
+#define	COCOFS_PROBE3(n, a, b, c)	do { } while (0)
+#define	COCOFS_PROBE4(n, a, b, c, d)	do { } while (0)
+#define	COCOFS_PROBE5(n, a, b, c, d, e)	do { } while (0)
+#endif
+
 /*
  * In-memory representation of a CoCo DOS file system.
  */
 struct cocofs {
 	int		fd;		/* file descriptor backing the image */
+	const char	*path;		/* image name, for diagnostics */
+	off_t		base;		/* offset of the disk in the file */
 	uint8_t		*image_data;	/* full image data */
 	uint8_t		*granule_map;	/* pointer to the Granule Map */
 	struct cocofs_dirent *directory;/* pointer to the directory */
 	unsigned int	free_granules;	/* # of free granules */
+	bool		shrink;		/* drop trailing free tracks on save */
+	bool		batch;		/* part of a scan; saves are deferred */
+					/* granule allocation policy */
+	const struct cocofs_allocator *allocator;
+	off_t		disk_size;	/* size of the image file on disk */
+					/* sectors modified since last save */
+	uint8_t		dirty[(COCOFS_NSECTORS + 7) / 8];
 };
 
 /*
@@ -318,6 +574,88 @@ plural(long v)
 	return v == 1 ? "" : "s";
 }
 
+/*
+ * Monotonic time in nanoseconds, for measuring how long things take.
+ */
+static uint64_t
+cocofs_now_ns(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
+		return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	}
+#endif
+	return (uint64_t)clock() * (1000000000ULL / CLOCKS_PER_SEC);
+}
+
+/*
+ * Little-endian encoding for the on-disk formats cocofs writes itself
+ * (journals, catalogs, and the like).
+ */
+static void
+cocofs_le32enc(uint8_t *cp, uint32_t v)
+{
+	unsigned int i;
+
+	for (i = 0; i < 4; i++) {
+		cp[i] = (uint8_t)(v >> (i * 8));
+	}
+}
+
+static uint32_t
+cocofs_le32dec(const uint8_t *cp)
+{
+	return cp[0] | (cp[1] << 8) | (cp[2] << 16) | ((uint32_t)cp[3] << 24);
+}
+
+static void
+cocofs_le64enc(uint8_t *cp, uint64_t v)
+{
+	cocofs_le32enc(cp, (uint32_t)v);
+	cocofs_le32enc(cp + 4, (uint32_t)(v >> 32));
+}
+
+static uint64_t
+cocofs_le64dec(const uint8_t *cp)
+{
+	return cocofs_le32dec(cp) | ((uint64_t)cocofs_le32dec(cp + 4) << 32);
+}
+
+/*
+ * 64-bit FNV-1a hash.  Pass FNV1A_64_INIT to start a new hash, or a
+ * previous result to continue one.
+ */
+#define	FNV1A_64_INIT		0xcbf29ce484222325ULL
+#define	FNV1A_64_PRIME		0x100000001b3ULL
+
+static uint64_t
+fnv1a_64(const void *buf, size_t len, uint64_t h)
+{
+	const uint8_t *cp = buf;
+
+	while (len-- != 0) {
+		h = (h ^ *cp++) * FNV1A_64_PRIME;
+	}
+	return h;
+}
+
+/*
+ * Scramble a 64-bit value (the SplitMix64 finalizer), for when all of
+ * its bits need to depend on all of the input's.
+ */
+static uint64_t
+hash_mix64(uint64_t h)
+{
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+	return h;
+}
+
 struct str2val {
 	const char *str;
 	unsigned int val;
@@ -551,924 +889,11762 @@ cocofs_dir_set_lastbytes(unsigned int cnt, uint8_t *lastbytes)
 	lastbytes[1] = (uint8_t)cnt;
 }
 
+#if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#define	COCOFS_THREAD_LOCAL	_Thread_local
+#else
+#define	COCOFS_THREAD_LOCAL	__thread
+#endif
+
+#define	REC_BUFSIZE		65536
+
 /*
- * We provide our own versions of pread() and pwrite() in order to
- * improve code portability.
+ * Per-thread state.  The main thread uses mainworker; scan mode
+ * creates one of these for each worker thread.
  */
+struct worker {
+	unsigned int	id;
+	pthread_t	thread;
+	int		image_fd;	/* image being processed, or -1 */
+	struct trace_buf *trace;	/* --trace event buffer */
+	struct metrics_shard *metrics;	/* --metrics counters */
+	uint8_t		*direct_buf;	/* --direct aligned read buffer */
+	bool		saved;		/* run_image() wrote the image back */
+	bool		buffer_out;	/* collect output in out[] */
+	char		*out;		/* the image's output so far */
+	size_t		outlen;
+	size_t		outsize;
+	size_t		rec_len;	/* --record buffer */
+	uint8_t		rec_buf[REC_BUFSIZE];
+};
 
-static ssize_t
-cocofs_pread(int d, void *buf, size_t nbyte, off_t offset)
-{
-	if (lseek(d, offset, SEEK_SET) == -1) {
-		return -1;
-	}
-	return read(d, buf, nbyte);
-}
+static struct worker mainworker = { .image_fd = -1 };
+static COCOFS_THREAD_LOCAL struct worker *curworker = &mainworker;
 
-static ssize_t
-cocofs_pwrite(int d, const void *buf, size_t nbyte, off_t offset)
+/*
+ * Output from the image commands.  In scan mode, each worker collects
+ * an image's output in memory and writes it out in one piece once the
+ * command is done, so that the workers only serialize on that.
+ * Error messages aren't collected; they still go straight to stderr.
+ */
+static void
+cocofs_printf(const char *fmt, ...)
 {
-	if (lseek(d, offset, SEEK_SET) == -1) {
-		return -1;
+	struct worker *w = curworker;
+	va_list ap, ap2;
+	size_t room;
+	int n;
+
+	va_start(ap, fmt);
+	if (! w->buffer_out) {
+		vprintf(fmt, ap);
+		va_end(ap);
+		return;
+	}
+	va_copy(ap2, ap);
+	room = w->outsize - w->outlen;
+	n = vsnprintf(w->out != NULL ? w->out + w->outlen : NULL, room,
+	    fmt, ap);
+	if (n >= 0 && (size_t)n >= room) {
+		do {
+			w->outsize = w->outsize ? w->outsize * 2 : 4096;
+		} while (w->outsize - w->outlen <= (size_t)n);
+		w->out = realloc(w->out, w->outsize);
+		assert(w->out != NULL);
+		n = vsnprintf(w->out + w->outlen, w->outsize - w->outlen,
+		    fmt, ap2);
 	}
-	return write(d, buf, nbyte);
+	if (n > 0) {
+		w->outlen += (size_t)n;
+	}
+	va_end(ap2);
+	va_end(ap);
 }
 
-static struct cocofs *
-cocofs_alloc(int fd)
-{
-	struct cocofs *fs = calloc(1, sizeof(*fs));
-	assert(fs != NULL);
+/*
+ * Operation trace recording (--record).  The trace is a compact binary
+ * log of each command that is run, along with every read and write
+ * issued through cocofs_pread() / cocofs_pwrite() and how long each of
+ * them took.  Traces are appended to, so one trace can cover a whole
+ * session of commands.  The format is:
+ *
+ *	"CCFSTRC1"			magic (once, at the start)
+ *
+ * ...followed by records, each starting with a type byte.  All of the
+ * numbers are unsigned LEB128 varints:
+ *
+ *	REC_CMD		image path, argc, argv[] (strings are
+ *			length-prefixed), wall clock time (usec)
+ *	REC_READ	target, offset, size, result + 1, duration (nsec)
+ *	REC_WRITE	target, offset, size, result + 1, duration (nsec)
+ *	REC_END		exit status, duration (nsec)
+ *
+ * Target is REC_TARGET_IMAGE for the disk image and REC_TARGET_HOST
+ * for anything else (host files being copied in).
+ */
+#define	REC_MAGIC		"CCFSTRC1"
+#define	REC_MAGIC_LEN		8
 
-	/* Allocate a fresh, zero'd image. */
-	fs->image_data = calloc(1, COCOFS_TOTALSIZE);
-	assert(fs->image_data != NULL);
+#define	REC_CMD			1
+#define	REC_READ		2
+#define	REC_WRITE		3
+#define	REC_END			4
 
-	/* Cache pointers to Granule Map and directory. */
-	uint8_t *directory_track =
-	    fs->image_data + cocofs_track_to_offset(COCOFS_DIR_TRACK);
-	fs->granule_map =
-	    directory_track + cocofs_sector_to_offset(GMAP_SECTOR);
-	fs->directory = (struct cocofs_dirent *)
-	    (directory_track +
-	     cocofs_sector_to_offset(COCOFS_DIR_TRACK_FIRST_SEC));
+#define	REC_TARGET_IMAGE	0
+#define	REC_TARGET_HOST		1
 
-	fs->fd = fd;
+#define	REC_MAXREC		64	/* max size of an I/O record */
 
-	return fs;
+/*
+ * Each worker records into its own buffer, which is written to the
+ * trace (under rec.lock) at the end of each command, so the records
+ * for concurrently-processed images don't interleave.
+ */
+static struct {
+	int		fd;		/* trace file, or -1 */
+	pthread_mutex_t	lock;
+} rec = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void
+rec_flush(void)
+{
+	struct worker *w = curworker;
+	ssize_t rv;
+	size_t off;
+
+	pthread_mutex_lock(&rec.lock);
+	for (off = 0; off < w->rec_len; off += (size_t)rv) {
+		rv = write(rec.fd, w->rec_buf + off, w->rec_len - off);
+		if (rv <= 0) {
+			fprintf(stderr, "WARNING: unable to write trace: %s\n",
+			    strerror(errno));
+			break;
+		}
+	}
+	pthread_mutex_unlock(&rec.lock);
+	w->rec_len = 0;
 }
 
 static void
-cocofs_free(struct cocofs *fs)
+rec_reserve(size_t len)
 {
-	free(fs->image_data);
-	free(fs);
+	if (curworker->rec_len + len > sizeof(curworker->rec_buf)) {
+		rec_flush();
+	}
 }
 
-static struct cocofs *
-cocofs_format(int fd)
+static void
+rec_put_byte(uint8_t v)
 {
-	struct cocofs *fs = cocofs_alloc(fd);
+	curworker->rec_buf[curworker->rec_len++] = v;
+}
 
-	/*
-	 * Looking at several CoCo disk images, it appears that simply
-	 * initializing the entire disk to 0xff's is sufficient. That
-	 * marks all of the granule map entries as "FREE", and it appears
-	 * to be what a free directory entry looks like, as well.
-	 *
-	 * As far as I can tell, CoCo disks to not have the separate
-	 * granule allocation table in sector 1 of the directory track.
-	 */
-	memset(fs->image_data, 0xff, COCOFS_TOTALSIZE);
-	fs->free_granules = COCOFS_NGRANULES;
+static void
+rec_put_varint(uint64_t v)
+{
+	while (v >= 0x80) {
+		rec_put_byte((uint8_t)(v | 0x80));
+		v >>= 7;
+	}
+	rec_put_byte((uint8_t)v);
+}
 
-	return fs;
+static void
+rec_put_string(const char *str)
+{
+	size_t len = strlen(str);
+
+	rec_reserve(10 + len);
+	if (len > sizeof(curworker->rec_buf) - 10) {
+		len = sizeof(curworker->rec_buf) - 10;
+	}
+	rec_put_varint(len);
+	memcpy(curworker->rec_buf + curworker->rec_len, str, len);
+	curworker->rec_len += len;
 }
 
-static struct cocofs *
-cocofs_load(int fd)
+static bool
+rec_open(const char *path)
 {
-	struct cocofs *fs = cocofs_alloc(fd);
 	struct stat sb;
-	ssize_t rsize, rv;
-	int i;
 
-	/* Get the size of the image. */
-	if (fstat(fd, &sb) == -1) {
-		fprintf(stderr, "ERROR: unable to stat image: %s\n",
-		    strerror(errno));
-		cocofs_free(fs);
-		return NULL;
+	rec.fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_BINARY, 0644);
+	if (rec.fd == -1 || fstat(rec.fd, &sb) == -1) {
+		fprintf(stderr, "unable to open trace %s: %s\n",
+		    path, strerror(errno));
+		return false;
 	}
-
-	/*
-	 * Reject images that are too large.  Compensate for images
-	 * that are too small (assume that the trailing tracks are
-	 * simply left off).
-	 */
-	if (sb.st_size > COCOFS_TOTALSIZE) {
-		fprintf(stderr, "ERROR: image size %lld exceeds max size %u\n",
-		    (long long)sb.st_size, COCOFS_TOTALSIZE);
-		cocofs_free(fs);
-		return NULL;
+	if (sb.st_size == 0 &&
+	    write(rec.fd, REC_MAGIC, REC_MAGIC_LEN) != REC_MAGIC_LEN) {
+		fprintf(stderr, "unable to write trace %s: %s\n",
+		    path, strerror(errno));
+		return false;
 	}
+	return true;
+}
 
-	rsize = (ssize_t)sb.st_size;
-	if (sb.st_size < COCOFS_TOTALSIZE) {
-		fprintf(stderr,
-		    "WARNING: image size %ld less than expected size %u\n",
-		    (long)rsize, COCOFS_TOTALSIZE);
-		memset(fs->image_data, 0xff, COCOFS_TOTALSIZE);
-	}
+static void
+rec_command(const char *image, int argc, char *argv[])
+{
+	struct timespec ts;
+	int i;
 
-	/* Read in the image. */
-	rv = cocofs_pread(fd, fs->image_data, rsize, 0);
-	if (rv == -1) {
-		fprintf(stderr, "ERROR: unable to read image: %s\n",
-		    strerror(errno));
-		cocofs_free(fs);
-		return NULL;
-	}
-	if (rv != rsize) {
-		fprintf(stderr,
-		    "WARNING: read only %ld byte%s of image data, "
-		    "expected %ld\n", (long)rv, plural(rv), (long)rsize);
+	rec_reserve(1);
+	rec_put_byte(REC_CMD);
+	rec_put_string(image);
+	rec_reserve(10);
+	rec_put_varint((uint64_t)argc);
+	for (i = 0; i < argc; i++) {
+		rec_put_string(argv[i]);
 	}
+	clock_gettime(CLOCK_REALTIME, &ts);
+	rec_reserve(10);
+	rec_put_varint((uint64_t)ts.tv_sec * 1000000 +
+	    (uint64_t)ts.tv_nsec / 1000);
+}
 
-	for (i = 0; i < COCOFS_NGRANULES; i++) {
-		if (fs->granule_map[i] == GMAP_FREE) {
-			fs->free_granules++;
+static void
+rec_io(uint8_t type, int d, off_t offset, size_t nbyte, ssize_t rv,
+    uint64_t ns)
+{
+	rec_reserve(REC_MAXREC);
+	rec_put_byte(type);
+	rec_put_byte(d == curworker->image_fd ? REC_TARGET_IMAGE
+					       : REC_TARGET_HOST);
+	rec_put_varint((uint64_t)offset);
+	rec_put_varint(nbyte);
+	rec_put_varint((uint64_t)(rv + 1));
+	rec_put_varint(ns);
+}
+
+static void
+rec_end(int status, uint64_t ns)
+{
+	rec_reserve(REC_MAXREC);
+	rec_put_byte(REC_END);
+	rec_put_varint((uint64_t)status);
+	rec_put_varint(ns);
+	rec_flush();
+}
+
+/*
+ * Timeline tracing (--trace).  Each thread collects spans in its own
+ * buffer without any locking; a thread takes trace.lock only when its
+ * buffer fills up (and when it exits) to write the events out in the
+ * Chrome trace-event JSON format, which chrome://tracing and Perfetto
+ * can display.
+ */
+#define	TRACE_NEVENTS		4096
+
+struct trace_event {
+	const char	*name;		/* static string */
+	char		*arg;		/* image path (malloc'd), or NULL */
+	uint64_t	ts;
+	uint64_t	dur;
+};
+
+struct trace_buf {
+	size_t		n;
+	struct trace_event ev[TRACE_NEVENTS];
+};
+
+static struct {
+	FILE		*fp;		/* trace file, or NULL */
+	uint64_t	t0;		/* start of trace */
+	bool		first;		/* no events written yet */
+	pthread_mutex_t	lock;
+} trace = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void
+json_put_string(FILE *fp, const char *str)
+{
+	const unsigned char *cp;
+
+	putc('"', fp);
+	for (cp = (const unsigned char *)str; *cp != '\0'; cp++) {
+		if (*cp == '"' || *cp == '\\') {
+			fprintf(fp, "\\%c", *cp);
+		} else if (*cp < 0x20) {
+			fprintf(fp, "\\u%04x", *cp);
+		} else {
+			putc(*cp, fp);
 		}
 	}
+	putc('"', fp);
+}
 
-	return fs;
+/* Called with trace.lock held. */
+static void
+trace_put_separator(void)
+{
+	fputs(trace.first ? "\n" : ",\n", trace.fp);
+	trace.first = false;
 }
 
 static bool
-cocofs_save(const struct cocofs *fs)
+trace_open(const char *path)
 {
-	ssize_t rv;
-
-	rv = cocofs_pwrite(fs->fd, fs->image_data, COCOFS_TOTALSIZE, 0);
-	if (rv != COCOFS_TOTALSIZE) {
-		fprintf(stderr, "ERROR: unable to write image data: %s\n",
-		    strerror(errno));
+	trace.fp = fopen(path, "w");
+	if (trace.fp == NULL) {
+		fprintf(stderr, "unable to open trace %s: %s\n",
+		    path, strerror(errno));
 		return false;
 	}
+	fputs("{\"traceEvents\":[", trace.fp);
+	trace.first = true;
+	trace.t0 = cocofs_now_ns();
 	return true;
 }
 
 static void
-cocofs_close(struct cocofs *fs)
+trace_flush(struct worker *w)
 {
-	close(fs->fd);
-	cocofs_free(fs);
+	struct trace_buf *tb = w->trace;
+	struct trace_event *ev;
+	size_t i;
+
+	pthread_mutex_lock(&trace.lock);
+	for (i = 0; i < tb->n; i++) {
+		ev = &tb->ev[i];
+		trace_put_separator();
+		fprintf(trace.fp, "{\"name\":\"%s\",\"cat\":\"cocofs\","
+		    "\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+		    "\"ts\":%.3f,\"dur\":%.3f", ev->name, w->id,
+		    (ev->ts - trace.t0) / 1e3, ev->dur / 1e3);
+		if (ev->arg != NULL) {
+			fputs(",\"args\":{\"image\":", trace.fp);
+			json_put_string(trace.fp, ev->arg);
+			fputc('}', trace.fp);
+			free(ev->arg);
+		}
+		fputc('}', trace.fp);
+	}
+	pthread_mutex_unlock(&trace.lock);
+	tb->n = 0;
 }
 
-static struct cocofs_dirent *
-cocofs_lookup_raw(struct cocofs *fs, const char *name, const char *ext)
+static void
+trace_thread_start(struct worker *w)
 {
-	struct cocofs_dirent *dir;
-	unsigned int i;
-
-	for (i = 0; i < COCOFS_DIR_TRACK_NENTRIES; i++) {
-		dir = &fs->directory[i];
-		if (dir->d_type == COCOFS_DIRENT_TYPE_FREE) {
-			continue;
-		}
-		if (memcmp(dir->d_name, name, sizeof(dir->d_name)) != 0) {
-			continue;
-		}
-		if (memcmp(dir->d_ext, ext, sizeof(dir->d_ext)) != 0) {
-			continue;
-		}
-		break;
+	if (trace.fp == NULL) {
+		return;
 	}
+	w->trace = calloc(1, sizeof(*w->trace));
+	assert(w->trace != NULL);
+
+	pthread_mutex_lock(&trace.lock);
+	trace_put_separator();
+	fprintf(trace.fp, "{\"name\":\"thread_name\",\"ph\":\"M\","
+	    "\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s %u\"}}",
+	    w->id, w->id == 0 ? "main" : "worker", w->id);
+	pthread_mutex_unlock(&trace.lock);
+}
 
-	if (i < COCOFS_DIR_TRACK_NENTRIES) {
-		return dir;
+static void
+trace_thread_done(struct worker *w)
+{
+	if (w->trace == NULL) {
+		return;
 	}
+	trace_flush(w);
+	free(w->trace);
+	w->trace = NULL;
+}
 
-	return NULL;
+static uint64_t
+trace_begin(void)
+{
+	return curworker->trace != NULL ? cocofs_now_ns() : 0;
 }
 
-static struct cocofs_dirent *
-cocofs_lookup(struct cocofs *fs, const char *lookup)
+/*
+ * Record a span that started at t0 (from trace_begin()) and ends now.
+ */
+static void
+trace_span(const char *name, uint64_t t0, const char *arg)
 {
-	char name[8], ext[3];
+	struct trace_buf *tb = curworker->trace;
+	struct trace_event *ev;
 
-	if (! cocofs_conv_name(lookup, name, ext)) {
-		return NULL;
+	if (tb == NULL) {
+		return;
+	}
+	ev = &tb->ev[tb->n++];
+	ev->name = name;
+	ev->arg = NULL;
+	if (arg != NULL) {
+		ev->arg = strdup(arg);
+		assert(ev->arg != NULL);
+	}
+	ev->ts = t0;
+	ev->dur = cocofs_now_ns() - t0;
+	if (tb->n == TRACE_NEVENTS) {
+		trace_flush(curworker);
 	}
-
-	return cocofs_lookup_raw(fs, name, ext);
 }
 
 static void
-cocofs_stat(const struct cocofs *fs, const struct cocofs_dirent *dir,
-    struct cocofs_stat *st)
+trace_close(void)
 {
-	uint32_t size = 0;
-	uint32_t last_nsec = 0;
-	unsigned int loopcnt;
-	uint8_t g, gn;
+	if (trace.fp == NULL) {
+		return;
+	}
+	trace_thread_done(&mainworker);
+	fputs("\n]}\n", trace.fp);
+	fclose(trace.fp);
+	trace.fp = NULL;
+}
 
-	for (loopcnt = 0, g = dir->d_first_granule;
-	     loopcnt <= COCOFS_NGRANULES;
-	     loopcnt++, g = gn) {
-		gn = fs->granule_map[g];
-		if (! gmap_entry_is_valid(gn) ||
-		    gn == GMAP_FREE) {
-			break;
-		}
+/*
+ * Metrics (--metrics).  Each thread counts into its own shard, so the
+ * hot paths never share a cache line or take a lock; the counters are
+ * atomics only so that a scrape can read them while they are being
+ * updated.  A scrape sums all of the shards and emits the result in
+ * the Prometheus text exposition format.
+ */
+#define	METRIC_IMAGES_OK	0
+#define	METRIC_IMAGES_FAILED	1
+#define	METRIC_READ_IMAGE	2
+#define	METRIC_READ_HOST	3
+#define	METRIC_WRITE_IMAGE	4
+#define	METRIC_WRITE_HOST	5
+#define	METRIC_LOOKUP_HIT	6
+#define	METRIC_LOOKUP_MISS	7
+#define	METRIC_ALLOC_FILES	8
+#define	METRIC_ALLOC_GRANULES	9
+#define	METRIC_ERR_OPEN		10
+#define	METRIC_ERR_LOAD		11
+#define	METRIC_ERR_SAVE		12
+#define	METRIC_ERR_IO		13
+#define	METRIC_ERR_CHAIN	14
+#define	METRIC_ERR_NOSPACE	15
+#define	METRIC_CACHE_HIT	16
+#define	METRIC_CACHE_MISS	17
+#define	METRIC_CACHE_EVICT	18
+#define	METRIC_CACHE_WRITEBACK	19
+#define	METRIC_NCOUNTERS	20
+
+static const struct {
+	const char	*name;
+	const char	*labels;
+	const char	*help;
+} metric_counters[METRIC_NCOUNTERS] = {
+	{ "cocofs_images_total", "result=\"ok\"",
+	  "Images processed." },
+	{ "cocofs_images_total", "result=\"failed\"", NULL },
+	{ "cocofs_read_bytes_total", "target=\"image\"",
+	  "Bytes read." },
+	{ "cocofs_read_bytes_total", "target=\"host\"", NULL },
+	{ "cocofs_written_bytes_total", "target=\"image\"",
+	  "Bytes written." },
+	{ "cocofs_written_bytes_total", "target=\"host\"", NULL },
+	{ "cocofs_lookups_total", "result=\"hit\"",
+	  "Directory lookups." },
+	{ "cocofs_lookups_total", "result=\"miss\"", NULL },
+	{ "cocofs_file_allocations_total", NULL,
+	  "Files allocated." },
+	{ "cocofs_granule_allocations_total", NULL,
+	  "Granules allocated." },
+	{ "cocofs_errors_total", "type=\"open\"",
+	  "Errors, by type." },
+	{ "cocofs_errors_total", "type=\"load\"", NULL },
+	{ "cocofs_errors_total", "type=\"save\"", NULL },
+	{ "cocofs_errors_total", "type=\"io\"", NULL },
+	{ "cocofs_errors_total", "type=\"chain\"", NULL },
+	{ "cocofs_errors_total", "type=\"nospace\"", NULL },
+	{ "cocofs_cache_lookups_total", "result=\"hit\"",
+	  "Image cache lookups." },
+	{ "cocofs_cache_lookups_total", "result=\"miss\"", NULL },
+	{ "cocofs_cache_evictions_total", NULL,
+	  "Images evicted from the image cache." },
+	{ "cocofs_cache_writebacks_total", NULL,
+	  "Dirty cached images written back." },
+};
 
-		if (GMAP_IS_LAST(gn)) {
-			last_nsec = GMAP_LAST_NSEC(gn);
-			break;
-		}
+/* Command latency histogram bucket upper bounds, in nanoseconds. */
+static const uint64_t metric_buckets[] = {
+	100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000,
+	25000000, 50000000, 100000000, 250000000, 500000000, 1000000000,
+	2500000000ULL,
+};
+#define	METRIC_NBUCKETS							\
+	(sizeof(metric_buckets) / sizeof(metric_buckets[0]))
+#define	METRIC_MAXVERBS		32
+
+struct metric_hist {
+	_Atomic uint64_t	count;
+	_Atomic uint64_t	sum_ns;
+	_Atomic uint64_t	bucket[METRIC_NBUCKETS];
+};
 
-		size += (COCOFS_SEC_PER_GRANULE * COCOFS_BYTES_PER_SEC);
-	}
+struct metrics_shard {
+	struct metrics_shard	*next;
+	_Atomic uint64_t	counter[METRIC_NCOUNTERS];
+	struct metric_hist	verb[METRIC_MAXVERBS];
+};
 
-	if (last_nsec) {
-		uint16_t lastsec_bytes;
+static struct {
+	bool			enabled;
+	struct metrics_shard	*shards;	/* all shards, ever */
+	pthread_mutex_t		lock;		/* protects shards */
+} metrics = { .lock = PTHREAD_MUTEX_INITIALIZER };
 
-		size += last_nsec * COCOFS_BYTES_PER_SEC;
+/*
+ * Only the owning thread ever writes to a shard, so a plain load and
+ * store is enough; there's no need for a locked read-modify-write.
+ */
+static inline void
+metric_add_atomic(_Atomic uint64_t *p, uint64_t v)
+{
+	atomic_store_explicit(p,
+	    atomic_load_explicit(p, memory_order_relaxed) + v,
+	    memory_order_relaxed);
+}
 
-		lastsec_bytes = cocofs_dir_lastbytes(dir->d_last_bytes);
-		if (lastsec_bytes > COCOFS_BYTES_PER_SEC) {
-			lastsec_bytes = COCOFS_BYTES_PER_SEC;
-		}
+static void
+metric_add(unsigned int m, uint64_t v)
+{
+	struct metrics_shard *ms = curworker->metrics;
 
-		size -= (COCOFS_BYTES_PER_SEC - lastsec_bytes);
+	if (ms != NULL) {
+		metric_add_atomic(&ms->counter[m], v);
 	}
+}
 
-	st->st_size = size;
+static void
+metric_observe(unsigned int verb, uint64_t ns)
+{
+	struct metrics_shard *ms = curworker->metrics;
+	struct metric_hist *h;
+	unsigned int i;
 
-	int i;
-	memcpy(st->st_name, dir->d_name, sizeof(st->st_name));
-	st->st_name[8] = '\0';
-	for (i = 7; i >= 0 && st->st_name[i] == ' '; i--) {
-		st->st_name[i] = '\0';
+	if (ms == NULL) {
+		return;
 	}
-
-	memcpy(st->st_ext, dir->d_ext, sizeof(st->st_ext));
-	st->st_ext[3] = '\0';
-	for (i = 2; i >= 0 && st->st_ext[i] == ' '; i--) {
-		st->st_ext[i] = '\0';
+	assert(verb < METRIC_MAXVERBS);
+	h = &ms->verb[verb];
+	metric_add_atomic(&h->count, 1);
+	metric_add_atomic(&h->sum_ns, ns);
+	for (i = 0; i < METRIC_NBUCKETS && ns > metric_buckets[i]; i++) {
+		/* find the bucket */
+	}
+	if (i < METRIC_NBUCKETS) {
+		metric_add_atomic(&h->bucket[i], 1);
 	}
-
-	st->st_type = dir->d_type;
-	st->st_encoding = dir->d_encoding;
 }
 
 static void
-cocofs_print_stat(const struct cocofs_stat *st)
+metrics_thread_start(struct worker *w)
 {
-	printf("  %-8s   %-3s  %6u byte%-1s (%s, %s)\n",
-	    st->st_name, st->st_ext, st->st_size, plural(st->st_size),
-	    cocofs_dir_type(st->st_type),
-	    cocofs_dir_encoding(st->st_encoding));
+	struct metrics_shard *ms;
+
+	if (! metrics.enabled) {
+		return;
+	}
+	ms = calloc(1, sizeof(*ms));
+	assert(ms != NULL);
+
+	pthread_mutex_lock(&metrics.lock);
+	ms->next = metrics.shards;
+	metrics.shards = ms;
+	pthread_mutex_unlock(&metrics.lock);
+	w->metrics = ms;
 }
 
+/*
+ * I/O rate limiting (--rate-bytes, --rate-ops), for background jobs
+ * sharing storage with others.  Image reads and writes draw from a
+ * pair of token buckets shared by all threads; a request that
+ * overdraws one sleeps until it's paid back, so each bucket holds at
+ * most a second's worth of burst.
+ *
+ * The limits are ceilings: every RATE_WINDOW reads, the p99 read
+ * latency of the window is compared with --rate-latency, and the
+ * rates are halved if it's over (down to 1/RATE_MIN_SCALE) or nudged
+ * back up if it's comfortably under.
+ */
+#define	RATE_WINDOW		64
+#define	RATE_MIN_SCALE		16
+#define	RATE_DEFAULT_LATENCY_MS	50
+
+static struct {
+	pthread_mutex_t	lock;
+	bool		enabled;
+	double		bytes_rate;	/* configured limits, per second */
+	double		ops_rate;
+	double		scale;		/* current fraction of the limits */
+	double		bytes_tokens;
+	double		ops_tokens;
+	uint64_t	last_ns;
+	uint64_t	target_ns;	/* p99 read latency target */
+	uint64_t	lat[RATE_WINDOW];
+	unsigned int	nlat;
+					/* for the report */
+	uint64_t	start_ns;
+	uint64_t	bytes;
+	uint64_t	ops;
+	uint64_t	wait_ns;
+	unsigned int	backoffs;
+} rate = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
 static void
-cocofs_enumerate_directory(struct cocofs *fs, bool do_dump)
+rate_start(uint64_t bytes_rate, uint64_t ops_rate, unsigned int latency_ms)
 {
-	struct cocofs_dirent *dir;
-	struct cocofs_stat st;
-	int nfiles = 0, gi;
-	unsigned int di;
-	unsigned int free_granules = COCOFS_NGRANULES;
-	unsigned int loopcnt;
-	uint16_t lastbytes;
-	uint8_t g, gn;
-
-	uint8_t gmap_shadow[COCOFS_NGRANULES];
-	memset(gmap_shadow, 0xff, sizeof(gmap_shadow));
+	rate.enabled = true;
+	rate.bytes_rate = (double)bytes_rate;
+	rate.ops_rate = (double)ops_rate;
+	rate.scale = 1.0;
+	rate.bytes_tokens = rate.bytes_rate;
+	rate.ops_tokens = rate.ops_rate;
+	rate.target_ns = (uint64_t)(latency_ms ? latency_ms
+					       : RATE_DEFAULT_LATENCY_MS) *
+	    1000000;
+	rate.start_ns = rate.last_ns = cocofs_now_ns();
+}
 
-	printf("\n");
-	for (di = 0; di < COCOFS_DIR_TRACK_NENTRIES; di++) {
-		dir = &fs->directory[di];
-		if (dir->d_type > COCOFS_DIRENT_TYPE_TEXT) {
-			if (do_dump) {
-				printf("%2d: entry type 0x%02x, skipping.\n",
-				    di, dir->d_type);
-			}
-			continue;
+/*
+ * Take tokens for an I/O of nbyte bytes, sleeping if we're over.
+ */
+static void
+rate_acquire(size_t nbyte)
+{
+	uint64_t now, wait_ns = 0;
+	double elapsed, wait = 0;
+
+	pthread_mutex_lock(&rate.lock);
+	now = cocofs_now_ns();
+	elapsed = (double)(now - rate.last_ns) / 1e9;
+	rate.last_ns = now;
+	if (rate.bytes_rate != 0) {
+		rate.bytes_tokens += elapsed * rate.bytes_rate * rate.scale;
+		if (rate.bytes_tokens > rate.bytes_rate * rate.scale) {
+			rate.bytes_tokens = rate.bytes_rate * rate.scale;
 		}
-
-		nfiles++;
-		cocofs_stat(fs, dir, &st);
-		cocofs_print_stat(&st);
-
-		if (! do_dump) {
-			continue;
+		rate.bytes_tokens -= (double)nbyte;
+		if (rate.bytes_tokens < 0) {
+			wait = -rate.bytes_tokens /
+			    (rate.bytes_rate * rate.scale);
 		}
-
-		/* Chase the granule list for this file. */
-		for (gi = 0, g = dir->d_first_granule, loopcnt = 0;
-		     loopcnt <= COCOFS_NGRANULES;
-		     gi++, g = gn) {
-			if (g >= COCOFS_NGRANULES) {
-				printf("\tINVALID GRANULE #%d: %d\n",
-				    gi, g);
-				break;
-			}
-			if (gmap_shadow[g] != 0xff) {
-				printf("\tGRANULE %d ALREADY ALLOCATED "
-				       "TO FILE %d\n", g, di);
-			} else {
-				assert(free_granules != 0);
-				free_granules--;
-				gmap_shadow[g] = di;
-			}
-			gn = fs->granule_map[g];
-			if (! gmap_entry_is_valid(gn)) {
-				printf("\tINVALID GRANULE MAP ENTRY "
-				       "%2d: %d -> 0x%02x\n", gi, g, gn);
-				break;
-			}
-			if (GMAP_IS_LAST(gn)) {
-				printf("\tGranule %2d: %d (last, nsec=%d)\n",
-				    gi, g, GMAP_LAST_NSEC(gn));
-				break;
-			} else {
-				printf("\tGranule %2d: %d\n",
-				    gi, g);
-			}
-			g = gn;
+	}
+	if (rate.ops_rate != 0) {
+		rate.ops_tokens += elapsed * rate.ops_rate * rate.scale;
+		if (rate.ops_tokens > rate.ops_rate * rate.scale) {
+			rate.ops_tokens = rate.ops_rate * rate.scale;
 		}
-		if (loopcnt > COCOFS_NGRANULES) {
-			printf("\tGRANULE LIST CYCLE DETECTED\n");
+		rate.ops_tokens -= 1;
+		if (rate.ops_tokens < 0 &&
+		    -rate.ops_tokens / (rate.ops_rate * rate.scale) > wait) {
+			wait = -rate.ops_tokens / (rate.ops_rate * rate.scale);
 		}
-		lastbytes = cocofs_dir_lastbytes(dir->d_last_bytes);
-		printf("\tBytes in last sector: %u (0x%02x 0x%02x)\n",
-		    lastbytes,
-		    dir->d_last_bytes[0], dir->d_last_bytes[1]);
-
-	}
-
-	if (nfiles) {
-		printf("\n");
 	}
-
-	if (! do_dump) {
-		free_granules = fs->free_granules;
+	rate.bytes += nbyte;
+	rate.ops++;
+	if (wait > 0) {
+		wait_ns = (uint64_t)(wait * 1e9);
+		rate.wait_ns += wait_ns;
 	}
-	printf("%d file%s, %u granule%s (%u bytes) free\n",
-	    nfiles, plural(nfiles),
-	    free_granules, plural(free_granules),
-	    free_granules * COCOFS_SEC_PER_GRANULE * COCOFS_BYTES_PER_SEC);
-	if (do_dump && free_granules != fs->free_granules) {
-		printf("WARNING: FREE GRANULES LOADED %u != COMPUTED %u\n",
-		    fs->free_granules, free_granules);
+	pthread_mutex_unlock(&rate.lock);
+
+	if (wait_ns != 0) {
+		struct timespec ts = {
+			.tv_sec = wait_ns / 1000000000,
+			.tv_nsec = wait_ns % 1000000000,
+		};
+		while (nanosleep(&ts, &ts) == -1 && errno == EINTR) {
+			/* keep sleeping */
+		}
 	}
 }
 
-static bool
-cocofs_rm(struct cocofs *fs, struct cocofs_dirent *dir)
+static int
+rate_cmp_u64(const void *a, const void *b)
 {
-	unsigned int gi;
-	uint8_t g, gn;
-
-	for (gi = 0, g = dir->d_first_granule;; gi++, g = gn) {
-		/* No need to detect cycles here, because we'll break them. */
-
-		if (g >= COCOFS_NGRANULES) {
-			fprintf(stderr, "INVALID GRANULE #%d: %d\n",
-			    gi, g);
-			return false;
-		}
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
 
-		gn = fs->granule_map[g];
-		if (! gmap_entry_is_valid(gn) ||
-		    gn == GMAP_FREE) {
-			printf("INVALID GRANULE MAP ENTRY "
-			       "%2d: %d -> 0x%02x\n", gi, g, gn);
-			return false;
-		}
+	return x < y ? -1 : x > y;
+}
 
-		fs->granule_map[g] = GMAP_FREE;
-		fs->free_granules++;
-		if (GMAP_IS_LAST(gn)) {
-			break;
+/*
+ * Note how long a read took, and adjust the rates at the end of
+ * each window.
+ */
+static void
+rate_observe(uint64_t ns)
+{
+	uint64_t sorted[RATE_WINDOW], p99;
+
+	pthread_mutex_lock(&rate.lock);
+	rate.lat[rate.nlat++] = ns;
+	if (rate.nlat == RATE_WINDOW) {
+		memcpy(sorted, rate.lat, sizeof(sorted));
+		qsort(sorted, RATE_WINDOW, sizeof(sorted[0]), rate_cmp_u64);
+		p99 = sorted[(RATE_WINDOW * 99 + 99) / 100 - 1];
+		if (p99 > rate.target_ns) {
+			if (rate.scale > 1.0 / RATE_MIN_SCALE) {
+				rate.scale /= 2;
+				rate.backoffs++;
+			}
+		} else if (p99 < rate.target_ns / 2 && rate.scale < 1.0) {
+			rate.scale *= 1.25;
+			if (rate.scale > 1.0) {
+				rate.scale = 1.0;
+			}
 		}
+		rate.nlat = 0;
 	}
+	pthread_mutex_unlock(&rate.lock);
+}
 
-	memset(dir, 0xff, sizeof(*dir));
+static void
+rate_report(void)
+{
+	double secs;
 
-	return true;
+	if (! rate.enabled) {
+		return;
+	}
+	secs = (double)(cocofs_now_ns() - rate.start_ns) / 1e9;
+	if (secs <= 0) {
+		secs = 1e-9;
+	}
+	fprintf(stderr, "rate: %" PRIu64 " bytes in %" PRIu64
+	    " I/Os over %.2fs (%.1f KB/s, %.1f ops/s); "
+	    "threads waited %.2fs, backed off %u time%s, now at %.0f%% "
+	    "of limit\n",
+	    rate.bytes, rate.ops, secs, rate.bytes / secs / 1024,
+	    rate.ops / secs, (double)rate.wait_ns / 1e9, rate.backoffs,
+	    plural(rate.backoffs), rate.scale * 100);
 }
 
-static bool
-cocofs_copyout(const struct cocofs *fs, const struct cocofs_dirent *dir,
-    const char *outfname)
+/*
+ * We provide our own versions of pread() and pwrite() in order to
+ * improve code portability.  They are also where I/O is recorded.
+ */
+
+static ssize_t
+cocofs_pread(int d, void *buf, size_t nbyte, off_t offset)
 {
-	unsigned int loopcnt;
-	unsigned int last_nsec = 0;
-	uint16_t last_nbytes;
-	unsigned int offset;
-	unsigned int gi;
+	uint64_t t0 = rec.fd != -1 ? cocofs_now_ns() : 0;
 	ssize_t rv;
-	uint8_t g, gn;
-	int outfd;
 
-	outfd = open(outfname, O_WRONLY | O_CREAT | O_BINARY, 0644);
-	if (outfd == -1) {
-		fprintf(stderr, "unable to open output file %s: %s\n",
-		    outfname, strerror(errno));
-		return false;
+	if (rate.enabled && d == curworker->image_fd) {
+		rate_acquire(nbyte);
+		t0 = cocofs_now_ns();
 	}
-
-	for (gi = 0, g = dir->d_first_granule, loopcnt = 0;; gi++, g = gn) {
-		if (loopcnt > COCOFS_NGRANULES) {
-			fprintf(stderr, "GRANULE MAP CYCLE DETECTED\n");
+	if (lseek(d, offset, SEEK_SET) == -1) {
+		rv = -1;
+	} else {
+		rv = read(d, buf, nbyte);
+	}
+	if (rate.enabled && d == curworker->image_fd) {
+		rate_observe(cocofs_now_ns() - t0);
+	}
+	if (rv > 0) {
+		metric_add(d == curworker->image_fd ? METRIC_READ_IMAGE
+						     : METRIC_READ_HOST, rv);
+	} else if (rv == -1) {
+		metric_add(METRIC_ERR_IO, 1);
+	}
+	if (rec.fd != -1) {
+		rec_io(REC_READ, d, offset, nbyte, rv, cocofs_now_ns() - t0);
+	}
+	return rv;
+}
+
+/*
+ * Read into several buffers at once.  Where there's no preadv(), fall
+ * back on a cocofs_pread() per buffer.
+ */
+#ifdef _WIN32
+struct iovec {
+	void		*iov_base;
+	size_t		iov_len;
+};
+#endif
+
+static ssize_t
+cocofs_preadv(int d, const struct iovec *iov, int iovcnt, off_t offset)
+{
+#ifndef _WIN32
+	uint64_t t0 = rec.fd != -1 ? cocofs_now_ns() : 0;
+	size_t nbyte = 0;
+	ssize_t rv;
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		nbyte += iov[i].iov_len;
+	}
+	if (rate.enabled && d == curworker->image_fd) {
+		rate_acquire(nbyte);
+		t0 = cocofs_now_ns();
+	}
+	rv = preadv(d, iov, iovcnt, offset);
+	if (rate.enabled && d == curworker->image_fd) {
+		rate_observe(cocofs_now_ns() - t0);
+	}
+	if (rv > 0) {
+		metric_add(d == curworker->image_fd ? METRIC_READ_IMAGE
+						     : METRIC_READ_HOST, rv);
+	} else if (rv == -1) {
+		metric_add(METRIC_ERR_IO, 1);
+	}
+	if (rec.fd != -1) {
+		rec_io(REC_READ, d, offset, nbyte, rv, cocofs_now_ns() - t0);
+	}
+	return rv;
+#else
+	ssize_t rv, total = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		rv = cocofs_pread(d, iov[i].iov_base, iov[i].iov_len,
+		    offset + total);
+		if (rv == -1) {
+			return total ? total : -1;
+		}
+		total += rv;
+		if ((size_t)rv != iov[i].iov_len) {
+			break;
+		}
+	}
+	return total;
+#endif
+}
+
+static ssize_t
+cocofs_pwrite(int d, const void *buf, size_t nbyte, off_t offset)
+{
+	uint64_t t0 = rec.fd != -1 ? cocofs_now_ns() : 0;
+	ssize_t rv;
+
+	if (rate.enabled && d == curworker->image_fd) {
+		rate_acquire(nbyte);
+		t0 = rec.fd != -1 ? cocofs_now_ns() : 0;
+	}
+	if (lseek(d, offset, SEEK_SET) == -1) {
+		rv = -1;
+	} else {
+		rv = write(d, buf, nbyte);
+	}
+	if (rv > 0) {
+		metric_add(d == curworker->image_fd ? METRIC_WRITE_IMAGE
+						     : METRIC_WRITE_HOST, rv);
+	} else if (rv == -1) {
+		metric_add(METRIC_ERR_IO, 1);
+	}
+	if (rec.fd != -1) {
+		rec_io(REC_WRITE, d, offset, nbyte, rv, cocofs_now_ns() - t0);
+	}
+	return rv;
+}
+
+/*
+ * Scans read each image once and never look at it again, so they
+ * shouldn't push everything else out of the page cache.  Images are
+ * read ahead sequentially, and dropped from the cache once they are
+ * done.  With --direct, the bulk read of an image is done with O_DIRECT
+ * (where the file system allows it) into an aligned buffer that each
+ * worker keeps, so it never enters the page cache at all.  O_DIRECT is
+ * only set for that one read: everything else done with the descriptor
+ * (finding an HDB-DOS drive, writing back dirty sectors) is unaligned.
+ */
+#define	DIRECT_ALIGN		4096
+#define	DIRECT_BUFSIZE							\
+	((COCOFS_TOTALSIZE + DIRECT_ALIGN - 1) & ~(DIRECT_ALIGN - 1))
+
+static void
+scan_io_start(int fd, bool direct)
+{
+	struct worker *w = curworker;
+
+#ifdef POSIX_FADV_SEQUENTIAL
+	(void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	(void)posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+#ifdef O_DIRECT
+	if (direct && w->direct_buf == NULL &&
+	    posix_memalign((void **)&w->direct_buf, DIRECT_ALIGN,
+			   DIRECT_BUFSIZE) != 0) {
+		w->direct_buf = NULL;
+	}
+#else
+	(void)w;
+	(void)direct;
+#endif
+}
+
+static void
+scan_io_done(int fd)
+{
+#ifdef POSIX_FADV_DONTNEED
+	(void)posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#else
+	(void)fd;
+#endif
+}
+
+/*
+ * Read image data, with O_DIRECT into the worker's aligned buffer if
+ * this is a scan with --direct and the read is aligned.
+ */
+static ssize_t
+cocofs_read_image(int d, void *buf, size_t nbyte, off_t offset)
+{
+#ifdef O_DIRECT
+	struct worker *w = curworker;
+	int flags, serrno;
+	ssize_t rv;
+
+	if (w->direct_buf != NULL && nbyte <= DIRECT_BUFSIZE &&
+	    offset % DIRECT_ALIGN == 0 &&
+	    (flags = fcntl(d, F_GETFL)) != -1 &&
+	    fcntl(d, F_SETFL, flags | O_DIRECT) != -1) {
+		rv = cocofs_pread(d, w->direct_buf,
+		    (nbyte + DIRECT_ALIGN - 1) & ~(DIRECT_ALIGN - 1), offset);
+		serrno = errno;
+		(void)fcntl(d, F_SETFL, flags);
+		if (rv != -1) {
+			if ((size_t)rv > nbyte) {
+				rv = nbyte;
+			}
+			memcpy(buf, w->direct_buf, rv);
+			return rv;
+		}
+		if (serrno != EINVAL) {
+			errno = serrno;
+			return -1;
+		}
+		/* Not all file systems allow it; use the page cache. */
+	}
+#endif
+	return cocofs_pread(d, buf, nbyte, offset);
+}
+
+static struct cocofs *
+cocofs_alloc(int fd, const char *path)
+{
+	struct cocofs *fs = calloc(1, sizeof(*fs));
+	assert(fs != NULL);
+
+	/* Allocate a fresh, zero'd image. */
+	fs->image_data = calloc(1, COCOFS_TOTALSIZE);
+	assert(fs->image_data != NULL);
+
+	/* Cache pointers to Granule Map and directory. */
+	uint8_t *directory_track =
+	    fs->image_data + cocofs_track_to_offset(COCOFS_DIR_TRACK);
+	fs->granule_map =
+	    directory_track + cocofs_sector_to_offset(GMAP_SECTOR);
+	fs->directory = (struct cocofs_dirent *)
+	    (directory_track +
+	     cocofs_sector_to_offset(COCOFS_DIR_TRACK_FIRST_SEC));
+
+	fs->fd = fd;
+	fs->path = path;
+
+	return fs;
+}
+
+/*
+ * Note that the image data in the range [p, p + len) has been modified
+ * and needs to be written out by the next cocofs_save().
+ */
+static void
+cocofs_mark_dirty(struct cocofs *fs, const void *p, size_t len)
+{
+	size_t offset = (const uint8_t *)p - fs->image_data;
+	unsigned int sec, lastsec;
+
+	assert(offset + len <= COCOFS_TOTALSIZE);
+	if (len == 0) {
+		return;
+	}
+
+	lastsec = (offset + len - 1) / COCOFS_BYTES_PER_SEC;
+	for (sec = offset / COCOFS_BYTES_PER_SEC; sec <= lastsec; sec++) {
+		fs->dirty[sec / 8] |= 1U << (sec % 8);
+	}
+}
+
+static bool
+cocofs_sector_is_dirty(const struct cocofs *fs, unsigned int sec)
+{
+	return (fs->dirty[sec / 8] & (1U << (sec % 8))) != 0;
+}
+
+static void
+cocofs_free(struct cocofs *fs)
+{
+	free(fs->image_data);
+	free(fs);
+}
+
+static struct cocofs *
+cocofs_format(int fd, const char *path)
+{
+	struct cocofs *fs = cocofs_alloc(fd, path);
+
+	/*
+	 * Looking at several CoCo disk images, it appears that simply
+	 * initializing the entire disk to 0xff's is sufficient. That
+	 * marks all of the granule map entries as "FREE", and it appears
+	 * to be what a free directory entry looks like, as well.
+	 *
+	 * As far as I can tell, CoCo disks to not have the separate
+	 * granule allocation table in sector 1 of the directory track.
+	 */
+	memset(fs->image_data, 0xff, COCOFS_TOTALSIZE);
+	fs->free_granules = COCOFS_NGRANULES;
+
+	return fs;
+}
+
+/*
+ * Load the disk that starts at the given offset in the image file.  A
+ * non-zero base is used for disks inside hard disk images; such disks
+ * must be complete.
+ */
+static struct cocofs *
+cocofs_load_at(int fd, const char *path, off_t base)
+{
+	struct cocofs *fs = cocofs_alloc(fd, path);
+	struct stat sb;
+	ssize_t rsize, rv;
+	int i;
+
+	COCOFS_PROBE1(load__start, path);
+
+	/* Get the size of the image. */
+	if (fstat(fd, &sb) == -1) {
+		fprintf(stderr, "ERROR: unable to stat image: %s\n",
+		    strerror(errno));
+		cocofs_free(fs);
+		return NULL;
+	}
+	if (base != 0) {
+		if (sb.st_size - base < COCOFS_TOTALSIZE) {
+			fprintf(stderr, "ERROR: no disk at offset %lld "
+			    "(image size %lld)\n", (long long)base,
+			    (long long)sb.st_size);
+			cocofs_free(fs);
+			return NULL;
+		}
+		fs->base = base;
+		sb.st_size = COCOFS_TOTALSIZE;
+	}
+
+	/*
+	 * Reject images that are too large.  Compensate for images
+	 * that are too small (assume that the trailing tracks are
+	 * simply left off).
+	 */
+	if (sb.st_size > COCOFS_TOTALSIZE) {
+		fprintf(stderr, "ERROR: image size %lld exceeds max size %u\n",
+		    (long long)sb.st_size, COCOFS_TOTALSIZE);
+		cocofs_free(fs);
+		return NULL;
+	}
+
+	rsize = (ssize_t)sb.st_size;
+	if (sb.st_size < COCOFS_TOTALSIZE) {
+		/*
+		 * Images written with --shrink end on a track boundary
+		 * somewhere after the directory track; don't complain
+		 * about those.
+		 */
+		if (rsize % COCOFS_BYTES_PER_TRACK != 0 ||
+		    rsize < (ssize_t)cocofs_track_to_offset(
+				COCOFS_DIR_TRACK + 1)) {
+			fprintf(stderr,
+			    "WARNING: image size %ld less than expected "
+			    "size %u\n", (long)rsize, COCOFS_TOTALSIZE);
+		}
+		memset(fs->image_data, 0xff, COCOFS_TOTALSIZE);
+	}
+
+	/* Read in the image. */
+	rv = cocofs_read_image(fd, fs->image_data, rsize, fs->base);
+	if (rv == -1) {
+		fprintf(stderr, "ERROR: unable to read image: %s\n",
+		    strerror(errno));
+		cocofs_free(fs);
+		return NULL;
+	}
+	if (rv != rsize) {
+		fprintf(stderr,
+		    "WARNING: read only %ld byte%s of image data, "
+		    "expected %ld\n", (long)rv, plural(rv), (long)rsize);
+	}
+	fs->disk_size = rv;
+
+	for (i = 0; i < COCOFS_NGRANULES; i++) {
+		if (fs->granule_map[i] == GMAP_FREE) {
+			fs->free_granules++;
+		}
+	}
+
+	COCOFS_PROBE3(load__done, path, rv, fs->free_granules);
+	return fs;
+}
+
+static struct cocofs *
+cocofs_load(int fd, const char *path)
+{
+	return cocofs_load_at(fd, path, 0);
+}
+
+/*
+ * Return the number of tracks, starting from track 0, that are needed
+ * to hold the directory track and every granule that is not free in
+ * the Granule Map.  Anything beyond that can be left off of the image;
+ * cocofs_load() (and most emulators) will treat it as unformatted.
+ */
+static unsigned int
+cocofs_used_tracks(const struct cocofs *fs)
+{
+	unsigned int ntracks = COCOFS_DIR_TRACK + 1;
+	unsigned int g, track;
+
+	for (g = 0; g < COCOFS_NGRANULES; g++) {
+		if (fs->granule_map[g] == GMAP_FREE) {
+			continue;
+		}
+		track = cocofs_granule_to_track(g);
+		if (track >= ntracks) {
+			ntracks = track + 1;
+		}
+	}
+
+	return ntracks;
+}
+
+/*
+ * Write out only the sectors that have been modified since the image
+ * was loaded (or last saved), coalescing adjacent dirty sectors into
+ * a single write.
+ */
+static ssize_t
+cocofs_save_dirty(struct cocofs *fs)
+{
+	unsigned int sec, nsec;
+	ssize_t rv, size, total = 0;
+	off_t offset;
+
+	for (sec = 0; sec < COCOFS_NSECTORS; sec += nsec) {
+		if (! cocofs_sector_is_dirty(fs, sec)) {
+			nsec = 1;
+			continue;
+		}
+		for (nsec = 1; sec + nsec < COCOFS_NSECTORS &&
+			       cocofs_sector_is_dirty(fs, sec + nsec); nsec++) {
+			/* coalesce */
+		}
+		offset = (off_t)sec * COCOFS_BYTES_PER_SEC;
+		size = (ssize_t)nsec * COCOFS_BYTES_PER_SEC;
+		rv = cocofs_pwrite(fs->fd, fs->image_data + offset,
+		    size, fs->base + offset);
+		if (rv != size) {
+			fprintf(stderr,
+			    "ERROR: unable to write image data: %s\n",
+			    rv == -1 ? strerror(errno) : "short write");
+			return -1;
+		}
+		total += size;
+	}
+	return total;
+}
+
+/*
+ * Returns the number of bytes written, or -1 on error.
+ */
+static ssize_t
+cocofs_save_image(struct cocofs *fs)
+{
+	ssize_t size = COCOFS_TOTALSIZE;
+	ssize_t rv;
+
+	/*
+	 * If the image on disk is already full-sized, we only need to
+	 * write the sectors that have changed.  Otherwise (new image,
+	 * short image, or --shrink), write out everything so that no
+	 * holes are left in the file.  A disk inside a larger image is
+	 * always full-sized, and can't be shrunk.
+	 */
+	if (fs->disk_size == COCOFS_TOTALSIZE &&
+	    (fs->base != 0 || ! fs->shrink)) {
+		rv = cocofs_save_dirty(fs);
+		if (rv != -1) {
+			memset(fs->dirty, 0, sizeof(fs->dirty));
+		}
+		return rv;
+	}
+
+	if (fs->shrink && fs->base == 0) {
+		size = cocofs_track_to_offset(cocofs_used_tracks(fs));
+	}
+
+	rv = cocofs_pwrite(fs->fd, fs->image_data, size, fs->base);
+	if (rv != size) {
+		fprintf(stderr, "ERROR: unable to write image data: %s\n",
+		    rv == -1 ? strerror(errno) : "short write");
+		return -1;
+	}
+
+	if (fs->shrink && fs->base == 0 && ftruncate(fs->fd, size) == -1) {
+		fprintf(stderr, "ERROR: unable to truncate image: %s\n",
+		    strerror(errno));
+		return -1;
+	}
+	fs->disk_size = size;
+	memset(fs->dirty, 0, sizeof(fs->dirty));
+	return size;
+}
+
+static bool
+cocofs_save(struct cocofs *fs)
+{
+	uint64_t t0;
+	ssize_t rv;
+
+	/* A scan saves each image once, when the command is done. */
+	if (fs->batch) {
+		return true;
+	}
+
+	t0 = trace_begin();
+	COCOFS_PROBE1(save__start, fs->path);
+	rv = cocofs_save_image(fs);
+	if (rv == -1) {
+		metric_add(METRIC_ERR_SAVE, 1);
+	}
+	COCOFS_PROBE2(save__done, fs->path, rv);
+	trace_span("cocofs_save", t0, NULL);
+	return rv != -1;
+}
+
+static bool
+cocofs_is_dirty(const struct cocofs *fs)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(fs->dirty); i++) {
+		if (fs->dirty[i] != 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void
+cocofs_close(struct cocofs *fs)
+{
+	close(fs->fd);
+	cocofs_free(fs);
+}
+
+/*
+ * Sector-level access to an image, by logical sector number (track *
+ * 18 + sector - 1), for things that present an image to a CoCo (or
+ * an emulator) as a disk.
+ */
+static bool
+cocofs_read_sector(const struct cocofs *fs, unsigned int lsn, uint8_t *buf)
+{
+	if (lsn >= COCOFS_NSECTORS) {
+		return false;
+	}
+	memcpy(buf, fs->image_data + (size_t)lsn * COCOFS_BYTES_PER_SEC,
+	    COCOFS_BYTES_PER_SEC);
+	return true;
+}
+
+static bool
+cocofs_write_sector(struct cocofs *fs, unsigned int lsn, const uint8_t *buf)
+{
+	uint8_t *sec;
+
+	if (lsn >= COCOFS_NSECTORS) {
+		return false;
+	}
+	sec = fs->image_data + (size_t)lsn * COCOFS_BYTES_PER_SEC;
+	memcpy(sec, buf, COCOFS_BYTES_PER_SEC);
+	cocofs_mark_dirty(fs, sec, COCOFS_BYTES_PER_SEC);
+	return true;
+}
+
+static struct cocofs_dirent *
+cocofs_lookup_raw(struct cocofs *fs, const char *name, const char *ext)
+{
+	struct cocofs_dirent *dir;
+	unsigned int i;
+
+	for (i = 0; i < COCOFS_DIR_TRACK_NENTRIES; i++) {
+		dir = &fs->directory[i];
+		if (dir->d_type == COCOFS_DIRENT_TYPE_FREE) {
+			continue;
+		}
+		if (memcmp(dir->d_name, name, sizeof(dir->d_name)) != 0) {
+			continue;
+		}
+		if (memcmp(dir->d_ext, ext, sizeof(dir->d_ext)) != 0) {
+			continue;
+		}
+		break;
+	}
+
+	if (i < COCOFS_DIR_TRACK_NENTRIES) {
+		metric_add(METRIC_LOOKUP_HIT, 1);
+		COCOFS_PROBE4(lookup, fs->path, name, ext, i);
+		return dir;
+	}
+
+	metric_add(METRIC_LOOKUP_MISS, 1);
+	COCOFS_PROBE4(lookup, fs->path, name, ext, -1);
+	return NULL;
+}
+
+static struct cocofs_dirent *
+cocofs_lookup(struct cocofs *fs, const char *lookup)
+{
+	char name[8], ext[3];
+
+	if (! cocofs_conv_name(lookup, name, ext)) {
+		return NULL;
+	}
+
+	return cocofs_lookup_raw(fs, name, ext);
+}
+
+static void
+cocofs_stat(const struct cocofs *fs, const struct cocofs_dirent *dir,
+    struct cocofs_stat *st)
+{
+	uint32_t size = 0;
+	uint32_t last_nsec = 0;
+	unsigned int loopcnt;
+	uint8_t g, gn;
+
+	for (loopcnt = 0, g = dir->d_first_granule;
+	     loopcnt <= COCOFS_NGRANULES;
+	     loopcnt++, g = gn) {
+		gn = fs->granule_map[g];
+		if (! gmap_entry_is_valid(gn) ||
+		    gn == GMAP_FREE) {
+			break;
+		}
+
+		if (GMAP_IS_LAST(gn)) {
+			last_nsec = GMAP_LAST_NSEC(gn);
+			break;
+		}
+
+		size += (COCOFS_SEC_PER_GRANULE * COCOFS_BYTES_PER_SEC);
+	}
+
+	if (last_nsec) {
+		uint16_t lastsec_bytes;
+
+		size += last_nsec * COCOFS_BYTES_PER_SEC;
+
+		lastsec_bytes = cocofs_dir_lastbytes(dir->d_last_bytes);
+		if (lastsec_bytes > COCOFS_BYTES_PER_SEC) {
+			lastsec_bytes = COCOFS_BYTES_PER_SEC;
+		}
+
+		size -= (COCOFS_BYTES_PER_SEC - lastsec_bytes);
+	}
+
+	st->st_size = size;
+
+	int i;
+	memcpy(st->st_name, dir->d_name, sizeof(st->st_name));
+	st->st_name[8] = '\0';
+	for (i = 7; i >= 0 && st->st_name[i] == ' '; i--) {
+		st->st_name[i] = '\0';
+	}
+
+	memcpy(st->st_ext, dir->d_ext, sizeof(st->st_ext));
+	st->st_ext[3] = '\0';
+	for (i = 2; i >= 0 && st->st_ext[i] == ' '; i--) {
+		st->st_ext[i] = '\0';
+	}
+
+	st->st_type = dir->d_type;
+	st->st_encoding = dir->d_encoding;
+}
+
+static void
+cocofs_print_stat(const struct cocofs_stat *st)
+{
+	cocofs_printf("  %-8s   %-3s  %6u byte%-1s (%s, %s)\n",
+	    st->st_name, st->st_ext, st->st_size, plural(st->st_size),
+	    cocofs_dir_type(st->st_type),
+	    cocofs_dir_encoding(st->st_encoding));
+}
+
+/*
+ * Note a broken granule chain (for the probes and metrics; the caller
+ * reports it).
+ */
+static void
+cocofs_chain_error(const struct cocofs *fs, const struct cocofs_dirent *dir,
+    unsigned int gi, unsigned int g, unsigned int gn)
+{
+	metric_add(METRIC_ERR_CHAIN, 1);
+	COCOFS_PROBE5(chain__error, fs->path, dir->d_name, gi, g, gn);
+	(void)fs;
+	(void)dir;
+	(void)gi;
+	(void)g;
+	(void)gn;
+}
+
+static void
+cocofs_enumerate_directory(struct cocofs *fs, bool do_dump)
+{
+	struct cocofs_dirent *dir;
+	struct cocofs_stat st;
+	int nfiles = 0, gi;
+	unsigned int di;
+	unsigned int free_granules = COCOFS_NGRANULES;
+	unsigned int loopcnt;
+	uint16_t lastbytes;
+	uint8_t g, gn;
+
+	uint8_t gmap_shadow[COCOFS_NGRANULES];
+	memset(gmap_shadow, 0xff, sizeof(gmap_shadow));
+
+	cocofs_printf("\n");
+	for (di = 0; di < COCOFS_DIR_TRACK_NENTRIES; di++) {
+		dir = &fs->directory[di];
+		if (dir->d_type > COCOFS_DIRENT_TYPE_TEXT) {
+			if (do_dump) {
+				cocofs_printf(
+				    "%2d: entry type 0x%02x, skipping.\n",
+				    di, dir->d_type);
+			}
+			continue;
+		}
+
+		nfiles++;
+		cocofs_stat(fs, dir, &st);
+		cocofs_print_stat(&st);
+
+		if (! do_dump) {
+			continue;
+		}
+
+		/* Chase the granule list for this file. */
+		for (gi = 0, g = dir->d_first_granule, loopcnt = 0;
+		     loopcnt <= COCOFS_NGRANULES;
+		     gi++, g = gn) {
+			if (g >= COCOFS_NGRANULES) {
+				cocofs_printf("\tINVALID GRANULE #%d: %d\n",
+				    gi, g);
+				cocofs_chain_error(fs, dir,
+				    gi, g, 0);
+				break;
+			}
+			if (gmap_shadow[g] != 0xff) {
+				cocofs_printf("\tGRANULE %d ALREADY ALLOCATED "
+				       "TO FILE %d\n", g, di);
+			} else {
+				assert(free_granules != 0);
+				free_granules--;
+				gmap_shadow[g] = di;
+			}
+			gn = fs->granule_map[g];
+			if (! gmap_entry_is_valid(gn)) {
+				cocofs_printf("\tINVALID GRANULE MAP ENTRY "
+				       "%2d: %d -> 0x%02x\n", gi, g, gn);
+				cocofs_chain_error(fs, dir,
+				    gi, g, gn);
+				break;
+			}
+			if (GMAP_IS_LAST(gn)) {
+				cocofs_printf(
+				    "\tGranule %2d: %d (last, nsec=%d)\n",
+				    gi, g, GMAP_LAST_NSEC(gn));
+				break;
+			} else {
+				cocofs_printf("\tGranule %2d: %d\n",
+				    gi, g);
+			}
+			g = gn;
+		}
+		if (loopcnt > COCOFS_NGRANULES) {
+			cocofs_printf("\tGRANULE LIST CYCLE DETECTED\n");
+		}
+		lastbytes = cocofs_dir_lastbytes(dir->d_last_bytes);
+		cocofs_printf("\tBytes in last sector: %u (0x%02x 0x%02x)\n",
+		    lastbytes,
+		    dir->d_last_bytes[0], dir->d_last_bytes[1]);
+
+	}
+
+	if (nfiles) {
+		cocofs_printf("\n");
+	}
+
+	if (! do_dump) {
+		free_granules = fs->free_granules;
+	}
+	cocofs_printf("%d file%s, %u granule%s (%u bytes) free\n",
+	    nfiles, plural(nfiles),
+	    free_granules, plural(free_granules),
+	    free_granules * COCOFS_SEC_PER_GRANULE * COCOFS_BYTES_PER_SEC);
+	if (do_dump && free_granules != fs->free_granules) {
+		cocofs_printf(
+		    "WARNING: FREE GRANULES LOADED %u != COMPUTED %u\n",
+		    fs->free_granules, free_granules);
+	}
+}
+
+static bool
+cocofs_rm(struct cocofs *fs, struct cocofs_dirent *dir)
+{
+	unsigned int gi;
+	uint8_t g, gn;
+
+	for (gi = 0, g = dir->d_first_granule;; gi++, g = gn) {
+		/* No need to detect cycles here, because we'll break them. */
+
+		if (g >= COCOFS_NGRANULES) {
+			fprintf(stderr, "INVALID GRANULE #%d: %d\n",
+			    gi, g);
+			cocofs_chain_error(fs, dir, gi, g, 0);
+			return false;
+		}
+
+		gn = fs->granule_map[g];
+		if (! gmap_entry_is_valid(gn) ||
+		    gn == GMAP_FREE) {
+			cocofs_printf("INVALID GRANULE MAP ENTRY "
+			       "%2d: %d -> 0x%02x\n", gi, g, gn);
+			cocofs_chain_error(fs, dir, gi, g, gn);
+			return false;
+		}
+
+		fs->granule_map[g] = GMAP_FREE;
+		fs->free_granules++;
+		if (GMAP_IS_LAST(gn)) {
+			break;
+		}
+	}
+
+	memset(dir, 0xff, sizeof(*dir));
+	cocofs_mark_dirty(fs, fs->granule_map, COCOFS_NGRANULES);
+	cocofs_mark_dirty(fs, dir, sizeof(*dir));
+
+	return true;
+}
+
+/*
+ * Copying a file out happens in two steps: gathering its contents
+ * from the image (checking the granule chain as we go), and writing
+ * them to the host file.  Any problem with the chain is only reported
+ * after whatever came before it has been written out, as if the two
+ * were done granule by granule.
+ */
+struct copyout_data {
+	uint8_t		*data;
+	size_t		len;
+	unsigned int	ngranules;
+	bool		chain_ok;
+	bool		err_stdout;	/* report the chain error on stdout */
+	char		err[64];
+};
+
+static void
+cocofs_copyout_gather(const struct cocofs *fs, const struct cocofs_dirent *dir,
+    struct copyout_data *cd)
+{
+	unsigned int loopcnt;
+	unsigned int last_nsec = 0;
+	uint16_t last_nbytes;
+	unsigned int offset;
+	unsigned int gi;
+	uint8_t g, gn;
+
+	cd->data = malloc(COCOFS_NGRANULES * COCOFS_BYTES_PER_GRANULE);
+	assert(cd->data != NULL);
+	cd->len = 0;
+	cd->chain_ok = false;
+	cd->err_stdout = false;
+	cd->err[0] = '\0';
+
+	for (gi = 0, g = dir->d_first_granule, loopcnt = 0;;
+	     gi++, g = gn, loopcnt++) {
+		if (loopcnt >= COCOFS_NGRANULES) {
+			snprintf(cd->err, sizeof(cd->err),
+			    "GRANULE MAP CYCLE DETECTED\n");
+			cocofs_chain_error(fs, dir, gi, g, 0);
+			goto out;
+		}
+
+		if (g >= COCOFS_NGRANULES) {
+			snprintf(cd->err, sizeof(cd->err),
+			    "INVALID GRANULE #%d: %d\n", gi, g);
+			cocofs_chain_error(fs, dir, gi, g, 0);
+			goto out;
+		}
+
+		gn = fs->granule_map[g];
+		if (! gmap_entry_is_valid(gn) ||
+		    gn == GMAP_FREE) {
+			snprintf(cd->err, sizeof(cd->err),
+			    "INVALID GRANULE MAP ENTRY "
+			    "%2d: %d -> 0x%02x\n", gi, g, gn);
+			cd->err_stdout = true;
+			cocofs_chain_error(fs, dir, gi, g, gn);
+			goto out;
+		}
+		if (GMAP_IS_LAST(gn)) {
+			last_nsec = GMAP_LAST_NSEC(gn);
+			break;
+		}
+
+		/* A full granule. */
+		offset = cocofs_granule_to_offset(g);
+		memcpy(cd->data + cd->len, fs->image_data + offset,
+		    COCOFS_BYTES_PER_GRANULE);
+		cd->len += COCOFS_BYTES_PER_GRANULE;
+	}
+
+	if (last_nsec < 1 || last_nsec > COCOFS_SEC_PER_GRANULE) {
+		snprintf(cd->err, sizeof(cd->err),
+		    "UNEXPECTED LAST_NSEC %u\n", last_nsec);
+		goto out;
+	}
+	last_nbytes = cocofs_dir_lastbytes(dir->d_last_bytes);
+	if (last_nbytes > COCOFS_BYTES_PER_SEC) {
+		fprintf(stderr, "UNEXPECTED LAST_BYTES %u, CLAMPING TO %d\n",
+		    last_nbytes, COCOFS_BYTES_PER_SEC);
+		last_nbytes = COCOFS_BYTES_PER_SEC;
+	}
+	last_nbytes = (last_nsec * COCOFS_BYTES_PER_SEC) -
+	    (COCOFS_BYTES_PER_SEC - last_nbytes);
+
+	/* The trailing bytes in the last granule. */
+	offset = cocofs_granule_to_offset(g);
+	memcpy(cd->data + cd->len, fs->image_data + offset, last_nbytes);
+	cd->len += last_nbytes;
+	cd->chain_ok = true;
+
+ out:
+	cd->ngranules = gi + cd->chain_ok;
+}
+
+/*
+ * Report a broken granule chain found by cocofs_copyout_gather().
+ * This is done by the thread running the command, so that the report
+ * lands in that image's output.
+ */
+static void
+cocofs_copyout_report(const struct copyout_data *cd)
+{
+	if (cd->chain_ok) {
+		return;
+	}
+	if (cd->err_stdout) {
+		cocofs_printf("%s", cd->err);
+	} else {
+		fputs(cd->err, stderr);
+	}
+}
+
+static bool
+cocofs_copyout_write(const struct cocofs *fs, const struct cocofs_dirent *dir,
+    const char *outfname, struct copyout_data *cd)
+{
+	size_t off;
+	ssize_t rv;
+	int outfd;
+
+	(void)fs;			/* only for the probes */
+	(void)dir;
+
+	outfd = open(outfname, O_WRONLY | O_CREAT | O_BINARY, 0644);
+	if (outfd == -1) {
+		fprintf(stderr, "unable to open output file %s: %s\n",
+		    outfname, strerror(errno));
+		COCOFS_PROBE5(copyout__done, fs->path, dir->d_name, outfname,
+		    -1, 0);
+		return false;
+	}
+
+	for (off = 0; off < cd->len; off += (size_t)rv) {
+		rv = write(outfd, cd->data + off, cd->len - off);
+		if (rv <= 0) {
+			fprintf(stderr, "error writing %s: %s\n",
+			    outfname, strerror(rv == 0 ? EIO : errno));
+			goto bad;
+		}
+	}
+	if (! cd->chain_ok) {
+		goto bad;
+	}
+
+	close(outfd);
+	metric_add(METRIC_WRITE_HOST, cd->len);
+	COCOFS_PROBE5(copyout__done, fs->path, dir->d_name, outfname,
+	    cd->len, cd->ngranules);
+	return true;
+
+ bad:
+	close(outfd);
+	COCOFS_PROBE5(copyout__done, fs->path, dir->d_name, outfname, -1,
+	    cd->ngranules);
+	return false;
+}
+
+static bool
+cocofs_copyout(const struct cocofs *fs, const struct cocofs_dirent *dir,
+    const char *outfname)
+{
+	struct copyout_data cd;
+	bool rv;
+
+	COCOFS_PROBE3(copyout__start, fs->path, dir->d_name, outfname);
+	cocofs_copyout_gather(fs, dir, &cd);
+	rv = cocofs_copyout_write(fs, dir, outfname, &cd);
+	cocofs_copyout_report(&cd);
+	free(cd.data);
+	return rv;
+}
+
+static unsigned int
+cocofs_galloc(struct cocofs *fs, unsigned int last)
+{
+	unsigned int g, next, loopcnt;
+
+	for (loopcnt = 0, g = last; loopcnt <= COCOFS_NGRANULES;
+	     loopcnt++, g = next) {
+		if (fs->granule_map[g] == GMAP_FREE) {
+			fs->granule_map[g] = GMAP_ALLOCATED;
+			fs->free_granules--;
+			COCOFS_PROBE4(galloc, fs->path, last, g,
+			    fs->free_granules);
+			return g;
+		}
+		next = g + 1;
+		if (next == COCOFS_NGRANULES) {
+			next = 0;
+		}
+	}
+	assert(loopcnt <= COCOFS_NGRANULES);
+	abort();
+}
+
+/*
+ * Granule allocation policies.  Each one fills in glist[] with n
+ * granules, marking each of them GMAP_ALLOCATED in the Granule Map.
+ * The caller has already checked that there are enough free granules.
+ */
+struct cocofs_allocator {
+	const char	*name;
+	const char	*descr;
+	void		(*alloc)(struct cocofs *, unsigned int, uint8_t *);
+};
+
+static void
+cocofs_alloc_nextfit(struct cocofs *fs, unsigned int n, uint8_t *glist)
+{
+	unsigned int g, gi, last;
+
+	/*
+	 * Our allocation strategy is really simple.  We start in the
+	 * middle of the disk (where the directory is; all file reads
+	 * need to start there), and allocate one block at a time.  We
+	 * pass in the starting point each time to try and allocate as
+	 * contiguously as possible.  We are guaranteed that this will
+	 * succeed, as we have already checked that there are enough
+	 * free granules to satisfy the request.
+	 */
+	for (last = COCOFS_NGRANULES / 2, gi = 0; gi < n; last = g, gi++) {
+		g = cocofs_galloc(fs, last);
+		glist[gi] = g;
+	}
+}
+
+static void
+cocofs_alloc_firstfit(struct cocofs *fs, unsigned int n, uint8_t *glist)
+{
+	unsigned int gi;
+
+	for (gi = 0; gi < n; gi++) {
+		glist[gi] = cocofs_galloc(fs, 0);
+	}
+}
+
+/*
+ * Always take the free granule closest to the directory track, as
+ * Disk BASIC itself does.  This minimizes seeking between the
+ * directory and the file data, at the cost of fragmentation.
+ */
+static void
+cocofs_alloc_nearest(struct cocofs *fs, unsigned int n, uint8_t *glist)
+{
+	unsigned int d, gi, g;
+
+	for (gi = 0, d = 0; gi < n; d++) {
+		assert(d < COCOFS_NGRANULES);
+		/* granules below the directory, then above it */
+		g = COCOFS_NGRANULES / 2 - 1 - d / 2;
+		if (d & 1) {
+			g = COCOFS_NGRANULES / 2 + d / 2;
+		}
+		if (fs->granule_map[g] == GMAP_FREE) {
+			fs->granule_map[g] = GMAP_ALLOCATED;
+			fs->free_granules--;
+			COCOFS_PROBE4(galloc, fs->path, COCOFS_NGRANULES / 2,
+			    g, fs->free_granules);
+			glist[gi++] = g;
+			d = (unsigned int)-1;	/* rescan from the middle */
+		}
+	}
+}
+
+/*
+ * Allocate from the smallest run of free granules that will hold the
+ * whole file.  If there is no such run, use up the largest runs first.
+ */
+static void
+cocofs_alloc_bestfit(struct cocofs *fs, unsigned int n, uint8_t *glist)
+{
+	unsigned int g, start, len, best, bestlen, big, biglen, gi = 0;
+
+	while (gi < n) {
+		best = big = COCOFS_NGRANULES;
+		bestlen = biglen = 0;
+		for (g = 0; g < COCOFS_NGRANULES; g += len ? len : 1) {
+			for (start = g, len = 0;
+			     g + len < COCOFS_NGRANULES &&
+			     fs->granule_map[g + len] == GMAP_FREE; len++) {
+				/* measure the run */
+			}
+			if (len == 0) {
+				continue;
+			}
+			if (len >= n - gi && (bestlen == 0 || len < bestlen)) {
+				best = start;
+				bestlen = len;
+			}
+			if (len > biglen) {
+				big = start;
+				biglen = len;
+			}
+		}
+		if (bestlen == 0) {
+			best = big;
+			bestlen = biglen;
+		}
+		assert(best < COCOFS_NGRANULES);
+		for (g = best; g < best + bestlen && gi < n; g++) {
+			fs->granule_map[g] = GMAP_ALLOCATED;
+			fs->free_granules--;
+			COCOFS_PROBE4(galloc, fs->path, best, g,
+			    fs->free_granules);
+			glist[gi++] = g;
+		}
+	}
+}
+
+static const struct cocofs_allocator cocofs_allocators[] = {
+	{ "nextfit",	"next free granule, starting mid-disk",
+	  cocofs_alloc_nextfit },
+	{ "firstfit",	"lowest-numbered free granule",
+	  cocofs_alloc_firstfit },
+	{ "nearest",	"free granule nearest the directory track",
+	  cocofs_alloc_nearest },
+	{ "bestfit",	"smallest contiguous run that fits",
+	  cocofs_alloc_bestfit },
+	{ NULL,		NULL,
+	  NULL },
+};
+
+static const struct cocofs_allocator *
+cocofs_allocator_lookup(const char *name)
+{
+	const struct cocofs_allocator *a;
+
+	for (a = cocofs_allocators; a->name != NULL; a++) {
+		if (strcmp(a->name, name) == 0) {
+			return a;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Allocate a directory entry (unless the caller supplies one) and
+ * enough granules to hold a file of the specified size.  The granules
+ * are marked GMAP_ALLOCATED and returned in glist[]; the caller fills
+ * them in and then calls cocofs_link_file().  The caller is responsible
+ * for rolling back the Granule Map if anything goes wrong.
+ */
+static struct cocofs_dirent *
+cocofs_alloc_file(struct cocofs *fs, struct cocofs_dirent *dir,
+    const char *label, unsigned long long size,
+    uint8_t glist[COCOFS_NGRANULES], unsigned int *granules_neededp)
+{
+	unsigned int granules_needed;
+	unsigned int i;
+
+	if (size > fs->free_granules * COCOFS_BYTES_PER_GRANULE) {
+		fprintf(stderr,
+		    "%s: %s\n", label, strerror(ENOSPC));
+		metric_add(METRIC_ERR_NOSPACE, 1);
+		return NULL;
+	}
+
+	granules_needed = size / COCOFS_BYTES_PER_GRANULE;
+	if (size % COCOFS_BYTES_PER_GRANULE) {
+		granules_needed++;
+	}
+	assert(granules_needed <= fs->free_granules);
+
+	/*
+	 * Find a free directory entry.
+	 */
+	if (dir == NULL) {
+		for (i = 0; i < COCOFS_DIR_TRACK_NENTRIES; i++) {
+			dir = &fs->directory[i];
+			if (dir->d_type == COCOFS_DIRENT_TYPE_FREE) {
+				break;
+			}
+		}
+		if (i == COCOFS_DIR_TRACK_NENTRIES) {
+			fprintf(stderr,
+			    "No directory entries available for %s\n", label);
+			metric_add(METRIC_ERR_NOSPACE, 1);
+			return NULL;
+		}
+	}
+
+	memset(glist, 0xff, COCOFS_NGRANULES);
+	if (fs->allocator == NULL) {
+		fs->allocator = &cocofs_allocators[0];
+	}
+	(*fs->allocator->alloc)(fs, granules_needed, glist);
+	metric_add(METRIC_ALLOC_FILES, 1);
+	metric_add(METRIC_ALLOC_GRANULES, granules_needed);
+
+	*granules_neededp = granules_needed;
+	return dir;
+}
+
+/*
+ * Link the granules allocated by cocofs_alloc_file() into a chain,
+ * zero the unused tail of the last granule, and fill in the directory
+ * entry.
+ */
+static void
+cocofs_link_file(struct cocofs *fs, struct cocofs_dirent *dir,
+    unsigned long long size, const uint8_t glist[COCOFS_NGRANULES],
+    unsigned int granules_needed, const char name[8], const char ext[3],
+    uint8_t type, uint8_t enc)
+{
+	unsigned long long resid;
+	unsigned int g, gi;
+	uint8_t *buf;
+
+	for (gi = 0, resid = size; resid != 0;
+	     gi++, resid -= COCOFS_BYTES_PER_GRANULE) {
+		g = glist[gi];
+		assert(fs->granule_map[g] == GMAP_ALLOCATED);
+		buf = fs->image_data + cocofs_granule_to_offset(g);
+		cocofs_mark_dirty(fs, buf, COCOFS_BYTES_PER_GRANULE);
+
+		if (resid <= COCOFS_BYTES_PER_GRANULE) {
+			/*
+			 * This is the last granule of the file.  Set
+			 * the trailing-bytes values.
+			 */
+			uint8_t nsec = resid / COCOFS_BYTES_PER_SEC;
+			if (resid % COCOFS_BYTES_PER_SEC) {
+				nsec++;
+			}
+			assert(gi + 1 == granules_needed);
+			assert(nsec <= COCOFS_SEC_PER_GRANULE);
+			fs->granule_map[g] = GMAP_LAST | nsec;
+
+			unsigned int lastbytes = resid % COCOFS_BYTES_PER_SEC;
+			if (lastbytes == 0) {
+				lastbytes = COCOFS_BYTES_PER_SEC;
+			}
+
+			/* Zero out the remainder of the granule. */
+			unsigned int trailing =
+			    COCOFS_BYTES_PER_GRANULE - resid;
+			if (trailing != 0) {
+				memset(&buf[resid], 0, trailing);
+			}
+
+			/* Set the directory entry. */
+			memcpy(dir->d_name, name, sizeof(dir->d_name));
+			memcpy(dir->d_ext, ext, sizeof(dir->d_ext));
+			dir->d_type = type;
+			dir->d_encoding = enc;
+			dir->d_first_granule = glist[0];
+			cocofs_dir_set_lastbytes(lastbytes, dir->d_last_bytes);
+			break;
+		} else {
+			/*
+			 * Point the current Granule Map entry at the
+			 * next granule.
+			 */
+			assert(gi + 1 < granules_needed);
+			fs->granule_map[g] = glist[gi + 1];
+		}
+	}
+
+	cocofs_mark_dirty(fs, fs->granule_map, COCOFS_NGRANULES);
+	cocofs_mark_dirty(fs, dir, sizeof(*dir));
+}
+
+static bool
+cocofs_copyin(struct cocofs *fs, const char *infile, const char name[8],
+    const char ext[3], uint8_t type, uint8_t enc)
+{
+	struct cocofs_dirent *dir = NULL;
+	struct stat sb;
+	int infd;
+	unsigned int granules_needed;
+	unsigned int orig_free_granules;
+	unsigned int g, gi;
+	uint8_t orig_gmap[COCOFS_NGRANULES];
+	uint8_t glist[COCOFS_NGRANULES];
+
+	/*
+	 * Make a backup copy of the granule map so we can roll back,
+	 * if necesary.
+	 */
+	memcpy(orig_gmap, fs->granule_map, sizeof(orig_gmap));
+	orig_free_granules = fs->free_granules;
+
+	COCOFS_PROBE2(copyin__start, fs->path, infile);
+
+	infd = open(infile, O_RDONLY | O_BINARY);
+	if (infd == -1) {
+		fprintf(stderr,
+		    "unable to open %s: %s\n", infile, strerror(errno));
+		COCOFS_PROBE4(copyin__done, fs->path, infile, -1, 0);
+		return false;
+	}
+
+	if (fstat(infd, &sb) == -1) {
+		fprintf(stderr,
+		    "unable to stat %s: %s\n", infile, strerror(errno));
+		goto bad;
+	}
+
+	dir = cocofs_alloc_file(fs, NULL, infile,
+	    (unsigned long long)sb.st_size, glist, &granules_needed);
+	if (dir == NULL) {
+		goto bad;
+	}
+
+	/*
+	 * We now have our list of granules for the new file, and
+	 * each granule has been marked as allocated in the Granule
+	 * Map.
+	 */
+	ssize_t resid, cursz;
+	ssize_t rv;
+	uint8_t *buf;
+	struct iovec iov[COCOFS_NGRANULES];
+	int iovcnt = 0;
+
+	/*
+	 * Read the whole file straight into its granules with a
+	 * single call, merging granules that are next to each other
+	 * in the image.
+	 */
+	for (gi = 0, resid = (ssize_t)sb.st_size;
+	     resid != 0; gi++, resid -= cursz) {
+		cursz = resid;
+		if (cursz > COCOFS_BYTES_PER_GRANULE) {
+			cursz = COCOFS_BYTES_PER_GRANULE;
+		}
+
+		g = glist[gi];
+		assert(fs->granule_map[g] == GMAP_ALLOCATED);
+		buf = fs->image_data + cocofs_granule_to_offset(g);
+		if (iovcnt != 0 &&
+		    (uint8_t *)iov[iovcnt - 1].iov_base +
+		    iov[iovcnt - 1].iov_len == buf) {
+			iov[iovcnt - 1].iov_len += cursz;
+		} else {
+			iov[iovcnt].iov_base = buf;
+			iov[iovcnt].iov_len = cursz;
+			iovcnt++;
+		}
+	}
+	if (iovcnt != 0) {
+		rv = cocofs_preadv(infd, iov, iovcnt, 0);
+		if (rv != (ssize_t)sb.st_size) {
+			fprintf(stderr, "failed to read %s\n", infile);
+			goto bad;
+		}
+	}
+
+	/* All done. */
+	cocofs_link_file(fs, dir, (unsigned long long)sb.st_size, glist,
+	    granules_needed, name, ext, type, enc);
+	close(infd);
+	COCOFS_PROBE4(copyin__done, fs->path, infile, sb.st_size,
+	    granules_needed);
+	return true;
+
+ bad:
+	/* Back out changes to the granule map. */
+	memcpy(fs->granule_map, orig_gmap, sizeof(orig_gmap));
+	fs->free_granules = orig_free_granules;
+	close(infd);
+	COCOFS_PROBE4(copyin__done, fs->path, infile, -1, 0);
+	return false;
+}
+
+/*
+ * Like cocofs_copyin(), but the file contents come from memory.  If
+ * dir is not NULL, that (free) directory entry is used for the file.
+ */
+static bool
+cocofs_copyin_data(struct cocofs *fs, struct cocofs_dirent *dir,
+    const char *label, const uint8_t *data, size_t size,
+    const char name[8], const char ext[3], uint8_t type, uint8_t enc)
+{
+	unsigned int granules_needed;
+	unsigned int gi;
+	size_t cursz;
+	uint8_t glist[COCOFS_NGRANULES];
+
+	COCOFS_PROBE2(copyin__start, fs->path, label);
+	dir = cocofs_alloc_file(fs, dir, label, size, glist,
+	    &granules_needed);
+	if (dir == NULL) {
+		COCOFS_PROBE4(copyin__done, fs->path, label, -1, 0);
+		return false;
+	}
+
+	for (gi = 0; gi < granules_needed; gi++) {
+		cursz = size - (size_t)gi * COCOFS_BYTES_PER_GRANULE;
+		if (cursz > COCOFS_BYTES_PER_GRANULE) {
+			cursz = COCOFS_BYTES_PER_GRANULE;
+		}
+		memcpy(fs->image_data + cocofs_granule_to_offset(glist[gi]),
+		    data + (size_t)gi * COCOFS_BYTES_PER_GRANULE, cursz);
+	}
+
+	cocofs_link_file(fs, dir, size, glist, granules_needed,
+	    name, ext, type, enc);
+	COCOFS_PROBE4(copyin__done, fs->path, label, size, granules_needed);
+	return true;
+}
+
+/*
+ * Read the entire contents of a file into a newly-allocated buffer.
+ */
+static bool
+cocofs_read_file(const struct cocofs *fs, const struct cocofs_dirent *dir,
+    uint8_t **datap, size_t *sizep)
+{
+	struct cocofs_stat st;
+	unsigned int loopcnt;
+	size_t resid, cursz, offset;
+	uint8_t *data;
+	uint8_t g, gn;
+
+	cocofs_stat(fs, dir, &st);
+	data = malloc(st.st_size ? st.st_size : 1);
+	assert(data != NULL);
+
+	for (offset = 0, resid = st.st_size, g = dir->d_first_granule,
+	     loopcnt = 0; resid != 0; loopcnt++, g = gn) {
+		if (loopcnt > COCOFS_NGRANULES || g >= COCOFS_NGRANULES) {
+			fprintf(stderr, "INVALID GRANULE CHAIN\n");
+			cocofs_chain_error(fs, dir, loopcnt, g, 0);
+			free(data);
+			return false;
+		}
+		cursz = resid;
+		if (cursz > COCOFS_BYTES_PER_GRANULE) {
+			cursz = COCOFS_BYTES_PER_GRANULE;
+		}
+		memcpy(data + offset,
+		    fs->image_data + cocofs_granule_to_offset(g), cursz);
+		offset += cursz;
+		resid -= cursz;
+		gn = fs->granule_map[g];
+	}
+
+	*datap = data;
+	*sizep = st.st_size;
+	return true;
+}
+
+/*
+ * Hash a file's contents (64-bit FNV-1a) in place, following its
+ * granule chain.  If chain is not NULL, the granules are stored there
+ * and their number in *nchainp.  Returns false if the chain is broken.
+ */
+static bool
+cocofs_hash_file(const struct cocofs *fs, const struct cocofs_dirent *dir,
+    uint32_t size, uint64_t *hashp, uint8_t *chain, unsigned int *nchainp)
+{
+	unsigned int n;
+	size_t resid, cursz;
+	uint64_t hash = FNV1A_64_INIT;
+	uint8_t g, gn;
+	bool ok = false;
+
+	resid = size;
+	for (n = 0, g = dir->d_first_granule;
+	     n < COCOFS_NGRANULES && g < COCOFS_NGRANULES; n++, g = gn) {
+		if (chain != NULL) {
+			chain[n] = g;
+		}
+		cursz = resid;
+		if (cursz > COCOFS_BYTES_PER_GRANULE) {
+			cursz = COCOFS_BYTES_PER_GRANULE;
+		}
+		hash = fnv1a_64(fs->image_data + cocofs_granule_to_offset(g),
+		    cursz, hash);
+		resid -= cursz;
+		gn = fs->granule_map[g];
+		if (gn != GMAP_FREE && gmap_entry_is_valid(gn) &&
+		    GMAP_IS_LAST(gn)) {
+			ok = resid == 0;
+			n++;
+			break;
+		}
+	}
+	if (nchainp != NULL) {
+		*nchainp = n;
+	}
+	*hashp = hash;
+	return ok;
+}
+
+/*
+ * Replace the contents of an existing file, keeping its directory
+ * slot, name, type, and encoding.  If this fails, the in-memory image
+ * is left in an inconsistent state and must not be saved.
+ */
+static bool
+cocofs_replace(struct cocofs *fs, struct cocofs_dirent *dir,
+    const uint8_t *data, size_t size)
+{
+	struct cocofs_dirent odir = *dir;
+	char label[8+1+3+1];
+
+	snprintf(label, sizeof(label), "%.8s.%.3s",
+	    (const char *)odir.d_name, (const char *)odir.d_ext);
+	if (! cocofs_rm(fs, dir)) {
+		return false;
+	}
+	return cocofs_copyin_data(fs, dir, label, data, size,
+	    (const char *)odir.d_name, (const char *)odir.d_ext,
+	    odir.d_type, odir.d_encoding);
+}
+
+/*
+ * Color BASIC program cruncher.
+ *
+ * Disk BASIC saves tokenized programs as:
+ *
+ *	0xff, program length (2 bytes, big-endian), program
+ *
+ * The program is a sequence of lines, each of which is:
+ *
+ *	link to next line (2 bytes, big-endian memory address)
+ *	line number (2 bytes, big-endian)
+ *	tokenized text, terminated by 0x00
+ *
+ * ...and the program is terminated by a link of 0x0000.  Crunching
+ * removes REMarks, removes spaces outside of strings and DATA
+ * statements, and merges lines together where no GOTO / GOSUB / THEN /
+ * ELSE / RUN refers to the line being merged away.  Only what is
+ * needed to find line number references is understood about the
+ * token stream.
+ */
+#define	BASIC_TOK_GO		0x81
+#define	BASIC_TOK_REM		0x82
+#define	BASIC_TOK_APOS		0x83	/* ' -- stored as :' */
+#define	BASIC_TOK_ELSE		0x84
+#define	BASIC_TOK_IF		0x85
+#define	BASIC_TOK_DATA		0x86
+#define	BASIC_TOK_RUN		0x8e
+#define	BASIC_TOK_LIST		0x94
+#define	BASIC_TOK_LLIST		0x9b
+#define	BASIC_TOK_TO		0xa5
+#define	BASIC_TOK_SUB		0xa6
+#define	BASIC_TOK_THEN		0xa7
+#define	BASIC_TOK_DEL		0xb5
+#define	BASIC_TOK_EDIT		0xb6
+#define	BASIC_TOK_RENUM		0xcb
+#define	BASIC_TOK_FUNC		0xff	/* prefix for function tokens */
+
+#define	BASIC_MAX_LINENO	63999
+#define	BASIC_MAX_LINE		240	/* max crunched line text length */
+
+struct basic_line {
+	unsigned int	lineno;
+	const uint8_t	*text;
+	size_t		len;		/* not including the 0x00 */
+};
+
+struct basic_program {
+	unsigned int	base;		/* memory address of first line */
+	unsigned int	lenpad;		/* header length - program length */
+	unsigned int	nlines;
+	struct basic_line *lines;
+};
+
+static bool
+basic_parse(const uint8_t *data, size_t size, struct basic_program *prog)
+{
+	size_t pos, end, hdrlen, i;
+	unsigned int next, maxlines;
+
+	if (size < 5 || data[0] != 0xff) {
+		return false;
+	}
+	hdrlen = (data[1] << 8) | data[2];
+	end = size;
+
+	maxlines = (end - 3) / 5;
+	prog->lines = calloc(maxlines ? maxlines : 1, sizeof(*prog->lines));
+	assert(prog->lines != NULL);
+	prog->nlines = 0;
+	prog->base = 0;
+
+	for (pos = 3;; ) {
+		if (pos + 2 > end) {
+			goto bad;
+		}
+		next = (data[pos] << 8) | data[pos + 1];
+		if (next == 0) {
+			pos += 2;
+			break;
+		}
+		if (pos + 4 > end || prog->nlines == maxlines) {
+			goto bad;
+		}
+		struct basic_line *l = &prog->lines[prog->nlines];
+		l->lineno = (data[pos + 2] << 8) | data[pos + 3];
+		l->text = &data[pos + 4];
+		for (i = pos + 4; i < end && data[i] != 0; i++) {
+			/* find end of line */
+		}
+		if (i == end) {
 			goto bad;
 		}
+		l->len = i - (pos + 4);
+		if (prog->nlines == 0) {
+			prog->base = next - (unsigned int)(i + 1 - pos);
+		}
+		prog->nlines++;
+		pos = i + 1;
+	}
+
+	prog->lenpad = hdrlen - (unsigned int)(pos - 3);
+	return true;
+
+ bad:
+	free(prog->lines);
+	prog->lines = NULL;
+	return false;
+}
+
+static size_t
+basic_skip_spaces(const uint8_t *p, size_t len, size_t i)
+{
+	while (i < len && p[i] == ' ') {
+		i++;
+	}
+	return i;
+}
+
+/*
+ * Skip a quoted string starting at p[i] (which is the opening quote).
+ */
+static size_t
+basic_skip_string(const uint8_t *p, size_t len, size_t i)
+{
+	for (i++; i < len && p[i] != '"'; i++) {
+		/* skip */
+	}
+	return i < len ? i + 1 : i;
+}
+
+/*
+ * Skip the body of a DATA statement starting at p[i], stopping at
+ * the ':' that ends it (or the end of the line).
+ */
+static size_t
+basic_skip_data(const uint8_t *p, size_t len, size_t i)
+{
+	while (i < len && p[i] != ':') {
+		if (p[i] == '"') {
+			i = basic_skip_string(p, len, i);
+		} else {
+			i++;
+		}
+	}
+	return i;
+}
+
+/*
+ * Parse a comma-separated list of line numbers at p[i], marking
+ * each of them as referenced.
+ */
+static size_t
+basic_mark_refs(const uint8_t *p, size_t len, size_t i, uint8_t *refs)
+{
+	unsigned long lineno;
+
+	for (;;) {
+		i = basic_skip_spaces(p, len, i);
+		if (i == len || p[i] < '0' || p[i] > '9') {
+			return i;
+		}
+		for (lineno = 0; i < len && p[i] >= '0' && p[i] <= '9'; i++) {
+			if (lineno <= BASIC_MAX_LINENO) {
+				lineno = lineno * 10 + (p[i] - '0');
+			}
+		}
+		if (lineno <= BASIC_MAX_LINENO) {
+			refs[lineno / 8] |= 1U << (lineno % 8);
+		}
+		i = basic_skip_spaces(p, len, i);
+		if (i == len || p[i] != ',') {
+			return i;
+		}
+		i++;
+	}
+}
+
+/*
+ * Find all of the line number references in a line.  Returns false
+ * if the line uses a command that operates on line number ranges
+ * (LIST, DEL, etc.), in which case no lines may be merged.
+ */
+static bool
+basic_scan_refs(const struct basic_line *l, uint8_t *refs)
+{
+	const uint8_t *p = l->text;
+	size_t len = l->len, i;
+	bool can_merge = true;
+
+	for (i = 0; i < len; ) {
+		switch (p[i]) {
+		case '"':
+			i = basic_skip_string(p, len, i);
+			break;
+
+		case BASIC_TOK_REM:
+		case BASIC_TOK_APOS:
+			return can_merge;
+
+		case BASIC_TOK_DATA:
+			i = basic_skip_data(p, len, i + 1);
+			break;
+
+		case BASIC_TOK_FUNC:
+			i += 2;
+			break;
+
+		case BASIC_TOK_GO:
+			i = basic_skip_spaces(p, len, i + 1);
+			if (i < len &&
+			    (p[i] == BASIC_TOK_TO || p[i] == BASIC_TOK_SUB)) {
+				i = basic_mark_refs(p, len, i + 1, refs);
+			}
+			break;
+
+		case BASIC_TOK_THEN:
+		case BASIC_TOK_ELSE:
+		case BASIC_TOK_RUN:
+			i = basic_mark_refs(p, len, i + 1, refs);
+			break;
+
+		case BASIC_TOK_LIST:
+		case BASIC_TOK_LLIST:
+		case BASIC_TOK_DEL:
+		case BASIC_TOK_EDIT:
+		case BASIC_TOK_RENUM:
+			can_merge = false;
+			i++;
+			break;
+
+		default:
+			i++;
+			break;
+		}
+	}
+	return can_merge;
+}
+
+/*
+ * Crunch the text of a single line into out[] (which must be at least
+ * as large as the input), returning the crunched length.  *sealedp is
+ * set if nothing may be appended to the line: it contains an IF, or it
+ * ends inside an unterminated string literal.
+ */
+static size_t
+basic_crunch_line(const struct basic_line *l, uint8_t *out, bool *sealedp)
+{
+	const uint8_t *p = l->text;
+	size_t len = l->len, i, j, o = 0;
+	bool in_string = false;
+
+	*sealedp = false;
+	for (i = 0; i < len; ) {
+		switch (p[i]) {
+		case '"':
+			j = basic_skip_string(p, len, i);
+			memcpy(&out[o], &p[i], j - i);
+			o += j - i;
+			i = j;
+			break;
+
+		case BASIC_TOK_REM:
+		case BASIC_TOK_APOS:
+			i = len;
+			break;
+
+		case BASIC_TOK_DATA:
+			j = basic_skip_data(p, len, i + 1);
+			memcpy(&out[o], &p[i], j - i);
+			o += j - i;
+			i = j;
+			break;
+
+		case BASIC_TOK_FUNC:
+			out[o++] = p[i++];
+			if (i < len) {
+				out[o++] = p[i++];
+			}
+			break;
+
+		case ' ':
+			i++;
+			break;
+
+		case BASIC_TOK_IF:
+			*sealedp = true;
+			/* FALLTHROUGH */
+		default:
+			out[o++] = p[i++];
+			break;
+		}
+	}
+
+	/*
+	 * A '"' only ever appears in the output as a string delimiter
+	 * (REMs are gone, and tokens and function codes have the high
+	 * bit set), so counting them tells whether the line ends inside
+	 * a string.
+	 */
+	for (j = 0; j < o; j++) {
+		if (out[j] == '"') {
+			in_string = ! in_string;
+		}
+	}
+	if (in_string) {
+		*sealedp = true;
+		return o;
+	}
+
+	/* Drop statement separators left dangling by removed REMs. */
+	while (o != 0 && out[o - 1] == ':') {
+		o--;
+	}
+	return o;
+}
+
+static uint8_t *
+basic_emit_line(uint8_t *op, unsigned int *addrp, unsigned int lineno,
+    const uint8_t *text, size_t len)
+{
+	unsigned int next = *addrp + 4 + (unsigned int)len + 1;
+
+	*op++ = (uint8_t)(next >> 8);
+	*op++ = (uint8_t)next;
+	*op++ = (uint8_t)(lineno >> 8);
+	*op++ = (uint8_t)lineno;
+	memcpy(op, text, len);
+	op += len;
+	*op++ = 0;
+	*addrp = next;
+	return op;
+}
+
+/*
+ * Crunch a tokenized BASIC program.  On success, a newly-allocated
+ * buffer containing the crunched program is returned in *outp.
+ */
+static bool
+basic_crunch(const uint8_t *data, size_t size, uint8_t **outp,
+    size_t *outsizep)
+{
+	struct basic_program prog;
+	uint8_t refs[(BASIC_MAX_LINENO + 8) / 8];
+	uint8_t cur[256], text[256];
+	unsigned int li, curlineno = 0, addr;
+	size_t curlen = 0, len, proglen;
+	bool can_merge = true, cur_sealed = false, sealed, have_cur = false;
+	uint8_t *out, *op;
+
+	if (! basic_parse(data, size, &prog)) {
+		return false;
+	}
+
+	memset(refs, 0, sizeof(refs));
+	for (li = 0; li < prog.nlines; li++) {
+		if (! basic_scan_refs(&prog.lines[li], refs)) {
+			can_merge = false;
+		}
+	}
+
+	/* Crunching never makes the program larger. */
+	out = malloc(size);
+	assert(out != NULL);
+	op = out + 3;
+	addr = prog.base;
+
+	for (li = 0; li < prog.nlines; li++) {
+		const struct basic_line *l = &prog.lines[li];
+		bool referenced =
+		    (refs[l->lineno / 8] & (1U << (l->lineno % 8))) != 0;
+
+		if (l->len > sizeof(text)) {
+			/* Can't happen in a real program; leave it be. */
+			len = 0;
+			sealed = true;
+			referenced = true;
+		} else {
+			len = basic_crunch_line(l, text, &sealed);
+		}
+
+		if (len == 0 && ! referenced && have_cur) {
+			/* Nothing left of it, and no one jumps to it. */
+			continue;
+		}
+		if (have_cur && can_merge && ! referenced && ! cur_sealed &&
+		    curlen + 1 + len <= BASIC_MAX_LINE) {
+			if (curlen != 0 && len != 0) {
+				cur[curlen++] = ':';
+			}
+			memcpy(&cur[curlen], text, len);
+			curlen += len;
+			cur_sealed = sealed;
+			continue;
+		}
+		if (have_cur) {
+			op = basic_emit_line(op, &addr, curlineno,
+			    cur, curlen);
+		}
+		if (l->len > sizeof(text)) {
+			op = basic_emit_line(op, &addr, l->lineno,
+			    l->text, l->len);
+			have_cur = false;
+			continue;
+		}
+		curlineno = l->lineno;
+		memcpy(cur, text, len);
+		curlen = len;
+		cur_sealed = sealed;
+		have_cur = true;
+	}
+	if (have_cur) {
+		op = basic_emit_line(op, &addr, curlineno, cur, curlen);
+	}
+	*op++ = 0;
+	*op++ = 0;
+
+	proglen = (size_t)(op - out) - 3 + prog.lenpad;
+	out[0] = 0xff;
+	out[1] = (uint8_t)(proglen >> 8);
+	out[2] = (uint8_t)proglen;
+
+	free(prog.lines);
+	*outp = out;
+	*outsizep = (size_t)(op - out);
+	return true;
+}
+
+static unsigned int
+cocofs_size_to_granules(size_t size)
+{
+	return (unsigned int)((size + COCOFS_BYTES_PER_GRANULE - 1) /
+	    COCOFS_BYTES_PER_GRANULE);
+}
+
+static void
+cocofs_print_crunch(const char *label, size_t before, size_t after)
+{
+	unsigned int saved = cocofs_size_to_granules(before) -
+	    cocofs_size_to_granules(after);
+
+	cocofs_printf("%s: %zu -> %zu bytes, %u granule%s saved\n",
+	    label, before, after, saved, plural(saved));
+}
+
+/*
+ * Machine language (LOADM) binaries.
+ *
+ * A LOADM file is a sequence of segments, each of which is:
+ *
+ *	0x00, length (2 bytes), load address (2 bytes), data
+ *
+ * ...followed by a postamble:
+ *
+ *	0xff, 0x00, 0x00, exec address (2 bytes)
+ *
+ * All values are big-endian.
+ */
+struct loadm_segment {
+	unsigned int	addr;
+	size_t		len;
+	const uint8_t	*data;
+};
+
+struct loadm {
+	unsigned int	nsegs;
+	struct loadm_segment *segs;
+	unsigned int	exec;
+};
+
+static bool
+loadm_parse(const uint8_t *data, size_t size, struct loadm *lm)
+{
+	size_t pos, maxsegs;
+
+	maxsegs = size / 5;
+	lm->segs = calloc(maxsegs ? maxsegs : 1, sizeof(*lm->segs));
+	assert(lm->segs != NULL);
+	lm->nsegs = 0;
+
+	for (pos = 0; pos + 5 <= size; ) {
+		unsigned int len = (data[pos + 1] << 8) | data[pos + 2];
+		unsigned int addr = (data[pos + 3] << 8) | data[pos + 4];
+
+		if (data[pos] == 0xff) {
+			if (len != 0) {
+				break;
+			}
+			lm->exec = addr;
+			return true;
+		}
+		if (data[pos] != 0x00 || pos + 5 + len > size ||
+		    lm->nsegs == maxsegs) {
+			break;
+		}
+		lm->segs[lm->nsegs].addr = addr;
+		lm->segs[lm->nsegs].len = len;
+		lm->segs[lm->nsegs].data = &data[pos + 5];
+		lm->nsegs++;
+		pos += 5 + len;
+	}
+
+	free(lm->segs);
+	lm->segs = NULL;
+	return false;
+}
+
+/*
+ * Packed binaries.
+ *
+ * A packed binary is a LOADM file with a single segment containing a
+ * small 6809 decompressor followed by the compressed image of each of
+ * the original segments; its exec address is the decompressor.  The
+ * compressed stream is a sequence of:
+ *
+ *	0x01 - 0x7f	literal run: that many bytes follow
+ *	0x80 - 0xff	match: copy ((c & 0x7f) + 3) bytes from the
+ *			output, starting (2 bytes, big-endian) bytes
+ *			before the current output position
+ *	0x00 0x01	set output position (2 bytes follow)
+ *	0x00 0x00	end of stream
+ *
+ * Everything is byte-aligned so that the 6809 can decode it with
+ * nothing more than auto-increment loads and stores.
+ */
+#define	LZ_MIN_MATCH		3
+#define	LZ_MAX_MATCH		(0x7f + LZ_MIN_MATCH)
+#define	LZ_MAX_LITERALS		0x7f
+#define	LZ_MAX_OFFSET		0xffff
+#define	LZ_HASH_BITS		12
+
+/*
+ * The decompressor.  It is position-independent (it finds the
+ * compressed stream PC-relative), so it can be loaded anywhere.
+ *
+ *	00  1A 50		ORCC	#$50
+ *	02  30 8C 33		LEAX	data,PCR
+ *	05  E6 80	loop	LDB	,X+
+ *	07  27 22		BEQ	cmd
+ *	09  2B 09		BMI	match
+ *	0B  A6 80	lit	LDA	,X+
+ *	0D  A7 C0		STA	,U+
+ *	0F  5A			DECB
+ *	10  26 F9		BNE	lit
+ *	12  20 F1		BRA	loop
+ *	14  C4 7F	match	ANDB	#$7F
+ *	16  CB 03		ADDB	#3
+ *	18  34 04		PSHS	B
+ *	1A  1F 30		TFR	U,D
+ *	1C  A3 81		SUBD	,X++
+ *	1E  1F 02		TFR	D,Y
+ *	20  35 04		PULS	B
+ *	22  A6 A0	mcopy	LDA	,Y+
+ *	24  A7 C0		STA	,U+
+ *	26  5A			DECB
+ *	27  26 F9		BNE	mcopy
+ *	29  20 DA		BRA	loop
+ *	2B  E6 80	cmd	LDB	,X+
+ *	2D  27 04		BEQ	done
+ *	2F  EE 81		LDU	,X++
+ *	31  20 D2		BRA	loop
+ *	33  1C AF	done	ANDCC	#$AF
+ *	35  7E xx xx		JMP	exec
+ *	38		data
+ */
+static const uint8_t lz_stub_6809[] = {
+	0x1a, 0x50, 0x30, 0x8c, 0x33, 0xe6, 0x80, 0x27,
+	0x22, 0x2b, 0x09, 0xa6, 0x80, 0xa7, 0xc0, 0x5a,
+	0x26, 0xf9, 0x20, 0xf1, 0xc4, 0x7f, 0xcb, 0x03,
+	0x34, 0x04, 0x1f, 0x30, 0xa3, 0x81, 0x1f, 0x02,
+	0x35, 0x04, 0xa6, 0xa0, 0xa7, 0xc0, 0x5a, 0x26,
+	0xf9, 0x20, 0xda, 0xe6, 0x80, 0x27, 0x04, 0xee,
+	0x81, 0x20, 0xd2, 0x1c, 0xaf, 0x7e, 0x00, 0x00,
+};
+#define	LZ_STUB_EXEC_OFFSET	0x36
+
+/*
+ * Memory the packed binary may occupy in addition to the original
+ * segments: above the end of Disk BASIC's work area and below the
+ * top of the 32K RAM visible to LOADM.
+ */
+#define	PACK_MEM_LOW		0x0e00
+#define	PACK_MEM_HIGH		0x8000
+
+/* Worst case for a segment: all literals, in runs of LZ_MAX_LITERALS. */
+#define	LZ_BOUND(len)							\
+	((len) + ((len) + LZ_MAX_LITERALS - 1) / LZ_MAX_LITERALS)
+
+static uint8_t *
+lz_flush_literals(uint8_t *op, const uint8_t *lit, size_t nlit)
+{
+	size_t n;
+
+	while (nlit != 0) {
+		n = nlit > LZ_MAX_LITERALS ? LZ_MAX_LITERALS : nlit;
+		*op++ = (uint8_t)n;
+		memcpy(op, lit, n);
+		op += n;
+		lit += n;
+		nlit -= n;
+	}
+	return op;
+}
+
+static unsigned int
+lz_hash(const uint8_t *p)
+{
+	uint32_t v = ((uint32_t)p[0] << 16) | (p[1] << 8) | p[2];
+
+	return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/*
+ * Compress a single segment.  out must have room for LZ_BOUND(len)
+ * bytes.  Matches never reach back
+ * before the start of the segment, since that memory may not hold
+ * what we expect at decompression time.  table is the caller's
+ * scratch space, so that packing is reentrant.
+ */
+static uint8_t *
+lz_compress(const uint8_t *src, size_t len, int32_t *table, uint8_t *op)
+{
+	size_t i, lit, mlen, maxlen, cand = 0;
+	unsigned int h;
+
+	for (h = 0; h < (1U << LZ_HASH_BITS); h++) {
+		table[h] = -1;
+	}
+
+	for (i = 0, lit = 0; i < len; ) {
+		mlen = 0;
+		if (i + LZ_MIN_MATCH <= len) {
+			h = lz_hash(&src[i]);
+			if (table[h] >= 0 &&
+			    i - (size_t)table[h] <= LZ_MAX_OFFSET) {
+				cand = (size_t)table[h];
+				maxlen = len - i;
+				if (maxlen > LZ_MAX_MATCH) {
+					maxlen = LZ_MAX_MATCH;
+				}
+				while (mlen < maxlen &&
+				       src[cand + mlen] == src[i + mlen]) {
+					mlen++;
+				}
+			}
+			table[h] = (int32_t)i;
+		}
+
+		/* A 3-byte match costs as much as the literals. */
+		if (mlen <= LZ_MIN_MATCH) {
+			i++;
+			continue;
+		}
+
+		op = lz_flush_literals(op, &src[lit], i - lit);
+		size_t off = i - cand;
+		*op++ = 0x80 | (uint8_t)(mlen - LZ_MIN_MATCH);
+		*op++ = (uint8_t)(off >> 8);
+		*op++ = (uint8_t)off;
+
+		/* Keep the hash table warm across the match. */
+		for (i++, mlen--; mlen != 0; i++, mlen--) {
+			if (i + LZ_MIN_MATCH <= len) {
+				table[lz_hash(&src[i])] = (int32_t)i;
+			}
+		}
+		lit = i;
+	}
+
+	return lz_flush_literals(op, &src[lit], i - lit);
+}
+
+/*
+ * Pack a LOADM binary.  On success, a newly-allocated buffer holding
+ * the packed binary is returned in *outp, and the address at which
+ * it loads in *loadaddrp.
+ */
+static bool
+loadm_pack(const struct loadm *lm, uint8_t **outp, size_t *outsizep,
+    unsigned int *loadaddrp)
+{
+	int32_t table[1U << LZ_HASH_BITS];
+	unsigned int lo = 0xffff, hi = 0, load, si;
+	size_t total = 0, bound = 0, plen;
+	uint8_t *out, *op, *payload;
+
+	for (si = 0; si < lm->nsegs; si++) {
+		total += lm->segs[si].len;
+		if (lm->segs[si].len == 0) {
+			continue;
+		}
+		bound += 4 + LZ_BOUND(lm->segs[si].len);
+		if (lm->segs[si].addr < lo) {
+			lo = lm->segs[si].addr;
+		}
+		if (lm->segs[si].addr + lm->segs[si].len > hi) {
+			hi = lm->segs[si].addr + lm->segs[si].len;
+		}
+	}
+	if (total == 0) {
+		return false;
+	}
+
+	/* Header, stub, segments, end of stream and the exec trailer. */
+	out = malloc(5 + sizeof(lz_stub_6809) + bound + 2 + 5);
+	assert(out != NULL);
+	payload = out + 5;
+	memcpy(payload, lz_stub_6809, sizeof(lz_stub_6809));
+	payload[LZ_STUB_EXEC_OFFSET] = (uint8_t)(lm->exec >> 8);
+	payload[LZ_STUB_EXEC_OFFSET + 1] = (uint8_t)lm->exec;
+	op = payload + sizeof(lz_stub_6809);
+
+	for (si = 0; si < lm->nsegs; si++) {
+		if (lm->segs[si].len == 0) {
+			continue;
+		}
+		*op++ = 0x00;
+		*op++ = 0x01;
+		*op++ = (uint8_t)(lm->segs[si].addr >> 8);
+		*op++ = (uint8_t)lm->segs[si].addr;
+		op = lz_compress(lm->segs[si].data, lm->segs[si].len, table,
+		    op);
+	}
+	*op++ = 0x00;
+	*op++ = 0x00;
+	plen = (size_t)(op - payload);
+	if (plen > 0xffff) {
+		free(out);
+		return false;
+	}
+
+	/*
+	 * The packed segment must not overlap anything the decompressor
+	 * writes.  Prefer loading it just above the original program;
+	 * failing that, just below it.
+	 */
+	if (hi + plen <= PACK_MEM_HIGH) {
+		load = hi;
+	} else if (lo >= PACK_MEM_LOW + plen) {
+		load = lo - (unsigned int)plen;
+	} else {
+		free(out);
+		return false;
+	}
+
+	out[0] = 0x00;
+	out[1] = (uint8_t)(plen >> 8);
+	out[2] = (uint8_t)plen;
+	out[3] = (uint8_t)(load >> 8);
+	out[4] = (uint8_t)load;
+	*op++ = 0xff;
+	*op++ = 0x00;
+	*op++ = 0x00;
+	*op++ = (uint8_t)(load >> 8);
+	*op++ = (uint8_t)load;
+
+	*outp = out;
+	*outsizep = (size_t)(op - out);
+	*loadaddrp = load;
+	return true;
+}
+
+/*
+ * Filesystem aging simulator.  Replays a long sequence of copyin / rm /
+ * append operations against an in-memory copy of an image, once for
+ * each allocation policy, and reports how the resulting layout ages.
+ */
+
+/*
+ * Load time model.  Disk BASIC reads a granule in about 2 revolutions
+ * (the default sector interleave lets it process one sector in every
+ * few that pass under the head), the drive turns at 300 RPM, and the
+ * head steps at 6ms per track.  Changing tracks costs a seek plus, on
+ * average, half a revolution of rotational latency.
+ */
+#define	AGE_REV_MS		200
+#define	AGE_GRANULE_MS		(2 * AGE_REV_MS)
+#define	AGE_STEP_MS		6
+#define	AGE_NCHECKPOINTS	4
+#define	AGE_MAX_FILE		(20 * 1024)
+
+struct age_sample {
+	unsigned long	nfiles;
+	unsigned long	free_granules;
+	unsigned long	extents;	/* sum over files */
+	unsigned long	fragmented;	/* files with > 1 extent */
+	unsigned long	load_ms;	/* sum over files */
+};
+
+struct age_stats {
+	struct age_sample samples[AGE_NCHECKPOINTS];
+	unsigned long	granules;	/* granules allocated */
+	uint64_t	alloc_ns;	/* time spent in the allocator */
+	unsigned long	failures;	/* ops that didn't fit */
+};
+
+enum age_op { AGE_COPYIN, AGE_RM, AGE_APPEND };
+
+struct age_workitem {
+	enum age_op	op;
+	char		name[8];
+	char		ext[3];
+	size_t		size;
+};
+
+/*
+ * The allocator under test is called through this shim, which keeps
+ * track of how much time is spent in it.
+ */
+static const struct cocofs_allocator *age_allocator;
+static uint64_t age_alloc_ns;
+
+static void
+age_timed_alloc(struct cocofs *fs, unsigned int n, uint8_t *glist)
+{
+	uint64_t t0 = cocofs_now_ns();
+
+	(*age_allocator->alloc)(fs, n, glist);
+	age_alloc_ns += cocofs_now_ns() - t0;
+}
+
+static const struct cocofs_allocator age_timed_allocator = {
+	"timed", "timing shim", age_timed_alloc,
+};
+
+static uint64_t
+age_random(uint64_t *state)
+{
+	/* xorshift64* */
+	uint64_t x = *state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545f4914f6cdd1dULL;
+}
+
+static void
+age_sample_image(const struct cocofs *fs, struct age_sample *sample)
+{
+	const struct cocofs_dirent *dir;
+	unsigned int di, loopcnt, extents, track, curtrack;
+	unsigned long ms;
+	uint8_t g, gn;
+
+	for (di = 0; di < COCOFS_DIR_TRACK_NENTRIES; di++) {
+		dir = &fs->directory[di];
+		if (dir->d_type > COCOFS_DIRENT_TYPE_TEXT) {
+			continue;
+		}
+		extents = 0;
+		ms = 0;
+		curtrack = COCOFS_DIR_TRACK;
+		for (g = dir->d_first_granule, loopcnt = 0, gn = 0xff;
+		     g < COCOFS_NGRANULES && loopcnt <= COCOFS_NGRANULES;
+		     loopcnt++, g = gn) {
+			track = cocofs_granule_to_track(g);
+			if (track != curtrack) {
+				ms += AGE_STEP_MS * (track > curtrack ?
+				    track - curtrack : curtrack - track) +
+				    AGE_REV_MS / 2;
+				curtrack = track;
+			}
+			ms += AGE_GRANULE_MS;
+			gn = fs->granule_map[g];
+			if (GMAP_IS_LAST(gn) || ! gmap_entry_is_valid(gn)) {
+				extents++;
+				break;
+			}
+			if (gn != g + 1) {
+				extents++;
+			}
+		}
+		sample->nfiles++;
+		sample->extents += extents;
+		sample->fragmented += extents > 1;
+		sample->load_ms += ms;
+	}
+	sample->free_granules += fs->free_granules;
+}
+
+static bool
+age_dirent_available(const struct cocofs *fs)
+{
+	unsigned int di;
+
+	for (di = 0; di < COCOFS_DIR_TRACK_NENTRIES; di++) {
+		if (fs->directory[di].d_type == COCOFS_DIRENT_TYPE_FREE) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static struct cocofs_dirent *
+age_pick_file(struct cocofs *fs, uint64_t *rng)
+{
+	unsigned int di, n = 0;
+	uint8_t slots[COCOFS_DIR_TRACK_NENTRIES];
+
+	for (di = 0; di < COCOFS_DIR_TRACK_NENTRIES; di++) {
+		if (fs->directory[di].d_type <= COCOFS_DIRENT_TYPE_TEXT) {
+			slots[n++] = di;
+		}
+	}
+	if (n == 0) {
+		return NULL;
+	}
+	return &fs->directory[slots[age_random(rng) % n]];
+}
+
+/*
+ * Apply one operation to the image.  Operations that don't fit are
+ * counted as failures rather than reported.
+ */
+static void
+age_apply(struct cocofs *fs, const struct age_workitem *w,
+    struct cocofs_dirent *dir, const uint8_t *junk, struct age_stats *stats)
+{
+	unsigned int have, need, free_before;
+	uint8_t *data, *ndata;
+	size_t size;
+
+	switch (w->op) {
+	case AGE_COPYIN:
+		need = cocofs_size_to_granules(w->size);
+		if (dir != NULL || need > fs->free_granules ||
+		    ! age_dirent_available(fs)) {
+			stats->failures++;
+			return;
+		}
+		free_before = fs->free_granules;
+		(void)cocofs_copyin_data(fs, NULL, "age", junk, w->size,
+		    w->name, w->ext, COCOFS_DIRENT_TYPE_DATA,
+		    COCOFS_DIRENT_ENC_BINARY);
+		stats->granules += free_before - fs->free_granules;
+		break;
+
+	case AGE_RM:
+		if (dir == NULL || ! cocofs_rm(fs, dir)) {
+			stats->failures++;
+		}
+		break;
+
+	case AGE_APPEND:
+		if (dir == NULL || ! cocofs_read_file(fs, dir, &data, &size)) {
+			stats->failures++;
+			return;
+		}
+		have = cocofs_size_to_granules(size);
+		need = cocofs_size_to_granules(size + w->size);
+		if (need > fs->free_granules + have) {
+			free(data);
+			stats->failures++;
+			return;
+		}
+		ndata = realloc(data, size + w->size);
+		assert(ndata != NULL);
+		memcpy(ndata + size, junk, w->size);
+		free_before = fs->free_granules + have;
+		(void)cocofs_replace(fs, dir, ndata, size + w->size);
+		stats->granules += free_before - fs->free_granules;
+		free(ndata);
+		break;
+	}
+}
+
+/*
+ * Generate a random operation.  File sizes are log-uniform, which is
+ * a reasonable match for what we see on real disks.
+ */
+static void
+age_random_op(struct age_workitem *w, uint64_t *rng, unsigned long *seq)
+{
+	unsigned int r = age_random(rng) % 100;
+	double f = (double)(age_random(rng) >> 11) / (double)(1ULL << 53);
+	char tmp[9];
+
+	w->op = r < 45 ? AGE_COPYIN : r < 80 ? AGE_RM : AGE_APPEND;
+	w->size = (size_t)exp(log(64.0) + f * (log(AGE_MAX_FILE) - log(64.0)));
+	if (w->op == AGE_APPEND) {
+		w->size /= 4;
+	}
+	if (w->size == 0) {
+		w->size = 1;
+	}
+	snprintf(tmp, sizeof(tmp), "F%07lu", (*seq)++ % 10000000);
+	memcpy(w->name, tmp, sizeof(w->name));
+	memcpy(w->ext, "DAT", sizeof(w->ext));
+}
+
+/*
+ * Read a recorded workload.  Each line is one of:
+ *
+ *	copyin NAME SIZE
+ *	rm NAME
+ *	append NAME SIZE
+ */
+static struct age_workitem *
+age_read_workload(const char *path, unsigned long *nitemsp)
+{
+	struct age_workitem *items = NULL, *w;
+	unsigned long nitems = 0, size, lineno = 0;
+	char line[256], verb[16], fname[64];
+	int n;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "unable to open %s: %s\n",
+		    path, strerror(errno));
+		return NULL;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		size = 0;
+		n = sscanf(line, "%15s %63s %lu", verb, fname, &size);
+		if (n <= 0 || verb[0] == '#') {
+			continue;
+		}
+		items = realloc(items, (nitems + 1) * sizeof(*items));
+		assert(items != NULL);
+		w = &items[nitems];
+		if (n >= 2 && strcmp(verb, "rm") == 0) {
+			w->op = AGE_RM;
+		} else if (n == 3 && strcmp(verb, "copyin") == 0) {
+			w->op = AGE_COPYIN;
+		} else if (n == 3 && strcmp(verb, "append") == 0) {
+			w->op = AGE_APPEND;
+		} else {
+			n = 0;
+		}
+		if (n == 0 || size > COCOFS_NGRANULES *
+				     COCOFS_BYTES_PER_GRANULE ||
+		    ! cocofs_conv_name(fname, w->name, w->ext)) {
+			fprintf(stderr, "%s:%lu: invalid workload item\n",
+			    path, lineno);
+			free(items);
+			fclose(fp);
+			return NULL;
+		}
+		w->size = size;
+		nitems++;
+	}
+	fclose(fp);
+	*nitemsp = nitems;
+	return items;
+}
+
+/*
+ * The number of ops after which checkpoint cp is sampled.  Short runs
+ * sample several checkpoints after the same op rather than none.
+ */
+static unsigned long
+age_checkpoint(unsigned long nops, unsigned int cp)
+{
+	unsigned long n = (nops * (cp + 1)) / AGE_NCHECKPOINTS;
+
+	return n != 0 ? n : 1;
+}
+
+/*
+ * Run the specified number of lifetimes with one allocator.
+ */
+static void
+age_run(const struct cocofs *initial, const struct cocofs_allocator *alloc,
+    unsigned long lifetimes, unsigned long nops,
+    const struct age_workitem *workload, uint64_t seed,
+    const uint8_t *junk, struct age_stats *stats)
+{
+	struct cocofs *fs = cocofs_alloc(-1, initial->path);
+	struct age_workitem w;
+	struct cocofs_dirent *dir;
+	unsigned long lt, op, seq;
+	unsigned int cp;
+	uint64_t rng;
+
+	memset(stats, 0, sizeof(*stats));
+	age_allocator = alloc;
+	age_alloc_ns = 0;
+	fs->allocator = &age_timed_allocator;
+
+	for (lt = 0; lt < lifetimes; lt++) {
+		memcpy(fs->image_data, initial->image_data, COCOFS_TOTALSIZE);
+		fs->free_granules = initial->free_granules;
+		rng = seed + lt * 0x9e3779b97f4a7c15ULL;
+		if (rng == 0) {
+			rng = 1;
+		}
+		seq = 0;
+		cp = 0;
+		for (op = 0; op < nops; op++) {
+			if (workload != NULL) {
+				w = workload[op];
+				dir = cocofs_lookup_raw(fs, w.name, w.ext);
+			} else {
+				age_random_op(&w, &rng, &seq);
+				dir = w.op == AGE_COPYIN ? NULL :
+				    age_pick_file(fs, &rng);
+			}
+			age_apply(fs, &w, dir, junk, stats);
+			while (cp < AGE_NCHECKPOINTS &&
+			    op + 1 == age_checkpoint(nops, cp)) {
+				age_sample_image(fs, &stats->samples[cp++]);
+			}
+		}
+	}
+
+	stats->alloc_ns = age_alloc_ns;
+	cocofs_free(fs);
+}
+
+static void
+age_report(const struct cocofs_allocator *alloc, const struct age_stats *st,
+    unsigned long lifetimes, unsigned long nops, double secs)
+{
+	const struct age_sample *s;
+	unsigned int cp;
+
+	cocofs_printf("%s (%s): %lu lifetime%s in %.2fs (%.0f/s), "
+	    "%lu failed op%s\n", alloc->name, alloc->descr,
+	    lifetimes, plural(lifetimes), secs,
+	    secs > 0 ? lifetimes / secs : 0.0,
+	    st->failures, plural(st->failures));
+	cocofs_printf("    %8s %7s %7s %13s %11s %13s\n", "ops", "files",
+	    "free", "extents/file", "fragmented", "load ms/file");
+	for (cp = 0; cp < AGE_NCHECKPOINTS; cp++) {
+		s = &st->samples[cp];
+		double nf = s->nfiles ? (double)s->nfiles : 1.0;
+		cocofs_printf("    %8lu %7.1f %7.1f %13.2f %10.1f%% %13.0f\n",
+		    age_checkpoint(nops, cp),
+		    (double)s->nfiles / lifetimes,
+		    (double)s->free_granules / lifetimes,
+		    s->extents / nf, 100.0 * s->fragmented / nf,
+		    s->load_ms / nf);
+	}
+	cocofs_printf("    allocation cost: %.0f ns/granule\n\n",
+	    st->granules ? (double)st->alloc_ns / st->granules : 0.0);
+}
+
+/*
+ * Granule ownership, as determined by walking the granule chain of
+ * every file in the directory.
+ */
+#define	COCOFS_OWNER_NONE	0xff	/* not reachable from any file */
+#define	COCOFS_OWNER_CONFLICT	0xfe	/* reachable from multiple files */
+
+struct cocofs_owners {
+	uint8_t		owner[COCOFS_NGRANULES];
+	uint8_t		last[COCOFS_DIR_TRACK_NENTRIES];
+					/* last granule of each file, or
+					   COCOFS_OWNER_NONE if the chain
+					   is broken */
+};
+
+static void
+cocofs_granule_owners(const struct cocofs *fs, struct cocofs_owners *o)
+{
+	const struct cocofs_dirent *dir;
+	unsigned int di, loopcnt;
+	uint8_t g, gn;
+
+	memset(o->owner, COCOFS_OWNER_NONE, sizeof(o->owner));
+	memset(o->last, COCOFS_OWNER_NONE, sizeof(o->last));
+
+	for (di = 0; di < COCOFS_DIR_TRACK_NENTRIES; di++) {
+		dir = &fs->directory[di];
+		if (dir->d_type > COCOFS_DIRENT_TYPE_TEXT) {
+			continue;
+		}
+		for (g = dir->d_first_granule, loopcnt = 0;
+		     loopcnt <= COCOFS_NGRANULES; loopcnt++, g = gn) {
+			if (g >= COCOFS_NGRANULES) {
+				break;
+			}
+			if (o->owner[g] != COCOFS_OWNER_NONE) {
+				o->owner[g] = COCOFS_OWNER_CONFLICT;
+				break;
+			}
+			o->owner[g] = di;
+			gn = fs->granule_map[g];
+			if (! gmap_entry_is_valid(gn) || gn == GMAP_FREE) {
+				break;
+			}
+			if (GMAP_IS_LAST(gn)) {
+				o->last[di] = g;
+				break;
+			}
+		}
+	}
+}
+
+/*
+ * Estimate how many bytes a general-purpose compressor would need to
+ * represent the image, using the order-0 entropy of each sector.  This
+ * is crude, but is good enough to show the effect of scrubbing.
+ */
+static unsigned long
+cocofs_estimate_compressed_size(const struct cocofs *fs)
+{
+	unsigned int counts[256];
+	const uint8_t *sec;
+	unsigned long total = 0;
+	unsigned int s, i;
+	double bits;
+
+	for (s = 0; s < COCOFS_NSECTORS; s++) {
+		sec = fs->image_data + (size_t)s * COCOFS_BYTES_PER_SEC;
+		memset(counts, 0, sizeof(counts));
+		for (i = 0; i < COCOFS_BYTES_PER_SEC; i++) {
+			counts[sec[i]]++;
+		}
+		bits = 0;
+		for (i = 0; i < 256; i++) {
+			if (counts[i] != 0) {
+				bits -= counts[i] *
+				    log2((double)counts[i] /
+					 COCOFS_BYTES_PER_SEC);
+			}
+		}
+		total += (unsigned long)ceil(bits / 8);
+	}
+
+	return total;
+}
+
+/*
+ * Fill [p, p + len) with the specified value, touching (and marking
+ * dirty) only those sectors whose contents actually change.  Returns
+ * the number of bytes whose value changed.
+ */
+static unsigned int
+cocofs_scrub_range(struct cocofs *fs, uint8_t *p, size_t len, uint8_t fill)
+{
+	unsigned int changed = 0;
+	size_t offset, chunk, i;
+	unsigned int n;
+
+	while (len != 0) {
+		offset = (size_t)(p - fs->image_data);
+		chunk = COCOFS_BYTES_PER_SEC - (offset % COCOFS_BYTES_PER_SEC);
+		if (chunk > len) {
+			chunk = len;
+		}
+		for (i = 0, n = 0; i < chunk; i++) {
+			if (p[i] != fill) {
+				n++;
+			}
+		}
+		if (n != 0) {
+			memset(p, fill, chunk);
+			cocofs_mark_dirty(fs, p, chunk);
+			changed += n;
+		}
+		p += chunk;
+		len -= chunk;
+	}
+
+	return changed;
+}
+
+struct cocofs_scrub_stats {
+	unsigned int	free_bytes;	/* bytes scrubbed in free granules */
+	unsigned int	slack_bytes;	/* bytes scrubbed in file slack */
+};
+
+/*
+ * Scrub leftover data from free granules and from the unused tail of
+ * the last granule of each file.  Granules whose ownership cannot be
+ * determined (broken or cross-linked chains) are left alone.  If
+ * slack_fill is negative, file slack is not touched.
+ */
+static void
+cocofs_scrub(struct cocofs *fs, int slack_fill,
+    struct cocofs_scrub_stats *stats)
+{
+	struct cocofs_owners o;
+	const struct cocofs_dirent *dir;
+	unsigned int g, di, used, nsec;
+	uint16_t lastbytes;
+	uint8_t *gdata;
+
+	memset(stats, 0, sizeof(*stats));
+	cocofs_granule_owners(fs, &o);
+
+	for (g = 0; g < COCOFS_NGRANULES; g++) {
+		if (fs->granule_map[g] != GMAP_FREE ||
+		    o.owner[g] != COCOFS_OWNER_NONE) {
+			continue;
+		}
+		stats->free_bytes += cocofs_scrub_range(fs,
+		    fs->image_data + cocofs_granule_to_offset(g),
+		    COCOFS_BYTES_PER_GRANULE, GMAP_FREE);
+	}
+
+	if (slack_fill < 0) {
+		return;
+	}
+
+	for (di = 0; di < COCOFS_DIR_TRACK_NENTRIES; di++) {
+		g = o.last[di];
+		if (g == COCOFS_OWNER_NONE || o.owner[g] != di) {
+			continue;
+		}
+		dir = &fs->directory[di];
+		nsec = GMAP_LAST_NSEC(fs->granule_map[g]);
+		if (nsec < 1 || nsec > COCOFS_SEC_PER_GRANULE) {
+			continue;
+		}
+		lastbytes = cocofs_dir_lastbytes(dir->d_last_bytes);
+		if (lastbytes > COCOFS_BYTES_PER_SEC) {
+			lastbytes = COCOFS_BYTES_PER_SEC;
+		}
+		used = (nsec - 1) * COCOFS_BYTES_PER_SEC + lastbytes;
+		gdata = fs->image_data + cocofs_granule_to_offset(g);
+		stats->slack_bytes += cocofs_scrub_range(fs, gdata + used,
+		    COCOFS_BYTES_PER_GRANULE - used, (uint8_t)slack_fill);
+	}
+}
+
+/*
+ * Directory sorting.  Disk BASIC searches the directory from the
+ * beginning and stops at the first entry whose name begins with 0xff,
+ * so putting frequently-used files first and packing the free entries
+ * at the end reduces the number of directory sectors read on lookup.
+ */
+struct cocofs_sortent {
+	struct cocofs_dirent dirent;
+	long		key;		/* primary key; lower sorts first */
+	unsigned int	slot;		/* original slot, for stability */
+};
+
+static int
+cocofs_sortent_cmp_key(const void *v1, const void *v2)
+{
+	const struct cocofs_sortent *e1 = v1, *e2 = v2;
+
+	if (e1->key != e2->key) {
+		return e1->key < e2->key ? -1 : 1;
+	}
+	return (int)e1->slot - (int)e2->slot;
+}
+
+static int
+cocofs_sortent_cmp_name(const void *v1, const void *v2)
+{
+	const struct cocofs_sortent *e1 = v1, *e2 = v2;
+	int rv;
+
+	rv = memcmp(e1->dirent.d_name, e2->dirent.d_name,
+	    sizeof(e1->dirent.d_name));
+	if (rv == 0) {
+		rv = memcmp(e1->dirent.d_ext, e2->dirent.d_ext,
+		    sizeof(e1->dirent.d_ext));
+	}
+	if (rv == 0) {
+		rv = (int)e1->slot - (int)e2->slot;
+	}
+	return rv;
+}
+
+static bool
+cocofs_dirent_is_free(const struct cocofs_dirent *dir)
+{
+	/*
+	 * Disk BASIC's KILL zeros the first byte of the name; a slot
+	 * that's never been used is all 0xff.  Anything else is kept,
+	 * even if its type is one we don't know.
+	 */
+	return dir->d_type == COCOFS_DIRENT_TYPE_FREE ||
+	       dir->d_name[0] == 0 || (uint8_t)dir->d_name[0] == 0xff;
+}
+
+/*
+ * A file that ls would list (same test as the granule ownership walk).
+ */
+static bool
+cocofs_dirent_is_file(const struct cocofs_dirent *dir)
+{
+	return ! cocofs_dirent_is_free(dir) &&
+	       dir->d_type <= COCOFS_DIRENT_TYPE_TEXT;
+}
+
+/*
+ * Gather the in-use directory entries into ents[] (with key set to
+ * LONG_MAX, meaning "unranked"), returning how many there are.
+ */
+static unsigned int
+cocofs_sortdir_gather(const struct cocofs *fs, struct cocofs_sortent *ents)
+{
+	unsigned int di, n = 0;
+
+	for (di = 0; di < COCOFS_DIR_TRACK_NENTRIES; di++) {
+		if (cocofs_dirent_is_free(&fs->directory[di])) {
+			continue;
+		}
+		ents[n].dirent = fs->directory[di];
+		ents[n].key = LONG_MAX;
+		ents[n].slot = di;
+		n++;
+	}
+	return n;
+}
+
+/*
+ * Rank the entry with the specified name; returns false if there
+ * is no such entry.
+ */
+static bool
+cocofs_sortdir_rank(struct cocofs_sortent *ents, unsigned int n,
+    const char *fname, long key)
+{
+	char name[8], ext[3];
+	unsigned int i;
+
+	if (! cocofs_conv_name(fname, name, ext)) {
+		return false;
+	}
+	for (i = 0; i < n; i++) {
+		if (memcmp(ents[i].dirent.d_name, name, sizeof(name)) == 0 &&
+		    memcmp(ents[i].dirent.d_ext, ext, sizeof(ext)) == 0) {
+			if (key < ents[i].key) {
+				ents[i].key = key;
+			}
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Write the sorted entries back to the directory, followed by free
+ * entries.  Only entries that actually change are marked dirty.
+ * Returns the number of directory slots that changed.
+ */
+static unsigned int
+cocofs_sortdir_apply(struct cocofs *fs, const struct cocofs_sortent *ents,
+    unsigned int n)
+{
+	struct cocofs_dirent freeent;
+	const struct cocofs_dirent *src;
+	unsigned int di, changed = 0;
+
+	memset(&freeent, 0xff, sizeof(freeent));
+
+	for (di = 0; di < COCOFS_DIR_TRACK_NENTRIES; di++) {
+		src = di < n ? &ents[di].dirent : &freeent;
+		if (memcmp(&fs->directory[di], src, sizeof(*src)) == 0) {
+			continue;
+		}
+		fs->directory[di] = *src;
+		cocofs_mark_dirty(fs, &fs->directory[di], sizeof(*src));
+		changed++;
+	}
+	return changed;
+}
+
+/*
+ * Global options.  These precede the image name on the command line.
+ */
+static struct {
+	bool		shrink;		/* --shrink */
+	bool		crunch;		/* --crunch */
+	const char	*record;	/* --record */
+	const char	*trace;		/* --trace */
+	unsigned int	jobs;		/* --jobs */
+	const char	*metrics;	/* --metrics */
+	const char	*journal;	/* --journal */
+	size_t		cache_size;	/* --cache-size */
+	bool		resume;		/* --resume */
+	unsigned int	metrics_interval; /* --metrics-interval */
+	bool		direct;		/* --direct */
+	uint64_t	rate_bytes;	/* --rate-bytes */
+	uint64_t	rate_ops;	/* --rate-ops */
+	unsigned int	rate_latency;	/* --rate-latency */
+	bool		hdb;		/* --hdb-drive or --hdb-offset */
+	unsigned int	hdb_drive;	/* --hdb-drive */
+	bool		hdb_offset_set;	/* --hdb-offset (else auto) */
+	off_t		hdb_offset;
+					/* --alloc */
+	const struct cocofs_allocator *allocator;
+} opts;
+
+static const char *myname = "cocofs";
+
+#ifdef COCOFS_VERSION
+#define	STRINGIFY(x)		#x
+#define	STRINGIFY_HARDER(x)	STRINGIFY(x)
+static const char *version = STRINGIFY_HARDER(COCOFS_VERSION);
+#endif
+
+static void
+set_myname(const char *argv0)
+{
+	char *cp;
+
+	/* Unix path. */
+	cp = strrchr(argv0, '/');
+	if (cp == NULL) {
+		/* Windows path. */
+		cp = strrchr(argv0, '\\');
+	}
+	if (cp == NULL) {
+		/* stick with the default. */
+		return;
+	}
+	myname = ++cp;	/* advance past the path delimeter */
+}
+
+static int
+usage(void)
+{
+#ifdef COCOFS_VERSION
+	fprintf(stderr, "%s version %s\n", myname, version);
+#endif
+	fprintf(stderr, "usage: %s <image> dump\n", myname);
+	fprintf(stderr, "       %s <image> format\n", myname);
+	fprintf(stderr, "       %s <image> ls [file1 [file2 [...]]]\n", myname);
+	fprintf(stderr, "       %s <image> rm file1 [file2 [...]]\n", myname);
+	fprintf(stderr, "       %s <image> copyin file1 [file2 [...]]\n",
+	    myname);
+	fprintf(stderr, "       %s <image> copyout file1 [file2 [...]]\n",
+	    myname);
+	fprintf(stderr, "       %s <image> cp from to\n", myname);
+	fprintf(stderr, "       %s <image> scrub [slack-fill | keep]\n",
+	    myname);
+	fprintf(stderr, "       %s <image> crunch file1 [file2 [...]]\n",
+	    myname);
+	fprintf(stderr, "       %s <image> pack-bin file1 [file2 [...]]\n",
+	    myname);
+	fprintf(stderr, "       %s <image> age [-n lifetimes] [-o ops] "
+			"[-s seed] [-a alloc] [-f workload]\n", myname);
+	fprintf(stderr, "       %s <image> sortdir [name | manifest <file> | "
+			"order file1 [file2 [...]]]\n", myname);
+	fprintf(stderr, "       %s <image> identify <iddb>\n", myname);
+	fprintf(stderr, "       %s replay trace\n", myname);
+	fprintf(stderr, "       %s scan [-o output] [-m manifest] "
+			"<dir | listfile> <command> [args]\n", myname);
+	fprintf(stderr, "       %s watch <dir> <catalog>\n", myname);
+	fprintf(stderr, "       %s catalog <catalog> [file1 [file2 [...]]]\n",
+	    myname);
+	fprintf(stderr, "       %s hdbscan <image>\n", myname);
+	fprintf(stderr, "       %s dwserve [-l [host:]port] <image | dir> "
+			"[...]\n", myname);
+	fprintf(stderr, "       %s http --root <dir> [--listen [host:]port]\n",
+	    myname);
+	fprintf(stderr, "       %s export-arrow <dir | listfile> <file>\n",
+	    myname);
+	fprintf(stderr, "       %s mkiddb <iddb> <listfile>\n", myname);
+	fprintf(stderr, "       %s coderefs [-n top] [-s interval] [-m bytes] "
+			"<dir | listfile>\n", myname);
+	fprintf(stderr, "\noptions (must precede <image>):\n");
+	fprintf(stderr, "       --shrink     leave trailing free tracks "
+			"off of the saved image\n");
+	fprintf(stderr, "       --crunch     crunch tokenized BASIC "
+			"programs on copyin\n");
+	fprintf(stderr, "       --alloc=NAME granule allocation policy "
+			"(nextfit, firstfit, nearest, bestfit)\n");
+	fprintf(stderr, "       --record=FILE append a trace of commands "
+			"and I/O to FILE\n");
+	fprintf(stderr, "       --trace=FILE write a Chrome trace-event "
+			"timeline to FILE\n");
+	fprintf(stderr, "       --jobs=N     number of scan worker "
+			"(or copyin/copyout I/O) threads\n");
+	fprintf(stderr, "       --direct     scan images with O_DIRECT\n");
+	fprintf(stderr, "       --rate-bytes=BYTES limit image I/O to "
+			"BYTES per second\n");
+	fprintf(stderr, "       --rate-ops=N limit image I/O to N "
+			"operations per second\n");
+	fprintf(stderr, "       --rate-latency=MS back off when p99 read "
+			"latency exceeds MS\n");
+	fprintf(stderr, "       --journal=FILE record scan progress "
+			"in FILE\n");
+	fprintf(stderr, "       --resume     resume a journaled scan\n");
+	fprintf(stderr, "       --cache-size=BYTES image cache budget for "
+			"long-running modes\n");
+	fprintf(stderr, "       --hdb-drive=N operate on HDB-DOS drive N "
+			"of a hard disk image\n");
+	fprintf(stderr, "       --hdb-offset=BYTES|auto start of the "
+			"HDB-DOS region\n");
+	fprintf(stderr, "       --metrics=FILE write Prometheus metrics "
+			"to FILE\n");
+	fprintf(stderr, "       --metrics-interval=SECS how often to "
+			"rewrite the metrics file\n");
+	fprintf(stderr, "       --           end of options; the next "
+			"argument is an image, even if\n"
+			"                    it has the name of a command "
+			"(such as scan)\n");
+
+	return EXIT_FAILURE;
+}
+
+static int
+cmd_dump(struct cocofs *fs, int argc, char *argv[])
+{
+	if (argc != 0) {
+		return usage();
+	}
+	(void)argv;
+
+	cocofs_enumerate_directory(fs, true);
+
+	return EXIT_SUCCESS;
+}
+
+static int
+cmd_format(struct cocofs *fs, int argc, char *argv[])
+{
+	if (argc != 0) {
+		return usage();
+	}
+	(void)argv;
+
+	/* Caller formatted a new image for us. */
+
+	return cocofs_save(fs) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int
+cmd_ls(struct cocofs *fs, int argc, char *argv[])
+{
+	if (argc == 0) {
+		cocofs_enumerate_directory(fs, false);
+		return EXIT_SUCCESS;
+	}
+
+	struct cocofs_dirent *dir;
+	struct cocofs_stat st;
+	int retval = EXIT_SUCCESS;
+	int i;
+	for (i = 0; i < argc; i++) {
+		dir = cocofs_lookup(fs, argv[i]);
+		if (dir == NULL) {
+			fprintf(stderr, "%s: %s\n",
+			    argv[i], strerror(ENOENT));
+			retval = EXIT_FAILURE;
+			continue;
+		}
+		cocofs_stat(fs, dir, &st);
+		cocofs_print_stat(&st);
+	}
+	return retval;
+}
+
+static int
+cmd_rm(struct cocofs *fs, int argc, char *argv[])
+{
+	if (argc == 0) {
+		return usage();
+	}
+
+	struct cocofs_dirent *dir;
+	int retval = EXIT_SUCCESS;
+	int i;
+	for (i = 0; i < argc; i++) {
+		dir = cocofs_lookup(fs, argv[i]);
+		if (dir == NULL) {
+			fprintf(stderr, "%s: %s\n",
+			    argv[i], strerror(ENOENT));
+			retval = EXIT_FAILURE;
+			continue;
+		}
+		if (! cocofs_rm(fs, dir)) {
+			retval = EXIT_FAILURE;
+			break;
+		}
+		if (! cocofs_save(fs)) {
+			retval = EXIT_FAILURE;
+			break;
+		}
+	}
+	return retval;
+}
+
+/*
+ * Asynchronous copyout.  With --jobs=N, the command's thread gathers
+ * each file from the image and hands it to a pool of N writer threads,
+ * which create and write the host files concurrently.  At most
+ * COPYOUT_WINDOW files per writer are in flight; a file with the same
+ * name as one in flight waits for it, so that the last one named still
+ * wins.
+ */
+#define	COPYOUT_WINDOW		4
+
+struct copyout_job {
+	struct copyout_job *next;	/* on the in-flight list */
+	struct copyout_job *qnext;	/* on the queue */
+	const struct cocofs_dirent *dir;
+	char		outfname[8+1+3+1];
+	struct copyout_data cd;
+	bool		done;
+};
+
+struct copyout_pool {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cv;
+	const struct cocofs *fs;
+	struct copyout_job *queue, **queue_tail;
+	struct copyout_job *inflight;	/* all jobs not yet reaped */
+	unsigned int	ninflight;
+	unsigned int	window;
+	bool		stop;
+	bool		failed;
+};
+
+struct copyout_writer {
+	struct worker	w;
+	struct copyout_pool *pool;
+};
+
+static void *
+copyout_writer(void *arg)
+{
+	struct copyout_writer *cw = arg;
+	struct copyout_pool *p = cw->pool;
+	struct copyout_job *job;
+	uint64_t t0;
+	bool ok;
+
+	curworker = &cw->w;
+	trace_thread_start(&cw->w);
+	metrics_thread_start(&cw->w);
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		while (p->queue == NULL && ! p->stop) {
+			pthread_cond_wait(&p->cv, &p->lock);
+		}
+		if ((job = p->queue) == NULL) {
+			break;
+		}
+		if ((p->queue = job->qnext) == NULL) {
+			p->queue_tail = &p->queue;
+		}
+		pthread_mutex_unlock(&p->lock);
+
+		t0 = trace_begin();
+		ok = cocofs_copyout_write(p->fs, job->dir, job->outfname,
+		    &job->cd);
+		trace_span("copyout_write", t0, job->outfname);
+		free(job->cd.data);
+		job->cd.data = NULL;
+
+		pthread_mutex_lock(&p->lock);
+		if (! ok) {
+			p->failed = true;
+		}
+		job->done = true;
+		pthread_cond_broadcast(&p->cv);
+	}
+	pthread_mutex_unlock(&p->lock);
+	trace_thread_done(&cw->w);
+	return NULL;
+}
+
+/*
+ * Free the jobs that are finished.  Called with the lock held.
+ */
+static void
+copyout_pool_reap(struct copyout_pool *p)
+{
+	struct copyout_job **jp, *job;
+
+	for (jp = &p->inflight; (job = *jp) != NULL;) {
+		if (job->done) {
+			*jp = job->next;
+			free(job);
+			p->ninflight--;
+		} else {
+			jp = &job->next;
+		}
+	}
+}
+
+static int
+cmd_copyout(struct cocofs *fs, int argc, char *argv[])
+{
+	if (argc == 0) {
+		return usage();
+	}
+
+	struct cocofs_dirent *dir;
+	struct cocofs_stat st;
+	struct copyout_pool pool;
+	struct copyout_writer *writers = NULL;
+	struct copyout_job *job;
+	unsigned int nwriters = 0, w;
+	char outfname[8+1+3+1];	/* 88888888.333\0 */
+	int retval = EXIT_SUCCESS;
+	int i;
+
+	if (opts.jobs > 1 && argc > 1 && ! fs->batch) {
+		memset(&pool, 0, sizeof(pool));
+		pthread_mutex_init(&pool.lock, NULL);
+		pthread_cond_init(&pool.cv, NULL);
+		pool.fs = fs;
+		pool.queue_tail = &pool.queue;
+		pool.window = opts.jobs * COPYOUT_WINDOW;
+		writers = calloc(opts.jobs, sizeof(*writers));
+		assert(writers != NULL);
+		for (w = 0; w < opts.jobs; w++) {
+			writers[w].w.id = w + 1;
+			writers[w].w.image_fd = -1;
+			writers[w].pool = &pool;
+			if (pthread_create(&writers[w].w.thread, NULL,
+					   copyout_writer, &writers[w]) != 0) {
+				break;
+			}
+			nwriters++;
+		}
+		if (nwriters == 0) {
+			/* Just do it the ordinary way. */
+			free(writers);
+			writers = NULL;
+		}
+	}
+
+	for (i = 0; i < argc; i++) {
+		dir = cocofs_lookup(fs, argv[i]);
+		if (dir == NULL) {
+			fprintf(stderr, "%s: %s\n",
+			    argv[i], strerror(ENOENT));
+			retval = EXIT_FAILURE;
+			continue;
+		}
+		cocofs_stat(fs, dir, &st);
+		/*
+		 * N.B. cocofs_stat() guarantees that st.st_name will
+		 * never exceed 8 bytes and that st.st_ext will never
+		 * exceed 3 bytes.  This means that the 13 byte buffer
+		 * allocated above will be sufficient for all possible
+		 * inputs, and thus strcpy() and sprintf() will be safe
+		 * to use.  (This improves the portability of the code.)
+		 */
+		if (st.st_ext[0] == '\0') {
+			/* No extension. */
+			strcpy(outfname, st.st_name);
+		} else {
+			sprintf(outfname, "%s.%s", st.st_name, st.st_ext);
+		}
+		if (writers == NULL) {
+			if (! cocofs_copyout(fs, dir, outfname)) {
+				retval = EXIT_FAILURE;
+			}
+			continue;
+		}
+
+		job = calloc(1, sizeof(*job));
+		assert(job != NULL);
+		job->dir = dir;
+		strcpy(job->outfname, outfname);
+		COCOFS_PROBE3(copyout__start, fs->path, dir->d_name, outfname);
+		cocofs_copyout_gather(fs, dir, &job->cd);
+		cocofs_copyout_report(&job->cd);
+
+		pthread_mutex_lock(&pool.lock);
+		for (;;) {
+			struct copyout_job *o;
+
+			copyout_pool_reap(&pool);
+			for (o = pool.inflight; o != NULL; o = o->next) {
+				if (strcmp(o->outfname, outfname) == 0) {
+					break;
+				}
+			}
+			if (o == NULL && pool.ninflight < pool.window) {
+				break;
+			}
+			pthread_cond_wait(&pool.cv, &pool.lock);
+		}
+		job->next = pool.inflight;
+		pool.inflight = job;
+		pool.ninflight++;
+		*pool.queue_tail = job;
+		pool.queue_tail = &job->qnext;
+		pthread_cond_broadcast(&pool.cv);
+		pthread_mutex_unlock(&pool.lock);
+	}
+
+	if (writers != NULL) {
+		pthread_mutex_lock(&pool.lock);
+		pool.stop = true;
+		pthread_cond_broadcast(&pool.cv);
+		pthread_mutex_unlock(&pool.lock);
+		for (w = 0; w < nwriters; w++) {
+			pthread_join(writers[w].w.thread, NULL);
+		}
+		copyout_pool_reap(&pool);
+		assert(pool.inflight == NULL);
+		if (pool.failed) {
+			retval = EXIT_FAILURE;
+		}
+		free(writers);
+		pthread_cond_destroy(&pool.cv);
+		pthread_mutex_destroy(&pool.lock);
+	}
+	return retval;
+}
+
+/*
+ * Read an entire host file into a newly-allocated buffer.
+ */
+static bool
+read_host_file(const char *path, uint8_t **datap, size_t *sizep)
+{
+	struct stat sb;
+	uint8_t *data;
+	ssize_t rv;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_BINARY);
+	if (fd == -1) {
+		fprintf(stderr,
+		    "unable to open %s: %s\n", path, strerror(errno));
+		return false;
+	}
+	if (fstat(fd, &sb) == -1) {
+		fprintf(stderr,
+		    "unable to stat %s: %s\n", path, strerror(errno));
+		close(fd);
+		return false;
+	}
+	data = malloc(sb.st_size ? (size_t)sb.st_size : 1);
+	assert(data != NULL);
+	rv = cocofs_pread(fd, data, (size_t)sb.st_size, 0);
+	close(fd);
+	if (rv != (ssize_t)sb.st_size) {
+		fprintf(stderr, "failed to read %s\n", path);
+		free(data);
+		return false;
+	}
+	*datap = data;
+	*sizep = (size_t)sb.st_size;
+	return true;
+}
+
+/*
+ * Map a host file read-only, for as long as we run.  Where there's no
+ * mmap(), the file is simply read into memory.
+ */
+static const uint8_t *
+cocofs_map_file(const char *path, size_t *sizep)
+{
+#ifdef _WIN32
+	uint8_t *data;
+
+	return read_host_file(path, &data, sizep) ? data : NULL;
+#else
+	struct stat sb;
+	void *data;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_BINARY);
+	if (fd == -1 || fstat(fd, &sb) == -1) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		if (fd != -1) {
+			close(fd);
+		}
+		return NULL;
+	}
+	*sizep = (size_t)sb.st_size;
+	if (sb.st_size == 0) {
+		close(fd);
+		return (const uint8_t *)"";
+	}
+	data = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	return data;
+#endif
+}
+
+/*
+ * Write a host file, replacing the old one atomically.
+ */
+static bool
+write_file_atomic(const char *path, const uint8_t *buf, size_t size)
+{
+	char tmp[PATH_MAX];
+	ssize_t rv;
+	int fd;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path,
+		     (long)getpid()) >= (int)sizeof(tmp)) {
+		fprintf(stderr, "%s: path too long\n", path);
+		return false;
+	}
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+	if (fd == -1) {
+		fprintf(stderr, "unable to open %s: %s\n", tmp,
+		    strerror(errno));
+		return false;
+	}
+	rv = cocofs_pwrite(fd, buf, size, 0);
+	if (rv != (ssize_t)size || fsync(fd) == -1) {
+		fprintf(stderr, "unable to write %s: %s\n", tmp,
+		    strerror(errno));
+		close(fd);
+		unlink(tmp);
+		return false;
+	}
+	close(fd);
+	if (rename(tmp, path) == -1) {
+		fprintf(stderr, "unable to rename %s: %s\n", tmp,
+		    strerror(errno));
+		unlink(tmp);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Like copyin_crunched(), with the file already read in.  Consumes
+ * data.
+ */
+static bool
+copyin_crunched_data(struct cocofs *fs, const char *infile, uint8_t *data,
+    size_t size, const char name[8], const char ext[3], uint8_t type,
+    uint8_t enc)
+{
+	uint8_t *cdata;
+	size_t csize;
+	bool rv;
+
+	if (basic_crunch(data, size, &cdata, &csize)) {
+		cocofs_print_crunch(infile, size, csize);
+		free(data);
+		data = cdata;
+		size = csize;
+	} else {
+		fprintf(stderr, "%s: not a tokenized BASIC program, "
+		    "copying as-is\n", infile);
+	}
+	rv = cocofs_copyin_data(fs, NULL, infile, data, size,
+	    name, ext, type, enc);
+	free(data);
+	return rv;
+}
+
+static bool
+copyin_crunched(struct cocofs *fs, const char *infile, const char name[8],
+    const char ext[3], uint8_t type, uint8_t enc)
+{
+	uint8_t *data;
+	size_t size;
+
+	if (! read_host_file(infile, &data, &size)) {
+		return false;
+	}
+	return copyin_crunched_data(fs, infile, data, size, name, ext,
+	    type, enc);
+}
+
+static int
+cmd_crunch(struct cocofs *fs, int argc, char *argv[])
+{
+	if (argc == 0) {
+		return usage();
+	}
+
+	struct cocofs_dirent *dir;
+	uint8_t *data, *cdata;
+	size_t size, csize;
+	int retval = EXIT_SUCCESS;
+	int i;
+	for (i = 0; i < argc; i++) {
+		dir = cocofs_lookup(fs, argv[i]);
+		if (dir == NULL) {
+			fprintf(stderr, "%s: %s\n",
+			    argv[i], strerror(ENOENT));
+			retval = EXIT_FAILURE;
+			continue;
+		}
+		if (dir->d_type != COCOFS_DIRENT_TYPE_BASIC ||
+		    dir->d_encoding != COCOFS_DIRENT_ENC_BINARY) {
+			fprintf(stderr, "%s: not a tokenized BASIC program\n",
+			    argv[i]);
+			retval = EXIT_FAILURE;
+			continue;
+		}
+		if (! cocofs_read_file(fs, dir, &data, &size)) {
+			retval = EXIT_FAILURE;
+			continue;
+		}
+		if (! basic_crunch(data, size, &cdata, &csize)) {
+			fprintf(stderr, "%s: not a tokenized BASIC program\n",
+			    argv[i]);
+			free(data);
+			retval = EXIT_FAILURE;
+			continue;
+		}
+		cocofs_print_crunch(argv[i], size, csize);
+		if (csize < size) {
+			if (! cocofs_replace(fs, dir, cdata, csize) ||
+			    ! cocofs_save(fs)) {
+				retval = EXIT_FAILURE;
+				free(data);
+				free(cdata);
+				break;
+			}
+		}
+		free(data);
+		free(cdata);
+	}
+
+	return retval;
+}
+
+static int
+cmd_pack_bin(struct cocofs *fs, int argc, char *argv[])
+{
+	if (argc == 0) {
+		return usage();
+	}
+
+	struct cocofs_dirent *dir;
+	struct loadm lm;
+	uint8_t *data, *pdata;
+	size_t size, psize;
+	unsigned int load, before, after;
+	int retval = EXIT_SUCCESS;
+	int i;
+	for (i = 0; i < argc; i++) {
+		dir = cocofs_lookup(fs, argv[i]);
+		if (dir == NULL) {
+			fprintf(stderr, "%s: %s\n",
+			    argv[i], strerror(ENOENT));
+			retval = EXIT_FAILURE;
+			continue;
+		}
+		if (dir->d_type != COCOFS_DIRENT_TYPE_CODE) {
+			fprintf(stderr, "%s: not a machine code program\n",
+			    argv[i]);
+			retval = EXIT_FAILURE;
+			continue;
+		}
+		if (! cocofs_read_file(fs, dir, &data, &size)) {
+			retval = EXIT_FAILURE;
+			continue;
+		}
+		if (! loadm_parse(data, size, &lm)) {
+			fprintf(stderr, "%s: invalid LOADM file\n", argv[i]);
+			free(data);
+			retval = EXIT_FAILURE;
+			continue;
+		}
+		if (lm.nsegs == 1 &&
+		    lm.segs[0].len >= sizeof(lz_stub_6809) &&
+		    memcmp(lm.segs[0].data, lz_stub_6809,
+			   LZ_STUB_EXEC_OFFSET) == 0) {
+			cocofs_printf("%s: already packed\n", argv[i]);
+			free(lm.segs);
+			free(data);
+			continue;
+		}
+		if (! loadm_pack(&lm, &pdata, &psize, &load)) {
+			fprintf(stderr, "%s: no room in memory for packed "
+			    "binary\n", argv[i]);
+			free(lm.segs);
+			free(data);
+			retval = EXIT_FAILURE;
+			continue;
+		}
+		free(lm.segs);
+
+		before = cocofs_size_to_granules(size);
+		after = cocofs_size_to_granules(psize);
+		if (psize >= size) {
+			cocofs_printf("%s: %zu -> %zu bytes, not packed\n",
+			    argv[i], size, psize);
+		} else {
+			cocofs_printf("%s: %zu -> %zu bytes (loads at $%04X), "
+			    "%u granule%s saved\n", argv[i], size, psize,
+			    load, before - after, plural(before - after));
+			if (! cocofs_replace(fs, dir, pdata, psize) ||
+			    ! cocofs_save(fs)) {
+				retval = EXIT_FAILURE;
+				free(pdata);
+				free(data);
+				break;
+			}
+		}
+		free(pdata);
+		free(data);
+	}
+
+	return retval;
+}
+
+static int
+cmd_age(struct cocofs *fs, int argc, char *argv[])
+{
+	const struct cocofs_allocator *alloc, *only = NULL;
+	struct age_workitem *workload = NULL;
+	struct age_stats stats;
+	unsigned long lifetimes = 1000, nops = 500, nwork = 0, seed = 1;
+	bool have_nops = false;
+	uint64_t t0;
+	uint8_t *junk;
+	char *ep;
+	int i;
+
+	for (i = 0; i < argc; i += 2) {
+		if (i + 1 == argc || argv[i][0] != '-' ||
+		    argv[i][1] == '\0' || argv[i][2] != '\0') {
+			goto usage;
+		}
+		switch (argv[i][1]) {
+		case 'n':
+			lifetimes = strtoul(argv[i + 1], &ep, 0);
+			break;
+		case 'o':
+			nops = strtoul(argv[i + 1], &ep, 0);
+			have_nops = true;
+			break;
+		case 's':
+			seed = strtoul(argv[i + 1], &ep, 0);
+			break;
+		case 'a':
+			only = cocofs_allocator_lookup(argv[i + 1]);
+			if (only == NULL) {
+				fprintf(stderr, "unknown allocator: %s\n",
+				    argv[i + 1]);
+				free(workload);
+				return EXIT_FAILURE;
+			}
+			continue;
+		case 'f':
+			free(workload);
+			workload = age_read_workload(argv[i + 1], &nwork);
+			if (workload == NULL) {
+				return EXIT_FAILURE;
+			}
+			continue;
+		default:
+			goto usage;
+		}
+		if (*ep != '\0') {
+			goto usage;
+		}
+	}
+
+	/* A workload can be cut short with -o, but not run past its end. */
+	if (workload != NULL && (! have_nops || nops > nwork)) {
+		nops = nwork;
+	}
+	if (lifetimes == 0 || nops == 0) {
+		goto usage;
+	}
+
+	junk = malloc(COCOFS_NGRANULES * COCOFS_BYTES_PER_GRANULE);
+	assert(junk != NULL);
+	for (i = 0; i < COCOFS_NGRANULES * COCOFS_BYTES_PER_GRANULE; i++) {
+		junk[i] = (uint8_t)(i * 7);
+	}
+
+	for (alloc = cocofs_allocators; alloc->name != NULL; alloc++) {
+		if (only != NULL && alloc != only) {
+			continue;
+		}
+		t0 = cocofs_now_ns();
+		age_run(fs, alloc, lifetimes, nops, workload, seed, junk,
+		    &stats);
+		age_report(alloc, &stats, lifetimes, nops,
+		    (cocofs_now_ns() - t0) / 1e9);
+	}
+
+	free(junk);
+	free(workload);
+	return EXIT_SUCCESS;
+
+ usage:
+	free(workload);
+	return usage();
+}
+
+/*
+ * Trace replay.  Re-issues the image I/O from a trace recorded with
+ * --record against scratch copies of the images, and reports the
+ * latency distribution of the recorded and replayed operations.
+ */
+struct replay_lat {
+	uint64_t	*v;
+	size_t		n;
+	size_t		cap;
+};
+
+struct replay_image {
+	char		*path;
+	char		*scratch;
+	int		fd;		/* -1 if the image is unavailable */
+};
+
+struct replay {
+	const uint8_t	*p;
+	const uint8_t	*end;
+	bool		bad;
+	struct replay_image *images;
+	unsigned int	nimages;
+	struct replay_lat lat[2][2];	/* [read/write][recorded/replayed] */
+	struct replay_lat cmds;
+	unsigned long	ncmds;
+	unsigned long	skipped;	/* I/O not replayed */
+	uint8_t		*buf;
+	size_t		bufsize;
+};
+
+static void
+replay_lat_add(struct replay_lat *l, uint64_t ns)
+{
+	if (l->n == l->cap) {
+		l->cap = l->cap ? l->cap * 2 : 1024;
+		l->v = realloc(l->v, l->cap * sizeof(*l->v));
+		assert(l->v != NULL);
+	}
+	l->v[l->n++] = ns;
+}
+
+static int
+replay_cmp_u64(const void *v1, const void *v2)
+{
+	uint64_t a = *(const uint64_t *)v1, b = *(const uint64_t *)v2;
+
+	return a < b ? -1 : a > b;
+}
+
+static void
+replay_lat_print(const char *label, struct replay_lat *l)
+{
+	static const double pct[] = { 0.50, 0.90, 0.99 };
+	unsigned int i;
+
+	printf("%-16s %8zu", label, l->n);
+	if (l->n == 0) {
+		printf("\n");
+		return;
+	}
+	qsort(l->v, l->n, sizeof(*l->v), replay_cmp_u64);
+	printf(" %10.1f", l->v[0] / 1e3);
+	for (i = 0; i < sizeof(pct) / sizeof(pct[0]); i++) {
+		printf(" %10.1f", l->v[(size_t)(pct[i] * (l->n - 1))] / 1e3);
+	}
+	printf(" %10.1f\n", l->v[l->n - 1] / 1e3);
+}
+
+static uint64_t
+replay_get_varint(struct replay *r)
+{
+	uint64_t v = 0;
+	unsigned int shift;
+
+	for (shift = 0; r->p < r->end && shift < 64; shift += 7) {
+		uint8_t b = *r->p++;
+		v |= (uint64_t)(b & 0x7f) << shift;
+		if ((b & 0x80) == 0) {
+			return v;
+		}
+	}
+	r->bad = true;
+	return 0;
+}
+
+static char *
+replay_get_string(struct replay *r)
+{
+	uint64_t len = replay_get_varint(r);
+	char *str;
+
+	if (r->bad || len > (uint64_t)(r->end - r->p)) {
+		r->bad = true;
+		return NULL;
+	}
+	str = malloc(len + 1);
+	assert(str != NULL);
+	memcpy(str, r->p, len);
+	str[len] = '\0';
+	r->p += len;
+	return str;
+}
+
+/*
+ * Find (or make) the scratch copy of the specified image.  It goes
+ * next to the image, so that it's on the same storage, under a name
+ * that can't clobber anything already there.
+ */
+static int
+replay_image_fd(struct replay *r, char *path)
+{
+	struct replay_image *ri;
+	uint8_t *data;
+	size_t size;
+	unsigned int i;
+	int fd;
+
+	for (i = 0; i < r->nimages; i++) {
+		if (strcmp(r->images[i].path, path) == 0) {
+			free(path);
+			return r->images[i].fd;
+		}
+	}
+
+	r->images = realloc(r->images, (r->nimages + 1) * sizeof(*ri));
+	assert(r->images != NULL);
+	ri = &r->images[r->nimages++];
+	ri->path = path;
+	ri->scratch = malloc(strlen(path) + sizeof(".replay.XXXXXX"));
+	assert(ri->scratch != NULL);
+	sprintf(ri->scratch, "%s.replay.XXXXXX", path);
+	ri->fd = -1;
+
+	if (! read_host_file(path, &data, &size)) {
+		free(ri->scratch);
+		ri->scratch = NULL;
+		return -1;
+	}
+	fd = mkstemp(ri->scratch);
+	if (fd == -1 || write(fd, data, size) != (ssize_t)size) {
+		fprintf(stderr, "unable to create %s: %s\n",
+		    ri->scratch, strerror(errno));
+		if (fd != -1) {
+			close(fd);
+			unlink(ri->scratch);
+		}
+		free(ri->scratch);
+		ri->scratch = NULL;
+	} else {
+		ri->fd = fd;
+	}
+	free(data);
+	return ri->fd;
+}
+
+static void
+replay_io(struct replay *r, uint8_t type, int fd)
+{
+	uint64_t target, offset, size, result, ns, t0;
+	ssize_t rv;
+
+	target = replay_get_varint(r);
+	offset = replay_get_varint(r);
+	size = replay_get_varint(r);
+	result = replay_get_varint(r);
+	ns = replay_get_varint(r);
+	if (r->bad) {
+		return;
+	}
+	replay_lat_add(&r->lat[type == REC_WRITE][0], ns);
+
+	if (target != REC_TARGET_IMAGE || fd == -1 || result == 0) {
+		r->skipped++;
+		return;
+	}
+	if (size > r->bufsize) {
+		r->buf = realloc(r->buf, size);
+		assert(r->buf != NULL);
+		memset(r->buf, 0xff, size);
+		r->bufsize = size;
+	}
+	t0 = cocofs_now_ns();
+	if (type == REC_READ) {
+		rv = cocofs_pread(fd, r->buf, size, (off_t)offset);
+	} else {
+		rv = cocofs_pwrite(fd, r->buf, size, (off_t)offset);
+	}
+	if (rv == -1) {
+		r->skipped++;
+		return;
+	}
+	replay_lat_add(&r->lat[type == REC_WRITE][1], cocofs_now_ns() - t0);
+}
+
+static bool
+replay_trace(struct replay *r)
+{
+	uint64_t argc, i;
+	int fd = -1;
+
+	if (r->end - r->p < REC_MAGIC_LEN ||
+	    memcmp(r->p, REC_MAGIC, REC_MAGIC_LEN) != 0) {
+		return false;
+	}
+	r->p += REC_MAGIC_LEN;
+
+	while (r->p < r->end && ! r->bad) {
+		switch (*r->p++) {
+		case REC_CMD:
+			fd = replay_image_fd(r, replay_get_string(r));
+			argc = replay_get_varint(r);
+			for (i = 0; i < argc && ! r->bad; i++) {
+				free(replay_get_string(r));
+			}
+			(void)replay_get_varint(r);	/* wall clock */
+			r->ncmds++;
+			break;
+
+		case REC_READ:
+		case REC_WRITE:
+			replay_io(r, r->p[-1], fd);
+			break;
+
+		case REC_END:
+			(void)replay_get_varint(r);	/* exit status */
+			replay_lat_add(&r->cmds, replay_get_varint(r));
+			break;
+
+		default:
+			r->bad = true;
+			break;
+		}
+	}
+	return ! r->bad;
+}
+
+static int
+cmd_replay(int argc, char *argv[])
+{
+	struct replay r;
+	uint8_t *data;
+	size_t size;
+	unsigned int i, j;
+	bool ok;
+
+	if (argc != 1) {
+		return usage();
+	}
+	if (! read_host_file(argv[0], &data, &size)) {
+		return EXIT_FAILURE;
+	}
+
+	memset(&r, 0, sizeof(r));
+	r.p = data;
+	r.end = data + size;
+	ok = replay_trace(&r);
+	if (! ok) {
+		fprintf(stderr, "%s: invalid trace at offset %ld\n",
+		    argv[0], (long)(r.p - data));
+	}
+
+	printf("%lu command%s, %lu I/O%s not replayed\n",
+	    r.ncmds, plural(r.ncmds), r.skipped, plural(r.skipped));
+	printf("%-16s %8s %10s %10s %10s %10s %10s  (usec)\n", "",
+	    "count", "min", "p50", "p90", "p99", "max");
+	replay_lat_print("read recorded", &r.lat[0][0]);
+	replay_lat_print("read replayed", &r.lat[0][1]);
+	replay_lat_print("write recorded", &r.lat[1][0]);
+	replay_lat_print("write replayed", &r.lat[1][1]);
+	replay_lat_print("command recorded", &r.cmds);
+
+	for (i = 0; i < r.nimages; i++) {
+		if (r.images[i].fd != -1) {
+			close(r.images[i].fd);
+			unlink(r.images[i].scratch);
+		}
+		free(r.images[i].scratch);
+		free(r.images[i].path);
+	}
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < 2; j++) {
+			free(r.lat[i][j].v);
+		}
+	}
+	free(r.cmds.v);
+	free(r.images);
+	free(r.buf);
+	free(data);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * Pipelined copyin.  With --jobs=N, N reader threads open and read the
+ * host files ahead of time (so that their latency overlaps), while the
+ * command's own thread allocates granules and fills the image strictly
+ * in argument order, just as it would have without them.  Readers stay
+ * at most COPYIN_WINDOW files per thread ahead of it.  Anything that
+ * goes wrong in a reader is left for the committer to do (and report)
+ * the ordinary way, as is --record, whose trace must stay in order.
+ */
+#define	COPYIN_WINDOW		4
+#define	COPYIN_MAXSIZE		(COCOFS_NGRANULES * COCOFS_BYTES_PER_GRANULE)
+
+struct copyin_slot {
+	uint8_t		*data;		/* NULL if the committer must read */
+	size_t		size;
+	bool		done;
+};
+
+struct copyin_pipe {
+	pthread_mutex_t	lock;
+	pthread_cond_t	cv;
+	char		**paths;
+	size_t		npaths;
+	struct copyin_slot *slots;
+	size_t		next;		/* next file to read */
+	size_t		committed;	/* files the committer is done with */
+	size_t		window;
+	bool		stop;
+};
+
+struct copyin_reader {
+	struct worker	w;
+	struct copyin_pipe *pipe;
+};
+
+static bool
+copyin_prefetch(const char *path, uint8_t **datap, size_t *sizep)
+{
+	struct stat sb;
+	uint8_t *data;
+	ssize_t rv;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_BINARY);
+	if (fd == -1) {
+		return false;
+	}
+	if (fstat(fd, &sb) == -1 || ! S_ISREG(sb.st_mode) ||
+	    sb.st_size == 0 || sb.st_size > COPYIN_MAXSIZE) {
+		close(fd);
+		return false;
+	}
+	data = malloc((size_t)sb.st_size);
+	assert(data != NULL);
+	rv = cocofs_pread(fd, data, (size_t)sb.st_size, 0);
+	close(fd);
+	if (rv != (ssize_t)sb.st_size) {
+		free(data);
+		return false;
+	}
+	*datap = data;
+	*sizep = (size_t)sb.st_size;
+	return true;
+}
+
+static void *
+copyin_reader(void *arg)
+{
+	struct copyin_reader *r = arg;
+	struct copyin_pipe *p = r->pipe;
+	struct copyin_slot *s;
+	uint64_t t0;
+	size_t i;
+
+	curworker = &r->w;
+	trace_thread_start(&r->w);
+	metrics_thread_start(&r->w);
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		while (! p->stop && p->next < p->npaths &&
+		       p->next >= p->committed + p->window) {
+			pthread_cond_wait(&p->cv, &p->lock);
+		}
+		if (p->stop || p->next >= p->npaths) {
+			break;
+		}
+		i = p->next++;
+		pthread_mutex_unlock(&p->lock);
+
+		s = &p->slots[i];
+		t0 = trace_begin();
+		if (! copyin_prefetch(p->paths[i], &s->data, &s->size)) {
+			s->data = NULL;
+		}
+		trace_span("prefetch", t0, p->paths[i]);
+
+		pthread_mutex_lock(&p->lock);
+		s->done = true;
+		pthread_cond_broadcast(&p->cv);
+	}
+	pthread_mutex_unlock(&p->lock);
+	trace_thread_done(&r->w);
+	return NULL;
+}
+
+/*
+ * Wait for a file to be read, and take its contents.
+ */
+static uint8_t *
+copyin_pipe_take(struct copyin_pipe *p, size_t i, size_t *sizep)
+{
+	uint8_t *data;
+
+	pthread_mutex_lock(&p->lock);
+	while (! p->slots[i].done) {
+		pthread_cond_wait(&p->cv, &p->lock);
+	}
+	data = p->slots[i].data;
+	*sizep = p->slots[i].size;
+	p->slots[i].data = NULL;
+	pthread_mutex_unlock(&p->lock);
+	return data;
+}
+
+static void
+copyin_pipe_advance(struct copyin_pipe *p, size_t committed, bool stop)
+{
+	pthread_mutex_lock(&p->lock);
+	p->committed = committed;
+	p->stop = stop;
+	pthread_cond_broadcast(&p->cv);
+	pthread_mutex_unlock(&p->lock);
+}
+
+static int
+cmd_copyin(struct cocofs *fs, int argc, char *argv[])
+{
+	if (argc == 0) {
+		return usage();
+	}
+
+	struct cocofs_dirent *dir;
+	struct copyin_pipe cpipe;
+	struct copyin_reader *readers = NULL;
+	unsigned int nreaders = 0, r;
+	char name[8], ext[3];
+	uint8_t type, enc;
+	uint8_t *data = NULL;
+	size_t size;
+	bool crunch, ok;
+	int retval = EXIT_SUCCESS;
+	int i;
+
+	/* (A scan already runs images in parallel.) */
+	if (opts.jobs > 1 && argc > 1 && opts.record == NULL && ! fs->batch) {
+		memset(&cpipe, 0, sizeof(cpipe));
+		pthread_mutex_init(&cpipe.lock, NULL);
+		pthread_cond_init(&cpipe.cv, NULL);
+		cpipe.paths = argv;
+		cpipe.npaths = argc;
+		cpipe.slots = calloc(argc, sizeof(*cpipe.slots));
+		assert(cpipe.slots != NULL);
+		cpipe.window = (size_t)opts.jobs * COPYIN_WINDOW;
+		readers = calloc(opts.jobs, sizeof(*readers));
+		assert(readers != NULL);
+		for (r = 0; r < opts.jobs; r++) {
+			readers[r].w.id = r + 1;
+			readers[r].w.image_fd = -1;
+			readers[r].pipe = &cpipe;
+			if (pthread_create(&readers[r].w.thread, NULL,
+					   copyin_reader, &readers[r]) != 0) {
+				break;
+			}
+			nreaders++;
+		}
+		if (nreaders == 0) {
+			/* Just do it the ordinary way. */
+			free(readers);
+			free(cpipe.slots);
+			readers = NULL;
+		}
+	}
+
+	for (i = 0; i < argc; i++) {
+		if (readers != NULL) {
+			data = copyin_pipe_take(&cpipe, i, &size);
+		}
+		if (! cocofs_parse_fname(argv[i], name, ext, &type, &enc)) {
+			/* Error message already displayed. */
+			retval = EXIT_FAILURE;
+			goto next;
+		}
+
+		/* Make sure this file does not already exist. */
+		dir = cocofs_lookup_raw(fs, name, ext);
+		if (dir != NULL) {
+			fprintf(stderr, "%s: %s\n", argv[i], strerror(EEXIST));
+			retval = EXIT_FAILURE;
+			goto next;
+		}
+		crunch = opts.crunch && type == COCOFS_DIRENT_TYPE_BASIC &&
+		    enc == COCOFS_DIRENT_ENC_BINARY;
+		if (data != NULL) {
+			ok = crunch ? copyin_crunched_data(fs, argv[i], data,
+							   size, name, ext,
+							   type, enc)
+				    : cocofs_copyin_data(fs, NULL, argv[i],
+							 data, size, name,
+							 ext, type, enc);
+			if (! crunch) {
+				free(data);
+			}
+			data = NULL;
+			if (! ok) {
+				retval = EXIT_FAILURE;
+				break;
+			}
+		} else if (crunch) {
+			if (! copyin_crunched(fs, argv[i], name, ext,
+					      type, enc)) {
+				retval = EXIT_FAILURE;
+				break;
+			}
+		} else if (! cocofs_copyin(fs, argv[i], name, ext, type, enc)) {
+			retval = EXIT_FAILURE;
+			break;
+		}
+		if (! cocofs_save(fs)) {
+			retval = EXIT_FAILURE;
+			break;
+		}
+ next:
+		free(data);
+		data = NULL;
+		if (readers != NULL) {
+			copyin_pipe_advance(&cpipe, i + 1, false);
+		}
+	}
+
+	if (readers != NULL) {
+		copyin_pipe_advance(&cpipe, i, true);
+		for (r = 0; r < nreaders; r++) {
+			pthread_join(readers[r].w.thread, NULL);
+		}
+		for (i = 0; i < argc; i++) {
+			free(cpipe.slots[i].data);
+		}
+		free(cpipe.slots);
+		free(readers);
+		pthread_cond_destroy(&cpipe.cv);
+		pthread_mutex_destroy(&cpipe.lock);
+	}
+	return retval;
+}
+
+/*
+ * Copy a file within the image.  The copy gets the same type and
+ * encoding as the original unless others are given for it.
+ */
+static int
+cmd_cp(struct cocofs *fs, int argc, char *argv[])
+{
+	struct cocofs_dirent *dir;
+	char name[8], ext[3];
+	uint8_t type, enc, *data;
+	size_t size;
+	bool qualified;
+	int retval = EXIT_SUCCESS;
+
+	if (argc != 2) {
+		return usage();
+	}
+
+	dir = cocofs_lookup(fs, argv[0]);
+	if (dir == NULL) {
+		fprintf(stderr, "%s: %s\n", argv[0], strerror(ENOENT));
+		return EXIT_FAILURE;
+	}
+	qualified = strchr(argv[1], '[') != NULL;
+	if (! cocofs_parse_fname(argv[1], name, ext, &type, &enc)) {
+		/* Error message already displayed. */
+		return EXIT_FAILURE;
+	}
+	if (! qualified) {
+		type = dir->d_type;
+		enc = dir->d_encoding;
+	}
+	if (cocofs_lookup_raw(fs, name, ext) != NULL) {
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(EEXIST));
+		return EXIT_FAILURE;
+	}
+
+	if (! cocofs_read_file(fs, dir, &data, &size)) {
+		return EXIT_FAILURE;
+	}
+	if (! cocofs_copyin_data(fs, NULL, argv[1], data, size, name, ext,
+				 type, enc) ||
+	    ! cocofs_save(fs)) {
+		retval = EXIT_FAILURE;
+	}
+	free(data);
+	return retval;
+}
+
+static int
+cmd_scrub(struct cocofs *fs, int argc, char *argv[])
+{
+	struct cocofs_scrub_stats stats;
+	unsigned long before, after;
+	unsigned int total;
+	int slack_fill = 0x00;
+	char *ep;
+
+	if (argc > 1) {
+		return usage();
+	}
+	if (argc == 1) {
+		if (strcmp(argv[0], "keep") == 0) {
+			slack_fill = -1;
+		} else {
+			unsigned long v = strtoul(argv[0], &ep, 0);
+			if (*argv[0] == '\0' || *ep != '\0' || v > 0xff) {
+				fprintf(stderr, "invalid slack fill: %s\n",
+				    argv[0]);
+				return EXIT_FAILURE;
+			}
+			slack_fill = (int)v;
+		}
+	}
+
+	before = cocofs_estimate_compressed_size(fs);
+	cocofs_scrub(fs, slack_fill, &stats);
+	after = cocofs_estimate_compressed_size(fs);
+
+	total = stats.free_bytes + stats.slack_bytes;
+	cocofs_printf("%u byte%s scrubbed "
+	    "(%u in free granules, %u in file slack)\n",
+	    total, plural(total), stats.free_bytes, stats.slack_bytes);
+	cocofs_printf("estimated compressed size %lu -> %lu bytes "
+	    "(%.1f%% smaller)\n", before, after,
+	    before ? 100.0 * ((double)before - (double)after) / before : 0.0);
+
+	if (total == 0 && ! fs->shrink) {
+		return EXIT_SUCCESS;
+	}
+	return cocofs_save(fs) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * Read a usage manifest for sortdir.  Each line contains a file name,
+ * optionally preceded by a use count.  Files with higher counts sort
+ * first; files without counts sort in the order listed, after those
+ * with counts.
+ */
+static bool
+sortdir_read_manifest(const char *path, struct cocofs_sortent *ents,
+    unsigned int n)
+{
+	char line[256], fname[64];
+	unsigned long count;
+	long lineno = 0;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "unable to open %s: %s\n",
+		    path, strerror(errno));
+		return false;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		if (sscanf(line, "%lu %63s", &count, fname) == 2) {
+			if (count > LONG_MAX / 2) {
+				count = LONG_MAX / 2;
+			}
+			/* Higher counts sort first. */
+			(void)cocofs_sortdir_rank(ents, n, fname,
+			    -(long)count);
+		} else if (sscanf(line, "%63s", fname) == 1 &&
+			   fname[0] != '#') {
+			(void)cocofs_sortdir_rank(ents, n, fname, lineno);
+		}
+	}
+	fclose(fp);
+	return true;
+}
+
+static int
+cmd_sortdir(struct cocofs *fs, int argc, char *argv[])
+{
+	struct cocofs_sortent ents[COCOFS_DIR_TRACK_NENTRIES];
+	int (*cmp)(const void *, const void *) = cocofs_sortent_cmp_key;
+	unsigned int n, changed;
+	int retval = EXIT_SUCCESS;
+	int i;
+
+	n = cocofs_sortdir_gather(fs, ents);
+
+	if (argc == 0) {
+		/* Just compact the free entries to the end. */
+	} else if (strcmp(argv[0], "name") == 0) {
+		if (argc != 1) {
+			return usage();
+		}
+		cmp = cocofs_sortent_cmp_name;
+	} else if (strcmp(argv[0], "manifest") == 0) {
+		if (argc != 2) {
+			return usage();
+		}
+		if (! sortdir_read_manifest(argv[1], ents, n)) {
+			return EXIT_FAILURE;
+		}
+	} else if (strcmp(argv[0], "order") == 0) {
+		if (argc < 2) {
+			return usage();
+		}
+		for (i = 1; i < argc; i++) {
+			if (! cocofs_sortdir_rank(ents, n, argv[i], i)) {
+				fprintf(stderr, "%s: %s\n",
+				    argv[i], strerror(ENOENT));
+				retval = EXIT_FAILURE;
+			}
+		}
+	} else {
+		return usage();
+	}
+
+	qsort(ents, n, sizeof(ents[0]), cmp);
+	changed = cocofs_sortdir_apply(fs, ents, n);
+	if (changed != 0 && ! cocofs_save(fs)) {
+		retval = EXIT_FAILURE;
+	}
+	return retval;
+}
+
+/*
+ * Known-software identification.  mkiddb compiles a curated list of
+ * titles into a database of file content hashes, and identify looks
+ * up every file in an image in it.
+ *
+ * The database is meant to be mapped, not loaded: a minimal perfect
+ * hash (hash-and-displace) takes a file's 64-bit FNV-1a hash straight
+ * to the one entry it could match.  Keys are split into buckets, and
+ * each bucket has a seed, chosen when the database is built, that
+ * sends all of its keys to free entries.  A lookup is a seed and an
+ * entry, and it neither allocates nor searches.
+ */
+#define	IDDB_MAGIC		"CIDDB01"	/* 8 bytes with the NUL */
+#define	IDDB_HDRSIZE		48
+#define	IDDB_ENTSIZE		24
+#define	IDDB_KEYS_PER_BUCKET	4
+#define	IDDB_MAXTRIES		(1U << 24)	/* per bucket, per salt */
+
+/* header */
+#define	IDDB_H_NKEYS		8		/* u32 */
+#define	IDDB_H_NBUCKETS		12		/* u32 */
+#define	IDDB_H_SALT		16		/* u64 */
+#define	IDDB_H_SEEDS		24		/* u64 offset */
+#define	IDDB_H_ENTRIES		32		/* u64 offset */
+#define	IDDB_H_STRINGS		40		/* u64 offset */
+
+/* entry */
+#define	IDDB_E_HASH		0		/* u64 FNV-1a of contents */
+#define	IDDB_E_SIZE		8		/* u32 */
+#define	IDDB_E_TITLE		12		/* u32 string offset */
+#define	IDDB_E_VERSION		16		/* u32 string offset */
+#define	IDDB_E_NAME		20		/* u32 string offset */
+
+static uint32_t
+iddb_bucket(uint64_t hash, uint64_t salt, uint32_t nbuckets)
+{
+	return (uint32_t)(hash_mix64(hash ^ salt) % nbuckets);
+}
+
+static uint32_t
+iddb_slot(uint64_t hash, uint64_t salt, uint32_t seed, uint32_t nkeys)
+{
+	return (uint32_t)(hash_mix64(hash + salt +
+	    (seed + 1ULL) * 0x9e3779b97f4a7c15ULL) % nkeys);
+}
+
+static struct {
+	char		*path;
+	const uint8_t	*base;
+	size_t		size;
+	pthread_mutex_t	lock;
+} iddb = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/*
+ * Map a database (once; a scan runs identify on every image with the
+ * same one) and check that everything in it is where it should be.
+ */
+static const uint8_t *
+iddb_open(const char *path, size_t *sizep)
+{
+	const uint8_t *base;
+	uint64_t nkeys, nbuckets, seeds, entries, strings;
+	size_t size;
+
+	pthread_mutex_lock(&iddb.lock);
+	if (iddb.path != NULL && strcmp(iddb.path, path) == 0) {
+		base = iddb.base;
+		size = iddb.size;
+		goto out;
+	}
+	base = cocofs_map_file(path, &size);
+	if (base == NULL) {
+		goto out;
+	}
+	if (size < IDDB_HDRSIZE ||
+	    memcmp(base, IDDB_MAGIC, sizeof(IDDB_MAGIC)) != 0) {
+		goto bad;
+	}
+	nkeys = cocofs_le32dec(base + IDDB_H_NKEYS);
+	nbuckets = cocofs_le32dec(base + IDDB_H_NBUCKETS);
+	seeds = cocofs_le64dec(base + IDDB_H_SEEDS);
+	entries = cocofs_le64dec(base + IDDB_H_ENTRIES);
+	strings = cocofs_le64dec(base + IDDB_H_STRINGS);
+	if ((nkeys != 0 && nbuckets == 0) ||
+	    seeds > size || nbuckets * 4 > size - seeds ||
+	    entries > size || nkeys * IDDB_ENTSIZE > size - entries ||
+	    strings >= size || base[size - 1] != '\0') {
+		goto bad;
+	}
+	free(iddb.path);
+	iddb.path = strdup(path);
+	assert(iddb.path != NULL);
+	iddb.base = base;
+	iddb.size = size;
+ out:
+	pthread_mutex_unlock(&iddb.lock);
+	*sizep = size;
+	return base;
+ bad:
+	pthread_mutex_unlock(&iddb.lock);
+	fprintf(stderr, "%s: not an identification database\n", path);
+	return NULL;
+}
+
+static const char *
+iddb_string(const uint8_t *base, size_t size, const uint8_t *ref)
+{
+	uint64_t off = cocofs_le64dec(base + IDDB_H_STRINGS) +
+	    cocofs_le32dec(ref);
+
+	return off < size ? (const char *)base + off : "";
+}
+
+/*
+ * Returns the entry for a file's contents, or NULL if they're unknown.
+ */
+static const uint8_t *
+iddb_lookup(const uint8_t *base, uint64_t hash, uint32_t size)
+{
+	uint32_t nkeys = cocofs_le32dec(base + IDDB_H_NKEYS);
+	uint32_t nbuckets = cocofs_le32dec(base + IDDB_H_NBUCKETS);
+	uint64_t salt = cocofs_le64dec(base + IDDB_H_SALT);
+	const uint8_t *ent;
+	uint32_t b, seed;
+
+	if (nkeys == 0) {
+		return NULL;
+	}
+	b = iddb_bucket(hash, salt, nbuckets);
+	seed = cocofs_le32dec(base + cocofs_le64dec(base + IDDB_H_SEEDS) +
+	    (size_t)b * 4);
+	ent = base + cocofs_le64dec(base + IDDB_H_ENTRIES) +
+	    (size_t)iddb_slot(hash, salt, seed, nkeys) * IDDB_ENTSIZE;
+	if (cocofs_le64dec(ent + IDDB_E_HASH) != hash ||
+	    cocofs_le32dec(ent + IDDB_E_SIZE) != size) {
+		return NULL;
+	}
+	return ent;
+}
+
+static int
+cmd_identify(struct cocofs *fs, int argc, char *argv[])
+{
+	const struct cocofs_dirent *dir;
+	struct cocofs_stat st;
+	const uint8_t *base, *ent;
+	char name[8+1+3+1];
+	unsigned int di, nfiles = 0, nknown = 0;
+	uint64_t hash;
+	size_t size;
+
+	if (argc != 1) {
+		return usage();
+	}
+	base = iddb_open(argv[0], &size);
+	if (base == NULL) {
+		return EXIT_FAILURE;
+	}
+
+	for (di = 0; di < COCOFS_DIR_TRACK_NENTRIES; di++) {
+		dir = &fs->directory[di];
+		if (! cocofs_dirent_is_file(dir)) {
+			continue;
+		}
+		nfiles++;
+		cocofs_stat(fs, dir, &st);
+		snprintf(name, sizeof(name), "%s%s%s", st.st_name,
+		    st.st_ext[0] != '\0' ? "." : "", st.st_ext);
+		if (! cocofs_hash_file(fs, dir, st.st_size, &hash, NULL,
+				       NULL)) {
+			cocofs_printf("  %-12s (invalid granule chain)\n",
+			    name);
+			continue;
+		}
+		ent = iddb_lookup(base, hash, st.st_size);
+		if (ent == NULL) {
+			cocofs_printf("  %-12s unknown %016" PRIx64 "\n",
+			    name, hash);
+			continue;
+		}
+		nknown++;
+		cocofs_printf("  %-12s %s %s (%s)\n", name,
+		    iddb_string(base, size, ent + IDDB_E_TITLE),
+		    iddb_string(base, size, ent + IDDB_E_VERSION),
+		    iddb_string(base, size, ent + IDDB_E_NAME));
+	}
+	cocofs_printf("\n%u of %u file%s identified\n", nknown, nfiles,
+	    plural(nfiles));
+	return EXIT_SUCCESS;
+}
+
+const struct {
+	const char *verb;
+	int oflags;
+	int (*func)(struct cocofs *, int, char *[]);
+} cmdtab[] = {
+	{
+		"dump",
+		O_RDONLY,
+		cmd_dump,
+	},
+	{
+		"ls",
+		O_RDONLY,
+		cmd_ls,
+	},
+	{
+		"rm",
+		O_RDWR,
+		cmd_rm,
+	},
+	{
+		"format",
+		O_WRONLY | O_CREAT | O_TRUNC,
+		cmd_format,
+	},
+	{
+		"copyout",
+		O_RDONLY,
+		cmd_copyout,
+	},
+	{
+		"copyin",
+		O_RDWR,
+		cmd_copyin,
+	},
+	{
+		"cp",
+		O_RDWR,
+		cmd_cp,
+	},
+	{
+		"scrub",
+		O_RDWR,
+		cmd_scrub,
+	},
+	{
+		"sortdir",
+		O_RDWR,
+		cmd_sortdir,
+	},
+	{
+		"crunch",
+		O_RDWR,
+		cmd_crunch,
+	},
+	{
+		"pack-bin",
+		O_RDWR,
+		cmd_pack_bin,
+	},
+	{
+		"age",
+		O_RDONLY,
+		cmd_age,
+	},
+	{
+		"identify",
+		O_RDONLY,
+		cmd_identify,
+	},
+
+	{
+		NULL,
+		0,
+		NULL,
+	}
+};
+
+/*
+ * Sum up all of the metrics shards and write them out in the Prometheus
+ * text format.
+ */
+static void
+metrics_format(FILE *fp)
+{
+	struct metrics_shard total, *ms;
+	struct metric_hist *h;
+	const char *prev = NULL;
+	uint64_t cum;
+	unsigned int m, v, i;
+
+	memset(&total, 0, sizeof(total));
+	pthread_mutex_lock(&metrics.lock);
+	for (ms = metrics.shards; ms != NULL; ms = ms->next) {
+		for (m = 0; m < METRIC_NCOUNTERS; m++) {
+			total.counter[m] += atomic_load_explicit(
+			    &ms->counter[m], memory_order_relaxed);
+		}
+		for (v = 0; v < METRIC_MAXVERBS; v++) {
+			h = &ms->verb[v];
+			total.verb[v].count += atomic_load_explicit(
+			    &h->count, memory_order_relaxed);
+			total.verb[v].sum_ns += atomic_load_explicit(
+			    &h->sum_ns, memory_order_relaxed);
+			for (i = 0; i < METRIC_NBUCKETS; i++) {
+				total.verb[v].bucket[i] += atomic_load_explicit(
+				    &h->bucket[i], memory_order_relaxed);
+			}
+		}
+	}
+	pthread_mutex_unlock(&metrics.lock);
+
+	for (m = 0; m < METRIC_NCOUNTERS; m++) {
+		if (prev == NULL ||
+		    strcmp(prev, metric_counters[m].name) != 0) {
+			prev = metric_counters[m].name;
+			fprintf(fp, "# HELP %s %s\n# TYPE %s counter\n",
+			    prev, metric_counters[m].help, prev);
+		}
+		if (metric_counters[m].labels != NULL) {
+			fprintf(fp, "%s{%s} %" PRIu64 "\n", prev,
+			    metric_counters[m].labels, total.counter[m]);
+		} else {
+			fprintf(fp, "%s %" PRIu64 "\n", prev,
+			    total.counter[m]);
+		}
+	}
+
+	fprintf(fp, "# HELP cocofs_command_duration_seconds "
+	    "Time spent running each command on an image.\n"
+	    "# TYPE cocofs_command_duration_seconds histogram\n");
+	for (v = 0; v < METRIC_MAXVERBS && cmdtab[v].verb != NULL; v++) {
+		h = &total.verb[v];
+		if (h->count == 0) {
+			continue;
+		}
+		for (i = 0, cum = 0; i < METRIC_NBUCKETS; i++) {
+			cum += h->bucket[i];
+			fprintf(fp, "cocofs_command_duration_seconds_bucket"
+			    "{verb=\"%s\",le=\"%g\"} %" PRIu64 "\n",
+			    cmdtab[v].verb, metric_buckets[i] / 1e9, cum);
+		}
+		fprintf(fp, "cocofs_command_duration_seconds_bucket"
+		    "{verb=\"%s\",le=\"+Inf\"} %" PRIu64 "\n",
+		    cmdtab[v].verb, (uint64_t)h->count);
+		fprintf(fp, "cocofs_command_duration_seconds_sum"
+		    "{verb=\"%s\"} %.9f\n", cmdtab[v].verb, h->sum_ns / 1e9);
+		fprintf(fp, "cocofs_command_duration_seconds_count"
+		    "{verb=\"%s\"} %" PRIu64 "\n",
+		    cmdtab[v].verb, (uint64_t)h->count);
+	}
+}
+
+/*
+ * Write the metrics to the --metrics textfile.  The file is replaced
+ * atomically, so a collector never sees a partial scrape.
+ */
+static bool
+metrics_write_file(const char *path)
+{
+	char tmp[PATH_MAX];
+	FILE *fp;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path,
+		     (long)getpid()) >= (int)sizeof(tmp)) {
+		fprintf(stderr, "%s: path too long\n", path);
+		return false;
+	}
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "unable to open %s: %s\n", tmp,
+		    strerror(errno));
+		return false;
+	}
+	metrics_format(fp);
+	if (fclose(fp) == EOF) {
+		fprintf(stderr, "unable to write %s: %s\n", tmp,
+		    strerror(errno));
+		unlink(tmp);
+		return false;
+	}
+	if (rename(tmp, path) == -1) {
+		fprintf(stderr, "unable to rename %s: %s\n", tmp,
+		    strerror(errno));
+		unlink(tmp);
+		return false;
+	}
+	return true;
+}
+
+static struct {
+	pthread_t	thread;
+	pthread_mutex_t	lock;
+	pthread_cond_t	cv;
+	bool		stop;
+} metrics_dumper = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cv = PTHREAD_COND_INITIALIZER,
+};
+
+static void *
+metrics_dumper_thread(void *arg)
+{
+	struct timespec ts;
+
+	(void)arg;
+	pthread_mutex_lock(&metrics_dumper.lock);
+	while (! metrics_dumper.stop) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += opts.metrics_interval;
+		if (pthread_cond_timedwait(&metrics_dumper.cv,
+			&metrics_dumper.lock, &ts) == ETIMEDOUT) {
+			metrics_write_file(opts.metrics);
+		}
+	}
+	pthread_mutex_unlock(&metrics_dumper.lock);
+	return NULL;
+}
+
+static void
+metrics_start(void)
+{
+	metrics.enabled = true;
+	metrics_thread_start(&mainworker);
+	if (pthread_create(&metrics_dumper.thread, NULL,
+			   metrics_dumper_thread, NULL) != 0) {
+		fprintf(stderr, "unable to start metrics thread\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void
+metrics_stop(void)
+{
+	if (! metrics.enabled) {
+		return;
+	}
+	pthread_mutex_lock(&metrics_dumper.lock);
+	metrics_dumper.stop = true;
+	pthread_cond_signal(&metrics_dumper.cv);
+	pthread_mutex_unlock(&metrics_dumper.lock);
+	pthread_join(metrics_dumper.thread, NULL);
+
+	metrics_write_file(opts.metrics);
+}
+
+/*
+ * Scan progress journal (--journal).  After a scanned image's output
+ * has been written, a record of the image's ID (a hash of its path)
+ * and the end offset of the output file is appended to the journal.
+ * Records are batched up and written out (after syncing the output)
+ * every JOURNAL_INTERVAL or JOURNAL_BATCH images, whichever comes
+ * first.  With --resume, the output is cut back to the last journaled
+ * offset and the images already listed in the journal are skipped.
+ *
+ * The journal starts with a 16-byte header (magic plus a hash of the
+ * directory or list file being scanned and the command being run, so
+ * a journal isn't resumed by a different job);
+ * each record is two little-endian 64-bit words.
+ */
+#define	JOURNAL_MAGIC		"CCJ1"
+#define	JOURNAL_HDRSIZE		16
+#define	JOURNAL_RECSIZE		16
+#define	JOURNAL_BATCH		256
+#define	JOURNAL_INTERVAL	1000000000ULL	/* 1 second */
+
+static struct {
+	int		fd;		/* journal, or -1 */
+	uint64_t	*done;		/* sorted IDs from the journal */
+	size_t		ndone;
+	off_t		resume_offset;	/* output size to resume from */
+	uint64_t	last_sync;	/* time of last checkpoint */
+	size_t		len;		/* pending records */
+	uint8_t		buf[JOURNAL_BATCH * JOURNAL_RECSIZE];
+} journal = { .fd = -1 };
+
+static uint64_t
+journal_image_id(const char *path)
+{
+	return fnv1a_64(path, strlen(path), FNV1A_64_INIT);
+}
+
+static uint64_t
+journal_command_id(const char *root, int argc, char *argv[])
+{
+	uint64_t h;
+	int i;
+
+	h = fnv1a_64(root, strlen(root) + 1, FNV1A_64_INIT);
+	for (i = 0; i < argc; i++) {
+		h = fnv1a_64(argv[i], strlen(argv[i]) + 1, h);
+	}
+	return h;
+}
+
+static int
+journal_compare(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static bool
+journal_is_done(const char *path)
+{
+	uint64_t id = journal_image_id(path);
+
+	return journal.ndone != 0 &&
+	    bsearch(&id, journal.done, journal.ndone, sizeof(id),
+		    journal_compare) != NULL;
+}
+
+/*
+ * Open the journal.  When resuming, load the IDs of the images that
+ * were already done and drop any torn record at the end.
+ */
+static bool
+journal_open(const char *path, bool resume, const char *root, int argc,
+    char *argv[])
+{
+	uint8_t hdr[JOURNAL_HDRSIZE], rec[JOURNAL_RECSIZE];
+	uint64_t cmdid = journal_command_id(root, argc, argv);
+	off_t end;
+	ssize_t rv;
+	size_t i;
+
+	journal.fd = open(path, O_RDWR | O_CREAT | O_BINARY |
+	    (resume ? 0 : O_TRUNC), 0644);
+	if (journal.fd == -1) {
+		fprintf(stderr, "unable to open journal %s: %s\n",
+		    path, strerror(errno));
+		return false;
+	}
+
+	rv = cocofs_pread(journal.fd, hdr, sizeof(hdr), 0);
+	if (rv == 0) {
+		memcpy(hdr, JOURNAL_MAGIC, 4);
+		memset(hdr + 4, 0, 4);
+		cocofs_le64enc(hdr + 8, cmdid);
+		if (cocofs_pwrite(journal.fd, hdr, sizeof(hdr), 0) !=
+		    sizeof(hdr)) {
+			fprintf(stderr, "unable to write journal %s: %s\n",
+			    path, strerror(errno));
+			return false;
+		}
+		journal.last_sync = cocofs_now_ns();
+		return true;
+	}
+	if (rv != sizeof(hdr) || memcmp(hdr, JOURNAL_MAGIC, 4) != 0) {
+		fprintf(stderr, "%s: not a scan journal\n", path);
+		return false;
+	}
+	if (cocofs_le64dec(hdr + 8) != cmdid) {
+		fprintf(stderr, "%s: journal is for a different command\n",
+		    path);
+		return false;
+	}
+
+	end = lseek(journal.fd, 0, SEEK_END);
+	journal.ndone = (end - JOURNAL_HDRSIZE) / JOURNAL_RECSIZE;
+	end = JOURNAL_HDRSIZE + (off_t)journal.ndone * JOURNAL_RECSIZE;
+	journal.done = calloc(journal.ndone ? journal.ndone : 1,
+	    sizeof(*journal.done));
+	assert(journal.done != NULL);
+	for (i = 0; i < journal.ndone; i++) {
+		if (cocofs_pread(journal.fd, rec, sizeof(rec),
+				 JOURNAL_HDRSIZE + (off_t)i * JOURNAL_RECSIZE)
+		    != sizeof(rec)) {
+			fprintf(stderr, "unable to read journal %s: %s\n",
+			    path, strerror(errno));
+			return false;
+		}
+		journal.done[i] = cocofs_le64dec(rec);
+		journal.resume_offset = (off_t)cocofs_le64dec(rec + 8);
+	}
+	qsort(journal.done, journal.ndone, sizeof(*journal.done),
+	    journal_compare);
+	if (ftruncate(journal.fd, end) == -1) {
+		fprintf(stderr, "unable to truncate journal %s: %s\n",
+		    path, strerror(errno));
+		return false;
+	}
+	journal.last_sync = cocofs_now_ns();
+	return true;
+}
+
+/*
+ * Make the output durable, then the journal records describing it.
+ * Called with output_lock held.
+ */
+static void
+journal_checkpoint(void)
+{
+	off_t end;
+
+	if (journal.fd == -1 || journal.len == 0) {
+		return;
+	}
+	fflush(stdout);
+	fsync(STDOUT_FILENO);
+
+	end = lseek(journal.fd, 0, SEEK_END);
+	if (cocofs_pwrite(journal.fd, journal.buf, journal.len, end) !=
+	    (ssize_t)journal.len || fsync(journal.fd) == -1) {
+		fprintf(stderr, "unable to write journal: %s\n",
+		    strerror(errno));
+	}
+	journal.len = 0;
+	journal.last_sync = cocofs_now_ns();
+}
+
+/*
+ * Note that an image's output is complete.  Called with output_lock
+ * held, right after the output has been flushed.
+ */
+static void
+journal_image_done(const char *path)
+{
+	off_t offset = ftello(stdout);
+
+	cocofs_le64enc(journal.buf + journal.len, journal_image_id(path));
+	cocofs_le64enc(journal.buf + journal.len + 8, (uint64_t)offset);
+	journal.len += JOURNAL_RECSIZE;
+
+	if (journal.len == sizeof(journal.buf) ||
+	    cocofs_now_ns() - journal.last_sync >= JOURNAL_INTERVAL) {
+		journal_checkpoint();
+	}
+}
+
+/*
+ * HDB-DOS hard disk images.  HDB-DOS keeps a run of RS-DOS disks
+ * (each COCOFS_TOTALSIZE bytes, in 256-byte sectors) back to back,
+ * starting at some offset into the hard disk; typically an OS-9
+ * partition comes first.  --hdb-drive selects one of those disks, at
+ * the offset given with --hdb-offset or found by hdb_scan().
+ *
+ * hdb_scan() reads the whole image once, sequentially.  Every sector
+ * that looks like a Granule Map followed by a directory sector marks
+ * a possible disk starting 307 sectors earlier.  A Granule Map with
+ * something allocated in it is also a vote for where the disks are;
+ * since they're back to back, the votes are tallied by position
+ * modulo the disk size.  (An empty disk looks like that everywhere, so
+ * it doesn't get a vote.)  A pair of sectors that's all 0xff isn't a
+ * hit at all: that's what erased, never-written space looks like too.
+ * If the OS-9 LSN0 is sane, the end of the OS-9 partition (DD.TOT)
+ * gets the benefit of the doubt; otherwise the disks start with the
+ * first one found in the winning position (less any empty disks right
+ * before it, as long as they're not just erased space).
+ */
+#define	HDB_NSECTORS		COCOFS_NSECTORS
+#define	HDB_GMAP_LSN							\
+	(COCOFS_DIR_TRACK * COCOFS_SEC_PER_TRACK + GMAP_SECTOR - 1)
+#define	HDB_CHUNK		(1024 * 1024)
+
+struct hdb_scan {
+	off_t		image_size;
+	off_t		os9_size;	/* 0 if no sane OS-9 LSN0 */
+	bool		found;
+	off_t		offset;		/* start of the first disk */
+	const char	*source;	/* how we found it */
+	uint8_t		*hits;		/* bitmap of possible disks, by LSN */
+};
+
+static bool
+hdb_hit(const struct hdb_scan *hs, off_t base)
+{
+	off_t lsn = base / COCOFS_BYTES_PER_SEC;
+
+	return (hs->hits[lsn >> 3] & (1U << (lsn & 7))) != 0;
+}
+
+/*
+ * Does this sector look like a Granule Map?  Most sectors don't, and
+ * fail on the first byte or two.  Returns the number of allocated
+ * granules, or -1.
+ */
+static int
+hdb_gmap_check(const uint8_t *sec)
+{
+	unsigned int i;
+	int nalloc = 0;
+
+	for (i = 0; i < COCOFS_NGRANULES; i++) {
+		if (! gmap_entry_is_valid(sec[i]) || sec[i] == i) {
+			return -1;
+		}
+		nalloc += sec[i] != GMAP_FREE;
+	}
+	return nalloc;
+}
+
+static bool
+hdb_is_erased(const uint8_t *sec)
+{
+	unsigned int i;
+
+	for (i = 0; i < COCOFS_BYTES_PER_SEC; i++) {
+		if (sec[i] != 0xff) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool
+hdb_is_dirsec(const uint8_t *sec)
+{
+	const struct cocofs_dirent *dir = (const struct cocofs_dirent *)sec;
+	unsigned int i;
+
+	for (i = 0; i < COCOFS_BYTES_PER_SEC / sizeof(*dir); i++, dir++) {
+		if ((uint8_t)dir->d_name[0] == 0xff) {
+			break;		/* end of directory */
+		}
+		if (dir->d_name[0] == 0) {
+			continue;	/* deleted */
+		}
+		if (dir->d_type > COCOFS_DIRENT_TYPE_TEXT ||
+		    (dir->d_encoding != COCOFS_DIRENT_ENC_BINARY &&
+		     dir->d_encoding != COCOFS_DIRENT_ENC_ASCII) ||
+		    dir->d_first_granule >= COCOFS_NGRANULES) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * OS-9 LSN0: DD.TOT (3 bytes), DD.TKS, DD.MAP (2), DD.BIT (2).  Returns
+ * the size of the OS-9 partition, or 0 if it doesn't look like one.
+ */
+static off_t
+hdb_os9_size(const uint8_t *lsn0, off_t image_size)
+{
+	uint32_t tot = (lsn0[0] << 16) | (lsn0[1] << 8) | lsn0[2];
+	uint32_t map = (lsn0[4] << 8) | lsn0[5];
+	uint32_t bit = (lsn0[6] << 8) | lsn0[7];
+
+	if (tot == 0 || (off_t)tot * COCOFS_BYTES_PER_SEC > image_size ||
+	    bit == 0 || (bit & (bit - 1)) != 0 ||
+	    (uint64_t)map * 8 * bit < tot ||
+	    (uint64_t)(map - 1) * 8 * bit >= tot) {
+		return 0;
+	}
+	return (off_t)tot * COCOFS_BYTES_PER_SEC;
+}
+
+static bool
+hdb_scan(int fd, struct hdb_scan *hs)
+{
+	unsigned long votes[HDB_NSECTORS];
+	off_t first[HDB_NSECTORS];	/* first disk voting for each */
+	uint8_t *buf, *sec;
+	struct stat sb;
+	off_t pos, lsn, base;
+	ssize_t rv;
+	size_t i, nsec;
+	unsigned int r, best;
+	int nalloc;
+
+	memset(hs, 0, sizeof(*hs));
+	if (fstat(fd, &sb) == -1) {
+		fprintf(stderr, "unable to stat image: %s\n", strerror(errno));
+		return false;
+	}
+	hs->image_size = sb.st_size;
+	hs->hits = calloc(1, sb.st_size / COCOFS_BYTES_PER_SEC / 8 + 1);
+	assert(hs->hits != NULL);
+	memset(votes, 0, sizeof(votes));
+
+	buf = malloc(HDB_CHUNK + COCOFS_BYTES_PER_SEC);
+	assert(buf != NULL);
+	for (pos = 0; pos < sb.st_size; pos += HDB_CHUNK) {
+		/* Overlap by a sector, to see the one after the last. */
+		rv = cocofs_pread(fd, buf, HDB_CHUNK + COCOFS_BYTES_PER_SEC,
+		    pos);
+		if (rv == -1) {
+			fprintf(stderr, "unable to read image: %s\n",
+			    strerror(errno));
+			free(buf);
+			free(hs->hits);
+			return false;
+		}
+		if (pos == 0 && rv >= COCOFS_BYTES_PER_SEC) {
+			hs->os9_size = hdb_os9_size(buf, sb.st_size);
+		}
+		nsec = (size_t)rv / COCOFS_BYTES_PER_SEC;
+		if (nsec > HDB_CHUNK / COCOFS_BYTES_PER_SEC) {
+			nsec = HDB_CHUNK / COCOFS_BYTES_PER_SEC + 1;
+		}
+		for (i = 0; i + 1 < nsec; i++) {
+			sec = buf + i * COCOFS_BYTES_PER_SEC;
+			nalloc = hdb_gmap_check(sec);
+			if (nalloc < 0 ||
+			    ! hdb_is_dirsec(sec + COCOFS_BYTES_PER_SEC) ||
+			    (nalloc == 0 && hdb_is_erased(sec) &&
+			     hdb_is_erased(sec + COCOFS_BYTES_PER_SEC))) {
+				continue;
+			}
+			lsn = pos / COCOFS_BYTES_PER_SEC + (off_t)i -
+			    HDB_GMAP_LSN;
+			if (lsn < 0) {
+				continue;
+			}
+			hs->hits[lsn >> 3] |= 1U << (lsn & 7);
+			if (nalloc == 0) {
+				continue;
+			}
+			if (votes[lsn % HDB_NSECTORS]++ == 0) {
+				first[lsn % HDB_NSECTORS] = lsn;
+			}
+		}
+	}
+	free(buf);
+
+	best = (hs->os9_size / COCOFS_BYTES_PER_SEC) % HDB_NSECTORS;
+	for (r = 0; r < HDB_NSECTORS; r++) {
+		if (votes[r] > votes[best]) {
+			best = r;
+		}
+	}
+	if (votes[best] == 0 && hs->os9_size == 0) {
+		return true;
+	}
+
+	hs->found = true;
+	hs->source = votes[best] == 0 ? "OS-9 LSN0" : "directory scan";
+	if (hs->os9_size != 0) {
+		/* The first disk after the OS-9 partition. */
+		base = hs->os9_size / COCOFS_BYTES_PER_SEC;
+		if (base % HDB_NSECTORS == best) {
+			hs->source = "OS-9 LSN0";
+		}
+		base += (best + HDB_NSECTORS - base % HDB_NSECTORS) %
+		    HDB_NSECTORS;
+	} else {
+		/*
+		 * What comes before the HDB-DOS region needn't be a whole
+		 * number of disks long, so start from the first disk with
+		 * something on it, and back up over any empty ones right
+		 * before it.
+		 */
+		base = first[best];
+		while (base >= HDB_NSECTORS &&
+		       hdb_hit(hs, (base - HDB_NSECTORS) *
+				   COCOFS_BYTES_PER_SEC)) {
+			base -= HDB_NSECTORS;
+		}
+	}
+	hs->offset = base * COCOFS_BYTES_PER_SEC;
+	return true;
+}
+
+/*
+ * Find the disk selected by --hdb-drive in an image.
+ */
+static bool
+hdb_locate(int fd, const char *path, off_t *basep)
+{
+	struct hdb_scan hs;
+	off_t offset = opts.hdb_offset;
+
+	if (! opts.hdb_offset_set) {
+		if (! hdb_scan(fd, &hs)) {
+			return false;
+		}
+		free(hs.hits);
+		if (! hs.found) {
+			fprintf(stderr, "%s: no HDB-DOS disks found\n", path);
+			return false;
+		}
+		offset = hs.offset;
+	}
+	*basep = offset + (off_t)opts.hdb_drive * COCOFS_TOTALSIZE;
+	return true;
+}
+
+static int
+cmd_hdbscan(int argc, char *argv[])
+{
+	struct hdb_scan hs;
+	unsigned long drive, ndrives, nformatted = 0, start = 0;
+	bool inrange = false, hit;
+	int fd;
+
+	if (argc != 1) {
+		return usage();
+	}
+	fd = open(argv[0], O_RDONLY | O_BINARY);
+	if (fd == -1) {
+		fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if (! hdb_scan(fd, &hs)) {
+		close(fd);
+		return EXIT_FAILURE;
+	}
+	close(fd);
+
+	if (hs.os9_size != 0) {
+		printf("OS-9 partition: %lld sectors (%lld bytes)\n",
+		    (long long)hs.os9_size / COCOFS_BYTES_PER_SEC,
+		    (long long)hs.os9_size);
+	}
+	if (! hs.found) {
+		printf("no HDB-DOS disks found\n");
+		free(hs.hits);
+		return EXIT_FAILURE;
+	}
+	ndrives = (hs.image_size - hs.offset) / COCOFS_TOTALSIZE;
+	printf("HDB-DOS offset: %lld bytes (LSN %lld), from %s\n",
+	    (long long)hs.offset, (long long)hs.offset / COCOFS_BYTES_PER_SEC,
+	    hs.source);
+	for (drive = 0; drive < ndrives; drive++) {
+		nformatted += hdb_hit(&hs,
+		    hs.offset + (off_t)drive * COCOFS_TOTALSIZE);
+	}
+	printf("%lu drive%s, %lu formatted:", ndrives, plural(ndrives),
+	    nformatted);
+
+	/* Print the formatted drives as ranges. */
+	for (drive = 0; drive <= ndrives; drive++) {
+		hit = drive < ndrives &&
+		    hdb_hit(&hs, hs.offset + (off_t)drive * COCOFS_TOTALSIZE);
+		if (hit && ! inrange) {
+			start = drive;
+			inrange = true;
+		} else if (! hit && inrange) {
+			if (drive - 1 == start) {
+				printf(" %lu", start);
+			} else {
+				printf(" %lu-%lu", start, drive - 1);
+			}
+			inrange = false;
+		}
+	}
+	printf("\n");
+	free(hs.hits);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * Open an image, run a command on it, and close it again.  argv[0]
+ * is the command verb.  In scan mode, the command's output is
+ * prefixed with the image name and written out in one piece.
+ */
+static pthread_mutex_t output_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+run_image(const char *path, int cmd, int argc, char *argv[], bool scan)
+{
+	struct worker *w = curworker;
+	struct cocofs *fs;
+	uint64_t timage, t0;
+	off_t base;
+	int fd, eval, oflags;
+	bool ok;
+
+	timage = cocofs_now_ns();
+	if (opts.record != NULL) {
+		rec_command(path, argc, argv);
+	}
+
+	/*
+	 * Open the image.  Formatting an HDB-DOS drive must leave the
+	 * rest of the hard disk alone (and may need to read it to find
+	 * the drive).
+	 */
+	oflags = cmdtab[cmd].oflags;
+	if (opts.hdb && (oflags & O_TRUNC)) {
+		oflags = (oflags & ~(O_TRUNC | O_WRONLY)) | O_RDWR;
+	}
+	t0 = trace_begin();
+	fd = open(path, oflags | O_BINARY, 0644);
+	trace_span("open", t0, NULL);
+	if (fd == -1) {
+		fprintf(stderr, "ERROR: failed to open '%s': %s\n",
+		    path, strerror(errno));
+		metric_add(METRIC_ERR_OPEN, 1);
+		eval = EXIT_FAILURE;
+		goto out;
+	}
+	w->image_fd = fd;
+	if (scan) {
+		scan_io_start(fd, opts.direct);
+	}
+
+	/* Find the HDB-DOS drive, if there is one. */
+	base = 0;
+	if (opts.hdb) {
+		t0 = trace_begin();
+		ok = hdb_locate(fd, path, &base);
+		trace_span("hdb_locate", t0, NULL);
+		if (! ok) {
+			close(fd);
+			w->image_fd = -1;
+			metric_add(METRIC_ERR_LOAD, 1);
+			eval = EXIT_FAILURE;
+			goto out;
+		}
+	}
+
+	/* O_CREAT implies "create new". */
+	t0 = trace_begin();
+	if (cmdtab[cmd].oflags & O_CREAT) {
+		fs = cocofs_format(fd, path);
+		fs->base = base;
+		trace_span("cocofs_format", t0, NULL);
+	} else {
+		fs = cocofs_load_at(fd, path, base);
+		trace_span("cocofs_load", t0, NULL);
+	}
+	if (fs == NULL) {
+		if (scan) {
+			fprintf(stderr, "%s: not a valid image\n", path);
+			scan_io_done(fd);
+		}
+		close(fd);
+		w->image_fd = -1;
+		metric_add(METRIC_ERR_LOAD, 1);
+		eval = EXIT_FAILURE;
+		goto out;
+	}
+	fs->shrink = opts.shrink;
+	fs->allocator = opts.allocator;
+	fs->batch = scan && cmdtab[cmd].oflags != O_RDONLY;
+
+	/* Run the command, collecting its output in scan mode. */
+	if (scan) {
+		w->buffer_out = true;
+		w->outlen = 0;
+		cocofs_printf("%s:\n", path);
+	}
+	t0 = cocofs_now_ns();
+	eval = (*cmdtab[cmd].func)(fs, argc - 1, argv + 1);
+	metric_observe(cmd, cocofs_now_ns() - t0);
+	trace_span(cmdtab[cmd].verb, t0, NULL);
+	if (scan) {
+		w->buffer_out = false;
+		t0 = trace_begin();
+		pthread_mutex_lock(&output_lock);
+		trace_span("output_wait", t0, NULL);
+		fwrite(w->out, 1, w->outlen, stdout);
+		fflush(stdout);
+		if (journal.fd != -1) {
+			journal_image_done(path);
+		}
+		pthread_mutex_unlock(&output_lock);
+	}
+
+	/*
+	 * Write back a scanned image's changes all at once -- and only if
+	 * the command succeeded, so that an image is either patched or
+	 * left alone.
+	 */
+	w->saved = false;
+	if (fs->batch) {
+		fs->batch = false;
+		if (eval == EXIT_SUCCESS && cocofs_is_dirty(fs)) {
+			if (cocofs_save(fs)) {
+				w->saved = true;
+			} else {
+				fprintf(stderr, "%s: changes not saved\n",
+				    path);
+				eval = EXIT_FAILURE;
+			}
+		}
+	}
+
+	t0 = trace_begin();
+	if (scan) {
+		scan_io_done(fs->fd);
+	}
+	cocofs_close(fs);
+	w->image_fd = -1;
+	trace_span("close", t0, NULL);
+
+ out:
+	metric_add(eval == EXIT_SUCCESS ? METRIC_IMAGES_OK
+					: METRIC_IMAGES_FAILED, 1);
+	if (opts.record != NULL) {
+		rec_end(eval, cocofs_now_ns() - timage);
+	}
+	trace_span("image", timage, path);
+	return eval;
+}
+
+/*
+ * Scan mode: run a command over every image in a directory tree (or
+ * named in a list file), using --jobs worker threads.
+ *
+ * Commands that modify images (copyin, rm, cp, ...) may be scanned,
+ * too.  Each image is written back once, when its command is done,
+ * but nothing is synced until the end, when the whole batch is made
+ * durable at once.  With -m, the outcome for each image is then
+ * written to a manifest.
+ */
+#define	SCAN_UNCHANGED		0	/* succeeded, nothing to write */
+#define	SCAN_FAILED		1
+#define	SCAN_SAVED		2	/* written, not yet synced */
+#define	SCAN_MODIFIED		3	/* written and synced */
+
+static struct {
+	char		**paths;
+	size_t		npaths;
+	size_t		maxpaths;
+	uint8_t		*status;	/* SCAN_* for each image */
+	size_t		next;		/* next image to hand out */
+	int		cmd;
+	int		argc;
+	char		**argv;
+	int		eval;
+	pthread_mutex_t	lock;		/* protects next and eval */
+} scan = { .eval = EXIT_SUCCESS, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void
+scan_add(const char *path)
+{
+	if (scan.npaths == scan.maxpaths) {
+		scan.maxpaths = scan.maxpaths ? scan.maxpaths * 2 : 64;
+		scan.paths = realloc(scan.paths,
+		    scan.maxpaths * sizeof(*scan.paths));
+		assert(scan.paths != NULL);
+	}
+	scan.paths[scan.npaths] = strdup(path);
+	assert(scan.paths[scan.npaths] != NULL);
+	scan.npaths++;
+}
+
+static bool
+scan_is_image(const char *name)
+{
+	size_t len = strlen(name);
+
+	return len > 4 && strcasecmp(name + len - 4, ".dsk") == 0;
+}
+
+static bool
+scan_walk(const char *dirpath)
+{
+	struct dirent *de;
+	struct stat sb;
+	char path[PATH_MAX];
+	bool rv = true;
+	DIR *dirp;
+
+	dirp = opendir(dirpath);
+	if (dirp == NULL) {
+		fprintf(stderr, "%s: %s\n", dirpath, strerror(errno));
+		return false;
+	}
+	while ((de = readdir(dirp)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 ||
+		    strcmp(de->d_name, "..") == 0) {
+			continue;
+		}
+		if (snprintf(path, sizeof(path), "%s/%s", dirpath,
+			     de->d_name) >= (int)sizeof(path)) {
+			fprintf(stderr, "%s/%s: path too long\n", dirpath,
+			    de->d_name);
+			rv = false;
+			continue;
+		}
+		if (stat(path, &sb) == -1) {
+			fprintf(stderr, "%s: %s\n", path, strerror(errno));
+			rv = false;
+			continue;
+		}
+		if (S_ISDIR(sb.st_mode)) {
+#ifndef _WIN32
+			/*
+			 * Links to images are followed, but not links to
+			 * directories, which could lead back up the tree.
+			 */
+			if (lstat(path, &sb) == 0 && S_ISLNK(sb.st_mode)) {
+				continue;
+			}
+#endif
+			rv = scan_walk(path) && rv;
+		} else if (S_ISREG(sb.st_mode) && scan_is_image(de->d_name)) {
+			scan_add(path);
+		}
+	}
+	closedir(dirp);
+	return rv;
+}
+
+static bool
+scan_read_list(const char *listpath)
+{
+	char line[PATH_MAX + 2];
+	size_t len;
+	FILE *fp;
+
+	fp = fopen(listpath, "r");
+	if (fp == NULL) {
+		fprintf(stderr, "%s: %s\n", listpath, strerror(errno));
+		return false;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		len = strcspn(line, "\r\n");
+		line[len] = '\0';
+		if (len != 0 && line[0] != '#') {
+			scan_add(line);
+		}
+	}
+	fclose(fp);
+	return true;
+}
+
+static int
+scan_compare(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*
+ * Load an image for a worker that examines images itself, rather than
+ * through run_image().  A failure is the scan's failure.
+ */
+static struct cocofs *
+scan_load_image(struct worker *w, const char *path)
+{
+	struct cocofs *fs = NULL;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_BINARY);
+	if (fd != -1) {
+		scan_io_start(fd, opts.direct);
+		w->image_fd = fd;
+		fs = cocofs_load(fd, path);
+		w->image_fd = -1;
+		scan_io_done(fd);
+	} else {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+	}
+	if (fs == NULL) {
+		if (fd != -1) {
+			close(fd);
+		}
+		metric_add(METRIC_IMAGES_FAILED, 1);
+		pthread_mutex_lock(&scan.lock);
+		scan.eval = EXIT_FAILURE;
+		pthread_mutex_unlock(&scan.lock);
+		return NULL;
+	}
+	metric_add(METRIC_IMAGES_OK, 1);
+	return fs;
+}
+
+static void *
+scan_worker(void *arg)
+{
+	struct worker *w = arg;
+	char **argv;
+	size_t i;
+	int a, eval;
+
+	curworker = w;
+	trace_thread_start(w);
+	metrics_thread_start(w);
+
+	/* Commands may scribble on their arguments; each image gets a copy. */
+	argv = calloc(scan.argc + 1, sizeof(*argv));
+	assert(argv != NULL);
+	for (;;) {
+		pthread_mutex_lock(&scan.lock);
+		i = scan.next++;
+		pthread_mutex_unlock(&scan.lock);
+		if (i >= scan.npaths) {
+			break;
+		}
+		for (a = 0; a < scan.argc; a++) {
+			argv[a] = strdup(scan.argv[a]);
+			assert(argv[a] != NULL);
+		}
+		eval = run_image(scan.paths[i], scan.cmd, scan.argc, argv,
+		    true);
+		for (a = 0; a < scan.argc; a++) {
+			free(argv[a]);
+		}
+		scan.status[i] = eval != EXIT_SUCCESS ? SCAN_FAILED
+			       : w->saved ? SCAN_SAVED : SCAN_UNCHANGED;
+		if (eval != EXIT_SUCCESS) {
+			pthread_mutex_lock(&scan.lock);
+			scan.eval = EXIT_FAILURE;
+			pthread_mutex_unlock(&scan.lock);
+		}
+	}
+	free(argv);
+	free(w->direct_buf);
+	w->direct_buf = NULL;
+	free(w->out);
+	w->out = NULL;
+	w->outsize = 0;
+	if (w != &mainworker) {
+		trace_thread_done(w);
+	}
+	return NULL;
+}
+
+/*
+ * Send the scan output to a file (-o), picking up where the journal
+ * left off when resuming.
+ */
+static bool
+scan_open_output(const char *path)
+{
+	int fd;
+
+	fd = open(path, O_WRONLY | O_CREAT | O_BINARY |
+	    (opts.resume ? 0 : O_TRUNC), 0644);
+	if (fd == -1) {
+		fprintf(stderr, "unable to open %s: %s\n", path,
+		    strerror(errno));
+		return false;
+	}
+	if (opts.resume && ftruncate(fd, journal.resume_offset) == -1) {
+		fprintf(stderr, "unable to truncate %s: %s\n", path,
+		    strerror(errno));
+		close(fd);
+		return false;
+	}
+	fflush(stdout);
+	if (dup2(fd, STDOUT_FILENO) == -1) {
+		fprintf(stderr, "unable to redirect output to %s: %s\n",
+		    path, strerror(errno));
+		close(fd);
+		return false;
+	}
+	close(fd);
+	fseeko(stdout, 0, SEEK_END);
+	return true;
+}
+
+/*
+ * Make the images a scan wrote back durable: a syncfs(2) for each file
+ * system they're on where there is such a thing, otherwise an fsync(2)
+ * of each one.
+ */
+static void
+scan_sync(void)
+{
+	struct stat sb;
+	size_t i, nsaved = 0, nfailed = 0;
+	uint64_t t0 = cocofs_now_ns();
+	int fd;
+#ifdef __linux__
+	struct {
+		dev_t	dev;
+		bool	ok;
+	} *fsys = NULL;
+	size_t nfsys = 0, j;
+#endif
+
+	for (i = 0; i < scan.npaths; i++) {
+		if (scan.status[i] != SCAN_SAVED) {
+			continue;
+		}
+		nsaved++;
+		if (stat(scan.paths[i], &sb) == -1) {
+			goto failed;
+		}
+#ifdef __linux__
+		for (j = 0; j < nfsys; j++) {
+			if (fsys[j].dev == sb.st_dev) {
+				break;
+			}
+		}
+		if (j == nfsys) {
+			fsys = realloc(fsys, (nfsys + 1) * sizeof(*fsys));
+			assert(fsys != NULL);
+			fsys[j].dev = sb.st_dev;
+			fd = open(scan.paths[i], O_RDONLY | O_BINARY);
+			fsys[j].ok = fd != -1 && syncfs(fd) == 0;
+			if (! fsys[j].ok) {
+				fprintf(stderr, "%s: unable to sync: %s\n",
+				    scan.paths[i], strerror(errno));
+			}
+			if (fd != -1) {
+				close(fd);
+			}
+			nfsys++;
+		}
+		if (! fsys[j].ok) {
+			goto failed;
+		}
+#else
+		fd = open(scan.paths[i], O_RDWR | O_BINARY);
+		if (fd == -1 || fsync(fd) == -1) {
+			fprintf(stderr, "%s: unable to sync: %s\n",
+			    scan.paths[i], strerror(errno));
+			if (fd != -1) {
+				close(fd);
+			}
+			goto failed;
+		}
+		close(fd);
+#endif
+		scan.status[i] = SCAN_MODIFIED;
+		continue;
+ failed:
+		scan.status[i] = SCAN_FAILED;
+		scan.eval = EXIT_FAILURE;
+		nfailed++;
+	}
+#ifdef __linux__
+	free(fsys);
+#endif
+	if (nsaved != 0) {
+		fprintf(stderr, "scan: %zu image%s modified, synced in %.2fs",
+		    nsaved - nfailed, plural((long)(nsaved - nfailed)),
+		    (double)(cocofs_now_ns() - t0) / 1e9);
+		if (nfailed != 0) {
+			fprintf(stderr, " (%zu failed)", nfailed);
+		}
+		fprintf(stderr, "\n");
+	}
+}
+
+static bool
+scan_write_manifest(const char *path)
+{
+	static const char *status[] = {
+		[SCAN_UNCHANGED] = "unchanged",
+		[SCAN_FAILED] = "failed",
+		[SCAN_SAVED] = "unsynced",
+		[SCAN_MODIFIED] = "modified",
+	};
+	FILE *fp;
+	size_t i;
+
+	fp = fopen(path, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "unable to create %s: %s\n", path,
+		    strerror(errno));
+		return false;
+	}
+	for (i = 0; i < scan.npaths; i++) {
+		fprintf(fp, "%s\t%s\n", status[scan.status[i]], scan.paths[i]);
+	}
+	if (fflush(fp) == EOF || fsync(fileno(fp)) == -1) {
+		fprintf(stderr, "unable to write %s: %s\n", path,
+		    strerror(errno));
+		fclose(fp);
+		return false;
+	}
+	fclose(fp);
+	return true;
+}
+
+static int
+cmd_scan(int argc, char *argv[])
+{
+	struct worker *workers;
+	struct stat sb;
+	const char *output = NULL, *manifest = NULL;
+	unsigned int i;
+	size_t n, ndone;
+	int cmd;
+
+	for (; argc >= 2; argc -= 2, argv += 2) {
+		if (strcmp(argv[0], "-o") == 0) {
+			output = argv[1];
+		} else if (strcmp(argv[0], "-m") == 0) {
+			manifest = argv[1];
+		} else {
+			break;
+		}
+	}
+	if (argc < 2) {
+		return usage();
+	}
+	if (opts.journal != NULL && output == NULL) {
+		fprintf(stderr, "scan: --journal requires -o output\n");
+		return EXIT_FAILURE;
+	}
+	if (opts.resume && opts.journal == NULL) {
+		fprintf(stderr, "scan: --resume requires --journal\n");
+		return EXIT_FAILURE;
+	}
+	for (cmd = 0; cmdtab[cmd].verb != NULL; cmd++) {
+		if (strcmp(cmdtab[cmd].verb, argv[1]) == 0) {
+			break;
+		}
+	}
+	if (cmdtab[cmd].verb == NULL) {
+		return usage();
+	}
+	if (cmdtab[cmd].oflags & O_CREAT) {
+		fprintf(stderr, "scan: %s creates images\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+	if (cmdtab[cmd].oflags != O_RDONLY && opts.journal != NULL) {
+		/* Resuming would skip images whose changes weren't synced. */
+		fprintf(stderr, "scan: --journal can't be used with %s\n",
+		    argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	if (stat(argv[0], &sb) == -1) {
+		fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if (S_ISDIR(sb.st_mode) ? !scan_walk(argv[0])
+				: !scan_read_list(argv[0])) {
+		scan.eval = EXIT_FAILURE;
+	}
+	if (scan.npaths != 0) {
+		qsort(scan.paths, scan.npaths, sizeof(*scan.paths),
+		    scan_compare);
+	}
+
+	if (opts.journal != NULL &&
+	    ! journal_open(opts.journal, opts.resume, argv[0], argc - 1,
+			   argv + 1)) {
+		return EXIT_FAILURE;
+	}
+	if (output != NULL && ! scan_open_output(output)) {
+		return EXIT_FAILURE;
+	}
+
+	/* Skip images that were finished before we were restarted. */
+	for (i = 0, n = 0, ndone = 0; i < scan.npaths; i++) {
+		if (journal_is_done(scan.paths[i])) {
+			free(scan.paths[i]);
+			ndone++;
+		} else {
+			scan.paths[n++] = scan.paths[i];
+		}
+	}
+	scan.npaths = n;
+	scan.status = calloc(n ? n : 1, sizeof(*scan.status));
+	assert(scan.status != NULL);
+	if (ndone != 0) {
+		fprintf(stderr, "scan: resuming, %zu image%s already done\n",
+		    ndone, plural((long)ndone));
+	}
+
+	scan.cmd = cmd;
+	scan.argc = argc - 1;
+	scan.argv = argv + 1;
+
+	if (opts.jobs <= 1) {
+		scan_worker(&mainworker);
+	} else {
+		workers = calloc(opts.jobs, sizeof(*workers));
+		assert(workers != NULL);
+		for (i = 0; i < opts.jobs; i++) {
+			workers[i].id = i + 1;
+			workers[i].image_fd = -1;
+			if (pthread_create(&workers[i].thread, NULL,
+					   scan_worker, &workers[i]) != 0) {
+				fprintf(stderr,
+				    "scan: unable to create worker\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		for (i = 0; i < opts.jobs; i++) {
+			pthread_join(workers[i].thread, NULL);
+		}
+		free(workers);
+	}
+	journal_checkpoint();
+
+	scan_sync();
+	if (manifest != NULL && ! scan_write_manifest(manifest)) {
+		scan.eval = EXIT_FAILURE;
+	}
+	return scan.eval;
+}
+
+/*
+ * Arrow export: export-arrow writes a row for every file in every image
+ * found by a scan to an Apache Arrow IPC file (a.k.a. Feather V2), for
+ * loading into dataframe tools.  The image path, file name, type and
+ * encoding columns are dictionary-encoded.
+ *
+ * Each --jobs worker builds record batches of its own and writes each
+ * one to the next free spot in the file as soon as it fills up, so the
+ * order of the batches in the file is not defined.  The dictionaries
+ * are shared; once all of the batches are written, they are written
+ * after them (the file format allows that), followed by the footer
+ * that indexes everything.
+ */
+#define	ARROW_MAGIC		"ARROW1"
+#define	ARROW_BATCH_ROWS	65536
+
+/* Schema.fbs / Message.fbs */
+#define	ARROW_V5		4
+#define	ARROW_TYPE_INT		2
+#define	ARROW_TYPE_BINARY	4
+#define	ARROW_TYPE_UTF8		5
+#define	ARROW_MSG_SCHEMA	1
+#define	ARROW_MSG_DICTIONARY	2
+#define	ARROW_MSG_RECORDBATCH	3
+
+/*
+ * A minimal FlatBuffers builder, enough for Arrow's metadata.  Unlike
+ * the real thing, it builds front to back: a table comes first and
+ * the things it refers to are appended after it, their offsets patched
+ * in as they're placed.
+ */
+struct fbb {
+	uint8_t		*buf;
+	size_t		len;
+	size_t		size;
+};
+
+static size_t
+fbb_alloc(struct fbb *b, size_t n, size_t align)
+{
+	size_t off = (b->len + align - 1) & ~(align - 1);
+
+	if (off + n > b->size) {
+		b->size = b->size ? b->size * 2 : 1024;
+		if (b->size < off + n) {
+			b->size = off + n;
+		}
+		b->buf = realloc(b->buf, b->size);
+		assert(b->buf != NULL);
+	}
+	memset(b->buf + b->len, 0, off + n - b->len);
+	b->len = off + n;
+	return off;
+}
+
+static void
+fbb_u16(struct fbb *b, size_t off, uint16_t v)
+{
+	b->buf[off] = (uint8_t)v;
+	b->buf[off + 1] = (uint8_t)(v >> 8);
+}
+
+/* Point the offset field at "at" to the object at "to". */
+static void
+fbb_ref(struct fbb *b, size_t at, size_t to)
+{
+	assert(to > at);
+	cocofs_le32enc(b->buf + at, (uint32_t)(to - at));
+}
+
+/*
+ * Lay out a table with the given field sizes (0 for a field that is
+ * left out) preceded by its vtable, returning where each field goes.
+ */
+static size_t
+fbb_table(struct fbb *b, unsigned int nfields, const uint8_t *sizes,
+    size_t *at)
+{
+	size_t vt, t;
+	unsigned int i;
+
+	vt = fbb_alloc(b, 4 + 2 * nfields, 2);
+	t = fbb_alloc(b, 4, 8);
+	for (i = 0; i < nfields; i++) {
+		at[i] = sizes[i] ? fbb_alloc(b, sizes[i], sizes[i]) : t;
+		fbb_u16(b, vt + 4 + 2 * i, (uint16_t)(at[i] - t));
+	}
+	fbb_u16(b, vt, (uint16_t)(4 + 2 * nfields));
+	fbb_u16(b, vt + 2, (uint16_t)(b->len - t));
+	cocofs_le32enc(b->buf + t, (uint32_t)(t - vt));
+	return t;
+}
+
+/* Returns the position of the first element. */
+static size_t
+fbb_vector(struct fbb *b, size_t at, uint32_t n, size_t elsize, size_t align)
+{
+	size_t v;
+
+	/* The length comes right before the (aligned) elements. */
+	if (align > 4 && ((b->len + 3) & ~(size_t)3) % align == 0) {
+		fbb_alloc(b, 4, 4);
+	}
+	v = fbb_alloc(b, 4 + n * elsize, 4);
+	cocofs_le32enc(b->buf + v, n);
+	fbb_ref(b, at, v);
+	return v + 4;
+}
+
+static void
+fbb_string(struct fbb *b, size_t at, const char *s)
+{
+	size_t len = strlen(s), v;
+
+	/* The NUL is there, but isn't counted. */
+	v = fbb_vector(b, at, (uint32_t)len + 1, 1, 1);
+	memcpy(b->buf + v, s, len);
+	cocofs_le32enc(b->buf + v - 4, (uint32_t)len);
+}
+
+/*
+ * The columns, and the buffers that hold them while a batch is being
+ * built.  Dictionary-encoded columns hold 32-bit indices.
+ */
+enum {
+	ARROW_C_IMAGE,
+	ARROW_C_SLOT,
+	ARROW_C_NAME,
+	ARROW_C_TYPE,
+	ARROW_C_ENCODING,
+	ARROW_C_SIZE,
+	ARROW_C_FIRST,
+	ARROW_C_GRANULES,
+	ARROW_C_EXTENTS,
+	ARROW_C_CHAIN,
+	ARROW_C_HASH,
+	ARROW_NCOLUMNS
+};
+
+#define	ARROW_NDICTS		4	/* image, name, type, encoding */
+
+static const struct arrow_column {
+	const char	*name;
+	uint8_t		type;		/* ARROW_TYPE_* */
+	uint8_t		bits;		/* of an integer */
+	int		dict;		/* dictionary ID, or -1 */
+	bool		nullable;
+} arrow_columns[ARROW_NCOLUMNS] = {
+	[ARROW_C_IMAGE] =	{ "image", ARROW_TYPE_UTF8, 0, 0, false },
+	[ARROW_C_SLOT] =	{ "slot", ARROW_TYPE_INT, 8, -1, false },
+	[ARROW_C_NAME] =	{ "name", ARROW_TYPE_UTF8, 0, 1, false },
+	[ARROW_C_TYPE] =	{ "type", ARROW_TYPE_UTF8, 0, 2, false },
+	[ARROW_C_ENCODING] =	{ "encoding", ARROW_TYPE_UTF8, 0, 3, false },
+	[ARROW_C_SIZE] =	{ "size", ARROW_TYPE_INT, 32, -1, false },
+	[ARROW_C_FIRST] =	{ "first_granule", ARROW_TYPE_INT, 8, -1,
+				  false },
+	[ARROW_C_GRANULES] =	{ "granules", ARROW_TYPE_INT, 8, -1, false },
+	[ARROW_C_EXTENTS] =	{ "extents", ARROW_TYPE_INT, 8, -1, false },
+	[ARROW_C_CHAIN] =	{ "chain", ARROW_TYPE_BINARY, 0, -1, false },
+	[ARROW_C_HASH] =	{ "hash", ARROW_TYPE_INT, 64, -1, true },
+};
+
+struct arrow_buf {
+	uint8_t		*data;
+	size_t		len;
+	size_t		size;
+};
+
+static void
+arrow_buf_put(struct arrow_buf *ab, const void *p, size_t n)
+{
+	if (n == 0) {
+		return;
+	}
+	if (ab->len + n > ab->size) {
+		ab->size = ab->size ? ab->size * 2 : 4096;
+		if (ab->size < ab->len + n) {
+			ab->size = ab->len + n;
+		}
+		ab->data = realloc(ab->data, ab->size);
+		assert(ab->data != NULL);
+	}
+	memcpy(ab->data + ab->len, p, n);
+	ab->len += n;
+}
+
+static void
+arrow_buf_put_le(struct arrow_buf *ab, uint64_t v, unsigned int bits)
+{
+	uint8_t buf[8];
+
+	cocofs_le64enc(buf, v);
+	arrow_buf_put(ab, buf, bits / 8);
+}
+
+struct arrow_col {
+	struct arrow_buf valid;		/* only if there are nulls */
+	struct arrow_buf offsets;	/* of variable-length values */
+	struct arrow_buf data;
+	uint32_t	nnulls;
+};
+
+struct arrow_dict {
+	struct arrow_col col;		/* the values, as a utf8 column */
+	uint32_t	n;
+	uint32_t	*slots;		/* hash table of index + 1 */
+	uint32_t	nslots;
+};
+
+struct arrow_block {
+	uint64_t	offset;
+	uint32_t	metalen;
+	uint64_t	bodylen;
+};
+
+static struct {
+	int		fd;
+	uint64_t	off;		/* where the next message goes */
+	struct arrow_dict dict[ARROW_NDICTS];
+	struct arrow_block *batches;
+	size_t		nbatches;
+	size_t		maxbatches;
+	uint64_t	nrows;
+	bool		failed;
+	pthread_mutex_t	lock;
+} arrow = { .fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static void
+arrow_col_free(struct arrow_col *c)
+{
+	free(c->valid.data);
+	free(c->offsets.data);
+	free(c->data.data);
+}
+
+static void
+arrow_col_clear(struct arrow_col *c)
+{
+	c->valid.len = c->offsets.len = c->data.len = 0;
+	c->nnulls = 0;
+}
+
+/* Append a value (n bytes at p; a null if p is NULL). */
+static void
+arrow_col_put(struct arrow_col *c, uint32_t row, const void *p, size_t n,
+    bool varlen)
+{
+	static const uint8_t zero[8];
+
+	if (varlen) {
+		if (row == 0) {
+			arrow_buf_put_le(&c->offsets, 0, 32);
+		}
+		if (p != NULL) {
+			arrow_buf_put(&c->data, p, n);
+		}
+		arrow_buf_put_le(&c->offsets, c->data.len, 32);
+	} else {
+		assert(n <= sizeof(zero));
+		arrow_buf_put(&c->data, p != NULL ? p : zero, n);
+	}
+	if (row % 8 == 0) {
+		arrow_buf_put(&c->valid, zero, 1);
+	}
+	if (p != NULL) {
+		c->valid.data[row / 8] |= 1U << (row % 8);
+	} else {
+		c->nnulls++;
+	}
+}
+
+static void
+arrow_col_put_int(struct arrow_col *c, uint32_t row, uint64_t v,
+    unsigned int bits)
+{
+	uint8_t buf[8];
+
+	cocofs_le64enc(buf, v);
+	arrow_col_put(c, row, buf, bits / 8, false);
+}
+
+static uint32_t
+arrow_dict_intern(struct arrow_dict *d, const char *s)
+{
+	size_t len = strlen(s);
+	uint32_t i, h, id, *oslots, onslots;
+	const uint8_t *offs;
+
+	if (d->n * 2 >= d->nslots) {
+		oslots = d->slots;
+		onslots = d->nslots;
+		d->nslots = onslots ? onslots * 2 : 1024;
+		d->slots = calloc(d->nslots, sizeof(*d->slots));
+		assert(d->slots != NULL);
+		offs = d->col.offsets.data;
+		for (i = 0; i < onslots; i++) {
+			if ((id = oslots[i]) == 0) {
+				continue;
+			}
+			id--;
+			h = (uint32_t)fnv1a_64(d->col.data.data +
+			    cocofs_le32dec(offs + id * 4),
+			    cocofs_le32dec(offs + id * 4 + 4) -
+			    cocofs_le32dec(offs + id * 4), FNV1A_64_INIT);
+			while (d->slots[h & (d->nslots - 1)] != 0) {
+				h++;
+			}
+			d->slots[h & (d->nslots - 1)] = id + 1;
+		}
+		free(oslots);
+	}
+
+	offs = d->col.offsets.data;
+	for (h = (uint32_t)fnv1a_64(s, len, FNV1A_64_INIT);
+	     (id = d->slots[h & (d->nslots - 1)]) != 0; h++) {
+		id--;
+		if (cocofs_le32dec(offs + id * 4 + 4) -
+		    cocofs_le32dec(offs + id * 4) == len &&
+		    memcmp(d->col.data.data + cocofs_le32dec(offs + id * 4),
+			   s, len) == 0) {
+			return id;
+		}
+	}
+	id = d->n++;
+	d->slots[h & (d->nslots - 1)] = id + 1;
+	arrow_col_put(&d->col, id, s, len, true);
+	return id;
+}
+
+/*
+ * Build the Schema table; the footer repeats it.
+ */
+static void
+arrow_schema(struct fbb *b, size_t at)
+{
+	static const uint8_t schema_sizes[] = { 0, 4 };
+	uint8_t field_sizes[] = { 4, 1, 1, 4, 4, 4 };
+	static const uint8_t int_sizes[] = { 4, 1 };
+	static const uint8_t dict_sizes[] = { 8, 4 };
+	const struct arrow_column *ac;
+	size_t sf[2], ff[6], tf[2], df[2], fields;
+	unsigned int i;
+
+	fbb_ref(b, at, fbb_table(b, 2, schema_sizes, sf));
+	fields = fbb_vector(b, sf[1], ARROW_NCOLUMNS, 4, 4);
+	for (i = 0; i < ARROW_NCOLUMNS; i++) {
+		ac = &arrow_columns[i];
+		field_sizes[4] = ac->dict >= 0 ? 4 : 0;
+		fbb_ref(b, fields + i * 4, fbb_table(b, 6, field_sizes, ff));
+		fbb_string(b, ff[0], ac->name);
+		b->buf[ff[1]] = ac->nullable;
+		b->buf[ff[2]] = ac->type;
+		if (ac->type == ARROW_TYPE_INT) {
+			fbb_ref(b, ff[3], fbb_table(b, 2, int_sizes, tf));
+			cocofs_le32enc(b->buf + tf[0], ac->bits);
+		} else {
+			fbb_ref(b, ff[3], fbb_table(b, 0, NULL, tf));
+		}
+		if (ac->dict >= 0) {
+			fbb_ref(b, ff[4], fbb_table(b, 2, dict_sizes, df));
+			cocofs_le64enc(b->buf + df[0], (uint64_t)ac->dict);
+			fbb_ref(b, df[1], fbb_table(b, 2, int_sizes, tf));
+			cocofs_le32enc(b->buf + tf[0], 32);
+			b->buf[tf[1]] = 1;	/* signed */
+		}
+		fbb_vector(b, ff[5], 0, 4, 4);	/* no children */
+	}
+}
+
+/*
+ * Start a message, returning where its header goes (and where its body
+ * length goes, in *bodylenp).
+ */
+static size_t
+arrow_message(struct fbb *b, uint8_t type, size_t *bodylenp)
+{
+	static const uint8_t msg_sizes[] = { 2, 1, 4, 8 };
+	size_t mf[4];
+
+	b->len = 0;
+	fbb_alloc(b, 4, 4);
+	fbb_ref(b, 0, fbb_table(b, 4, msg_sizes, mf));
+	fbb_u16(b, mf[0], ARROW_V5);
+	b->buf[mf[1]] = type;
+	*bodylenp = mf[3];
+	return mf[2];
+}
+
+/*
+ * Add a RecordBatch table describing columns laid out one after the
+ * other in the body (as arrow_body() does), and return the body size.
+ */
+static uint64_t
+arrow_record_batch(struct fbb *b, size_t at, const struct arrow_col *cols,
+    const struct arrow_column *defs, unsigned int ncols, uint32_t nrows)
+{
+	static const uint8_t rb_sizes[] = { 8, 4, 4 };
+	const struct arrow_buf *bufs[3];
+	size_t rf[3], nodes, buffers;
+	uint64_t off = 0, len;
+	unsigned int i, j, nbufs, nb;
+
+	for (i = 0, nbufs = 0; i < ncols; i++) {
+		nbufs += defs[i].type == ARROW_TYPE_INT ||
+		    defs[i].dict >= 0 ? 2 : 3;
+	}
+	fbb_ref(b, at, fbb_table(b, 3, rb_sizes, rf));
+	cocofs_le64enc(b->buf + rf[0], nrows);
+	nodes = fbb_vector(b, rf[1], ncols, 16, 8);
+	buffers = fbb_vector(b, rf[2], nbufs, 16, 8);
+	for (i = 0, nb = 0; i < ncols; i++) {
+		cocofs_le64enc(b->buf + nodes + i * 16, nrows);
+		cocofs_le64enc(b->buf + nodes + i * 16 + 8, cols[i].nnulls);
+		bufs[0] = &cols[i].valid;
+		bufs[1] = &cols[i].offsets;
+		bufs[2] = &cols[i].data;
+		for (j = 0; j < 3; j++) {
+			if (j == 1 && (defs[i].type == ARROW_TYPE_INT ||
+				       defs[i].dict >= 0)) {
+				continue;
+			}
+			len = j == 0 && cols[i].nnulls == 0 ? 0 : bufs[j]->len;
+			cocofs_le64enc(b->buf + buffers + nb * 16, off);
+			cocofs_le64enc(b->buf + buffers + nb * 16 + 8, len);
+			nb++;
+			off += (len + 7) & ~7ULL;
+		}
+	}
+	return off;
+}
+
+/*
+ * Append the columns' buffers, each padded out to 8 bytes.
+ */
+static void
+arrow_body(struct arrow_buf *out, const struct arrow_col *cols,
+    const struct arrow_column *defs, unsigned int ncols)
+{
+	static const uint8_t pad[8];
+	const struct arrow_buf *bufs[3];
+	unsigned int i, j;
+	size_t len;
+
+	for (i = 0; i < ncols; i++) {
+		bufs[0] = &cols[i].valid;
+		bufs[1] = &cols[i].offsets;
+		bufs[2] = &cols[i].data;
+		for (j = 0; j < 3; j++) {
+			if (j == 1 && (defs[i].type == ARROW_TYPE_INT ||
+				       defs[i].dict >= 0)) {
+				continue;
+			}
+			len = j == 0 && cols[i].nnulls == 0 ? 0 : bufs[j]->len;
+			arrow_buf_put(out, bufs[j]->data, len);
+			arrow_buf_put(out, pad, -len & 7);
+		}
+	}
+}
+
+/*
+ * Frame a message for the file: a continuation marker, the padded
+ * metadata length, and the metadata.  The body comes next.
+ */
+static void
+arrow_frame(struct arrow_buf *out, struct fbb *b, struct arrow_block *blk)
+{
+	uint8_t hdr[8];
+
+	fbb_alloc(b, 0, 8);
+	cocofs_le32enc(hdr, 0xffffffff);
+	cocofs_le32enc(hdr + 4, (uint32_t)b->len);
+	out->len = 0;
+	arrow_buf_put(out, hdr, sizeof(hdr));
+	arrow_buf_put(out, b->buf, b->len);
+	blk->metalen = (uint32_t)out->len;
+}
+
+/*
+ * Claim the next spot in the file for a message and write it there.
+ */
+static bool
+arrow_write(const struct arrow_buf *out, struct arrow_block *blk,
+    bool batch)
+{
+	uint64_t off;
+	size_t n;
+	ssize_t rv;
+
+	pthread_mutex_lock(&arrow.lock);
+	off = arrow.off;
+	arrow.off += out->len;
+	blk->offset = off;
+	if (batch) {
+		if (arrow.nbatches == arrow.maxbatches) {
+			arrow.maxbatches = arrow.maxbatches ?
+			    arrow.maxbatches * 2 : 64;
+			arrow.batches = realloc(arrow.batches,
+			    arrow.maxbatches * sizeof(*arrow.batches));
+			assert(arrow.batches != NULL);
+		}
+		arrow.batches[arrow.nbatches++] = *blk;
+	}
+	pthread_mutex_unlock(&arrow.lock);
+
+	for (n = 0; n < out->len; n += rv) {
+		rv = cocofs_pwrite(arrow.fd, out->data + n, out->len - n,
+		    (off_t)(off + n));
+		if (rv <= 0) {
+			fprintf(stderr, "export-arrow: write failed: %s\n",
+			    rv == 0 ? "short write" : strerror(errno));
+			pthread_mutex_lock(&arrow.lock);
+			arrow.failed = true;
+			pthread_mutex_unlock(&arrow.lock);
+			return false;
+		}
+	}
+	return true;
+}
+
+struct arrow_batch {
+	struct arrow_col cols[ARROW_NCOLUMNS];
+	uint32_t	nrows;
+	struct fbb	meta;
+	struct arrow_buf out;
+};
+
+/*
+ * Write out a worker's batch (if it has anything in it) and start a
+ * new one.
+ */
+static void
+arrow_flush(struct arrow_batch *ab)
+{
+	struct arrow_block blk;
+	unsigned int i;
+	size_t hdr, bodylen;
+
+	if (ab->nrows == 0) {
+		return;
+	}
+	hdr = arrow_message(&ab->meta, ARROW_MSG_RECORDBATCH, &bodylen);
+	cocofs_le64enc(ab->meta.buf + bodylen,
+	    arrow_record_batch(&ab->meta, hdr, ab->cols, arrow_columns,
+			       ARROW_NCOLUMNS, ab->nrows));
+	arrow_frame(&ab->out, &ab->meta, &blk);
+	arrow_body(&ab->out, ab->cols, arrow_columns, ARROW_NCOLUMNS);
+	blk.bodylen = ab->out.len - blk.metalen;
+	arrow_write(&ab->out, &blk, true);
+
+	pthread_mutex_lock(&arrow.lock);
+	arrow.nrows += ab->nrows;
+	pthread_mutex_unlock(&arrow.lock);
+	for (i = 0; i < ARROW_NCOLUMNS; i++) {
+		arrow_col_clear(&ab->cols[i]);
+	}
+	ab->nrows = 0;
+}
+
+/*
+ * Add a row for each file in an image.  The dictionary lookups for the
+ * whole image are done under the lock at once.
+ */
+static void
+arrow_add_image(struct arrow_batch *ab, const struct cocofs *fs,
+    uint32_t image)
+{
+	uint32_t ids[COCOFS_DIR_TRACK_NENTRIES][3];
+	uint32_t sizes[COCOFS_DIR_TRACK_NENTRIES];
+	const struct cocofs_dirent *dir;
+	struct cocofs_stat st;
+	struct arrow_col *cols = ab->cols;
+	char name[8+1+3+1];
+	uint8_t chain[COCOFS_NGRANULES];
+	unsigned int di, i, n, nextents;
+	uint64_t hash;
+	bool ok;
+
+	pthread_mutex_lock(&arrow.lock);
+	for (di = 0; di < COCOFS_DIR_TRACK_NENTRIES; di++) {
+		dir = &fs->directory[di];
+		if (! cocofs_dirent_is_file(dir)) {
+			continue;
+		}
+		cocofs_stat(fs, dir, &st);
+		snprintf(name, sizeof(name), "%s%s%s", st.st_name,
+		    st.st_ext[0] != '\0' ? "." : "", st.st_ext);
+		sizes[di] = st.st_size;
+		ids[di][0] = arrow_dict_intern(&arrow.dict[1], name);
+		ids[di][1] = arrow_dict_intern(&arrow.dict[2],
+		    cocofs_dir_type(dir->d_type));
+		ids[di][2] = arrow_dict_intern(&arrow.dict[3],
+		    cocofs_dir_encoding(dir->d_encoding));
+	}
+	pthread_mutex_unlock(&arrow.lock);
+
+	for (di = 0; di < COCOFS_DIR_TRACK_NENTRIES; di++) {
+		dir = &fs->directory[di];
+		if (! cocofs_dirent_is_file(dir)) {
+			continue;
+		}
+
+		ok = cocofs_hash_file(fs, dir, sizes[di], &hash, chain, &n);
+		for (i = 0, nextents = 0; i < n; i++) {
+			if (i == 0 || chain[i] != chain[i - 1] + 1) {
+				nextents++;
+			}
+		}
+
+		arrow_col_put_int(&cols[ARROW_C_IMAGE], ab->nrows, image, 32);
+		arrow_col_put_int(&cols[ARROW_C_SLOT], ab->nrows, di, 8);
+		arrow_col_put_int(&cols[ARROW_C_NAME], ab->nrows,
+		    ids[di][0], 32);
+		arrow_col_put_int(&cols[ARROW_C_TYPE], ab->nrows,
+		    ids[di][1], 32);
+		arrow_col_put_int(&cols[ARROW_C_ENCODING], ab->nrows,
+		    ids[di][2], 32);
+		arrow_col_put_int(&cols[ARROW_C_SIZE], ab->nrows,
+		    sizes[di], 32);
+		arrow_col_put_int(&cols[ARROW_C_FIRST], ab->nrows,
+		    dir->d_first_granule, 8);
+		arrow_col_put_int(&cols[ARROW_C_GRANULES], ab->nrows, n, 8);
+		arrow_col_put_int(&cols[ARROW_C_EXTENTS], ab->nrows,
+		    nextents, 8);
+		arrow_col_put(&cols[ARROW_C_CHAIN], ab->nrows, chain, n, true);
+		if (ok) {
+			arrow_col_put_int(&cols[ARROW_C_HASH], ab->nrows,
+			    hash, 64);
+		} else {
+			arrow_col_put(&cols[ARROW_C_HASH], ab->nrows, NULL,
+			    8, false);
+		}
+		ab->nrows++;
+	}
+}
+
+static void *
+arrow_worker(void *arg)
+{
+	struct worker *w = arg;
+	struct arrow_batch *ab;
+	struct cocofs *fs;
+	unsigned int c;
+	size_t i;
+
+	curworker = w;
+	trace_thread_start(w);
+	metrics_thread_start(w);
+
+	ab = calloc(1, sizeof(*ab));
+	assert(ab != NULL);
+	for (;;) {
+		pthread_mutex_lock(&scan.lock);
+		i = scan.next++;
+		pthread_mutex_unlock(&scan.lock);
+		if (i >= scan.npaths) {
+			break;
+		}
+		fs = scan_load_image(w, scan.paths[i]);
+		if (fs == NULL) {
+			continue;
+		}
+		arrow_add_image(ab, fs, (uint32_t)i);
+		cocofs_close(fs);
+		if (ab->nrows >= ARROW_BATCH_ROWS) {
+			arrow_flush(ab);
+		}
+	}
+	arrow_flush(ab);
+
+	for (c = 0; c < ARROW_NCOLUMNS; c++) {
+		arrow_col_free(&ab->cols[c]);
+	}
+	free(ab->meta.buf);
+	free(ab->out.data);
+	free(ab);
+	free(w->direct_buf);
+	w->direct_buf = NULL;
+	if (w != &mainworker) {
+		trace_thread_done(w);
+	}
+	return NULL;
+}
+
+/*
+ * Write the footer: the schema again, and where all of the dictionaries
+ * and record batches are.
+ */
+static bool
+arrow_finish(const struct arrow_block *dicts)
+{
+	static const uint8_t footer_sizes[] = { 2, 4, 4, 4 };
+	static const uint8_t eos[8] = { 0xff, 0xff, 0xff, 0xff };
+	const struct arrow_block *blk;
+	struct arrow_buf out = { NULL, 0, 0 };
+	struct arrow_block dummy;
+	struct fbb b = { NULL, 0, 0 };
+	size_t ff[4], v;
+	uint8_t len[4];
+	unsigned int i;
+	bool rv;
+
+	fbb_alloc(&b, 4, 4);
+	fbb_ref(&b, 0, fbb_table(&b, 4, footer_sizes, ff));
+	fbb_u16(&b, ff[0], ARROW_V5);
+	arrow_schema(&b, ff[1]);
+	v = fbb_vector(&b, ff[2], ARROW_NDICTS, 24, 8);
+	for (i = 0; i < ARROW_NDICTS + arrow.nbatches; i++) {
+		if (i == ARROW_NDICTS) {
+			v = fbb_vector(&b, ff[3], (uint32_t)arrow.nbatches,
+			    24, 8);
+		}
+		blk = i < ARROW_NDICTS ? &dicts[i]
+				       : &arrow.batches[i - ARROW_NDICTS];
+		cocofs_le64enc(b.buf + v, blk->offset);
+		cocofs_le32enc(b.buf + v + 8, blk->metalen);
+		cocofs_le64enc(b.buf + v + 16, blk->bodylen);
+		v += 24;
+	}
+	if (arrow.nbatches == 0) {
+		fbb_vector(&b, ff[3], 0, 24, 8);
+	}
+
+	arrow_buf_put(&out, eos, sizeof(eos));
+	arrow_buf_put(&out, b.buf, b.len);
+	cocofs_le32enc(len, (uint32_t)b.len);
+	arrow_buf_put(&out, len, sizeof(len));
+	arrow_buf_put(&out, ARROW_MAGIC, strlen(ARROW_MAGIC));
+	rv = arrow_write(&out, &dummy, false);
+	free(out.data);
+	free(b.buf);
+	return rv;
+}
+
+static int
+cmd_export_arrow(int argc, char *argv[])
+{
+	static const struct arrow_column dict_column = {
+		"", ARROW_TYPE_UTF8, 0, -1, false
+	};
+	static const uint8_t dict_sizes[] = { 8, 4 };
+	static const char magic[8] = ARROW_MAGIC;
+	struct arrow_block dicts[ARROW_NDICTS], blk;
+	struct arrow_buf out = { NULL, 0, 0 };
+	struct arrow_dict *d;
+	struct worker *workers;
+	struct fbb b = { NULL, 0, 0 };
+	struct stat sb;
+	size_t hdr, bodylen, df[2], i;
+	unsigned int j;
+
+	if (argc != 2) {
+		return usage();
+	}
+	if (stat(argv[0], &sb) == -1) {
+		fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if (S_ISDIR(sb.st_mode) ? !scan_walk(argv[0])
+				: !scan_read_list(argv[0])) {
+		scan.eval = EXIT_FAILURE;
+	}
+	if (scan.npaths != 0) {
+		qsort(scan.paths, scan.npaths, sizeof(*scan.paths),
+		    scan_compare);
+	}
+
+	arrow.fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC | O_BINARY,
+	    0644);
+	if (arrow.fd == -1) {
+		fprintf(stderr, "unable to create %s: %s\n", argv[1],
+		    strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	/* The images are their own dictionary, in the order scanned. */
+	d = &arrow.dict[0];
+	for (i = 0; i < scan.npaths; i++) {
+		arrow_col_put(&d->col, (uint32_t)i, scan.paths[i],
+		    strlen(scan.paths[i]), true);
+	}
+	d->n = (uint32_t)scan.npaths;
+
+	/* The file starts with the magic number and the schema. */
+	hdr = arrow_message(&b, ARROW_MSG_SCHEMA, &bodylen);
+	arrow_schema(&b, hdr);
+	arrow_frame(&out, &b, &blk);
+	arrow.off = sizeof(magic);
+	if (cocofs_pwrite(arrow.fd, magic, sizeof(magic), 0) !=
+	    (ssize_t)sizeof(magic) || ! arrow_write(&out, &blk, false)) {
+		fprintf(stderr, "unable to write %s: %s\n", argv[1],
+		    strerror(errno));
+		close(arrow.fd);
+		return EXIT_FAILURE;
+	}
+
+	if (opts.jobs <= 1) {
+		arrow_worker(&mainworker);
+	} else {
+		workers = calloc(opts.jobs, sizeof(*workers));
+		assert(workers != NULL);
+		for (j = 0; j < opts.jobs; j++) {
+			workers[j].id = j + 1;
+			workers[j].image_fd = -1;
+			if (pthread_create(&workers[j].thread, NULL,
+					   arrow_worker, &workers[j]) != 0) {
+				fprintf(stderr,
+				    "export-arrow: unable to create worker\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		for (j = 0; j < opts.jobs; j++) {
+			pthread_join(workers[j].thread, NULL);
+		}
+		free(workers);
+	}
+
+	/* Now that they're complete, the dictionaries. */
+	for (j = 0; j < ARROW_NDICTS; j++) {
+		d = &arrow.dict[j];
+		if (d->n == 0) {
+			arrow_buf_put_le(&d->col.offsets, 0, 32);
+		}
+		hdr = arrow_message(&b, ARROW_MSG_DICTIONARY, &bodylen);
+		fbb_ref(&b, hdr, fbb_table(&b, 2, dict_sizes, df));
+		cocofs_le64enc(b.buf + df[0], j);
+		cocofs_le64enc(b.buf + bodylen,
+		    arrow_record_batch(&b, df[1], &d->col, &dict_column, 1,
+				       d->n));
+		arrow_frame(&out, &b, &dicts[j]);
+		arrow_body(&out, &d->col, &dict_column, 1);
+		dicts[j].bodylen = out.len - dicts[j].metalen;
+		arrow_write(&out, &dicts[j], false);
+	}
+	arrow_finish(dicts);
+	if (close(arrow.fd) == -1) {
+		fprintf(stderr, "unable to write %s: %s\n", argv[1],
+		    strerror(errno));
+		arrow.failed = true;
+	}
+
+	fprintf(stderr, "export-arrow: %" PRIu64 " file%s from %zu image%s "
+	    "in %zu batch%s\n", arrow.nrows, plural((long)arrow.nrows),
+	    scan.npaths, plural((long)scan.npaths), arrow.nbatches,
+	    arrow.nbatches == 1 ? "" : "es");
+
+	for (j = 0; j < ARROW_NDICTS; j++) {
+		arrow_col_free(&arrow.dict[j].col);
+		free(arrow.dict[j].slots);
+	}
+	free(arrow.batches);
+	free(out.data);
+	free(b.buf);
+	return arrow.failed ? EXIT_FAILURE : scan.eval;
+}
+
+/*
+ * Building a database.  The list names one title per line:
+ *
+ *	title <TAB> version <TAB> path
+ *
+ * where path is a disk image (all of whose files are that title) or a
+ * single host file.  If the same contents are listed more than once,
+ * the first title listed wins.
+ */
+struct iddb_key {
+	uint64_t	hash;
+	uint32_t	size;
+	uint32_t	title;		/* string offsets */
+	uint32_t	version;
+	uint32_t	name;
+	uint32_t	seq;		/* in the list */
+	uint32_t	bucket;
+};
+
+static struct {
+	struct iddb_key	*keys;
+	size_t		nkeys;
+	size_t		maxkeys;
+	char		*strings;
+	size_t		strsize;
+	size_t		maxstrings;
+} mkiddb;
+
+static uint32_t
+mkiddb_string(const char *s)
+{
+	size_t len = strlen(s) + 1;
+	uint32_t off = (uint32_t)mkiddb.strsize;
+
+	if (mkiddb.strsize + len > mkiddb.maxstrings) {
+		mkiddb.maxstrings = mkiddb.maxstrings ?
+		    mkiddb.maxstrings * 2 : 4096;
+		if (mkiddb.maxstrings < mkiddb.strsize + len) {
+			mkiddb.maxstrings = mkiddb.strsize + len;
+		}
+		mkiddb.strings = realloc(mkiddb.strings, mkiddb.maxstrings);
+		assert(mkiddb.strings != NULL);
+	}
+	memcpy(mkiddb.strings + mkiddb.strsize, s, len);
+	mkiddb.strsize += len;
+	return off;
+}
+
+static void
+mkiddb_add(uint64_t hash, uint32_t size, uint32_t title, uint32_t version,
+    const char *name)
+{
+	struct iddb_key *k;
+
+	if (mkiddb.nkeys == mkiddb.maxkeys) {
+		mkiddb.maxkeys = mkiddb.maxkeys ? mkiddb.maxkeys * 2 : 1024;
+		mkiddb.keys = realloc(mkiddb.keys,
+		    mkiddb.maxkeys * sizeof(*mkiddb.keys));
+		assert(mkiddb.keys != NULL);
+	}
+	k = &mkiddb.keys[mkiddb.nkeys];
+	k->seq = (uint32_t)mkiddb.nkeys++;
+	k->hash = hash;
+	k->size = size;
+	k->title = title;
+	k->version = version;
+	k->name = mkiddb_string(name);
+}
+
+static bool
+mkiddb_add_path(const char *path, uint32_t title, uint32_t version)
+{
+	const struct cocofs_dirent *dir;
+	struct cocofs_stat st;
+	struct cocofs *fs;
+	const char *base;
+	char name[8+1+3+1];
+	uint8_t *data;
+	unsigned int di;
+	uint64_t hash;
+	size_t size;
+	int fd;
+
+	if (! scan_is_image(path)) {
+		if (! read_host_file(path, &data, &size)) {
+			return false;
+		}
+		if (size > UINT32_MAX) {
+			fprintf(stderr, "%s: too big\n", path);
+			free(data);
+			return false;
+		}
+		base = strrchr(path, '/');
+		mkiddb_add(fnv1a_64(data, size, FNV1A_64_INIT),
+		    (uint32_t)size, title, version,
+		    base != NULL ? base + 1 : path);
+		free(data);
+		return true;
+	}
+
+	fd = open(path, O_RDONLY | O_BINARY);
+	if (fd == -1) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return false;
+	}
+	fs = cocofs_load(fd, path);
+	if (fs == NULL) {
+		close(fd);
+		return false;
+	}
+	for (di = 0; di < COCOFS_DIR_TRACK_NENTRIES; di++) {
+		dir = &fs->directory[di];
+		if (! cocofs_dirent_is_file(dir)) {
+			continue;
+		}
+		cocofs_stat(fs, dir, &st);
+		snprintf(name, sizeof(name), "%s%s%s", st.st_name,
+		    st.st_ext[0] != '\0' ? "." : "", st.st_ext);
+		if (! cocofs_hash_file(fs, dir, st.st_size, &hash, NULL,
+				       NULL)) {
+			fprintf(stderr, "%s: %s: invalid granule chain, "
+			    "skipped\n", path, name);
+			continue;
+		}
+		mkiddb_add(hash, st.st_size, title, version, name);
+	}
+	cocofs_close(fs);
+	return true;
+}
+
+static int
+mkiddb_compare(const void *a, const void *b)
+{
+	const struct iddb_key *ka = a, *kb = b;
+
+	if (ka->hash != kb->hash) {
+		return ka->hash < kb->hash ? -1 : 1;
+	}
+	if (ka->size != kb->size) {
+		return ka->size < kb->size ? -1 : 1;
+	}
+	/* Keep the list order, so that the first one listed wins. */
+	return ka->seq < kb->seq ? -1 : ka->seq > kb->seq;
+}
+
+/*
+ * Find a seed for each bucket, biggest buckets first, that sends its
+ * keys to entries not yet taken.  Returns false if some bucket can't be
+ * placed with this salt.
+ */
+#define	IDDB_MAXBUCKET		32
+
+static bool
+mkiddb_place(uint64_t salt, uint32_t nbuckets, uint32_t *seeds,
+    uint32_t *slots)
+{
+	struct iddb_key *keys = mkiddb.keys;
+	uint32_t nkeys = (uint32_t)mkiddb.nkeys;
+	uint32_t *start, *fill, *members, b, i, j, n, bsize, maxsize;
+	uint32_t seed, bslots[IDDB_MAXBUCKET];
+	uint8_t *taken;
+	bool rv = false;
+
+	start = calloc(nbuckets + 1, sizeof(*start));
+	fill = calloc(nbuckets, sizeof(*fill));
+	members = calloc(nkeys, sizeof(*members));
+	taken = calloc(nkeys, 1);
+	assert(start != NULL && fill != NULL && members != NULL &&
+	    taken != NULL);
+
+	/* Gather up the keys in each bucket. */
+	for (i = 0; i < nkeys; i++) {
+		b = iddb_bucket(keys[i].hash, salt, nbuckets);
+		keys[i].bucket = b;
+		start[b + 1]++;
+	}
+	for (b = 0, maxsize = 0; b < nbuckets; b++) {
+		if (start[b + 1] > maxsize) {
+			maxsize = start[b + 1];
+		}
+		start[b + 1] += start[b];
+	}
+	if (maxsize > IDDB_MAXBUCKET) {
+		goto out;
+	}
+	for (i = 0; i < nkeys; i++) {
+		b = keys[i].bucket;
+		members[start[b] + fill[b]++] = i;
+	}
+
+	for (bsize = maxsize; bsize > 0; bsize--) {
+		for (b = 0; b < nbuckets; b++) {
+			n = start[b + 1] - start[b];
+			if (n != bsize) {
+				continue;
+			}
+			for (seed = 0; seed < IDDB_MAXTRIES; seed++) {
+				for (i = 0; i < n; i++) {
+					bslots[i] = iddb_slot(
+					    keys[members[start[b] + i]].hash,
+					    salt, seed, nkeys);
+					if (taken[bslots[i]]) {
+						break;
+					}
+					for (j = 0; j < i; j++) {
+						if (bslots[j] == bslots[i]) {
+							break;
+						}
+					}
+					if (j < i) {
+						break;
+					}
+				}
+				if (i == n) {
+					break;
+				}
+			}
+			if (seed == IDDB_MAXTRIES) {
+				goto out;
+			}
+			seeds[b] = seed;
+			for (i = 0; i < n; i++) {
+				taken[bslots[i]] = 1;
+				slots[bslots[i]] = members[start[b] + i];
+			}
+		}
+	}
+	rv = true;
+ out:
+	free(start);
+	free(fill);
+	free(members);
+	free(taken);
+	return rv;
+}
+
+static int
+cmd_mkiddb(int argc, char *argv[])
+{
+	char line[PATH_MAX + 512], *title, *version, *path;
+	uint32_t nkeys, nbuckets, b, i, *seeds, *slots;
+	size_t n, size, off_seeds, off_entries, off_strings;
+	struct iddb_key *k;
+	uint64_t salt;
+	uint8_t *buf, *ent;
+	unsigned long lineno = 0;
+	FILE *fp;
+	bool rv;
+
+	if (argc != 2) {
+		return usage();
+	}
+	fp = fopen(argv[1], "r");
+	if (fp == NULL) {
+		fprintf(stderr, "%s: %s\n", argv[1], strerror(errno));
+		return EXIT_FAILURE;
+	}
+	mkiddb_string("");
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		line[strcspn(line, "\r\n")] = '\0';
+		if (line[0] == '\0' || line[0] == '#') {
+			continue;
+		}
+		title = line;
+		version = strchr(title, '\t');
+		path = version != NULL ? strchr(version + 1, '\t') : NULL;
+		if (path == NULL) {
+			fprintf(stderr, "%s:%lu: expected title, version "
+			    "and path, separated by tabs\n", argv[1], lineno);
+			fclose(fp);
+			return EXIT_FAILURE;
+		}
+		*version++ = '\0';
+		*path++ = '\0';
+		if (! mkiddb_add_path(path, mkiddb_string(title),
+				      mkiddb_string(version))) {
+			fclose(fp);
+			return EXIT_FAILURE;
+		}
+	}
+	fclose(fp);
+	if (mkiddb.nkeys > UINT32_MAX / 2) {
+		fprintf(stderr, "%s: too many files\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	/*
+	 * Weed out the duplicates.  Two different files with the same
+	 * hash would land in the same slot for every salt, so refuse them
+	 * rather than searching forever.
+	 */
+	if (mkiddb.nkeys != 0) {
+		qsort(mkiddb.keys, mkiddb.nkeys, sizeof(*mkiddb.keys),
+		    mkiddb_compare);
+	}
+	for (i = 0, n = 0; i < mkiddb.nkeys; i++) {
+		k = &mkiddb.keys[i];
+		if (n != 0 && mkiddb.keys[n - 1].hash == k->hash) {
+			if (mkiddb.keys[n - 1].size == k->size) {
+				continue;
+			}
+			fprintf(stderr, "%s: %s and %s have the same hash\n",
+			    argv[1], mkiddb.strings + mkiddb.keys[n - 1].name,
+			    mkiddb.strings + k->name);
+			free(mkiddb.keys);
+			free(mkiddb.strings);
+			return EXIT_FAILURE;
+		}
+		mkiddb.keys[n++] = *k;
+	}
+	mkiddb.nkeys = n;
+	nkeys = (uint32_t)n;
+	nbuckets = nkeys / IDDB_KEYS_PER_BUCKET + 1;
+
+	seeds = calloc(nbuckets, sizeof(*seeds));
+	slots = calloc(nkeys ? nkeys : 1, sizeof(*slots));
+	assert(seeds != NULL && slots != NULL);
+	for (salt = FNV1A_64_INIT;
+	     nkeys != 0 && ! mkiddb_place(salt, nbuckets, seeds, slots);
+	     salt = hash_mix64(salt)) {
+		/* Unlucky; try again with another salt. */
+	}
+
+	off_seeds = IDDB_HDRSIZE;
+	off_entries = (off_seeds + (size_t)nbuckets * 4 + 7) & ~(size_t)7;
+	off_strings = off_entries + (size_t)nkeys * IDDB_ENTSIZE;
+	size = off_strings + mkiddb.strsize;
+	buf = calloc(1, size);
+	assert(buf != NULL);
+	memcpy(buf, IDDB_MAGIC, sizeof(IDDB_MAGIC));
+	cocofs_le32enc(buf + IDDB_H_NKEYS, nkeys);
+	cocofs_le32enc(buf + IDDB_H_NBUCKETS, nbuckets);
+	cocofs_le64enc(buf + IDDB_H_SALT, salt);
+	cocofs_le64enc(buf + IDDB_H_SEEDS, off_seeds);
+	cocofs_le64enc(buf + IDDB_H_ENTRIES, off_entries);
+	cocofs_le64enc(buf + IDDB_H_STRINGS, off_strings);
+	for (b = 0; b < nbuckets; b++) {
+		cocofs_le32enc(buf + off_seeds + (size_t)b * 4, seeds[b]);
+	}
+	for (i = 0; i < nkeys; i++) {
+		k = &mkiddb.keys[slots[i]];
+		ent = buf + off_entries + (size_t)i * IDDB_ENTSIZE;
+		cocofs_le64enc(ent + IDDB_E_HASH, k->hash);
+		cocofs_le32enc(ent + IDDB_E_SIZE, k->size);
+		cocofs_le32enc(ent + IDDB_E_TITLE, k->title);
+		cocofs_le32enc(ent + IDDB_E_VERSION, k->version);
+		cocofs_le32enc(ent + IDDB_E_NAME, k->name);
+	}
+	memcpy(buf + off_strings, mkiddb.strings, mkiddb.strsize);
+
+	rv = write_file_atomic(argv[0], buf, size);
+	if (rv) {
+		printf("%u file%s, %u bucket%s, %zu bytes\n", nkeys,
+		    plural(nkeys), nbuckets, plural(nbuckets), size);
+	}
+	free(buf);
+	free(seeds);
+	free(slots);
+	free(mkiddb.keys);
+	free(mkiddb.strings);
+	return rv ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*
+ * Shared code detection.  coderefs splits the code in every LOADM
+ * segment of every machine language program in the archive into
+ * content-defined chunks, and builds an inverted index from chunk
+ * hashes to the programs that contain them.  Programs that share a lot
+ * of chunks share routines: the same library, or one is a patched (or
+ * cracked) copy of the other.
+ *
+ * Chunk boundaries come from a gear rolling hash, so they depend only
+ * on the nearby code: an inserted or patched instruction disturbs the
+ * chunks around it, but the rest of the program still chunks the same
+ * way.
+ *
+ * Only the chunks whose (mixed) hash is 0 modulo the sampling interval
+ * are indexed.  That's a consistent sample -- a chunk is either kept
+ * wherever it appears, or nowhere -- so shared chunks are still found,
+ * in proportion.  If the index outgrows its memory budget, the
+ * interval is doubled and the chunks that no longer qualify are
+ * dropped, which keeps the sample consistent.
+ */
+#define	CODEREFS_MIN_CHUNK	16
+#define	CODEREFS_MAX_CHUNK	256
+#define	CODEREFS_MASK		(0x3fULL << 58)	/* 64 byte average */
+#define	CODEREFS_MAXGROUP	64	/* chunks wider than this are common */
+#define	CODEREFS_DEFAULT_MEM	(256UL * 1024 * 1024)
+
+struct coderefs_ref {
+	uint64_t	hash;
+	uint32_t	bin;
+	uint16_t	len;
+};
+
+struct coderefs_bin {
+	uint32_t	image;
+	uint32_t	entry;		/* in the directory */
+	char		name[8+1+3+1];
+	uint32_t	nchunks;	/* in the final sample */
+};
+
+static struct {
+	uint64_t	gear[256];
+	uint64_t	interval;	/* sampling; a power of 2 */
+	struct coderefs_ref *refs;
+	size_t		nrefs;
+	size_t		maxrefs;
+	size_t		limit;		/* the memory budget */
+	struct coderefs_bin *bins;
+	size_t		nbins;
+	size_t		maxbins;
+	unsigned long	nchunks;	/* before sampling */
+	unsigned long	invalid;	/* not LOADM files */
+	pthread_mutex_t	lock;
+} coderefs = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static bool
+coderefs_sampled(uint64_t hash, uint64_t interval)
+{
+	return (hash_mix64(hash) & (interval - 1)) == 0;
+}
+
+static int
+coderefs_ref_compare(const void *a, const void *b)
+{
+	const struct coderefs_ref *ra = a, *rb = b;
+
+	if (ra->hash != rb->hash) {
+		return ra->hash < rb->hash ? -1 : 1;
+	}
+	return ra->bin < rb->bin ? -1 : ra->bin > rb->bin;
+}
+
+/*
+ * Chunk one segment, appending the chunks that are in the sample.
+ */
+static void
+coderefs_chunk(const uint8_t *data, size_t len, uint64_t interval,
+    struct coderefs_ref **refsp, size_t *nrefsp, size_t *maxrefsp,
+    unsigned long *nchunksp)
+{
+	struct coderefs_ref *r;
+	size_t start, pos;
+	uint64_t g, h;
+
+	/*
+	 * The gear hash rolls on across cut points, so whether a byte
+	 * ends a chunk depends only on the 64 bytes before it; shared
+	 * code re-synchronizes shortly after it starts.
+	 */
+	g = 0;
+	for (start = pos = 0; len - start >= CODEREFS_MIN_CHUNK; start = pos) {
+		while (pos < len) {
+			g = (g << 1) + coderefs.gear[data[pos++]];
+			if (pos - start >= CODEREFS_MAX_CHUNK ||
+			    (pos - start >= CODEREFS_MIN_CHUNK &&
+			     (g & CODEREFS_MASK) == 0)) {
+				break;
+			}
+		}
+		if (pos - start < CODEREFS_MIN_CHUNK) {
+			break;
+		}
+		(*nchunksp)++;
+		h = fnv1a_64(data + start, pos - start, FNV1A_64_INIT);
+		if (! coderefs_sampled(h, interval)) {
+			continue;
+		}
+		if (*nrefsp == *maxrefsp) {
+			*maxrefsp = *maxrefsp ? *maxrefsp * 2 : 256;
+			*refsp = realloc(*refsp, *maxrefsp * sizeof(**refsp));
+			assert(*refsp != NULL);
+		}
+		r = &(*refsp)[(*nrefsp)++];
+		r->hash = h;
+		r->bin = 0;
+		r->len = (uint16_t)(pos - start);
+	}
+}
+
+/*
+ * Add one program's chunks to the index (once each), making room by
+ * sampling more sparsely if need be.
+ */
+static void
+coderefs_add(uint32_t image, uint32_t entry, const char *name,
+    struct coderefs_ref *refs, size_t nrefs, unsigned long nchunks)
+{
+	uint32_t bin;
+	size_t i, n;
+
+	if (nrefs != 0) {
+		qsort(refs, nrefs, sizeof(*refs), coderefs_ref_compare);
+	}
+
+	pthread_mutex_lock(&coderefs.lock);
+	coderefs.nchunks += nchunks;
+	if (coderefs.nbins == coderefs.maxbins) {
+		coderefs.maxbins = coderefs.maxbins ?
+		    coderefs.maxbins * 2 : 256;
+		coderefs.bins = realloc(coderefs.bins,
+		    coderefs.maxbins * sizeof(*coderefs.bins));
+		assert(coderefs.bins != NULL);
+	}
+	bin = (uint32_t)coderefs.nbins++;
+	coderefs.bins[bin].image = image;
+	coderefs.bins[bin].entry = entry;
+	snprintf(coderefs.bins[bin].name, sizeof(coderefs.bins[bin].name),
+	    "%s", name);
+	coderefs.bins[bin].nchunks = 0;
+
+	for (i = 0; i < nrefs; i++) {
+		if ((i != 0 && refs[i].hash == refs[i - 1].hash) ||
+		    ! coderefs_sampled(refs[i].hash, coderefs.interval)) {
+			continue;
+		}
+		if (coderefs.nrefs == coderefs.maxrefs &&
+		    coderefs.maxrefs < coderefs.limit) {
+			coderefs.maxrefs = coderefs.maxrefs ?
+			    coderefs.maxrefs * 2 : 65536;
+			if (coderefs.maxrefs > coderefs.limit) {
+				coderefs.maxrefs = coderefs.limit;
+			}
+			coderefs.refs = realloc(coderefs.refs,
+			    coderefs.maxrefs * sizeof(*coderefs.refs));
+			assert(coderefs.refs != NULL);
+		}
+		while (coderefs.nrefs == coderefs.maxrefs &&
+		       coderefs.interval < (1ULL << 63)) {
+			coderefs.interval *= 2;
+			for (n = 0; n < coderefs.nrefs; ) {
+				if (coderefs_sampled(coderefs.refs[n].hash,
+						     coderefs.interval)) {
+					n++;
+				} else {
+					coderefs.refs[n] =
+					    coderefs.refs[--coderefs.nrefs];
+				}
+			}
+		}
+		if (coderefs.nrefs == coderefs.maxrefs ||
+		    ! coderefs_sampled(refs[i].hash, coderefs.interval)) {
+			continue;
+		}
+		coderefs.refs[coderefs.nrefs] = refs[i];
+		coderefs.refs[coderefs.nrefs].bin = bin;
+		coderefs.nrefs++;
+	}
+	pthread_mutex_unlock(&coderefs.lock);
+}
+
+static void *
+coderefs_worker(void *arg)
+{
+	struct worker *w = arg;
+	const struct cocofs_dirent *dir;
+	struct coderefs_ref *refs = NULL;
+	struct cocofs_stat st;
+	struct cocofs *fs;
+	struct loadm lm;
+	char name[8+1+3+1];
+	size_t i, nrefs, maxrefs = 0, size;
+	unsigned long nchunks;
+	unsigned int di, s;
+	uint64_t interval;
+	uint8_t *data;
+
+	curworker = w;
+	trace_thread_start(w);
+	metrics_thread_start(w);
+
+	for (;;) {
+		pthread_mutex_lock(&scan.lock);
+		i = scan.next++;
+		pthread_mutex_unlock(&scan.lock);
+		if (i >= scan.npaths) {
+			break;
+		}
+		fs = scan_load_image(w, scan.paths[i]);
+		if (fs == NULL) {
+			continue;
+		}
+		for (di = 0; di < COCOFS_DIR_TRACK_NENTRIES; di++) {
+			dir = &fs->directory[di];
+			if (! cocofs_dirent_is_file(dir) ||
+			    dir->d_type != COCOFS_DIRENT_TYPE_CODE) {
+				continue;
+			}
+			cocofs_stat(fs, dir, &st);
+			snprintf(name, sizeof(name), "%s%s%s", st.st_name,
+			    st.st_ext[0] != '\0' ? "." : "", st.st_ext);
+			if (! cocofs_read_file(fs, dir, &data, &size)) {
+				continue;
+			}
+			if (! loadm_parse(data, size, &lm)) {
+				pthread_mutex_lock(&coderefs.lock);
+				coderefs.invalid++;
+				pthread_mutex_unlock(&coderefs.lock);
+				free(data);
+				continue;
+			}
+
+			/* (A stale interval only means more to drop later.) */
+			pthread_mutex_lock(&coderefs.lock);
+			interval = coderefs.interval;
+			pthread_mutex_unlock(&coderefs.lock);
+			nrefs = 0;
+			nchunks = 0;
+			for (s = 0; s < lm.nsegs; s++) {
+				coderefs_chunk(lm.segs[s].data, lm.segs[s].len,
+				    interval, &refs, &nrefs, &maxrefs,
+				    &nchunks);
+			}
+			coderefs_add((uint32_t)i, di, name, refs, nrefs,
+			    nchunks);
+			free(lm.segs);
+			free(data);
+		}
+		cocofs_close(fs);
+	}
+
+	free(refs);
+	free(w->direct_buf);
+	w->direct_buf = NULL;
+	if (w != &mainworker) {
+		trace_thread_done(w);
+	}
+	return NULL;
+}
+
+/*
+ * The workers number the programs in whatever order they get to them.
+ * Renumber them by path (scan.paths is sorted) and name, so that ties
+ * in the output break the same way from run to run.
+ */
+static int
+coderefs_bin_compare(const void *a, const void *b)
+{
+	const struct coderefs_bin *ba = &coderefs.bins[*(const uint32_t *)a];
+	const struct coderefs_bin *bb = &coderefs.bins[*(const uint32_t *)b];
+	int rv;
+
+	if (ba->image != bb->image) {
+		return ba->image < bb->image ? -1 : 1;
+	}
+	rv = strcmp(ba->name, bb->name);
+	if (rv != 0) {
+		return rv;
+	}
+	return ba->entry < bb->entry ? -1 : ba->entry > bb->entry;
+}
+
+static void
+coderefs_renumber(void)
+{
+	struct coderefs_bin *bins;
+	uint32_t *order, *map;
+	size_t i;
+
+	if (coderefs.nbins == 0) {
+		return;
+	}
+	order = calloc(coderefs.nbins, sizeof(*order));
+	map = calloc(coderefs.nbins, sizeof(*map));
+	bins = calloc(coderefs.nbins, sizeof(*bins));
+	assert(order != NULL && map != NULL && bins != NULL);
+	for (i = 0; i < coderefs.nbins; i++) {
+		order[i] = (uint32_t)i;
+	}
+	qsort(order, coderefs.nbins, sizeof(*order), coderefs_bin_compare);
+	for (i = 0; i < coderefs.nbins; i++) {
+		bins[i] = coderefs.bins[order[i]];
+		map[order[i]] = (uint32_t)i;
+	}
+	for (i = 0; i < coderefs.nrefs; i++) {
+		coderefs.refs[i].bin = map[coderefs.refs[i].bin];
+	}
+	free(coderefs.bins);
+	coderefs.bins = bins;
+	coderefs.maxbins = coderefs.nbins;
+	free(order);
+	free(map);
+}
+
+/*
+ * Counting the chunks that each pair of programs shares.
+ */
+struct coderefs_pair {
+	uint64_t	key;		/* bin a << 32 | bin b, a < b */
+	uint32_t	count;
+	uint32_t	bytes;
+};
+
+static struct {
+	struct coderefs_pair *slots;
+	size_t		nslots;
+	size_t		n;
+} crpairs;
+
+static void
+coderefs_pair_add(uint32_t a, uint32_t b, unsigned int len)
+{
+	struct coderefs_pair *old, *p;
+	uint64_t key = (uint64_t)a << 32 | b;
+	size_t i, onslots;
+
+	if (crpairs.n * 2 >= crpairs.nslots) {
+		old = crpairs.slots;
+		onslots = crpairs.nslots;
+		crpairs.nslots = onslots ? onslots * 2 : 1024;
+		crpairs.slots = calloc(crpairs.nslots, sizeof(*crpairs.slots));
+		assert(crpairs.slots != NULL);
+		for (i = 0; i < onslots; i++) {
+			if (old[i].count == 0) {
+				continue;
+			}
+			p = &crpairs.slots[hash_mix64(old[i].key) &
+					   (crpairs.nslots - 1)];
+			while (p->count != 0) {
+				if (++p == crpairs.slots + crpairs.nslots) {
+					p = crpairs.slots;
+				}
+			}
+			*p = old[i];
+		}
+		free(old);
+	}
+
+	p = &crpairs.slots[hash_mix64(key) & (crpairs.nslots - 1)];
+	while (p->count != 0 && p->key != key) {
+		if (++p == crpairs.slots + crpairs.nslots) {
+			p = crpairs.slots;
+		}
+	}
+	if (p->count == 0) {
+		p->key = key;
+		crpairs.n++;
+	}
+	p->count++;
+	p->bytes += len;
+}
+
+static int
+coderefs_pair_compare(const void *a, const void *b)
+{
+	const struct coderefs_pair *pa = a, *pb = b;
+
+	if (pa->count != pb->count) {
+		return pa->count > pb->count ? -1 : 1;
+	}
+	return pa->key < pb->key ? -1 : pa->key > pb->key;
+}
+
+struct coderefs_group {
+	size_t		first;		/* in coderefs.refs */
+	uint32_t	nbins;
+};
+
+static int
+coderefs_group_compare(const void *a, const void *b)
+{
+	const struct coderefs_group *ga = a, *gb = b;
+
+	if (ga->nbins != gb->nbins) {
+		return ga->nbins > gb->nbins ? -1 : 1;
+	}
+	return ga->first < gb->first ? -1 : ga->first > gb->first;
+}
+
+static void
+coderefs_print_bin(uint32_t bin)
+{
+	printf("%s:%s", scan.paths[coderefs.bins[bin].image],
+	    coderefs.bins[bin].name);
+}
+
+static int
+cmd_coderefs(int argc, char *argv[])
+{
+	const struct coderefs_ref *r;
+	struct coderefs_group *groups = NULL;
+	struct coderefs_pair *p;
+	struct worker *workers;
+	struct stat sb;
+	unsigned long top = 20, interval = 1;
+	unsigned long long mem = CODEREFS_DEFAULT_MEM;
+	size_t i, j, k, g, ngroups = 0, nshared = 0, ncommon = 0;
+	uint32_t a, b;
+	unsigned int n;
+	char *ep;
+
+	for (; argc >= 2 && argv[0][0] == '-'; argc -= 2, argv += 2) {
+		if (argv[0][1] == '\0' || argv[0][2] != '\0') {
+			return usage();
+		}
+		switch (argv[0][1]) {
+		case 'n':
+			top = strtoul(argv[1], &ep, 0);
+			break;
+		case 's':
+			interval = strtoul(argv[1], &ep, 0);
+			break;
+		case 'm':
+			mem = strtoull(argv[1], &ep, 10);
+			switch (*ep) {
+			case 'k': case 'K':	mem <<= 10; ep++; break;
+			case 'm': case 'M':	mem <<= 20; ep++; break;
+			case 'g': case 'G':	mem <<= 30; ep++; break;
+			}
+			break;
+		default:
+			return usage();
+		}
+		if (*ep != '\0') {
+			return usage();
+		}
+	}
+	if (argc != 1 || interval == 0 || (interval & (interval - 1)) != 0 ||
+	    mem / sizeof(*coderefs.refs) == 0 || mem > SIZE_MAX) {
+		return usage();
+	}
+
+	if (stat(argv[0], &sb) == -1) {
+		fprintf(stderr, "%s: %s\n", argv[0], strerror(errno));
+		return EXIT_FAILURE;
+	}
+	if (S_ISDIR(sb.st_mode) ? !scan_walk(argv[0])
+				: !scan_read_list(argv[0])) {
+		scan.eval = EXIT_FAILURE;
+	}
+	if (scan.npaths != 0) {
+		qsort(scan.paths, scan.npaths, sizeof(*scan.paths),
+		    scan_compare);
+	}
+
+	for (i = 0; i < 256; i++) {
+		coderefs.gear[i] = hash_mix64(i + 1);
+	}
+	coderefs.interval = interval;
+	coderefs.limit = (size_t)(mem / sizeof(*coderefs.refs));
+
+	if (opts.jobs <= 1) {
+		coderefs_worker(&mainworker);
+	} else {
+		workers = calloc(opts.jobs, sizeof(*workers));
+		assert(workers != NULL);
+		for (n = 0; n < opts.jobs; n++) {
+			workers[n].id = n + 1;
+			workers[n].image_fd = -1;
+			if (pthread_create(&workers[n].thread, NULL,
+					   coderefs_worker, &workers[n]) != 0) {
+				fprintf(stderr,
+				    "coderefs: unable to create worker\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		for (n = 0; n < opts.jobs; n++) {
+			pthread_join(workers[n].thread, NULL);
+		}
+		free(workers);
+	}
+
+	coderefs_renumber();
+
+	/*
+	 * Drop what a stale sampling interval let in, then sort the index
+	 * to bring each chunk's programs together.
+	 */
+	for (i = 0, j = 0; i < coderefs.nrefs; i++) {
+		if (coderefs_sampled(coderefs.refs[i].hash,
+				     coderefs.interval)) {
+			coderefs.refs[j++] = coderefs.refs[i];
+		}
+	}
+	coderefs.nrefs = j;
+	if (coderefs.nrefs != 0) {
+		qsort(coderefs.refs, coderefs.nrefs, sizeof(*coderefs.refs),
+		    coderefs_ref_compare);
+	}
+
+	/* Count the pairs of programs that share each chunk. */
+	for (i = 0; i < coderefs.nrefs; i = j) {
+		r = &coderefs.refs[i];
+		coderefs.bins[r->bin].nchunks++;
+		for (j = i + 1; j < coderefs.nrefs &&
+		     coderefs.refs[j].hash == r->hash; j++) {
+			coderefs.bins[coderefs.refs[j].bin].nchunks++;
+		}
+		if (j - i < 2) {
+			continue;
+		}
+		nshared++;
+		if (ngroups % 1024 == 0) {
+			groups = realloc(groups,
+			    (ngroups + 1024) * sizeof(*groups));
+			assert(groups != NULL);
+		}
+		groups[ngroups].first = i;
+		groups[ngroups].nbins = (uint32_t)(j - i);
+		ngroups++;
+		if (j - i > CODEREFS_MAXGROUP) {
+			ncommon++;
+			continue;
+		}
+		for (k = i; k < j; k++) {
+			for (g = k + 1; g < j; g++) {
+				coderefs_pair_add(coderefs.refs[k].bin,
+				    coderefs.refs[g].bin, r->len);
+			}
+		}
+	}
+
+	printf("%zu program%s in %zu image%s (%lu not LOADM), "
+	    "%lu chunk%s, 1 in %" PRIu64 " indexed\n",
+	    coderefs.nbins, plural((long)coderefs.nbins),
+	    scan.npaths, plural((long)scan.npaths), coderefs.invalid,
+	    coderefs.nchunks, plural((long)coderefs.nchunks),
+	    coderefs.interval);
+	printf("%zu indexed chunk%s shared (%zu by more than %u programs)\n",
+	    nshared, plural((long)nshared), ncommon, CODEREFS_MAXGROUP);
+
+	/* The program pairs that share the most. */
+	for (i = 0, j = 0; i < crpairs.nslots; i++) {
+		if (crpairs.slots[i].count != 0) {
+			crpairs.slots[j++] = crpairs.slots[i];
+		}
+	}
+	if (j != 0) {
+		qsort(crpairs.slots, j, sizeof(*crpairs.slots),
+		    coderefs_pair_compare);
+		printf("\nprograms sharing the most code:\n");
+	}
+	for (i = 0; i < j && i < top; i++) {
+		p = &crpairs.slots[i];
+		a = (uint32_t)(p->key >> 32);
+		b = (uint32_t)p->key;
+		n = coderefs.bins[a].nchunks < coderefs.bins[b].nchunks ?
+		    coderefs.bins[a].nchunks : coderefs.bins[b].nchunks;
+		printf("  %5u chunk%s %6u bytes %3u%%  ", p->count,
+		    plural(p->count), p->bytes, p->count * 100 / n);
+		coderefs_print_bin(a);
+		printf("  ");
+		coderefs_print_bin(b);
+		printf("\n");
+	}
+
+	/* The chunks that turn up in the most programs. */
+	if (ngroups != 0) {
+		qsort(groups, ngroups, sizeof(*groups),
+		    coderefs_group_compare);
+		printf("\nmost widely shared chunks:\n");
+	}
+	for (i = 0; i < ngroups && i < top; i++) {
+		r = &coderefs.refs[groups[i].first];
+		printf("  %016" PRIx64 " %3u bytes %5u programs, e.g. ",
+		    r->hash, r->len, groups[i].nbins);
+		coderefs_print_bin(r->bin);
+		printf("\n");
+	}
+
+	free(groups);
+	free(crpairs.slots);
+	free(coderefs.refs);
+	free(coderefs.bins);
+	return scan.eval;
+}
+
+/*
+ * Image cache, for the long-running modes.  Recently used images are
+ * kept loaded, up to a byte budget (--cache-size).  The cache is split
+ * into shards by path, each with its own lock, and each shard uses the
+ * CLOCK algorithm to choose what to evict: a hit sets an entry's
+ * reference bit, and the clock hand sweeps around clearing reference
+ * bits until it finds an entry without one.  Pinned entries (those in
+ * use) are never evicted.  Dirty entries are written back by a
+ * separate thread as soon as they are released, and become evictable
+ * again once they are clean.  A write-back that fails is retried a few
+ * times, backing off; after that, the changes are given up on (and
+ * reported), and the image is reloaded from disk the next time it's
+ * wanted.
+ *
+ * Callers may hang a parsed index of their own off of an entry; it is
+ * thrown away along with the image when the entry is evicted or the
+ * image changes on disk.
+ */
+#define	IMGCACHE_NSHARDS	16
+#define	IMGCACHE_DEFAULT_SIZE	(64UL * 1024 * 1024)
+#define	IMGCACHE_WB_TRIES	5
+#define	IMGCACHE_WB_BACKOFF	1000000000ULL	/* 1s, doubling */
+
+struct imgcache_entry {
+	char		*path;
+	struct cocofs	*fs;
+	int64_t		mtime_ns;	/* to notice changes on disk */
+	off_t		size;
+	ino_t		ino;
+	size_t		bytes;		/* charged against the budget */
+	unsigned int	pins;		/* users, plus write-back */
+	bool		referenced;	/* CLOCK reference bit */
+	bool		dirty;		/* needs to be written back */
+	bool		writeback;	/* queued for write-back */
+	unsigned int	wb_tries;	/* failed write-backs in a row */
+	uint64_t	wb_after;	/* don't retry before this */
+	pthread_rwlock_t lock;		/* held by users while pinned */
+	void		*index;		/* caller's parsed index */
+	void		(*index_free)(void *);
+};
+
+struct imgcache_shard {
+	pthread_mutex_t	lock;
+	struct imgcache_entry **entries;
+	size_t		nentries;
+	size_t		maxentries;
+	size_t		hand;		/* CLOCK hand */
+	size_t		bytes;
+};
+
+static struct {
+	bool		enabled;
+	size_t		budget;		/* per shard */
+	struct imgcache_shard shard[IMGCACHE_NSHARDS];
+
+	pthread_t	wb_thread;
+	pthread_mutex_t	wb_lock;	/* protects the rest */
+	pthread_cond_t	wb_cv;
+	struct imgcache_entry **wbq;	/* write-back queue */
+	size_t		nwbq;
+	size_t		maxwbq;
+	bool		wb_stop;
+} imgcache = {
+	.wb_lock = PTHREAD_MUTEX_INITIALIZER,
+	.wb_cv = PTHREAD_COND_INITIALIZER,
+};
+
+static int64_t
+cocofs_mtime_ns(const struct stat *sb)
+{
+#if defined(__APPLE__)
+	return (int64_t)sb->st_mtimespec.tv_sec * 1000000000 +
+	    sb->st_mtimespec.tv_nsec;
+#elif defined(_WIN32)
+	return (int64_t)sb->st_mtime * 1000000000;
+#else
+	return (int64_t)sb->st_mtim.tv_sec * 1000000000 + sb->st_mtim.tv_nsec;
+#endif
+}
+
+static struct imgcache_shard *
+imgcache_shard(const char *path)
+{
+	return &imgcache.shard[fnv1a_64(path, strlen(path), FNV1A_64_INIT) %
+	    IMGCACHE_NSHARDS];
+}
+
+static void
+imgcache_entry_free(struct imgcache_entry *e)
+{
+	if (e->index != NULL) {
+		(*e->index_free)(e->index);
+	}
+	cocofs_free(e->fs);
+	pthread_rwlock_destroy(&e->lock);
+	free(e->path);
+	free(e);
+}
+
+/* Called with the shard lock held. */
+static void
+imgcache_remove(struct imgcache_shard *sh, size_t i)
+{
+	struct imgcache_entry *e = sh->entries[i];
+
+	sh->bytes -= e->bytes;
+	sh->entries[i] = sh->entries[--sh->nentries];
+	if (sh->hand >= sh->nentries) {
+		sh->hand = 0;
+	}
+	imgcache_entry_free(e);
+}
+
+/* Called with the shard lock held. */
+static void
+imgcache_queue_writeback(struct imgcache_entry *e)
+{
+	e->writeback = true;
+	e->pins++;
+
+	pthread_mutex_lock(&imgcache.wb_lock);
+	if (imgcache.nwbq == imgcache.maxwbq) {
+		imgcache.maxwbq = imgcache.maxwbq ? imgcache.maxwbq * 2 : 16;
+		imgcache.wbq = realloc(imgcache.wbq,
+		    imgcache.maxwbq * sizeof(*imgcache.wbq));
+		assert(imgcache.wbq != NULL);
+	}
+	imgcache.wbq[imgcache.nwbq++] = e;
+	pthread_cond_signal(&imgcache.wb_cv);
+	pthread_mutex_unlock(&imgcache.wb_lock);
+}
+
+/*
+ * Bring a shard back under budget, if we can.  Called with the shard
+ * lock held.
+ */
+static void
+imgcache_evict(struct imgcache_shard *sh)
+{
+	struct imgcache_entry *e;
+	size_t steps;
+
+	for (steps = 0; sh->bytes > imgcache.budget && sh->nentries != 0 &&
+	     steps < 2 * sh->nentries; steps++) {
+		e = sh->entries[sh->hand];
+		if (e->pins != 0 || e->dirty) {
+			/* in use or on its way to disk */
+		} else if (e->referenced) {
+			e->referenced = false;
+		} else {
+			imgcache_remove(sh, sh->hand);
+			metric_add(METRIC_CACHE_EVICT, 1);
+			steps = 0;
+			continue;
+		}
+		sh->hand = (sh->hand + 1) % sh->nentries;
+	}
+}
+
+static struct imgcache_entry *
+imgcache_load(const char *path, const struct stat *sb)
+{
+	struct imgcache_entry *e;
+	struct cocofs *fs;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_BINARY);
+	if (fd == -1) {
+		return NULL;
+	}
+	curworker->image_fd = fd;
+	fs = cocofs_load(fd, path);
+	curworker->image_fd = -1;
+	close(fd);
+	if (fs == NULL) {
+		metric_add(METRIC_ERR_LOAD, 1);
+		return NULL;
+	}
+	fs->fd = -1;
+
+	e = calloc(1, sizeof(*e));
+	assert(e != NULL);
+	e->path = strdup(path);
+	assert(e->path != NULL);
+	fs->path = e->path;
+	e->fs = fs;
+	e->mtime_ns = cocofs_mtime_ns(sb);
+	e->size = sb->st_size;
+	e->ino = sb->st_ino;
+	e->bytes = sizeof(*e) + sizeof(*fs) + COCOFS_TOTALSIZE;
+	pthread_rwlock_init(&e->lock, NULL);
+	return e;
+}
+
+/*
+ * Look up (or load) an image and pin it.  A writable entry is locked
+ * exclusively; otherwise it is shared with other readers.  Returns
+ * NULL if the image can't be loaded.
+ */
+static struct imgcache_entry *
+imgcache_get(const char *path, bool writable)
+{
+	struct imgcache_shard *sh = imgcache_shard(path);
+	struct imgcache_entry *e = NULL, *ne;
+	struct stat sb;
+	size_t i;
+
+	if (stat(path, &sb) == -1 || ! S_ISREG(sb.st_mode)) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&sh->lock);
+	for (i = 0; i < sh->nentries; i++) {
+		if (strcmp(sh->entries[i]->path, path) == 0) {
+			e = sh->entries[i];
+			break;
+		}
+	}
+	if (e != NULL && e->pins == 0 && ! e->dirty &&
+	    (e->mtime_ns != cocofs_mtime_ns(&sb) || e->size != sb.st_size ||
+	     e->ino != sb.st_ino)) {
+		/* Changed behind our back; start over. */
+		imgcache_remove(sh, i);
+		e = NULL;
+	}
+	if (e != NULL) {
+		e->pins++;
+		e->referenced = true;
+		pthread_mutex_unlock(&sh->lock);
+		metric_add(METRIC_CACHE_HIT, 1);
+		goto out;
+	}
+	pthread_mutex_unlock(&sh->lock);
+
+	metric_add(METRIC_CACHE_MISS, 1);
+	ne = imgcache_load(path, &sb);
+	if (ne == NULL) {
+		return NULL;
+	}
+
+	pthread_mutex_lock(&sh->lock);
+	for (i = 0; i < sh->nentries; i++) {
+		if (strcmp(sh->entries[i]->path, path) == 0) {
+			e = sh->entries[i];
+			break;
+		}
+	}
+	if (e != NULL) {
+		/* Someone beat us to it. */
+		imgcache_entry_free(ne);
+	} else {
+		if (sh->nentries == sh->maxentries) {
+			sh->maxentries = sh->maxentries ?
+			    sh->maxentries * 2 : 16;
+			sh->entries = realloc(sh->entries,
+			    sh->maxentries * sizeof(*sh->entries));
+			assert(sh->entries != NULL);
+		}
+		e = ne;
+		sh->entries[sh->nentries++] = e;
+		sh->bytes += e->bytes;
+	}
+	e->pins++;
+	e->referenced = true;
+	imgcache_evict(sh);
+	pthread_mutex_unlock(&sh->lock);
+
+ out:
+	if (writable) {
+		pthread_rwlock_wrlock(&e->lock);
+	} else {
+		pthread_rwlock_rdlock(&e->lock);
+	}
+	return e;
+}
+
+/*
+ * Unpin an image.  If the caller modified it, it is queued up to be
+ * written back.
+ */
+static void
+imgcache_release(struct imgcache_entry *e, bool dirty)
+{
+	struct imgcache_shard *sh = imgcache_shard(e->path);
+
+	pthread_rwlock_unlock(&e->lock);
+
+	pthread_mutex_lock(&sh->lock);
+	e->pins--;
+	if (dirty) {
+		e->dirty = true;
+	}
+	if (e->dirty && ! e->writeback) {
+		imgcache_queue_writeback(e);
+	}
+	imgcache_evict(sh);
+	pthread_mutex_unlock(&sh->lock);
+}
+
+static void
+imgcache_writeback(struct imgcache_entry *e)
+{
+	struct imgcache_shard *sh = imgcache_shard(e->path);
+	struct stat sb;
+	bool ok = false;
+
+	/*
+	 * Anything dirtied from here on needs another write-back, so
+	 * clear the flags before we start.
+	 */
+	pthread_mutex_lock(&sh->lock);
+	e->dirty = false;
+	e->writeback = false;
+	pthread_mutex_unlock(&sh->lock);
+
+	pthread_rwlock_wrlock(&e->lock);
+	e->fs->fd = open(e->path, O_RDWR | O_BINARY);
+	if (e->fs->fd == -1) {
+		fprintf(stderr, "unable to write back %s: %s\n", e->path,
+		    strerror(errno));
+	} else {
+		curworker->image_fd = e->fs->fd;
+		ok = cocofs_save(e->fs);
+		curworker->image_fd = -1;
+		if (fstat(e->fs->fd, &sb) == 0) {
+			/* Don't mistake our own write for someone else's. */
+			e->mtime_ns = cocofs_mtime_ns(&sb);
+			e->size = sb.st_size;
+			e->ino = sb.st_ino;
+		}
+		close(e->fs->fd);
+		e->fs->fd = -1;
+	}
+	pthread_rwlock_unlock(&e->lock);
+	metric_add(METRIC_CACHE_WRITEBACK, 1);
+
+	pthread_mutex_lock(&sh->lock);
+	if (ok) {
+		e->wb_tries = 0;
+		e->wb_after = 0;
+	} else if (++e->wb_tries < IMGCACHE_WB_TRIES) {
+		e->dirty = true;
+		e->wb_after = cocofs_now_ns() +
+		    (IMGCACHE_WB_BACKOFF << (e->wb_tries - 1));
+		if (! e->writeback) {
+			imgcache_queue_writeback(e);
+		}
+	} else {
+		fprintf(stderr, "%s: giving up on write-back, changes lost\n",
+		    e->path);
+		e->wb_tries = 0;
+		e->wb_after = 0;
+		if (! e->dirty) {
+			/* Make imgcache_get() reload it from disk. */
+			e->mtime_ns = -1;
+		}
+	}
+	e->pins--;
+	imgcache_evict(sh);
+	pthread_mutex_unlock(&sh->lock);
+}
+
+static void *
+imgcache_writeback_thread(void *arg)
+{
+	struct imgcache_entry *e;
+	struct timespec ts;
+	uint64_t now, next;
+	size_t i;
+
+	curworker = arg;
+	metrics_thread_start(curworker);
+
+	pthread_mutex_lock(&imgcache.wb_lock);
+	for (;;) {
+		if (imgcache.nwbq == 0) {
+			if (imgcache.wb_stop) {
+				break;
+			}
+			pthread_cond_wait(&imgcache.wb_cv, &imgcache.wb_lock);
+			continue;
+		}
+
+		/* Take the first entry that isn't backing off. */
+		now = cocofs_now_ns();
+		next = UINT64_MAX;
+		for (i = 0; i < imgcache.nwbq; i++) {
+			if (imgcache.wbq[i]->wb_after <= now ||
+			    imgcache.wb_stop) {
+				break;
+			}
+			if (imgcache.wbq[i]->wb_after < next) {
+				next = imgcache.wbq[i]->wb_after;
+			}
+		}
+		if (i == imgcache.nwbq) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += (time_t)((next - now) / 1000000000);
+			ts.tv_nsec += (long)((next - now) % 1000000000);
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			pthread_cond_timedwait(&imgcache.wb_cv,
+			    &imgcache.wb_lock, &ts);
+			continue;
+		}
+		e = imgcache.wbq[i];
+		memmove(&imgcache.wbq[i], &imgcache.wbq[i + 1],
+		    (--imgcache.nwbq - i) * sizeof(*imgcache.wbq));
+		pthread_mutex_unlock(&imgcache.wb_lock);
+		imgcache_writeback(e);
+		pthread_mutex_lock(&imgcache.wb_lock);
+	}
+	pthread_mutex_unlock(&imgcache.wb_lock);
+	return NULL;
+}
+
+static void
+imgcache_init(size_t budget)
+{
+	static struct worker wbworker = { .id = 1000, .image_fd = -1 };
+	unsigned int i;
+
+	for (i = 0; i < IMGCACHE_NSHARDS; i++) {
+		pthread_mutex_init(&imgcache.shard[i].lock, NULL);
+	}
+	imgcache.budget = budget / IMGCACHE_NSHARDS;
+	if (pthread_create(&imgcache.wb_thread, NULL,
+			   imgcache_writeback_thread, &wbworker) != 0) {
+		fprintf(stderr, "unable to start write-back thread\n");
+		exit(EXIT_FAILURE);
+	}
+	imgcache.enabled = true;
+}
+
+/*
+ * Write back anything that's still dirty, and stop the write-back
+ * thread.  (Entries that are backing off get their remaining tries
+ * right away.)
+ */
+static void
+imgcache_shutdown(void)
+{
+	struct imgcache_shard *sh;
+	unsigned int i;
+	size_t j;
+
+	if (! imgcache.enabled) {
+		return;
+	}
+	for (i = 0; i < IMGCACHE_NSHARDS; i++) {
+		sh = &imgcache.shard[i];
+		pthread_mutex_lock(&sh->lock);
+		for (j = 0; j < sh->nentries; j++) {
+			if (sh->entries[j]->dirty &&
+			    ! sh->entries[j]->writeback) {
+				imgcache_queue_writeback(sh->entries[j]);
+			}
+		}
+		pthread_mutex_unlock(&sh->lock);
+	}
+	pthread_mutex_lock(&imgcache.wb_lock);
+	imgcache.wb_stop = true;
+	pthread_cond_signal(&imgcache.wb_cv);
+	pthread_mutex_unlock(&imgcache.wb_lock);
+	pthread_join(imgcache.wb_thread, NULL);
+	imgcache.enabled = false;
+}
+
+/*
+ * Image catalog.  A catalog lists every file in every image under an
+ * archive tree, along with a hash of each file's contents, and has a
+ * Bloom filter over the file names and content hashes so that readers
+ * can quickly rule out files that aren't in the archive at all.
+ *
+ * Catalogs are only ever replaced (written to a temporary file and
+ * renamed into place), never modified, so readers can simply mmap()
+ * one without any locking.  All values are little-endian.
+ *
+ *	header		CATALOG_HDRSIZE bytes
+ *	images		nimages * CATALOG_IMGSIZE bytes, sorted by path
+ *	files		nfiles * CATALOG_FILESIZE bytes, grouped by image
+ *	bloom		nbloom 64-bit words
+ *	strings		NUL-terminated image paths
+ */
+#define	CATALOG_MAGIC		"CCATLG1"	/* 8 bytes with the NUL */
+#define	CATALOG_HDRSIZE		64
+#define	CATALOG_IMGSIZE		32
+#define	CATALOG_FILESIZE	32
+#define	CATALOG_BLOOM_K		7
+#define	CATALOG_BLOOM_BITS	10		/* per key */
+
+/* header */
+#define	CATALOG_H_NIMAGES	8		/* u32 */
+#define	CATALOG_H_NFILES	12		/* u32 */
+#define	CATALOG_H_NBLOOM	16		/* u32 */
+#define	CATALOG_H_BLOOM_K	20		/* u32 */
+#define	CATALOG_H_GENERATION	24		/* u64 */
+#define	CATALOG_H_IMAGES	32		/* u64 offset */
+#define	CATALOG_H_FILES		40		/* u64 offset */
+#define	CATALOG_H_BLOOM		48		/* u64 offset */
+#define	CATALOG_H_STRINGS	56		/* u64 offset */
+
+/* image record */
+#define	CATALOG_I_PATH		0		/* u64 string offset */
+#define	CATALOG_I_MTIME		8		/* u64 (ns) */
+#define	CATALOG_I_SIZE		16		/* u32 */
+#define	CATALOG_I_FIRST		20		/* u32 first file */
+#define	CATALOG_I_NFILES	24		/* u32 */
+
+/* file record */
+#define	CATALOG_F_HASH		0		/* u64 FNV-1a of contents */
+#define	CATALOG_F_IMAGE		8		/* u32 image index */
+#define	CATALOG_F_SIZE		12		/* u32 */
+#define	CATALOG_F_NAME		16		/* 8 bytes */
+#define	CATALOG_F_EXT		24		/* 3 bytes */
+#define	CATALOG_F_TYPE		27		/* u8 */
+#define	CATALOG_F_ENCODING	28		/* u8 */
+
+struct catalog_file {
+	uint64_t	hash;
+	uint32_t	size;
+	char		name[8];
+	char		ext[3];
+	uint8_t		type;
+	uint8_t		encoding;
+};
+
+struct catalog_image {
+	char		*path;
+	int64_t		mtime;
+	uint32_t	size;
+	unsigned int	nfiles;
+	struct catalog_file *files;
+};
+
+static struct {
+	struct catalog_image *images;	/* sorted by path */
+	size_t		nimages;
+	size_t		maximages;
+	uint64_t	generation;
+} catalog;
+
+/*
+ * The Bloom filter keys are "NAME.EXT" (as ls prints them) and the
+ * 8-byte content hashes.  The k probe positions come from the two
+ * halves of a 64-bit hash of the key.
+ */
+static uint64_t
+catalog_name_key(const char name[8], const char ext[3])
+{
+	char buf[8 + 1 + 3 + 1];
+	int i, n = 0;
+
+	for (i = 0; i < 8 && name[i] != ' '; i++) {
+		buf[n++] = name[i];
+	}
+	buf[n++] = '.';
+	for (i = 0; i < 3 && ext[i] != ' '; i++) {
+		buf[n++] = ext[i];
+	}
+	return fnv1a_64(buf, n, FNV1A_64_INIT);
+}
+
+static uint64_t
+catalog_hash_key(uint64_t hash)
+{
+	uint8_t buf[8];
+
+	cocofs_le64enc(buf, hash);
+	return fnv1a_64(buf, sizeof(buf), FNV1A_64_INIT ^ 0xff);
+}
+
+static void
+catalog_bloom_add(uint8_t *bloom, uint32_t nwords, uint64_t key)
+{
+	uint64_t bit, nbits = (uint64_t)nwords * 64;
+	uint32_t h1 = (uint32_t)key, h2 = (uint32_t)(key >> 32) | 1;
+	uint8_t *cp;
+	unsigned int i;
+
+	for (i = 0; i < CATALOG_BLOOM_K; i++) {
+		bit = (h1 + (uint64_t)i * h2) % nbits;
+		cp = bloom + (bit / 64) * 8 + (bit % 64) / 8;
+		*cp |= 1U << (bit % 8);
+	}
+}
+
+static bool
+catalog_bloom_test(const uint8_t *bloom, uint32_t nwords, uint32_t k,
+    uint64_t key)
+{
+	uint64_t bit, nbits = (uint64_t)nwords * 64;
+	uint32_t h1 = (uint32_t)key, h2 = (uint32_t)(key >> 32) | 1;
+	unsigned int i;
+
+	for (i = 0; i < k; i++) {
+		bit = (h1 + (uint64_t)i * h2) % nbits;
+		if ((bloom[(bit / 64) * 8 + (bit % 64) / 8] &
+		     (1U << (bit % 8))) == 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static struct catalog_image *
+catalog_find(const char *path, size_t *slotp)
+{
+	size_t lo = 0, hi = catalog.nimages, mid;
+	int c;
+
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		c = strcmp(path, catalog.images[mid].path);
+		if (c == 0) {
+			return &catalog.images[mid];
+		}
+		if (c < 0) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+	*slotp = lo;
+	return NULL;
+}
+
+static void
+catalog_remove(struct catalog_image *ci)
+{
+	size_t i = ci - catalog.images;
+
+	free(ci->path);
+	free(ci->files);
+	memmove(ci, ci + 1, (catalog.nimages - i - 1) * sizeof(*ci));
+	catalog.nimages--;
+}
+
+static void
+catalog_index_free(void *arg)
+{
+	struct catalog_image *idx = arg;
+
+	free(idx->files);
+	free(idx);
+}
+
+/*
+ * Parse an image's directory and hash its files.  The result is kept
+ * with the image in the image cache.
+ */
+static struct catalog_image *
+catalog_index_image(struct imgcache_entry *e)
+{
+	struct cocofs *fs = e->fs;
+	struct catalog_image *idx;
+	struct catalog_file *cf;
+	struct cocofs_dirent *dir;
+	struct cocofs_stat st;
+	uint8_t *data;
+	size_t size;
+	unsigned int di;
+	uint64_t t0;
+
+	t0 = trace_begin();
+	idx = calloc(1, sizeof(*idx));
+	assert(idx != NULL);
+	idx->mtime = e->mtime_ns;
+	idx->size = (uint32_t)e->size;
+	idx->files = calloc(COCOFS_DIR_TRACK_NENTRIES, sizeof(*idx->files));
+	assert(idx->files != NULL);
+	for (di = 0; di < COCOFS_DIR_TRACK_NENTRIES; di++) {
+		dir = &fs->directory[di];
+		if (! cocofs_dirent_is_file(dir)) {
+			continue;
+		}
+		cf = &idx->files[idx->nfiles++];
+		cocofs_stat(fs, dir, &st);
+		memcpy(cf->name, dir->d_name, sizeof(cf->name));
+		memcpy(cf->ext, dir->d_ext, sizeof(cf->ext));
+		cf->type = dir->d_type;
+		cf->encoding = dir->d_encoding;
+		cf->size = st.st_size;
+		if (cocofs_read_file(fs, dir, &data, &size)) {
+			cf->hash = fnv1a_64(data, size, FNV1A_64_INIT);
+			free(data);
+		}
+	}
+	metric_add(METRIC_IMAGES_OK, 1);
+	trace_span("index", t0, e->path);
+	return idx;
+}
+
+/*
+ * (Re-)index a single image.  Returns true if the catalog changed.
+ */
+static bool
+catalog_index(const char *path)
+{
+	struct catalog_image *ci, *idx;
+	struct imgcache_entry *e;
+	struct stat sb;
+	size_t slot = 0;
+
+	ci = catalog_find(path, &slot);
+
+	e = imgcache_get(path, false);
+	if (e == NULL) {
+		/* Gone (or never was a valid image); forget about it. */
+		if (stat(path, &sb) == 0 && S_ISREG(sb.st_mode)) {
+			metric_add(METRIC_IMAGES_FAILED, 1);
+		}
+		if (ci != NULL) {
+			catalog_remove(ci);
+			return true;
+		}
+		return false;
+	}
+	idx = e->index;
+	if (idx == NULL) {
+		idx = catalog_index_image(e);
+		e->index = idx;
+		e->index_free = catalog_index_free;
+	} else if (ci != NULL && ci->mtime == idx->mtime &&
+		   ci->size == idx->size) {
+		imgcache_release(e, false);
+		return false;
+	}
+
+	if (ci == NULL) {
+		if (catalog.nimages == catalog.maximages) {
+			catalog.maximages = catalog.maximages ?
+			    catalog.maximages * 2 : 64;
+			catalog.images = realloc(catalog.images,
+			    catalog.maximages * sizeof(*catalog.images));
+			assert(catalog.images != NULL);
+		}
+		memmove(&catalog.images[slot + 1], &catalog.images[slot],
+		    (catalog.nimages - slot) * sizeof(*catalog.images));
+		ci = &catalog.images[slot];
+		catalog.nimages++;
+		ci->path = strdup(path);
+		assert(ci->path != NULL);
+	} else {
+		free(ci->files);
+	}
+	ci->mtime = idx->mtime;
+	ci->size = idx->size;
+	ci->nfiles = idx->nfiles;
+	ci->files = calloc(idx->nfiles ? idx->nfiles : 1, sizeof(*ci->files));
+	assert(ci->files != NULL);
+	memcpy(ci->files, idx->files, idx->nfiles * sizeof(*ci->files));
+
+	imgcache_release(e, false);
+	return true;
+}
+
+/*
+ * Write out the catalog, replacing the old one atomically.
+ */
+static bool
+catalog_publish(const char *path)
+{
+	size_t nfiles = 0, strsize = 0, size, i, j, fi;
+	size_t off_images, off_files, off_bloom, off_strings, stroff;
+	uint32_t nbloom;
+	uint8_t *buf, *cp;
+	bool rv;
+
+	for (i = 0; i < catalog.nimages; i++) {
+		nfiles += catalog.images[i].nfiles;
+		strsize += strlen(catalog.images[i].path) + 1;
+	}
+	nbloom = (uint32_t)((nfiles * 2 * CATALOG_BLOOM_BITS + 63) / 64);
+	if (nbloom < 16) {
+		nbloom = 16;
+	}
+
+	off_images = CATALOG_HDRSIZE;
+	off_files = off_images + catalog.nimages * CATALOG_IMGSIZE;
+	off_bloom = off_files + nfiles * CATALOG_FILESIZE;
+	off_strings = off_bloom + (size_t)nbloom * 8;
+	size = off_strings + strsize;
+
+	buf = calloc(1, size);
+	assert(buf != NULL);
+	memcpy(buf, CATALOG_MAGIC, sizeof(CATALOG_MAGIC));
+	cocofs_le32enc(buf + CATALOG_H_NIMAGES, (uint32_t)catalog.nimages);
+	cocofs_le32enc(buf + CATALOG_H_NFILES, (uint32_t)nfiles);
+	cocofs_le32enc(buf + CATALOG_H_NBLOOM, nbloom);
+	cocofs_le32enc(buf + CATALOG_H_BLOOM_K, CATALOG_BLOOM_K);
+	cocofs_le64enc(buf + CATALOG_H_GENERATION, ++catalog.generation);
+	cocofs_le64enc(buf + CATALOG_H_IMAGES, off_images);
+	cocofs_le64enc(buf + CATALOG_H_FILES, off_files);
+	cocofs_le64enc(buf + CATALOG_H_BLOOM, off_bloom);
+	cocofs_le64enc(buf + CATALOG_H_STRINGS, off_strings);
+
+	for (i = 0, fi = 0, stroff = 0; i < catalog.nimages; i++) {
+		const struct catalog_image *ci = &catalog.images[i];
+
+		cp = buf + off_images + i * CATALOG_IMGSIZE;
+		cocofs_le64enc(cp + CATALOG_I_PATH, stroff);
+		cocofs_le64enc(cp + CATALOG_I_MTIME, (uint64_t)ci->mtime);
+		cocofs_le32enc(cp + CATALOG_I_SIZE, ci->size);
+		cocofs_le32enc(cp + CATALOG_I_FIRST, (uint32_t)fi);
+		cocofs_le32enc(cp + CATALOG_I_NFILES, ci->nfiles);
+		strcpy((char *)buf + off_strings + stroff, ci->path);
+		stroff += strlen(ci->path) + 1;
+
+		for (j = 0; j < ci->nfiles; j++, fi++) {
+			const struct catalog_file *cf = &ci->files[j];
+
+			cp = buf + off_files + fi * CATALOG_FILESIZE;
+			cocofs_le64enc(cp + CATALOG_F_HASH, cf->hash);
+			cocofs_le32enc(cp + CATALOG_F_IMAGE, (uint32_t)i);
+			cocofs_le32enc(cp + CATALOG_F_SIZE, cf->size);
+			memcpy(cp + CATALOG_F_NAME, cf->name, 8);
+			memcpy(cp + CATALOG_F_EXT, cf->ext, 3);
+			cp[CATALOG_F_TYPE] = cf->type;
+			cp[CATALOG_F_ENCODING] = cf->encoding;
+			catalog_bloom_add(buf + off_bloom, nbloom,
+			    catalog_name_key(cf->name, cf->ext));
+			catalog_bloom_add(buf + off_bloom, nbloom,
+			    catalog_hash_key(cf->hash));
+		}
+	}
+
+	rv = write_file_atomic(path, buf, size);
+	free(buf);
+	return rv;
+}
+
+/*
+ * Check that a catalog someone handed us is self-consistent, so that
+ * nothing it says can send a lookup outside of it.
+ */
+static bool
+catalog_region_ok(size_t size, uint64_t off, uint64_t n, size_t recsize)
+{
+	return off <= size && n <= (size - off) / recsize;
+}
+
+static bool
+catalog_check(const uint8_t *base, size_t size)
+{
+	uint64_t off_images, off_files, off_bloom, off_strings, strsize;
+	uint32_t nimages, nfiles, nbloom, k, i, first, n;
+	const uint8_t *cp;
+
+	if (size < CATALOG_HDRSIZE ||
+	    memcmp(base, CATALOG_MAGIC, sizeof(CATALOG_MAGIC)) != 0) {
+		return false;
+	}
+	nimages = cocofs_le32dec(base + CATALOG_H_NIMAGES);
+	nfiles = cocofs_le32dec(base + CATALOG_H_NFILES);
+	nbloom = cocofs_le32dec(base + CATALOG_H_NBLOOM);
+	k = cocofs_le32dec(base + CATALOG_H_BLOOM_K);
+	off_images = cocofs_le64dec(base + CATALOG_H_IMAGES);
+	off_files = cocofs_le64dec(base + CATALOG_H_FILES);
+	off_bloom = cocofs_le64dec(base + CATALOG_H_BLOOM);
+	off_strings = cocofs_le64dec(base + CATALOG_H_STRINGS);
+
+	if (! catalog_region_ok(size, off_images, nimages, CATALOG_IMGSIZE) ||
+	    ! catalog_region_ok(size, off_files, nfiles, CATALOG_FILESIZE) ||
+	    ! catalog_region_ok(size, off_bloom, nbloom, 8) ||
+	    nbloom == 0 || k == 0 || k > 64 ||
+	    off_strings > size) {
+		return false;
+	}
+
+	/* Every path must be a NUL-terminated string in the table. */
+	strsize = size - off_strings;
+	if (nimages != 0 &&
+	    (strsize == 0 || base[off_strings + strsize - 1] != '\0')) {
+		return false;
+	}
+	for (i = 0; i < nimages; i++) {
+		cp = base + off_images + (size_t)i * CATALOG_IMGSIZE;
+		first = cocofs_le32dec(cp + CATALOG_I_FIRST);
+		n = cocofs_le32dec(cp + CATALOG_I_NFILES);
+		if (cocofs_le64dec(cp + CATALOG_I_PATH) >= strsize ||
+		    first > nfiles || n > nfiles - first) {
+			return false;
+		}
+	}
+	for (i = 0; i < nfiles; i++) {
+		cp = base + off_files + (size_t)i * CATALOG_FILESIZE;
+		if (cocofs_le32dec(cp + CATALOG_F_IMAGE) >= nimages) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Look things up in a published catalog.
+ */
+static int
+cmd_catalog(int argc, char *argv[])
+{
+	const uint8_t *base, *bloom, *images, *img, *cp;
+	const char *strings;
+	uint32_t nimages, nfiles, nbloom, k, i;
+	char name[8], ext[3];
+	uint64_t namekey;
+	size_t size;
+	int a, found;
+	int eval = EXIT_SUCCESS;
+
+	if (argc < 1) {
+		return usage();
+	}
+	base = cocofs_map_file(argv[0], &size);
+	if (base == NULL) {
+		return EXIT_FAILURE;
+	}
+	if (! catalog_check(base, size)) {
+		fprintf(stderr, "%s: not a catalog\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+	nimages = cocofs_le32dec(base + CATALOG_H_NIMAGES);
+	nfiles = cocofs_le32dec(base + CATALOG_H_NFILES);
+	nbloom = cocofs_le32dec(base + CATALOG_H_NBLOOM);
+	k = cocofs_le32dec(base + CATALOG_H_BLOOM_K);
+	bloom = base + cocofs_le64dec(base + CATALOG_H_BLOOM);
+	images = base + cocofs_le64dec(base + CATALOG_H_IMAGES);
+	strings = (const char *)base + cocofs_le64dec(base + CATALOG_H_STRINGS);
+
+	if (argc == 1) {
+		printf("generation %" PRIu64 ", %u image%s, %u file%s\n",
+		    cocofs_le64dec(base + CATALOG_H_GENERATION),
+		    nimages, plural(nimages), nfiles, plural(nfiles));
+		return EXIT_SUCCESS;
+	}
+
+	for (a = 1; a < argc; a++) {
+		if (! cocofs_conv_name(argv[a], name, ext)) {
+			fprintf(stderr, "%s: invalid file name\n", argv[a]);
+			eval = EXIT_FAILURE;
+			continue;
+		}
+		namekey = catalog_name_key(name, ext);
+		found = 0;
+		if (catalog_bloom_test(bloom, nbloom, k, namekey)) {
+			cp = base + cocofs_le64dec(base + CATALOG_H_FILES);
+			for (i = 0; i < nfiles; i++, cp += CATALOG_FILESIZE) {
+				if (memcmp(cp + CATALOG_F_NAME, name, 8) != 0 ||
+				    memcmp(cp + CATALOG_F_EXT, ext, 3) != 0) {
+					continue;
+				}
+				img = images + CATALOG_IMGSIZE * (size_t)
+				    cocofs_le32dec(cp + CATALOG_F_IMAGE);
+				printf("%s: %s %u bytes %016" PRIx64 "\n",
+				    strings +
+				    cocofs_le64dec(img + CATALOG_I_PATH),
+				    argv[a],
+				    cocofs_le32dec(cp + CATALOG_F_SIZE),
+				    cocofs_le64dec(cp + CATALOG_F_HASH));
+				found++;
+			}
+		}
+		if (found == 0) {
+			fprintf(stderr, "%s: %s\n", argv[a], strerror(ENOENT));
+			eval = EXIT_FAILURE;
+		}
+	}
+	return eval;
+}
+
+/*
+ * Watch an archive tree and keep its catalog up to date.  Changes to
+ * an image are debounced (an image is reindexed only once it has been
+ * left alone for the debounce interval), and the catalog is published
+ * once per batch of reindexed images.  The pending images are hashed
+ * by path, since an overflow queues up the whole archive at once.
+ */
+#ifdef __linux__
+#define	WATCH_DEBOUNCE		500000000ULL	/* 0.5s */
+
+static struct {
+	int		fd;		/* inotify descriptor */
+	const char	*root;
+	char		**wdpath;	/* directory for each watch */
+	int		nwd;
+	struct watch_pending {
+		char		*path;
+		uint64_t	deadline;
+	}		*pending;
+	size_t		npending;
+	size_t		maxpending;
+	uint32_t	*slots;		/* pending index + 1, or 0 */
+	size_t		nslots;
+} watch = { .fd = -1 };
+
+static size_t
+watch_slot(const char *path)
+{
+	size_t h = (size_t)fnv1a_64(path, strlen(path), FNV1A_64_INIT);
+	uint32_t id;
+
+	while ((id = watch.slots[h & (watch.nslots - 1)]) != 0 &&
+	       strcmp(watch.pending[id - 1].path, path) != 0) {
+		h++;
+	}
+	return h & (watch.nslots - 1);
+}
+
+/*
+ * Rebuild the hash of pending paths, after the list has been compacted
+ * or has outgrown it.
+ */
+static void
+watch_rehash(void)
+{
+	size_t i;
+
+	while ((watch.npending + 1) * 2 >= watch.nslots) {
+		watch.nslots = watch.nslots ? watch.nslots * 2 : 1024;
+	}
+	free(watch.slots);
+	watch.slots = calloc(watch.nslots, sizeof(*watch.slots));
+	assert(watch.slots != NULL);
+	for (i = 0; i < watch.npending; i++) {
+		watch.slots[watch_slot(watch.pending[i].path)] =
+		    (uint32_t)i + 1;
+	}
+}
+
+static void
+watch_pend(const char *path)
+{
+	uint64_t deadline = cocofs_now_ns() + WATCH_DEBOUNCE;
+	size_t slot;
+
+	if ((watch.npending + 1) * 2 >= watch.nslots) {
+		watch_rehash();
+	}
+	slot = watch_slot(path);
+	if (watch.slots[slot] != 0) {
+		watch.pending[watch.slots[slot] - 1].deadline = deadline;
+		return;
+	}
+	if (watch.npending == watch.maxpending) {
+		watch.maxpending = watch.maxpending ?
+		    watch.maxpending * 2 : 16;
+		watch.pending = realloc(watch.pending,
+		    watch.maxpending * sizeof(*watch.pending));
+		assert(watch.pending != NULL);
+	}
+	watch.pending[watch.npending].path = strdup(path);
+	assert(watch.pending[watch.npending].path != NULL);
+	watch.pending[watch.npending].deadline = deadline;
+	watch.slots[slot] = (uint32_t)++watch.npending;
+}
+
+/*
+ * Watch a directory and everything under it, queueing up any images
+ * found there (for a directory that has just appeared).
+ */
+static void
+watch_add_tree(const char *dirpath, bool pend)
+{
+	char path[PATH_MAX];
+	struct dirent *de;
+	struct stat sb;
+	DIR *dirp;
+	int wd;
+
+	wd = inotify_add_watch(watch.fd, dirpath,
+	    IN_CLOSE_WRITE | IN_MODIFY | IN_CREATE | IN_DELETE |
+	    IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+	if (wd == -1) {
+		fprintf(stderr, "unable to watch %s: %s\n", dirpath,
+		    strerror(errno));
+		return;
+	}
+	if (wd >= watch.nwd) {
+		watch.wdpath = realloc(watch.wdpath,
+		    (wd + 1) * sizeof(*watch.wdpath));
+		assert(watch.wdpath != NULL);
+		memset(&watch.wdpath[watch.nwd], 0,
+		    (wd + 1 - watch.nwd) * sizeof(*watch.wdpath));
+		watch.nwd = wd + 1;
+	}
+	free(watch.wdpath[wd]);
+	watch.wdpath[wd] = strdup(dirpath);
+	assert(watch.wdpath[wd] != NULL);
+
+	dirp = opendir(dirpath);
+	if (dirp == NULL) {
+		return;
+	}
+	while ((de = readdir(dirp)) != NULL) {
+		if (strcmp(de->d_name, ".") == 0 ||
+		    strcmp(de->d_name, "..") == 0) {
+			continue;
+		}
+		if (snprintf(path, sizeof(path), "%s/%s", dirpath,
+			     de->d_name) >= (int)sizeof(path) ||
+		    stat(path, &sb) == -1) {
+			continue;
+		}
+		if (S_ISDIR(sb.st_mode)) {
+			/* As in scan_walk(), don't follow directory links. */
+			if (lstat(path, &sb) == 0 && S_ISLNK(sb.st_mode)) {
+				continue;
+			}
+			watch_add_tree(path, pend);
+		} else if (pend && scan_is_image(de->d_name)) {
+			watch_pend(path);
+		}
+	}
+	closedir(dirp);
+}
+
+/*
+ * Queue up every catalogued image under a directory that went away.
+ */
+static void
+watch_pend_prefix(const char *dirpath)
+{
+	size_t i, len = strlen(dirpath);
+
+	for (i = 0; i < catalog.nimages; i++) {
+		if (strncmp(catalog.images[i].path, dirpath, len) == 0 &&
+		    catalog.images[i].path[len] == '/') {
+			watch_pend(catalog.images[i].path);
+		}
+	}
+}
+
+static void
+watch_event(const struct inotify_event *ev)
+{
+	char path[PATH_MAX];
+	size_t i;
+
+	if (ev->mask & IN_Q_OVERFLOW) {
+		/*
+		 * Lost events; go over everything again, once, from the
+		 * top.  Catalogued images are queued too, in case they're
+		 * gone.
+		 */
+		watch_add_tree(watch.root, true);
+		for (i = 0; i < catalog.nimages; i++) {
+			watch_pend(catalog.images[i].path);
+		}
+		return;
+	}
+	if (ev->mask & IN_IGNORED) {
+		if (ev->wd < watch.nwd) {
+			free(watch.wdpath[ev->wd]);
+			watch.wdpath[ev->wd] = NULL;
+		}
+		return;
+	}
+	if (ev->len == 0 || ev->wd >= watch.nwd ||
+	    watch.wdpath[ev->wd] == NULL ||
+	    snprintf(path, sizeof(path), "%s/%s", watch.wdpath[ev->wd],
+		     ev->name) >= (int)sizeof(path)) {
+		return;
+	}
+
+	if (ev->mask & IN_ISDIR) {
+		if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+			watch_add_tree(path, true);
+		} else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+			watch_pend_prefix(path);
+		}
+		return;
+	}
+	if (scan_is_image(ev->name)) {
+		watch_pend(path);
+	}
+}
+
+static int
+cmd_watch(int argc, char *argv[])
+{
+	union {
+		struct inotify_event ev;
+		char buf[64 * 1024];
+	} u;
+	const struct inotify_event *ev;
+	struct pollfd pfd;
+	uint64_t now, next;
+	size_t i, n;
+	ssize_t len;
+	bool changed;
+	int timeout;
+
+	if (argc != 2) {
+		return usage();
+	}
+
+	watch.fd = inotify_init1(IN_CLOEXEC);
+	if (watch.fd == -1) {
+		fprintf(stderr, "inotify: %s\n", strerror(errno));
+		return EXIT_FAILURE;
+	}
+
+	imgcache_init(opts.cache_size ? opts.cache_size
+				      : IMGCACHE_DEFAULT_SIZE);
+
+	/* Watch the tree first, so that nothing slips by while indexing. */
+	watch.root = argv[0];
+	watch_add_tree(argv[0], false);
+	if (! scan_walk(argv[0])) {
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < scan.npaths; i++) {
+		catalog_index(scan.paths[i]);
+	}
+	if (! catalog_publish(argv[1])) {
+		return EXIT_FAILURE;
+	}
+	fprintf(stderr, "%s: %zu image%s indexed, watching %s\n",
+	    argv[1], catalog.nimages, plural((long)catalog.nimages), argv[0]);
+
+	pfd.fd = watch.fd;
+	pfd.events = POLLIN;
+	for (;;) {
+		timeout = -1;
+		if (watch.npending != 0) {
+			now = cocofs_now_ns();
+			next = UINT64_MAX;
+			for (i = 0; i < watch.npending; i++) {
+				if (watch.pending[i].deadline < next) {
+					next = watch.pending[i].deadline;
+				}
+			}
+			timeout = next <= now ? 0 :
+			    (int)((next - now + 999999) / 1000000);
+		}
+		if (poll(&pfd, 1, timeout) == -1 && errno != EINTR) {
+			fprintf(stderr, "poll: %s\n", strerror(errno));
+			return EXIT_FAILURE;
+		}
+		if (pfd.revents & POLLIN) {
+			len = read(watch.fd, u.buf, sizeof(u.buf));
+			for (i = 0; len > 0 && i < (size_t)len;
+			     i += sizeof(*ev) + ev->len) {
+				ev = (const struct inotify_event *)
+				    (u.buf + i);
+				watch_event(ev);
+			}
+		}
+
+		/* Reindex the images that have settled down. */
+		now = cocofs_now_ns();
+		changed = false;
+		for (i = 0, n = 0; i < watch.npending; i++) {
+			if (watch.pending[i].deadline > now) {
+				watch.pending[n++] = watch.pending[i];
+				continue;
+			}
+			changed = catalog_index(watch.pending[i].path) ||
+			    changed;
+			free(watch.pending[i].path);
+		}
+		if (n != watch.npending) {
+			watch.npending = n;
+			watch_rehash();
+		}
+		if (changed) {
+			catalog_publish(argv[1]);
+		}
+	}
+}
+#else
+static int
+cmd_watch(int argc, char *argv[])
+{
+	(void)argc;
+	(void)argv;
+	fprintf(stderr, "watch is not supported on this platform\n");
+	return EXIT_FAILURE;
+}
+#endif /* __linux__ */
+
+/*
+ * Synthetic images.  A host directory is presented as an RS-DOS disk:
+ * each regular file in it (named as for copyin, with optional [type,
+ * encoding] qualifiers) gets a directory entry and a granule chain.
+ * Only this metadata is built up front; a granule's contents are read
+ * from the host file the first time one of its sectors is read.
+ *
+ * When the directory track is read, and the host directory hasn't been
+ * looked at in the last VIMAGE_RESCAN, the metadata is brought up to
+ * date.  Files that haven't changed keep their granules (and whatever
+ * data has already been read in); only new or changed files are laid
+ * out again.  The disk is read-only.
+ */
+#define	VIMAGE_RESCAN		1000000000ULL	/* 1 second */
+
+struct vimage_file {
+	char		*hostpath;
+	char		name[8];
+	char		ext[3];
+	uint8_t		type;
+	uint8_t		encoding;
+	off_t		size;
+	int64_t		mtime_ns;
+	uint8_t		glist[COCOFS_NGRANULES];
+	unsigned int	ngranules;	/* 0 if not laid out yet */
+	bool		warned;		/* said it doesn't fit */
+};
+
+struct vimage {
+	char		*root;
+	struct cocofs	*fs;
+	struct vimage_file files[COCOFS_DIR_TRACK_NENTRIES];
+	unsigned int	nfiles;
+	uint8_t		owner[COCOFS_NGRANULES];  /* file index, or 0xff */
+	uint8_t		gindex[COCOFS_NGRANULES]; /* granule # within file */
+	bool		present[COCOFS_NGRANULES];
+	uint64_t	last_scan;
+};
+
+static int
+vimage_file_compare(const void *a, const void *b)
+{
+	const struct vimage_file *fa = a, *fb = b;
+
+	return strcmp(fa->hostpath, fb->hostpath);
+}
+
+/*
+ * Gather up the files in the host directory, sorted by name.  If there
+ * are more than the directory holds, the first ones by name are used,
+ * whatever order the host file system returns them in.
+ */
+static unsigned int
+vimage_list(const struct vimage *vi, struct vimage_file *files)
+{
+	struct vimage_file *all = NULL, *vf;
+	struct dirent *de;
+	struct stat sb;
+	char path[PATH_MAX], fname[256];
+	unsigned int n = 0, max = 0, i;
+	DIR *dirp;
+
+	dirp = opendir(vi->root);
+	if (dirp == NULL) {
+		fprintf(stderr, "%s: %s\n", vi->root, strerror(errno));
+		return 0;
+	}
+	while ((de = readdir(dirp)) != NULL) {
+		if (de->d_name[0] == '.' ||
+		    snprintf(path, sizeof(path), "%s/%s", vi->root,
+			     de->d_name) >= (int)sizeof(path) ||
+		    stat(path, &sb) == -1 || ! S_ISREG(sb.st_mode) ||
+		    sb.st_size == 0) {
+			continue;
+		}
+		if (n == max) {
+			max = max ? max * 2 : 64;
+			all = realloc(all, max * sizeof(*all));
+			assert(all != NULL);
+		}
+		vf = &all[n];
+		memset(vf, 0, sizeof(*vf));
+		snprintf(fname, sizeof(fname), "%s", de->d_name);
+		if (! cocofs_parse_fname(fname, vf->name, vf->ext,
+					 &vf->type, &vf->encoding)) {
+			continue;
+		}
+		vf->hostpath = strdup(path);
+		assert(vf->hostpath != NULL);
+		vf->size = sb.st_size;
+		vf->mtime_ns = cocofs_mtime_ns(&sb);
+		n++;
+	}
+	closedir(dirp);
+	if (n != 0) {
+		qsort(all, n, sizeof(*all), vimage_file_compare);
+	}
+	if (n > COCOFS_DIR_TRACK_NENTRIES) {
+		for (i = COCOFS_DIR_TRACK_NENTRIES; i < n; i++) {
+			free(all[i].hostpath);
+		}
+		n = COCOFS_DIR_TRACK_NENTRIES;
+	}
+	if (n != 0) {
+		memcpy(files, all, n * sizeof(*files));
+	}
+	free(all);
+	return n;
+}
+
+/*
+ * Rebuild the Granule Map and directory from the host directory.
+ */
+static void
+vimage_scan(struct vimage *vi)
+{
+	static struct vimage_file files[COCOFS_DIR_TRACK_NENTRIES];
+	struct cocofs *fs = vi->fs;
+	struct vimage_file *vf, *of;
+	bool present[COCOFS_NGRANULES];
+	unsigned int i, j, gi, n, slot;
+
+	n = vimage_list(vi, files);
+
+	/*
+	 * Carry over the layout of files that haven't changed, and
+	 * whether we've already said that one doesn't fit.
+	 */
+	memset(present, 0, sizeof(present));
+	for (i = 0; i < n; i++) {
+		vf = &files[i];
+		for (j = 0; j < vi->nfiles; j++) {
+			of = &vi->files[j];
+			if (strcmp(of->hostpath, vf->hostpath) != 0 ||
+			    of->size != vf->size ||
+			    of->mtime_ns != vf->mtime_ns) {
+				continue;
+			}
+			vf->warned = of->warned;
+			if (of->ngranules != 0 &&
+			    memcmp(of->name, vf->name, 8) == 0 &&
+			    memcmp(of->ext, vf->ext, 3) == 0) {
+				memcpy(vf->glist, of->glist,
+				    sizeof(vf->glist));
+				vf->ngranules = of->ngranules;
+				for (gi = 0; gi < vf->ngranules; gi++) {
+					present[vf->glist[gi]] =
+					    vi->present[vf->glist[gi]];
+				}
+			}
+			break;
+		}
+	}
+	for (j = 0; j < vi->nfiles; j++) {
+		free(vi->files[j].hostpath);
+	}
+
+	memset(fs->granule_map, GMAP_FREE, COCOFS_NGRANULES);
+	memset(fs->directory, 0xff,
+	    COCOFS_DIR_TRACK_NENTRIES * sizeof(*fs->directory));
+	fs->free_granules = COCOFS_NGRANULES;
+	for (i = 0; i < n; i++) {
+		vf = &files[i];
+		for (gi = 0; gi < vf->ngranules; gi++) {
+			fs->granule_map[vf->glist[gi]] = GMAP_ALLOCATED;
+			fs->free_granules--;
+		}
+	}
+
+	/*
+	 * Lay out the new and changed files in the space that's left.
+	 * A file that doesn't fit is only complained about once (until
+	 * it changes); it's tried again on every rescan, though, in case
+	 * something else has made room for it.
+	 */
+	for (i = 0; i < n; i++) {
+		vf = &files[i];
+		if (vf->ngranules != 0) {
+			continue;
+		}
+		if ((unsigned long long)vf->size >
+		    fs->free_granules * COCOFS_BYTES_PER_GRANULE) {
+			if (! vf->warned) {
+				fprintf(stderr, "%s: %s\n", vf->hostpath,
+				    strerror(ENOSPC));
+				vf->warned = true;
+			}
+			continue;
+		}
+		if (cocofs_alloc_file(fs, &fs->directory[i], vf->hostpath,
+			(unsigned long long)vf->size, vf->glist,
+			&vf->ngranules) == NULL) {
+			vf->ngranules = 0;
+		}
+	}
+
+	/*
+	 * Files that didn't fit are left out of the directory entirely;
+	 * an unused (0xff) entry would end the directory for Disk BASIC,
+	 * hiding every file after it.
+	 */
+	memset(vi->owner, 0xff, sizeof(vi->owner));
+	for (i = 0, slot = 0; i < n; i++) {
+		vf = &files[i];
+		if (vf->ngranules == 0) {
+			continue;
+		}
+		cocofs_link_file(fs, &fs->directory[slot++],
+		    (unsigned long long)vf->size, vf->glist, vf->ngranules,
+		    vf->name, vf->ext, vf->type, vf->encoding);
+		for (gi = 0; gi < vf->ngranules; gi++) {
+			vi->owner[vf->glist[gi]] = i;
+			vi->gindex[vf->glist[gi]] = gi;
+		}
+	}
+
+	memcpy(vi->files, files, n * sizeof(*files));
+	vi->nfiles = n;
+	memcpy(vi->present, present, sizeof(present));
+	vi->last_scan = cocofs_now_ns();
+}
+
+static struct vimage *
+vimage_open(const char *root)
+{
+	struct vimage *vi = calloc(1, sizeof(*vi));
+
+	assert(vi != NULL);
+	vi->root = strdup(root);
+	assert(vi->root != NULL);
+	vi->fs = cocofs_alloc(-1, vi->root);
+	vi->fs->allocator = opts.allocator;
+	memset(vi->fs->image_data, 0xff, COCOFS_TOTALSIZE);
+	vimage_scan(vi);
+	return vi;
+}
+
+/*
+ * Read a granule in from its host file.
+ */
+static void
+vimage_materialize(struct vimage *vi, unsigned int g)
+{
+	const struct vimage_file *vf = &vi->files[vi->owner[g]];
+	uint8_t *buf = vi->fs->image_data + cocofs_granule_to_offset(g);
+	off_t offset = (off_t)vi->gindex[g] * COCOFS_BYTES_PER_GRANULE;
+	ssize_t rv = 0;
+	size_t len;
+	int fd;
+
+	len = COCOFS_BYTES_PER_GRANULE;
+	if (vf->size - offset < (off_t)len) {
+		len = (size_t)(vf->size - offset);
+	}
+	fd = open(vf->hostpath, O_RDONLY | O_BINARY);
+	if (fd != -1) {
+		rv = cocofs_pread(fd, buf, len, offset);
+		close(fd);
+	}
+	if (rv < 0) {
+		rv = 0;
+	}
+	if ((size_t)rv != len) {
+		/* It changed underneath us; look again soon. */
+		vi->last_scan = 0;
+	}
+	memset(buf + rv, 0, COCOFS_BYTES_PER_GRANULE - rv);
+	vi->present[g] = true;
+}
+
+static bool
+vimage_read_sector(struct vimage *vi, unsigned int lsn, uint8_t *buf)
+{
+	unsigned int g;
+
+	if (lsn >= COCOFS_NSECTORS) {
+		return false;
+	}
+	if (lsn / COCOFS_SEC_PER_TRACK == COCOFS_DIR_TRACK) {
+		if (cocofs_now_ns() - vi->last_scan >= VIMAGE_RESCAN) {
+			vimage_scan(vi);
+		}
+	} else {
+		g = cocofs_offset_to_granule(lsn * COCOFS_BYTES_PER_SEC);
+		if (vi->owner[g] != 0xff && ! vi->present[g]) {
+			vimage_materialize(vi, g);
+		}
+	}
+	return cocofs_read_sector(vi->fs, lsn, buf);
+}
 
-		if (g >= COCOFS_NGRANULES) {
-			fprintf(stderr, "INVALID GRANULE #%d: %d\n",
-			    gi, g);
-			goto bad;
+#ifndef _WIN32
+/*
+ * Open a listening TCP socket on "[host:]port" (an IPv6 host goes in
+ * brackets).  With no host, only the loopback address is used.
+ */
+static int
+listen_on(const char *spec)
+{
+	struct addrinfo hints, *res, *ai;
+	char host[256];
+	const char *port, *cp;
+	int s = -1, error, one = 1;
+
+	cp = strrchr(spec, ':');
+	if (cp == NULL) {
+		strcpy(host, "localhost");
+		port = spec;
+	} else {
+		if (spec[0] == '[' && cp > spec && cp[-1] == ']') {
+			snprintf(host, sizeof(host), "%.*s",
+			    (int)(cp - spec - 2), spec + 1);
+		} else {
+			snprintf(host, sizeof(host), "%.*s",
+			    (int)(cp - spec), spec);
 		}
+		port = cp + 1;
+	}
 
-		gn = fs->granule_map[g];
-		if (! gmap_entry_is_valid(gn) ||
-		    gn == GMAP_FREE) {
-			printf("INVALID GRANULE MAP ENTRY "
-			       "%2d: %d -> 0x%02x\n", gi, g, gn);
-			goto bad;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	error = getaddrinfo(host[0] == '\0' || strcmp(host, "*") == 0 ?
+	    NULL : host, port, &hints, &res);
+	if (error != 0) {
+		fprintf(stderr, "%s: %s\n", spec, gai_strerror(error));
+		return -1;
+	}
+	for (ai = res; ai != NULL; ai = ai->ai_next) {
+		s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (s == -1) {
+			continue;
 		}
-		if (GMAP_IS_LAST(gn)) {
-			last_nsec = GMAP_LAST_NSEC(gn);
+		setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(s, ai->ai_addr, ai->ai_addrlen) == 0 &&
+		    listen(s, 16) == 0) {
+			break;
+		}
+		close(s);
+		s = -1;
+	}
+	if (s == -1) {
+		fprintf(stderr, "unable to listen on %s: %s\n", spec,
+		    strerror(errno));
+	}
+	freeaddrinfo(res);
+	return s;
+}
+
+/*
+ * DriveWire 4 server.  This speaks the DriveWire protocol over TCP, as
+ * emulators' "Becker port" cartridges (XRoar, MAME, ...) do, serving
+ * disk images and synthetic images of host directories as DriveWire
+ * drives 0, 1, and so on.  As HDB-DOS does, sectors past the end of
+ * drive 0 are taken from the following drives.
+ *
+ * Writes to disk images are done in the image cache and written back
+ * asynchronously.  Synthetic images are write-protected.
+ */
+#define	DW_OP_NOP		0x00
+#define	DW_OP_TIME		0x23
+#define	DW_OP_INIT		0x49
+#define	DW_OP_GETSTAT		0x47
+#define	DW_OP_SETSTAT		0x53
+#define	DW_OP_TERM		0x54
+#define	DW_OP_WRITE		0x57
+#define	DW_OP_DWINIT		0x5a
+#define	DW_OP_REWRITE		0x77
+#define	DW_OP_READEX		0xd2
+#define	DW_OP_REREADEX		0xf2
+#define	DW_OP_RESET3		0xf8
+#define	DW_OP_RESET2		0xfe
+#define	DW_OP_RESET		0xff
+
+#define	DW_E_OK			0x00
+#define	DW_E_UNIT		0xf0
+#define	DW_E_WP			0xf2
+#define	DW_E_CRC		0xf3
+#define	DW_E_READ		0xf4
+#define	DW_E_WRITE		0xf5
+
+#define	DW_DEFAULT_LISTEN	"127.0.0.1:65504"
+#define	DW_MAXDRIVES		4
+
+static struct {
+	unsigned int	ndrives;
+	struct dw_drive {
+		const char	*image;		/* disk image, or */
+		struct vimage	*vi;		/* synthetic image */
+	}		drive[DW_MAXDRIVES];
+} dw;
+
+/*
+ * Map a DriveWire drive and LSN to one of our drives.
+ */
+static struct dw_drive *
+dw_drive(unsigned int drive, unsigned int *lsnp)
+{
+	if (drive == 0 && *lsnp >= COCOFS_NSECTORS) {
+		drive = *lsnp / COCOFS_NSECTORS;
+		*lsnp %= COCOFS_NSECTORS;
+	}
+	return drive < dw.ndrives ? &dw.drive[drive] : NULL;
+}
+
+static uint8_t
+dw_read_sector(unsigned int drive, unsigned int lsn, uint8_t *buf)
+{
+	struct dw_drive *d = dw_drive(drive, &lsn);
+	struct imgcache_entry *e;
+	bool ok;
+
+	if (d == NULL) {
+		return DW_E_UNIT;
+	}
+	if (d->vi != NULL) {
+		return vimage_read_sector(d->vi, lsn, buf) ? DW_E_OK
+							   : DW_E_READ;
+	}
+	e = imgcache_get(d->image, false);
+	if (e == NULL) {
+		return DW_E_READ;
+	}
+	ok = cocofs_read_sector(e->fs, lsn, buf);
+	imgcache_release(e, false);
+	return ok ? DW_E_OK : DW_E_READ;
+}
+
+static uint8_t
+dw_write_sector(unsigned int drive, unsigned int lsn, const uint8_t *buf)
+{
+	struct dw_drive *d = dw_drive(drive, &lsn);
+	struct imgcache_entry *e;
+	bool ok;
+
+	if (d == NULL) {
+		return DW_E_UNIT;
+	}
+	if (d->vi != NULL) {
+		return DW_E_WP;
+	}
+	e = imgcache_get(d->image, true);
+	if (e == NULL) {
+		return DW_E_WRITE;
+	}
+	ok = cocofs_write_sector(e->fs, lsn, buf);
+	imgcache_release(e, ok);
+	return ok ? DW_E_OK : DW_E_WRITE;
+}
+
+static bool
+dw_recv(int s, uint8_t *buf, size_t len)
+{
+	ssize_t rv;
+
+	while (len != 0) {
+		rv = read(s, buf, len);
+		if (rv <= 0) {
+			if (rv == -1 && errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		buf += rv;
+		len -= (size_t)rv;
+	}
+	return true;
+}
+
+static bool
+dw_send(int s, const uint8_t *buf, size_t len)
+{
+	ssize_t rv;
+
+	while (len != 0) {
+		rv = write(s, buf, len);
+		if (rv <= 0) {
+			if (rv == -1 && errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		buf += rv;
+		len -= (size_t)rv;
+	}
+	return true;
+}
+
+static uint16_t
+dw_checksum(const uint8_t *buf)
+{
+	uint16_t sum = 0;
+	unsigned int i;
+
+	for (i = 0; i < COCOFS_BYTES_PER_SEC; i++) {
+		sum += buf[i];
+	}
+	return sum;
+}
+
+/*
+ * Serve one client until it goes away.
+ */
+static void
+dw_session(int s)
+{
+	uint8_t op, hdr[4], cksum[2], err;
+	uint8_t buf[COCOFS_BYTES_PER_SEC];
+	unsigned int lsn;
+	struct tm *tm;
+	time_t now;
+
+	while (dw_recv(s, &op, 1)) {
+		switch (op) {
+		case DW_OP_READEX:
+		case DW_OP_REREADEX:
+			if (! dw_recv(s, hdr, 4)) {
+				return;
+			}
+			lsn = (hdr[1] << 16) | (hdr[2] << 8) | hdr[3];
+			err = dw_read_sector(hdr[0], lsn, buf);
+			if (err != DW_E_OK) {
+				memset(buf, 0, sizeof(buf));
+			}
+			if (! dw_send(s, buf, sizeof(buf)) ||
+			    ! dw_recv(s, cksum, 2)) {
+				return;
+			}
+			if (err == DW_E_OK &&
+			    ((cksum[0] << 8) | cksum[1]) != dw_checksum(buf)) {
+				err = DW_E_CRC;
+			}
+			if (! dw_send(s, &err, 1)) {
+				return;
+			}
+			break;
+
+		case DW_OP_WRITE:
+		case DW_OP_REWRITE:
+			if (! dw_recv(s, hdr, 4) ||
+			    ! dw_recv(s, buf, sizeof(buf)) ||
+			    ! dw_recv(s, cksum, 2)) {
+				return;
+			}
+			lsn = (hdr[1] << 16) | (hdr[2] << 8) | hdr[3];
+			if (((cksum[0] << 8) | cksum[1]) != dw_checksum(buf)) {
+				err = DW_E_CRC;
+			} else {
+				err = dw_write_sector(hdr[0], lsn, buf);
+			}
+			if (! dw_send(s, &err, 1)) {
+				return;
+			}
+			break;
+
+		case DW_OP_GETSTAT:
+		case DW_OP_SETSTAT:
+			/* drive, code; no reply */
+			if (! dw_recv(s, hdr, 2)) {
+				return;
+			}
+			break;
+
+		case DW_OP_DWINIT:
+			/* client capabilities; we have none to offer */
+			if (! dw_recv(s, hdr, 1)) {
+				return;
+			}
+			err = 0;
+			if (! dw_send(s, &err, 1)) {
+				return;
+			}
+			break;
+
+		case DW_OP_TIME:
+			now = time(NULL);
+			tm = localtime(&now);
+			buf[0] = (uint8_t)tm->tm_year;
+			buf[1] = (uint8_t)(tm->tm_mon + 1);
+			buf[2] = (uint8_t)tm->tm_mday;
+			buf[3] = (uint8_t)tm->tm_hour;
+			buf[4] = (uint8_t)tm->tm_min;
+			buf[5] = (uint8_t)tm->tm_sec;
+			if (! dw_send(s, buf, 6)) {
+				return;
+			}
+			break;
+
+		case DW_OP_NOP:
+		case DW_OP_INIT:
+		case DW_OP_TERM:
+		case DW_OP_RESET:
+		case DW_OP_RESET2:
+		case DW_OP_RESET3:
+			break;
+
+		default:
+			fprintf(stderr, "dwserve: unsupported opcode 0x%02x\n",
+			    op);
 			break;
+		}
+	}
+}
+
+static int
+cmd_dwserve(int argc, char *argv[])
+{
+	const char *listen_spec = DW_DEFAULT_LISTEN;
+	struct imgcache_entry *e;
+	struct stat sb;
+	int ls, s, i, one = 1;
+
+	if (argc >= 2 && strcmp(argv[0], "-l") == 0) {
+		listen_spec = argv[1];
+		argc -= 2;
+		argv += 2;
+	}
+	if (argc < 1 || argc > DW_MAXDRIVES) {
+		return usage();
+	}
+
+	imgcache_init(opts.cache_size ? opts.cache_size
+				      : IMGCACHE_DEFAULT_SIZE);
+	for (i = 0; i < argc; i++) {
+		if (stat(argv[i], &sb) == -1) {
+			fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+			return EXIT_FAILURE;
+		}
+		if (S_ISDIR(sb.st_mode)) {
+			dw.drive[i].vi = vimage_open(argv[i]);
 		} else {
-			/* Write out a full granule. */
-			offset = cocofs_granule_to_offset(g);
-			rv = write(outfd, fs->image_data + offset,
-			    COCOFS_BYTES_PER_GRANULE);
-			if (rv != COCOFS_BYTES_PER_GRANULE) {
-				fprintf(stderr, "error writing %s: %s\n",
-				    outfname, strerror(errno));
-				goto bad;
+			e = imgcache_get(argv[i], false);
+			if (e == NULL) {
+				fprintf(stderr, "%s: unable to load image\n",
+				    argv[i]);
+				return EXIT_FAILURE;
 			}
+			imgcache_release(e, false);
+			dw.drive[i].image = argv[i];
 		}
-		g = gn;
 	}
+	dw.ndrives = argc;
 
-	if (last_nsec < 1 || last_nsec > COCOFS_SEC_PER_GRANULE) {
-		fprintf(stderr, "UNEXPECTED LAST_NSEC %u\n", last_nsec);
-		goto bad;
+	ls = listen_on(listen_spec);
+	if (ls == -1) {
+		return EXIT_FAILURE;
 	}
-	last_nbytes = cocofs_dir_lastbytes(dir->d_last_bytes);
-	if (last_nbytes > COCOFS_BYTES_PER_SEC) {
-		fprintf(stderr, "UNEXPECTED LAST_BYTES %u, CLAMPING TO %d\n",
-		    last_nbytes, COCOFS_BYTES_PER_SEC);
-		last_nbytes = COCOFS_BYTES_PER_SEC;
+	fprintf(stderr, "dwserve: listening on %s\n", listen_spec);
+
+	for (;;) {
+		s = accept(ls, NULL, NULL);
+		if (s == -1) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			fprintf(stderr, "accept: %s\n", strerror(errno));
+			return EXIT_FAILURE;
+		}
+		setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		dw_session(s);
+		close(s);
 	}
-	last_nbytes = (last_nsec * COCOFS_BYTES_PER_SEC) -
-	    (COCOFS_BYTES_PER_SEC - last_nbytes);
-	
-	/* Write out the trailing bytes in the last granule. */
-	offset = cocofs_granule_to_offset(g);
-	rv = write(outfd, fs->image_data + offset, last_nbytes);
-	if (rv != last_nbytes) {
-		fprintf(stderr, "error writing %s: %s\n",
-		    outfname, strerror(errno));
-		goto bad;
+}
+/*
+ * Read-only HTTP server (cocofs http).  This lets other programs (a
+ * catalog web UI, say) look inside the images under a directory
+ * without running cocofs for every request:
+ *
+ *	GET /dir/PATH		a host directory's subdirectories and
+ *				images, or an image's files, as JSON
+ *	GET /img/PATH		a whole image
+ *	GET /file/PATH/NAME	one file from an image
+ *	GET /metrics		the --metrics counters, if enabled
+ *
+ * Images and files have ETags (FNV-1a hashes of their contents) and
+ * may be fetched in pieces with Range.  Parsed directories are kept
+ * with their images in the image cache.  It's a single-threaded
+ * poll(2) loop over non-blocking connections (with keep-alive and
+ * pipelining); whole images are sent with sendfile(2) where there is
+ * one.
+ */
+#define	HTTP_DEFAULT_LISTEN	"127.0.0.1:8080"
+#define	HTTP_MAXCONNS		256
+#define	HTTP_REQMAX		8192
+#define	HTTP_IDLE_SECS		30
+
+#ifndef MSG_NOSIGNAL
+#define	MSG_NOSIGNAL		0	/* SIGPIPE is ignored anyway */
+#endif
+
+struct http_conn {
+	int		fd;
+	char		req[HTTP_REQMAX];
+	size_t		reqlen;
+	char		*out;		/* headers and any in-memory body */
+	size_t		outlen;
+	size_t		outoff;
+	int		file_fd;	/* body sent from a file, or -1 */
+	off_t		file_off;
+	off_t		file_end;
+	bool		close;		/* once this response is sent */
+	time_t		last;
+};
+
+struct http_req {
+	char		*method;
+	char		*target;
+	const char	*range;
+	const char	*if_none_match;
+	bool		head;
+};
+
+/* What's kept with an image in the image cache. */
+struct http_index {
+	struct catalog_image *ci;
+	char		etag[20];
+	char		*json;
+	size_t		jsonlen;
+};
+
+static struct {
+	const char	*root;
+	struct http_conn *conns[HTTP_MAXCONNS];
+	unsigned int	nconns;
+} http;
+
+static const char *
+http_reason(int status)
+{
+	switch (status) {
+	case 200:	return "OK";
+	case 206:	return "Partial Content";
+	case 304:	return "Not Modified";
+	case 400:	return "Bad Request";
+	case 404:	return "Not Found";
+	case 405:	return "Method Not Allowed";
+	case 416:	return "Range Not Satisfiable";
+	case 431:	return "Request Header Fields Too Large";
+	default:	return "Internal Server Error";
+	}
+}
+
+/*
+ * Start a response.  The body, if there is one in memory, follows the
+ * headers in the output buffer.
+ */
+static void
+http_reply(struct http_conn *c, const struct http_req *rq, int status,
+    const char *ctype, const char *etag, const char *extra,
+    const void *body, off_t length)
+{
+	char hdr[512];
+	int hlen;
+
+	hlen = snprintf(hdr, sizeof(hdr),
+	    "HTTP/1.1 %d %s\r\n"
+	    "Server: cocofs\r\n"
+	    "Content-Length: %lld\r\n"
+	    "%s%s%s"
+	    "%s%s%s"
+	    "Accept-Ranges: bytes\r\n"
+	    "%s"
+	    "%s"
+	    "\r\n",
+	    status, http_reason(status), (long long)length,
+	    ctype ? "Content-Type: " : "", ctype ? ctype : "",
+	    ctype ? "\r\n" : "",
+	    etag ? "ETag: " : "", etag ? etag : "", etag ? "\r\n" : "",
+	    extra ? extra : "",
+	    c->close ? "Connection: close\r\n" : "");
+	assert(hlen > 0 && (size_t)hlen < sizeof(hdr));
+
+	if (rq != NULL && rq->head) {
+		body = NULL;
 	}
+	c->outlen = hlen + (body != NULL ? (size_t)length : 0);
+	c->out = malloc(c->outlen);
+	assert(c->out != NULL);
+	memcpy(c->out, hdr, hlen);
+	if (body != NULL) {
+		memcpy(c->out + hlen, body, (size_t)length);
+	}
+	c->outoff = 0;
+}
 
-	close(outfd);
-	return true;
+static void
+http_error(struct http_conn *c, const struct http_req *rq, int status)
+{
+	char body[64];
+	int len;
 
- bad:
-	close(outfd);
-	return false;
+	len = snprintf(body, sizeof(body), "%d %s\n", status,
+	    http_reason(status));
+	http_reply(c, rq, status, "text/plain", NULL, NULL, body, len);
 }
 
-static unsigned int
-cocofs_galloc(struct cocofs *fs, unsigned int last)
+/*
+ * Parse a Range header.  Only a single range is supported; anything
+ * else is ignored, and the whole thing is sent.  Returns 1 if there's
+ * a range, 0 if not, or -1 if it can't be satisfied.
+ */
+static int
+http_range(const char *hdr, off_t size, off_t *startp, off_t *endp)
 {
-	unsigned int g, next, loopcnt;
+	unsigned long long a, b;
+	char *ep;
+
+	if (hdr == NULL || strncmp(hdr, "bytes=", 6) != 0 ||
+	    strchr(hdr, ',') != NULL) {
+		return 0;
+	}
+	hdr += 6;
+	if (*hdr == '-') {
+		/* The last N bytes. */
+		b = strtoull(hdr + 1, &ep, 10);
+		if (ep == hdr + 1 || *ep != '\0') {
+			return 0;
+		}
+		if (b == 0) {
+			return -1;
+		}
+		*startp = (off_t)b >= size ? 0 : size - (off_t)b;
+		*endp = size;
+		return size == 0 ? -1 : 1;
+	}
+	a = strtoull(hdr, &ep, 10);
+	if (ep == hdr || *ep != '-') {
+		return 0;
+	}
+	hdr = ep + 1;
+	if (*hdr == '\0') {
+		b = (unsigned long long)size - 1;
+	} else {
+		b = strtoull(hdr, &ep, 10);
+		if (*ep != '\0' || b < a) {
+			return 0;
+		}
+	}
+	if ((off_t)a >= size) {
+		return -1;
+	}
+	if ((off_t)b >= size) {
+		b = (unsigned long long)size - 1;
+	}
+	*startp = (off_t)a;
+	*endp = (off_t)b + 1;
+	return 1;
+}
+
+/*
+ * Send an image or file, from memory or from fd (which we take over),
+ * honoring If-None-Match and Range.
+ */
+static void
+http_send(struct http_conn *c, const struct http_req *rq, const char *ctype,
+    const char *etag, const uint8_t *data, int fd, off_t size)
+{
+	char extra[96];
+	off_t start = 0, end = size;
+	int status = 200;
+
+	extra[0] = '\0';
+	if (rq->if_none_match != NULL &&
+	    (strcmp(rq->if_none_match, etag) == 0 ||
+	     strcmp(rq->if_none_match, "*") == 0)) {
+		http_reply(c, NULL, 304, NULL, etag, NULL, NULL, 0);
+		goto done;
+	}
+	switch (http_range(rq->range, size, &start, &end)) {
+	case -1:
+		snprintf(extra, sizeof(extra),
+		    "Content-Range: bytes */%lld\r\n", (long long)size);
+		http_reply(c, NULL, 416, NULL, etag, extra, NULL, 0);
+		goto done;
+	case 1:
+		status = 206;
+		snprintf(extra, sizeof(extra),
+		    "Content-Range: bytes %lld-%lld/%lld\r\n",
+		    (long long)start, (long long)end - 1, (long long)size);
+		break;
+	}
+
+	if (data != NULL) {
+		http_reply(c, rq, status, ctype, etag, extra, data + start,
+		    end - start);
+	} else {
+		http_reply(c, rq, status, ctype, etag, extra, NULL,
+		    end - start);
+		if (! rq->head && end > start) {
+			c->file_fd = fd;
+			c->file_off = start;
+			c->file_end = end;
+			return;
+		}
+	}
+ done:
+	if (fd != -1) {
+		close(fd);
+	}
+}
+
+/*
+ * Turn a request path into a host path under the root.  Returns false
+ * for anything that would go outside of it.
+ */
+static bool
+http_path(const char *rel, char *path, size_t pathsize)
+{
+	const char *cp;
+
+	while (*rel == '/') {
+		rel++;
+	}
+	for (cp = rel; *cp != '\0'; cp = strchr(cp, '/') + 1) {
+		if (strncmp(cp, "..", 2) == 0 &&
+		    (cp[2] == '/' || cp[2] == '\0')) {
+			return false;
+		}
+		if (strchr(cp, '/') == NULL) {
+			break;
+		}
+	}
+	return (size_t)snprintf(path, pathsize, "%s/%s", http.root, rel) <
+	    pathsize;
+}
+
+static void
+http_index_free(void *arg)
+{
+	struct http_index *hi = arg;
+
+	catalog_index_free(hi->ci);
+	free(hi->json);
+	free(hi);
+}
+
+static void
+http_put_name(FILE *fp, const char *name, size_t namelen, const char *ext,
+    size_t extlen)
+{
+	char buf[8+1+3+1];
+	size_t n;
+
+	while (namelen > 0 && name[namelen - 1] == ' ') {
+		namelen--;
+	}
+	while (extlen > 0 && ext[extlen - 1] == ' ') {
+		extlen--;
+	}
+	n = (size_t)snprintf(buf, sizeof(buf), "%.*s", (int)namelen, name);
+	if (extlen != 0) {
+		snprintf(buf + n, sizeof(buf) - n, ".%.*s", (int)extlen, ext);
+	}
+	json_put_string(fp, buf);
+}
+
+/*
+ * Hash the first size bytes of a file, for its ETag.
+ */
+static bool
+http_hash_fd(int fd, off_t size, uint64_t *hashp)
+{
+	uint64_t hash = FNV1A_64_INIT;
+	uint8_t *buf;
+	off_t off;
+	ssize_t rv;
 
-	for (loopcnt = 0, g = last; loopcnt <= COCOFS_NGRANULES;
-	     loopcnt++, g = next) {
-		if (fs->granule_map[g] == GMAP_FREE) {
-			fs->granule_map[g] = GMAP_ALLOCATED;
-			fs->free_granules--;
-			return g;
-		}
-		next = g + 1;
-		if (next == COCOFS_NGRANULES) {
-			next = 0;
+	buf = malloc(HDB_CHUNK);
+	assert(buf != NULL);
+	for (off = 0; off < size; off += rv) {
+		rv = cocofs_pread(fd, buf, size - off < HDB_CHUNK ?
+		    (size_t)(size - off) : HDB_CHUNK, off);
+		if (rv <= 0) {
+			free(buf);
+			return false;
 		}
+		hash = fnv1a_64(buf, (size_t)rv, hash);
 	}
-	assert(loopcnt <= COCOFS_NGRANULES);
-	abort();
+	free(buf);
+	*hashp = hash;
+	return true;
 }
 
-static bool
-cocofs_copyin(struct cocofs *fs, const char *infile, const char name[8],
-    const char ext[3], uint8_t type, uint8_t enc)
+/*
+ * Get an image from the cache, along with its HTTP index.
+ */
+static struct imgcache_entry *
+http_image(const char *path, struct http_index **hip)
 {
-	struct cocofs_dirent *dir = NULL;
-	struct stat sb;
-	int infd;
-	unsigned int granules_needed;
-	unsigned int orig_free_granules;
-	unsigned int g, gi;
+	struct imgcache_entry *e;
+	struct http_index *hi;
+	struct catalog_file *cf;
+	FILE *fp;
 	unsigned int i;
-	uint8_t orig_gmap[COCOFS_NGRANULES];
-	uint8_t glist[COCOFS_NGRANULES];
 
-	/*
-	 * Make a backup copy of the granule map so we can roll back,
-	 * if necesary.
-	 */
-	memcpy(orig_gmap, fs->granule_map, sizeof(orig_gmap));
-	orig_free_granules = fs->free_granules;
+	e = imgcache_get(path, false);
+	if (e == NULL) {
+		return NULL;
+	}
+	if ((hi = e->index) != NULL) {
+		*hip = hi;
+		return e;
+	}
+
+	hi = calloc(1, sizeof(*hi));
+	assert(hi != NULL);
+	hi->ci = catalog_index_image(e);
 
 	/*
-	 * Initialize the list we use to hold allocate granules.
+	 * The ETag is a hash of the whole file, as /img sends it.  (An
+	 * image is never bigger than COCOFS_TOTALSIZE, and was read in
+	 * whole.)
 	 */
-	memset(glist, 0xff, sizeof(glist));
-
-	infd = open(infile, O_RDONLY | O_BINARY);
-	if (infd == -1) {
-		fprintf(stderr,
-		    "unable to open %s: %s\n", infile, strerror(errno));
-		return false;
+	snprintf(hi->etag, sizeof(hi->etag), "\"%016" PRIx64 "\"",
+	    fnv1a_64(e->fs->image_data, (size_t)e->size, FNV1A_64_INIT));
+
+	fp = open_memstream(&hi->json, &hi->jsonlen);
+	assert(fp != NULL);
+	fprintf(fp, "{\"size\":%lld,\"free_granules\":%u,\"etag\":",
+	    (long long)e->size, e->fs->free_granules);
+	json_put_string(fp, hi->etag);
+	fputs(",\"files\":[", fp);
+	for (i = 0; i < hi->ci->nfiles; i++) {
+		cf = &hi->ci->files[i];
+		fputs(i ? ",{\"name\":" : "{\"name\":", fp);
+		http_put_name(fp, cf->name, sizeof(cf->name), cf->ext,
+		    sizeof(cf->ext));
+		fputs(",\"type\":", fp);
+		json_put_string(fp, cocofs_dir_type(cf->type));
+		fputs(",\"encoding\":", fp);
+		json_put_string(fp, cocofs_dir_encoding(cf->encoding));
+		fprintf(fp, ",\"size\":%u,\"hash\":\"%016" PRIx64 "\"}",
+		    cf->size, cf->hash);
 	}
+	fputs("]}\n", fp);
+	fclose(fp);
 
-	if (fstat(infd, &sb) == -1) {
-		fprintf(stderr,
-		    "unable to stat %s: %s\n", infile, strerror(errno));
-		goto bad;
-	}
+	e->index = hi;
+	e->index_free = http_index_free;
+	*hip = hi;
+	return e;
+}
 
-	if ((unsigned long long)sb.st_size >
-	    fs->free_granules * COCOFS_BYTES_PER_GRANULE) {
-		fprintf(stderr,
-		    "%s: %s\n", infile, strerror(ENOSPC));
-		goto bad;
-	}
+static int
+http_strcmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
 
-	granules_needed = sb.st_size / COCOFS_BYTES_PER_GRANULE;
-	if (sb.st_size % COCOFS_BYTES_PER_GRANULE) {
-		granules_needed++;
+static void
+http_get_dir(struct http_conn *c, const struct http_req *rq, const char *path)
+{
+	struct imgcache_entry *e;
+	struct http_index *hi;
+	struct dirent *de;
+	struct stat sb;
+	char sub[PATH_MAX], **names = NULL;
+	size_t nnames = 0, maxnames = 0, i, len;
+	char *json;
+	FILE *fp;
+	DIR *d;
+	bool first;
+	int pass;
+
+	if (stat(path, &sb) == -1) {
+		http_error(c, rq, 404);
+		return;
 	}
-	assert(granules_needed <= fs->free_granules);
-
-	/*
-	 * Find a free directory entry.
-	 */
-	for (i = 0; i < COCOFS_DIR_TRACK_NENTRIES; i++) {
-		dir = &fs->directory[i];
-		if (dir->d_type == COCOFS_DIRENT_TYPE_FREE) {
-			break;
+	if (S_ISREG(sb.st_mode)) {
+		e = http_image(path, &hi);
+		if (e == NULL) {
+			http_error(c, rq, 404);
+			return;
 		}
-	}
-	if (i == COCOFS_DIR_TRACK_NENTRIES) {
-		fprintf(stderr,
-		    "No directory entries available for %s\n", infile);
-		dir = NULL;
-		goto bad;
+		http_reply(c, rq, 200, "application/json", hi->etag, NULL,
+		    hi->json, hi->jsonlen);
+		imgcache_release(e, false);
+		return;
 	}
 
-	/*
-	 * Our allocation strategy is really simple.  We start in the
-	 * middle of the disk (where the directory is; all file reads
-	 * need to start there), and allocate one block at a time.  We
-	 * pass in the starting point each time to try and allocate as
-	 * contiguously as possible.  We are guaranteed that this will
-	 * succeed, as we have already checked that there are enough
-	 * free granules to satisfy the request.
-	 */
-	unsigned int last;
-	for (last = COCOFS_NGRANULES / 2, gi = 0; gi < granules_needed;
-	     last = g, gi++) {
-		g = cocofs_galloc(fs, last);
-		glist[gi] = g;
+	d = opendir(path);
+	if (d == NULL) {
+		http_error(c, rq, 404);
+		return;
 	}
-
-	/*
-	 * We now have our list of granules for the new file, and
-	 * each granule has been marked as allocated in the Granule
-	 * Map.
-	 */
-	ssize_t resid, cursz;
-	ssize_t rv;
-	uint8_t *buf;
-	for (gi = 0, resid = (ssize_t)sb.st_size;
-	     resid != 0; gi++, resid -= cursz) {
-		cursz = resid;
-		if (cursz > COCOFS_BYTES_PER_GRANULE) {
-			cursz = COCOFS_BYTES_PER_GRANULE;
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] == '.') {
+			continue;
 		}
-
-		g = glist[gi];
-		assert(fs->granule_map[g] == GMAP_ALLOCATED);
-		buf = fs->image_data + cocofs_granule_to_offset(g);
-		rv = cocofs_pread(infd, buf, cursz,
-				  gi * COCOFS_BYTES_PER_GRANULE);
-		if (rv != cursz) {
-			fprintf(stderr, "failed to read %s\n", infile);
-			goto bad;
+		if (nnames == maxnames) {
+			maxnames = maxnames ? maxnames * 2 : 64;
+			names = realloc(names, maxnames * sizeof(*names));
+			assert(names != NULL);
 		}
+		names[nnames] = strdup(de->d_name);
+		assert(names[nnames] != NULL);
+		nnames++;
+	}
+	closedir(d);
+	if (nnames != 0) {
+		qsort(names, nnames, sizeof(*names), http_strcmp);
+	}
 
-		if (resid <= COCOFS_BYTES_PER_GRANULE) {
-			/*
-			 * This is the last granule of the file.  Set
-			 * the trailing-bytes values.
-			 */
-			uint8_t nsec = resid / COCOFS_BYTES_PER_SEC;
-			if (resid % COCOFS_BYTES_PER_SEC) {
-				nsec++;
-			}
-			assert(gi + 1 == granules_needed);
-			assert(nsec <= COCOFS_SEC_PER_GRANULE);
-			fs->granule_map[g] = GMAP_LAST | nsec;
-
-			unsigned int lastbytes = resid % COCOFS_BYTES_PER_SEC;
-			if (lastbytes == 0) {
-				lastbytes = COCOFS_BYTES_PER_SEC;
+	fp = open_memstream(&json, &len);
+	assert(fp != NULL);
+	for (pass = 0; pass < 2; pass++) {
+		fputs(pass == 0 ? "{\"dirs\":[" : "],\"images\":[", fp);
+		for (i = 0, first = true; i < nnames; i++) {
+			snprintf(sub, sizeof(sub), "%s/%s", path, names[i]);
+			if (stat(sub, &sb) == -1) {
+				continue;
 			}
-
-			/* Zero out the remainder of the granule. */
-			unsigned int trailing =
-			    COCOFS_BYTES_PER_GRANULE - resid;
-			if (trailing != 0) {
-				memset(&buf[resid], 0, trailing);
+			if (pass == 0 && S_ISDIR(sb.st_mode)) {
+				fputs(first ? "" : ",", fp);
+				json_put_string(fp, names[i]);
+			} else if (pass == 1 && S_ISREG(sb.st_mode) &&
+				   scan_is_image(names[i])) {
+				fputs(first ? "{\"name\":" : ",{\"name\":",
+				    fp);
+				json_put_string(fp, names[i]);
+				fprintf(fp, ",\"size\":%lld}",
+				    (long long)sb.st_size);
+			} else {
+				continue;
 			}
-
-			/* Set the directory entry. */
-			memcpy(dir->d_name, name, sizeof(dir->d_name));
-			memcpy(dir->d_ext, ext, sizeof(dir->d_ext));
-			dir->d_type = type;
-			dir->d_encoding = enc;
-			dir->d_first_granule = glist[0];
-			cocofs_dir_set_lastbytes(lastbytes, dir->d_last_bytes);
-		} else {
-			/*
-			 * Point the current Granule Map entry at the
-			 * next granule.
-			 */
-			assert(gi + 1 < granules_needed);
-			fs->granule_map[g] = glist[gi + 1];
+			first = false;
 		}
 	}
-
-	/* All done. */
-	close(infd);
-	return true;
-
- bad:
-	/* Back out changes to the directory and granule map. */
-	if (dir != NULL) {
-		memset(dir, 0xff, sizeof(*dir));
+	fputs("]}\n", fp);
+	fclose(fp);
+	for (i = 0; i < nnames; i++) {
+		free(names[i]);
 	}
-	memcpy(fs->granule_map, orig_gmap, sizeof(orig_gmap));
-	fs->free_granules = orig_free_granules;
-	close(infd);
-	return false;
-}
-
-static const char *myname = "cocofs";
+	free(names);
 
-#ifdef COCOFS_VERSION
-#define	STRINGIFY(x)		#x
-#define	STRINGIFY_HARDER(x)	STRINGIFY(x)
-static const char *version = STRINGIFY_HARDER(COCOFS_VERSION);
-#endif
+	http_reply(c, rq, 200, "application/json", NULL, NULL, json, len);
+	free(json);
+}
 
+/*
+ * Send a whole image.  The ETag is computed from the same descriptor
+ * the image is sent from, so that it describes the bytes actually sent
+ * even if the image is replaced in the meantime.
+ */
 static void
-set_myname(const char *argv0)
+http_get_img(struct http_conn *c, const struct http_req *rq, const char *path)
 {
-	char *cp;
-
-	/* Unix path. */
-	cp = strrchr(argv0, '/');
-	if (cp == NULL) {
-		/* Windows path. */
-		cp = strrchr(argv0, '\\');
+	struct imgcache_entry *e;
+	struct http_index *hi;
+	struct stat sb;
+	char etag[sizeof(hi->etag)];
+	uint64_t hash;
+	int fd;
+
+	/* Only images are served. */
+	e = http_image(path, &hi);
+	if (e == NULL) {
+		http_error(c, rq, 404);
+		return;
 	}
-	if (cp == NULL) {
-		/* stick with the default. */
+	imgcache_release(e, false);
+
+	fd = open(path, O_RDONLY | O_BINARY);
+	if (fd == -1 || fstat(fd, &sb) == -1 ||
+	    ! http_hash_fd(fd, sb.st_size, &hash)) {
+		if (fd != -1) {
+			close(fd);
+		}
+		http_error(c, rq, 404);
 		return;
 	}
-	myname = ++cp;	/* advance past the path delimeter */
+	snprintf(etag, sizeof(etag), "\"%016" PRIx64 "\"", hash);
+	http_send(c, rq, "application/octet-stream", etag, NULL, fd,
+	    sb.st_size);
 }
 
-static int
-usage(void)
+static void
+http_get_file(struct http_conn *c, const struct http_req *rq, char *path)
 {
-#ifdef COCOFS_VERSION
-	fprintf(stderr, "%s version %s\n", myname, version);
-#endif
-	fprintf(stderr, "usage: %s <image> dump\n", myname);
-	fprintf(stderr, "       %s <image> format\n", myname);
-	fprintf(stderr, "       %s <image> ls [file1 [file2 [...]]]\n", myname);
-	fprintf(stderr, "       %s <image> rm file1 [file2 [...]]\n", myname);
-	fprintf(stderr, "       %s <image> copyin file1 [file2 [...]]\n",
-	    myname);
-	fprintf(stderr, "       %s <image> copyout file1 [file2 [...]]\n",
-	    myname);
-
-	return EXIT_FAILURE;
-}
+	struct imgcache_entry *e;
+	struct http_index *hi;
+	struct cocofs_dirent *dir;
+	char *name, etag[20];
+	uint8_t *data;
+	size_t size;
 
-static int
-cmd_dump(struct cocofs *fs, int argc, char *argv[])
-{
-	if (argc != 0) {
-		return usage();
+	name = strrchr(path, '/');
+	if (name == NULL) {
+		http_error(c, rq, 404);
+		return;
 	}
-	(void)argv;
+	*name++ = '\0';
 
-	cocofs_enumerate_directory(fs, true);
+	e = http_image(path, &hi);
+	if (e == NULL) {
+		http_error(c, rq, 404);
+		return;
+	}
+	dir = cocofs_lookup(e->fs, name);
+	if (dir == NULL || ! cocofs_read_file(e->fs, dir, &data, &size)) {
+		imgcache_release(e, false);
+		http_error(c, rq, 404);
+		return;
+	}
+	imgcache_release(e, false);
 
-	return EXIT_SUCCESS;
+	snprintf(etag, sizeof(etag), "\"%016" PRIx64 "\"",
+	    fnv1a_64(data, size, FNV1A_64_INIT));
+	http_send(c, rq, "application/octet-stream", etag, data, -1,
+	    (off_t)size);
+	free(data);
 }
 
-static int
-cmd_format(struct cocofs *fs, int argc, char *argv[])
+static void
+http_get_metrics(struct http_conn *c, const struct http_req *rq)
 {
-	if (argc != 0) {
-		return usage();
-	}
-	(void)argv;
-
-	/* Caller formatted a new image for us. */
+	char *text;
+	size_t len;
+	FILE *fp;
 
-	return cocofs_save(fs) ? EXIT_SUCCESS : EXIT_FAILURE;
+	if (! metrics.enabled) {
+		http_error(c, rq, 404);
+		return;
+	}
+	fp = open_memstream(&text, &len);
+	assert(fp != NULL);
+	metrics_format(fp);
+	fclose(fp);
+	http_reply(c, rq, 200, "text/plain; version=0.0.4", NULL, NULL,
+	    text, len);
+	free(text);
 }
 
-static int
-cmd_ls(struct cocofs *fs, int argc, char *argv[])
+/*
+ * Decode %XX escapes in place.  Returns false for bad escapes, and for
+ * NULs.
+ */
+static bool
+http_unescape(char *s)
 {
-	if (argc == 0) {
-		cocofs_enumerate_directory(fs, false);
-		return EXIT_SUCCESS;
-	}
+	char *d = s, hex[3] = { 0 };
+	unsigned long v;
 
-	struct cocofs_dirent *dir;
-	struct cocofs_stat st;
-	int retval = EXIT_SUCCESS;
-	int i;
-	for (i = 0; i < argc; i++) {
-		dir = cocofs_lookup(fs, argv[i]);
-		if (dir == NULL) {
-			fprintf(stderr, "%s: %s\n",
-			    argv[i], strerror(ENOENT));
-			retval = EXIT_FAILURE;
+	for (; *s != '\0'; s++) {
+		if (*s != '%') {
+			*d++ = *s;
 			continue;
 		}
-		cocofs_stat(fs, dir, &st);
-		cocofs_print_stat(&st);
+		if (! isxdigit((unsigned char)s[1]) ||
+		    ! isxdigit((unsigned char)s[2])) {
+			return false;
+		}
+		hex[0] = s[1];
+		hex[1] = s[2];
+		v = strtoul(hex, NULL, 16);
+		if (v == 0) {
+			return false;
+		}
+		*d++ = (char)v;
+		s += 2;
+	}
+	*d = '\0';
+	return true;
+}
+
+static void
+http_handle(struct http_conn *c, struct http_req *rq)
+{
+	char path[PATH_MAX], *target = rq->target, *cp;
+
+	if ((cp = strchr(target, '?')) != NULL) {
+		*cp = '\0';
+	}
+	if (strcmp(rq->method, "GET") != 0 && ! rq->head) {
+		http_error(c, rq, 405);
+		return;
+	}
+	if (! http_unescape(target)) {
+		http_error(c, rq, 400);
+		return;
+	}
+
+	if (strcmp(target, "/metrics") == 0) {
+		http_get_metrics(c, rq);
+	} else if (strcmp(target, "/") == 0 || strcmp(target, "/dir") == 0) {
+		snprintf(path, sizeof(path), "%s", http.root);
+		http_get_dir(c, rq, path);
+	} else if (strncmp(target, "/dir/", 5) == 0 &&
+		   http_path(target + 5, path, sizeof(path))) {
+		http_get_dir(c, rq, path);
+	} else if (strncmp(target, "/img/", 5) == 0 &&
+		   http_path(target + 5, path, sizeof(path))) {
+		http_get_img(c, rq, path);
+	} else if (strncmp(target, "/file/", 6) == 0 &&
+		   http_path(target + 6, path, sizeof(path))) {
+		http_get_file(c, rq, path);
+	} else {
+		http_error(c, rq, 404);
 	}
-	return retval;
 }
 
-static int
-cmd_rm(struct cocofs *fs, int argc, char *argv[])
+/*
+ * If a whole request has arrived (and we aren't still sending the last
+ * response), parse and answer it.
+ */
+static void
+http_process(struct http_conn *c)
 {
-	if (argc == 0) {
-		return usage();
+	struct http_req rq;
+	char *end, *line, *next, *version, *val;
+	size_t used;
+
+	if (c->out != NULL || c->file_fd != -1) {
+		return;
+	}
+	c->req[c->reqlen] = '\0';
+	end = strstr(c->req, "\r\n\r\n");
+	if (end == NULL) {
+		if (c->reqlen == sizeof(c->req) - 1) {
+			c->close = true;
+			http_error(c, NULL, 431);
+		}
+		return;
+	}
+	*end = '\0';
+	used = end + 4 - c->req;
+
+	memset(&rq, 0, sizeof(rq));
+	line = c->req;
+	next = strstr(line, "\r\n");
+	if (next != NULL) {
+		*next = '\0';
+		next += 2;
+	}
+	rq.method = line;
+	rq.target = strchr(line, ' ');
+	version = rq.target ? strchr(rq.target + 1, ' ') : NULL;
+	if (version == NULL || strncmp(version + 1, "HTTP/1.", 7) != 0) {
+		c->close = true;
+		http_error(c, NULL, 400);
+		goto out;
+	}
+	*rq.target++ = '\0';
+	*version++ = '\0';
+	rq.head = strcmp(rq.method, "HEAD") == 0;
+	if (strcmp(version, "HTTP/1.0") == 0) {
+		c->close = true;
 	}
 
-	struct cocofs_dirent *dir;
-	int retval = EXIT_SUCCESS;
-	int i;
-	for (i = 0; i < argc; i++) {
-		dir = cocofs_lookup(fs, argv[i]);
-		if (dir == NULL) {
-			fprintf(stderr, "%s: %s\n",
-			    argv[i], strerror(ENOENT));
-			retval = EXIT_FAILURE;
+	for (line = next; line != NULL; line = next) {
+		next = strstr(line, "\r\n");
+		if (next != NULL) {
+			*next = '\0';
+			next += 2;
+		}
+		if ((val = strchr(line, ':')) == NULL) {
 			continue;
 		}
-		if (! cocofs_rm(fs, dir)) {
-			retval = EXIT_FAILURE;
-			break;
+		*val++ = '\0';
+		while (*val == ' ' || *val == '\t') {
+			val++;
 		}
-		if (! cocofs_save(fs)) {
-			retval = EXIT_FAILURE;
-			break;
+		if (strcasecmp(line, "Range") == 0) {
+			rq.range = val;
+		} else if (strcasecmp(line, "If-None-Match") == 0) {
+			rq.if_none_match = val;
+		} else if (strcasecmp(line, "Connection") == 0) {
+			if (strcasecmp(val, "close") == 0) {
+				c->close = true;
+			} else if (strcasecmp(val, "keep-alive") == 0) {
+				c->close = false;
+			}
+		} else if (strcasecmp(line, "Content-Length") == 0 &&
+			   strcmp(val, "0") != 0) {
+			/* We don't read request bodies. */
+			c->close = true;
 		}
 	}
-	return retval;
+
+	http_handle(c, &rq);
+
+ out:
+	memmove(c->req, c->req + used, c->reqlen - used);
+	c->reqlen -= used;
 }
 
-static int
-cmd_copyout(struct cocofs *fs, int argc, char *argv[])
+static void
+http_close(unsigned int i)
 {
-	if (argc == 0) {
-		return usage();
+	struct http_conn *c = http.conns[i];
+
+	close(c->fd);
+	if (c->file_fd != -1) {
+		close(c->file_fd);
 	}
+	free(c->out);
+	free(c);
+	http.conns[i] = http.conns[--http.nconns];
+}
 
-	struct cocofs_dirent *dir;
-	struct cocofs_stat st;
-	char outfname[8+1+3+1];	/* 88888888.333\0 */
-	int retval = EXIT_SUCCESS;
-	int i;
-	for (i = 0; i < argc; i++) {
-		dir = cocofs_lookup(fs, argv[i]);
-		if (dir == NULL) {
-			fprintf(stderr, "%s: %s\n",
-			    argv[i], strerror(ENOENT));
-			retval = EXIT_FAILURE;
-			continue;
+/*
+ * Send as much of the response as we can.  Returns false if the
+ * connection should be closed.
+ */
+static bool
+http_write(struct http_conn *c)
+{
+	ssize_t rv;
+
+	while (c->out != NULL && c->outoff < c->outlen) {
+		rv = send(c->fd, c->out + c->outoff, c->outlen - c->outoff,
+		    MSG_NOSIGNAL);
+		if (rv == -1) {
+			return errno == EAGAIN || errno == EWOULDBLOCK ||
+			    errno == EINTR;
 		}
-		cocofs_stat(fs, dir, &st);
-		/*
-		 * N.B. cocofs_stat() guarantees that st.st_name will
-		 * never exceed 8 bytes and that st.st_ext will never
-		 * exceed 3 bytes.  This means that the 13 byte buffer
-		 * allocated above will be sufficient for all possible
-		 * inputs, and thus strcpy() and sprintf() will be safe
-		 * to use.  (This improves the portability of the code.)
-		 */
-		if (st.st_ext[0] == '\0') {
-			/* No extension. */
-			strcpy(outfname, st.st_name);
-		} else {
-			sprintf(outfname, "%s.%s", st.st_name, st.st_ext);
+		c->outoff += (size_t)rv;
+	}
+	free(c->out);
+	c->out = NULL;
+
+	while (c->file_fd != -1 && c->file_off < c->file_end) {
+#ifdef __linux__
+		rv = sendfile(c->fd, c->file_fd, &c->file_off,
+		    (size_t)(c->file_end - c->file_off));
+#else
+		{
+			char buf[16384];
+			size_t n = sizeof(buf);
+
+			if ((off_t)n > c->file_end - c->file_off) {
+				n = (size_t)(c->file_end - c->file_off);
+			}
+			rv = pread(c->file_fd, buf, n, c->file_off);
+			if (rv > 0) {
+				rv = send(c->fd, buf, (size_t)rv,
+				    MSG_NOSIGNAL);
+			}
+			if (rv > 0) {
+				c->file_off += rv;
+			}
 		}
-		if (! cocofs_copyout(fs, dir, outfname)) {
-			retval = EXIT_FAILURE;
+#endif
+		if (rv == -1) {
+			return errno == EAGAIN || errno == EWOULDBLOCK ||
+			    errno == EINTR;
+		}
+		if (rv == 0) {
+			/* The file got shorter; the response is broken. */
+			return false;
 		}
+		metric_add(METRIC_READ_IMAGE, rv);
 	}
+	if (c->file_fd != -1) {
+		close(c->file_fd);
+		c->file_fd = -1;
+	}
+	return ! c->close;
+}
 
-	return retval;
+static bool
+http_busy(const struct http_conn *c)
+{
+	return c->out != NULL || c->file_fd != -1;
 }
 
 static int
-cmd_copyin(struct cocofs *fs, int argc, char *argv[])
+cmd_http(int argc, char *argv[])
 {
-	if (argc == 0) {
+	const char *listen_spec = HTTP_DEFAULT_LISTEN;
+	struct pollfd pfd[1 + HTTP_MAXCONNS];
+	struct http_conn *c;
+	struct stat sb;
+	unsigned int i, n;
+	ssize_t rv;
+	time_t now;
+	int ls, s, one = 1;
+
+	http.root = NULL;
+	for (; argc >= 2; argc -= 2, argv += 2) {
+		if (strcmp(argv[0], "--root") == 0) {
+			http.root = argv[1];
+		} else if (strcmp(argv[0], "--listen") == 0) {
+			listen_spec = argv[1];
+		} else {
+			return usage();
+		}
+	}
+	if (argc != 0 || http.root == NULL) {
 		return usage();
 	}
+	if (stat(http.root, &sb) == -1 || ! S_ISDIR(sb.st_mode)) {
+		fprintf(stderr, "%s: not a directory\n", http.root);
+		return EXIT_FAILURE;
+	}
 
-	struct cocofs_dirent *dir;
-	char name[8], ext[3];
-	uint8_t type, enc;
-	int retval = EXIT_SUCCESS;
-	int i;
-	for (i = 0; i < argc; i++) {
-		if (! cocofs_parse_fname(argv[i], name, ext, &type, &enc)) {
-			/* Error message already displayed. */
-			retval = EXIT_FAILURE;
-			continue;
+	imgcache_init(opts.cache_size ? opts.cache_size
+				      : IMGCACHE_DEFAULT_SIZE);
+	ls = listen_on(listen_spec);
+	if (ls == -1) {
+		return EXIT_FAILURE;
+	}
+	fcntl(ls, F_SETFL, fcntl(ls, F_GETFL) | O_NONBLOCK);
+	signal(SIGPIPE, SIG_IGN);
+	fprintf(stderr, "http: serving %s on %s\n", http.root, listen_spec);
+
+	for (;;) {
+		pfd[0].fd = ls;
+		pfd[0].events = http.nconns < HTTP_MAXCONNS ? POLLIN : 0;
+		for (i = 0; i < http.nconns; i++) {
+			c = http.conns[i];
+			pfd[1 + i].fd = c->fd;
+			pfd[1 + i].events = http_busy(c) ? POLLOUT : POLLIN;
+			pfd[1 + i].revents = 0;
 		}
-
-		/* Make sure this file does not already exist. */
-		dir = cocofs_lookup_raw(fs, name, ext);
-		if (dir != NULL) {
-			fprintf(stderr, "%s: %s\n", argv[1], strerror(EEXIST));
-			retval = EXIT_FAILURE;
-			continue;
+		n = http.nconns;
+		if (poll(pfd, 1 + n, 1000) == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "poll: %s\n", strerror(errno));
+			return EXIT_FAILURE;
 		}
-		if (! cocofs_copyin(fs, argv[i], name, ext, type, enc)) {
-			retval = EXIT_FAILURE;
-			break;
+		now = time(NULL);
+
+		/*
+		 * Go backwards, so closing a connection (which moves the
+		 * last one into its place) doesn't skip any.
+		 */
+		for (i = n; i-- > 0;) {
+			c = http.conns[i];
+			if (pfd[1 + i].revents == 0) {
+				if (now - c->last > HTTP_IDLE_SECS) {
+					http_close(i);
+				}
+				continue;
+			}
+			c->last = now;
+			if (pfd[1 + i].revents & POLLIN) {
+				rv = recv(c->fd, c->req + c->reqlen,
+				    sizeof(c->req) - 1 - c->reqlen, 0);
+				if (rv == 0 || (rv == -1 && errno != EAGAIN &&
+						errno != EINTR)) {
+					http_close(i);
+					continue;
+				}
+				if (rv > 0) {
+					c->reqlen += (size_t)rv;
+				}
+			} else if ((pfd[1 + i].revents &
+				    (POLLERR | POLLHUP | POLLOUT)) != POLLOUT) {
+				http_close(i);
+				continue;
+			}
+			/* Answer as many pipelined requests as we can. */
+			for (;;) {
+				http_process(c);
+				if (! http_busy(c)) {
+					break;
+				}
+				if (! http_write(c)) {
+					http_close(i);
+					break;
+				}
+				if (http_busy(c)) {
+					break;
+				}
+			}
 		}
-		if (! cocofs_save(fs)) {
-			retval = EXIT_FAILURE;
-			break;
+
+		if (pfd[0].revents & POLLIN) {
+			while (http.nconns < HTTP_MAXCONNS &&
+			       (s = accept(ls, NULL, NULL)) != -1) {
+				fcntl(s, F_SETFL, fcntl(s, F_GETFL) |
+				    O_NONBLOCK);
+				setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one,
+				    sizeof(one));
+				c = calloc(1, sizeof(*c));
+				assert(c != NULL);
+				c->fd = s;
+				c->file_fd = -1;
+				c->last = now;
+				http.conns[http.nconns++] = c;
+			}
 		}
 	}
+}
+#else
+static int
+cmd_dwserve(int argc, char *argv[])
+{
+	(void)argc;
+	(void)argv;
+	fprintf(stderr, "dwserve is not supported on this platform\n");
+	return EXIT_FAILURE;
+}
 
-	return retval;
+static int
+cmd_http(int argc, char *argv[])
+{
+	(void)argc;
+	(void)argv;
+	fprintf(stderr, "http is not supported on this platform\n");
+	return EXIT_FAILURE;
 }
+#endif /* ! _WIN32 */
 
+/*
+ * Commands that don't operate on a single image.  These are given in
+ * place of the image name.
+ */
 const struct {
 	const char *verb;
-	int oflags;
-	int (*func)(struct cocofs *, int, char *[]);
-} cmdtab[] = {
+	int (*func)(int, char *[]);
+} globalcmdtab[] = {
 	{
-		"dump",
-		O_RDONLY,
-		cmd_dump,
+		"replay",
+		cmd_replay,
 	},
 	{
-		"ls",
-		O_RDONLY,
-		cmd_ls,
+		"scan",
+		cmd_scan,
 	},
 	{
-		"rm",
-		O_RDWR,
-		cmd_rm,
+		"watch",
+		cmd_watch,
 	},
 	{
-		"format",
-		O_WRONLY | O_CREAT | O_TRUNC,
-		cmd_format,
+		"catalog",
+		cmd_catalog,
 	},
 	{
-		"copyout",
-		O_RDONLY,
-		cmd_copyout,
+		"hdbscan",
+		cmd_hdbscan,
 	},
 	{
-		"copyin",
-		O_RDWR,
-		cmd_copyin,
+		"dwserve",
+		cmd_dwserve,
+	},
+	{
+		"http",
+		cmd_http,
+	},
+	{
+		"export-arrow",
+		cmd_export_arrow,
+	},
+	{
+		"mkiddb",
+		cmd_mkiddb,
+	},
+	{
+		"coderefs",
+		cmd_coderefs,
 	},
 
 	{
 		NULL,
-		0,
 		NULL,
 	}
 };
 
+static bool
+parse_option(const char *opt)
+{
+	if (strcmp(opt, "--shrink") == 0) {
+		opts.shrink = true;
+		return true;
+	}
+	if (strcmp(opt, "--crunch") == 0) {
+		opts.crunch = true;
+		return true;
+	}
+	if (strncmp(opt, "--record=", 9) == 0) {
+		opts.record = opt + 9;
+		return true;
+	}
+	if (strncmp(opt, "--trace=", 8) == 0) {
+		opts.trace = opt + 8;
+		return true;
+	}
+	if (strncmp(opt, "--jobs=", 7) == 0) {
+		char *ep;
+		unsigned long v = strtoul(opt + 7, &ep, 10);
+		if (*ep != '\0' || v < 1 || v > 256) {
+			fprintf(stderr, "invalid job count: %s\n", opt + 7);
+			return false;
+		}
+		opts.jobs = (unsigned int)v;
+		return true;
+	}
+	if (strncmp(opt, "--cache-size=", 13) == 0) {
+		char *ep;
+		unsigned long long v = strtoull(opt + 13, &ep, 10);
+		switch (*ep) {
+		case 'k': case 'K':	v <<= 10; ep++; break;
+		case 'm': case 'M':	v <<= 20; ep++; break;
+		case 'g': case 'G':	v <<= 30; ep++; break;
+		}
+		if (*ep != '\0' || v == 0 || v > SIZE_MAX) {
+			fprintf(stderr, "invalid cache size: %s\n", opt + 13);
+			return false;
+		}
+		opts.cache_size = (size_t)v;
+		return true;
+	}
+	if (strncmp(opt, "--rate-bytes=", 13) == 0) {
+		char *ep;
+		unsigned long long v = strtoull(opt + 13, &ep, 10);
+		switch (*ep) {
+		case 'k': case 'K':	v <<= 10; ep++; break;
+		case 'm': case 'M':	v <<= 20; ep++; break;
+		case 'g': case 'G':	v <<= 30; ep++; break;
+		}
+		if (*ep != '\0' || v == 0) {
+			fprintf(stderr, "invalid byte rate: %s\n", opt + 13);
+			return false;
+		}
+		opts.rate_bytes = v;
+		return true;
+	}
+	if (strncmp(opt, "--rate-ops=", 11) == 0) {
+		char *ep;
+		unsigned long long v = strtoull(opt + 11, &ep, 10);
+		if (*ep != '\0' || v == 0) {
+			fprintf(stderr, "invalid I/O rate: %s\n", opt + 11);
+			return false;
+		}
+		opts.rate_ops = v;
+		return true;
+	}
+	if (strncmp(opt, "--rate-latency=", 15) == 0) {
+		char *ep;
+		unsigned long v = strtoul(opt + 15, &ep, 10);
+		if (*ep != '\0' || v == 0 || v > 60000) {
+			fprintf(stderr, "invalid latency target: %s\n",
+			    opt + 15);
+			return false;
+		}
+		opts.rate_latency = (unsigned int)v;
+		return true;
+	}
+	if (strcmp(opt, "--direct") == 0) {
+		opts.direct = true;
+		return true;
+	}
+	if (strncmp(opt, "--hdb-drive=", 12) == 0) {
+		char *ep;
+		unsigned long v = strtoul(opt + 12, &ep, 10);
+		if (*ep != '\0' || ep == opt + 12 || v > 255) {
+			fprintf(stderr, "invalid HDB-DOS drive: %s\n",
+			    opt + 12);
+			return false;
+		}
+		opts.hdb = true;
+		opts.hdb_drive = (unsigned int)v;
+		return true;
+	}
+	if (strncmp(opt, "--hdb-offset=", 13) == 0) {
+		char *ep;
+		unsigned long long v;
+		opts.hdb = true;
+		if (strcmp(opt + 13, "auto") == 0) {
+			opts.hdb_offset_set = false;
+			return true;
+		}
+		v = strtoull(opt + 13, &ep, 0);
+		if (*ep != '\0' || ep == opt + 13 ||
+		    v % COCOFS_BYTES_PER_SEC != 0 || v > INT64_MAX) {
+			fprintf(stderr, "invalid HDB-DOS offset: %s\n",
+			    opt + 13);
+			return false;
+		}
+		opts.hdb_offset_set = true;
+		opts.hdb_offset = (off_t)v;
+		return true;
+	}
+	if (strncmp(opt, "--journal=", 10) == 0) {
+		opts.journal = opt + 10;
+		return true;
+	}
+	if (strcmp(opt, "--resume") == 0) {
+		opts.resume = true;
+		return true;
+	}
+	if (strncmp(opt, "--metrics=", 10) == 0) {
+		opts.metrics = opt + 10;
+		return true;
+	}
+	if (strncmp(opt, "--metrics-interval=", 19) == 0) {
+		char *ep;
+		unsigned long v = strtoul(opt + 19, &ep, 10);
+		if (*ep != '\0' || v < 1 || v > 86400) {
+			fprintf(stderr, "invalid metrics interval: %s\n",
+			    opt + 19);
+			return false;
+		}
+		opts.metrics_interval = (unsigned int)v;
+		return true;
+	}
+	if (strncmp(opt, "--alloc=", 8) == 0) {
+		opts.allocator = cocofs_allocator_lookup(opt + 8);
+		if (opts.allocator == NULL) {
+			fprintf(stderr, "unknown allocator: %s\n", opt + 8);
+			return false;
+		}
+		return true;
+	}
+
+	fprintf(stderr, "unknown option: %s\n", opt);
+	return false;
+}
+
 int
 main(int argc, char *argv[])
 {
-	struct cocofs *fs;
-	int fd, cmd;
+	int cmd, eval;
+	bool image_only = false;
 
 	/* Skip over argv[0]. */
 	assert(argc > 0);
@@ -1476,6 +12652,57 @@ main(int argc, char *argv[])
 	argc--;
 	argv++;
 
+	/*
+	 * Consume any global options.  A "--" ends them, and says that
+	 * what follows is an image even if it is named like a command.
+	 */
+	while (argc > 0 && strncmp(argv[0], "--", 2) == 0) {
+		if (strcmp(argv[0], "--") == 0) {
+			image_only = true;
+			argc--;
+			argv++;
+			break;
+		}
+		if (! parse_option(argv[0])) {
+			exit(usage());
+		}
+		argc--;
+		argv++;
+	}
+
+	if (opts.record != NULL && ! rec_open(opts.record)) {
+		exit(EXIT_FAILURE);
+	}
+	if (opts.trace != NULL) {
+		if (! trace_open(opts.trace)) {
+			exit(EXIT_FAILURE);
+		}
+		trace_thread_start(&mainworker);
+	}
+	if (opts.metrics != NULL) {
+		if (opts.metrics_interval == 0) {
+			opts.metrics_interval = 10;
+		}
+		metrics_start();
+	}
+
+	if (opts.rate_bytes != 0 || opts.rate_ops != 0) {
+		rate_start(opts.rate_bytes, opts.rate_ops, opts.rate_latency);
+	}
+
+	/* Commands that don't take an image. */
+	for (cmd = 0; argc > 0 && ! image_only &&
+	    globalcmdtab[cmd].verb != NULL; cmd++) {
+		if (strcmp(globalcmdtab[cmd].verb, argv[0]) == 0) {
+			eval = (*globalcmdtab[cmd].func)(argc - 1, argv + 1);
+			imgcache_shutdown();
+			rate_report();
+			metrics_stop();
+			trace_close();
+			exit(eval);
+		}
+	}
+
 	/* Must have at least 2 arguments. */
 	if (argc < 2) {
 		exit(usage());
@@ -1491,29 +12718,11 @@ main(int argc, char *argv[])
 		exit(usage());
 	}
 
-	/* Open the image (name in argv[0]). */
-	fd = open(argv[0], cmdtab[cmd].oflags | O_BINARY, 0644);
-	if (fd == -1) {
-		fprintf(stderr, "ERROR: failed to open '%s': %s\n",
-		    argv[0], strerror(errno));
-		exit(EXIT_FAILURE);
-	}
-
-	/* O_CREAT implies "create new". */
-	fs = (cmdtab[cmd].oflags & O_CREAT) ? cocofs_format(fd)
-					    : cocofs_load(fd);
-	if (fs == NULL) {
-		exit(EXIT_FAILURE);
-	}
-
-	/* Advance past the mandatory arguments. */
-	argc -= 2;
-	argv += 2;
-
-	/* Run the command. */
-	int eval = (*cmdtab[cmd].func)(fs, argc, argv);
-
-	cocofs_close(fs);
+	/* Run the command on the image (name in argv[0]). */
+	eval = run_image(argv[0], cmd, argc - 1, argv + 1, false);
+	rate_report();
+	metrics_stop();
+	trace_close();
 
 	exit(eval);
 }